@@ -0,0 +1,235 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+#include <PerfCounters.h>
+#include <Timer.h>
+
+/**
+ * Benchmark runner: every measured operation is run a few times for
+ * warm-up (caches, branch predictors, page faults of fresh memory) and
+ * then repeated, timing every run separately. The result is statistics
+ * of time per operation over the runs: median - the typical value,
+ * p99 - a bound of slow runs, and standard deviation - the noise, that
+ * tells whether the difference of two versions is meaningful.
+ * Results are printed in a human readable line, or as CSV or JSON lines
+ * with fixed fields, that can be saved and compared between versions.
+ * If CPerfCounters are enabled, medians of hardware counters per
+ * operation are reported too.
+ */
+
+/**
+ * Statistics of time per operation over runs, in nanoseconds, and
+ * medians of hardware counters per operation, -1 if not available
+ * (see CPerfCounters).
+ */
+struct BenchStats {
+	size_t runs;
+	double median_ns;
+	double p99_ns;
+	double mean_ns;
+	double stddev_ns;
+	double min_ns;
+	double counters[PERF_COUNTER_COUNT];
+	// Cycles are counted by rdtsc, see CPerfCounters::IsRdtsc.
+	bool is_rdtsc;
+};
+
+inline double
+bench_median(std::vector<double> samples)
+{
+	if (samples.empty())
+		return 0;
+	std::sort(samples.begin(), samples.end());
+	size_t n = samples.size();
+	return n % 2 != 0 ? samples[n / 2] :
+	       (samples[n / 2 - 1] + samples[n / 2]) / 2;
+}
+
+// Calculate statistics of samples (time per operation of every run).
+inline BenchStats
+bench_stats(std::vector<double> samples)
+{
+	BenchStats stats = {samples.size(), 0, 0, 0, 0, 0, {0}, false};
+	for (size_t i = 0; i < PERF_COUNTER_COUNT; i++)
+		stats.counters[i] = -1;
+	if (samples.empty())
+		return stats;
+	std::sort(samples.begin(), samples.end());
+	size_t n = samples.size();
+	stats.min_ns = samples[0];
+	stats.median_ns = bench_median(samples);
+	// Nearest rank.
+	size_t rank = (size_t)std::ceil(0.99 * n);
+	stats.p99_ns = samples[rank - 1];
+	double sum = 0;
+	for (size_t i = 0; i < n; i++)
+		sum += samples[i];
+	stats.mean_ns = sum / n;
+	double var = 0;
+	for (size_t i = 0; i < n; i++)
+		var += (samples[i] - stats.mean_ns) * (samples[i] - stats.mean_ns);
+	stats.stddev_ns = n > 1 ? std::sqrt(var / (n - 1)) : 0;
+	return stats;
+}
+
+enum bench_format_t {
+	BENCH_FORMAT_TEXT,
+	BENCH_FORMAT_CSV,
+	// One JSON object per line.
+	BENCH_FORMAT_JSON,
+};
+
+class CBenchRunner
+{
+public:
+	CBenchRunner(std::ostream &out, bench_format_t format, size_t warmup,
+		     size_t repeat)
+		: m_out(out), m_format(format), m_warmup(warmup),
+		  m_repeat(repeat), m_sink(0)
+	{
+	}
+
+	CBenchRunner(const CBenchRunner&) = delete;
+	CBenchRunner& operator=(const CBenchRunner&) = delete;
+
+	// Print the header of the output if the format has one.
+	void Header()
+	{
+		if (m_format == BENCH_FORMAT_CSV) {
+			m_out << "scenario,op,ops,runs,median_ns,p99_ns,mean_ns,"
+				 "stddev_ns,min_ns,median_mrps";
+			for (size_t i = 0; i < PERF_COUNTER_COUNT; i++)
+				m_out << "," << perf_counter_names[i] << "_per_op";
+			m_out << std::endl;
+		}
+	}
+
+	/**
+	 * Measure body, that performs ops operations and returns
+	 * a checksum of the results, so the work can't be optimized out.
+	 * setup is called before every run and is not measured, for example
+	 * to restore the input that body changes.
+	 */
+	template <class SETUP, class BODY>
+	BenchStats Run(const char *scenario, const char *op, uint64_t ops,
+		       SETUP setup, BODY body)
+	{
+		for (size_t i = 0; i < m_warmup; i++) {
+			setup();
+			m_sink += body();
+		}
+		std::vector<double> samples;
+		std::vector<double> counters[PERF_COUNTER_COUNT];
+		bool is_rdtsc = false;
+		for (size_t i = 0; i < m_repeat; i++) {
+			setup();
+			CTimer t;
+			t.Start();
+			m_sink += body();
+			t.Stop();
+			samples.push_back(t.Elapsed() * 1e9 / ops);
+			const CPerfCounters &perf = t.PerfCounters();
+			is_rdtsc = perf.IsRdtsc();
+			for (size_t j = 0; j < PERF_COUNTER_COUNT; j++) {
+				perf_counter_t counter = (perf_counter_t)j;
+				if (CPerfCounters::IsEnabled() &&
+				    perf.Available(counter))
+					counters[j].push_back(
+						(double)perf.Value(counter) / ops);
+			}
+		}
+		BenchStats stats = bench_stats(samples);
+		stats.is_rdtsc = is_rdtsc;
+		for (size_t j = 0; j < PERF_COUNTER_COUNT; j++)
+			if (!counters[j].empty())
+				stats.counters[j] = bench_median(counters[j]);
+		Print(scenario, op, ops, stats);
+		return stats;
+	}
+
+	// Run without setup.
+	template <class BODY>
+	BenchStats Run(const char *scenario, const char *op, uint64_t ops,
+		       BODY body)
+	{
+		return Run(scenario, op, ops, []() {}, body);
+	}
+
+	// Sum of checksums of all runs.
+	uint64_t Sink() const
+	{
+		return m_sink;
+	}
+
+private:
+	std::ostream &m_out;
+	bench_format_t m_format;
+	size_t m_warmup;
+	size_t m_repeat;
+	volatile uint64_t m_sink;
+
+	void Print(const char *scenario, const char *op, uint64_t ops,
+		   const BenchStats &stats)
+	{
+		double mrps = stats.median_ns > 0 ? 1e3 / stats.median_ns : 0;
+		switch (m_format) {
+			case BENCH_FORMAT_TEXT:
+				m_out << scenario << " " << op << " Mrps: " << mrps
+				      << " (median " << stats.median_ns
+				      << " ns, p99 " << stats.p99_ns
+				      << " ns, stddev "
+				      << 100 * stats.stddev_ns / stats.mean_ns
+				      << "%)";
+				for (size_t i = 0; i < PERF_COUNTER_COUNT; i++)
+					if (stats.counters[i] >= 0)
+						m_out << " " << (i == PERF_CYCLES &&
+							stats.is_rdtsc ? "tsc" :
+							perf_counter_names[i])
+						      << "/op " << stats.counters[i];
+				m_out << std::endl;
+				break;
+			case BENCH_FORMAT_CSV:
+				m_out << scenario << "," << op << "," << ops << ","
+				      << stats.runs << "," << stats.median_ns << ","
+				      << stats.p99_ns << "," << stats.mean_ns << ","
+				      << stats.stddev_ns << "," << stats.min_ns
+				      << "," << mrps;
+				// Unavailable counters are empty.
+				for (size_t i = 0; i < PERF_COUNTER_COUNT; i++) {
+					m_out << ",";
+					if (stats.counters[i] >= 0)
+						m_out << stats.counters[i];
+				}
+				m_out << std::endl;
+				break;
+			default:
+				assert(m_format == BENCH_FORMAT_JSON);
+				m_out << "{\"scenario\":\"" << scenario
+				      << "\",\"op\":\"" << op
+				      << "\",\"ops\":" << ops
+				      << ",\"runs\":" << stats.runs
+				      << ",\"median_ns\":" << stats.median_ns
+				      << ",\"p99_ns\":" << stats.p99_ns
+				      << ",\"mean_ns\":" << stats.mean_ns
+				      << ",\"stddev_ns\":" << stats.stddev_ns
+				      << ",\"min_ns\":" << stats.min_ns
+				      << ",\"median_mrps\":" << mrps;
+				for (size_t i = 0; i < PERF_COUNTER_COUNT; i++) {
+					m_out << ",\"" << perf_counter_names[i]
+					      << "_per_op\":";
+					if (stats.counters[i] >= 0)
+						m_out << stats.counters[i];
+					else
+						m_out << "null";
+				}
+				m_out << "}" << std::endl;
+		}
+	}
+};
@@ -0,0 +1,561 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <BenchRunner.h>
+#include <KeyDef.h>
+#include <ThreadPool.h>
+#include <Tuple.h>
+#include <TupleArena.h>
+#include <TupleColumn.h>
+#include <TupleCompare.h>
+#include <TupleMerge.h>
+#include <TupleSort.h>
+#include <TupleTreeConcurrent.h>
+
+/**
+ * Named benchmark scenarios. A scenario describes the data - key parts,
+ * tuple width, length of strings, share of duplicate keys, how much the
+ * input is presorted and the number of tuples, that sets the working set
+ * size from L1 cache to DRAM - and the access patterns that are measured
+ * on it. The data is generated from the seed, so runs of different
+ * versions measure the same tuples.
+ */
+
+const size_t BENCH_MAX_PARTS = 8;
+// Only first tuples are compared in all pairs, so it takes ~1M compares.
+const size_t BENCH_ALL_PAIRS_MAX = 1024;
+// Number of compares or lookups in one run of random access patterns.
+const size_t BENCH_LOOKUP_COUNT = 200000;
+// Number of sorted sources in merge.
+const size_t BENCH_MERGE_WAYS = 16;
+// Lookups of every thread in one run of concurrent lookups.
+const size_t BENCH_CONCURRENT_LOOKUPS = 20000;
+const size_t BENCH_CONCURRENT_MAX_THREADS = 64;
+
+enum bench_access_t {
+	// All pairs of the first BENCH_ALL_PAIRS_MAX tuples.
+	BENCH_ALL_PAIRS = 1,
+	// Random pairs of the whole working set.
+	BENCH_RANDOM_PAIRS = 2,
+	// Binary search of keys of random tuples in the sorted tuples.
+	BENCH_BINARY_SEARCH = 4,
+	// tuple_sort of the tuples in generated order.
+	BENCH_SORT = 8,
+	// Merge of BENCH_MERGE_WAYS sorted parts of the tuples.
+	BENCH_MERGE = 16,
+	BENCH_ALL = 31,
+	/**
+	 * Measure all pairs, random pairs and sort with branchless
+	 * comparators too (see KeyDef::use_branchless), ops are named with
+	 * "_branchless" suffix.
+	 */
+	BENCH_BRANCHLESS = 32,
+	/**
+	 * Filter all tuples by the first part, uint or string, row by row
+	 * and by a decoded column (see TupleColumn.h).
+	 */
+	BENCH_COLUMN = 64,
+	/**
+	 * Lookups of random keys in CTupleTreeConcurrent by 1 to
+	 * BENCH_CONCURRENT_MAX_THREADS threads (concurrent_find_<N>t),
+	 * and the same with a writer thread that replaces tuples with their
+	 * copies meanwhile (concurrent_find_writer_<N>t). Ops are lookups
+	 * of all the threads.
+	 */
+	BENCH_CONCURRENT = 128,
+};
+
+struct BenchPart {
+	KeyDef::field_type_t field_type;
+	size_t field_no;
+};
+
+struct BenchScenario {
+	const char *name;
+	size_t part_count;
+	BenchPart parts[BENCH_MAX_PARTS];
+	// Number of fields in tuple, fields that are not parts are uints.
+	size_t field_count;
+	// Length of strings and binary strings.
+	uint32_t string_len;
+	size_t tuple_count;
+	// Share of tuples that have the key of another tuple.
+	unsigned dup_percent;
+	// Share of tuples that are in sorted order, others are swapped.
+	unsigned sorted_percent;
+	// Mask of bench_access_t.
+	unsigned access;
+};
+
+// Set parts of the scenario to the key def, with specialized comparators.
+inline void
+bench_scenario_key_def(const BenchScenario *scenario, KeyDef *def)
+{
+	assert(scenario->part_count > 0 &&
+	       scenario->part_count <= BENCH_MAX_PARTS);
+	def->part_count = scenario->part_count;
+	def->use_hint = false;
+	def->use_branchless = false;
+	for (size_t i = 0; i < scenario->part_count; i++) {
+		assert(scenario->parts[i].field_no < scenario->field_count);
+		def->parts[i].field_type = scenario->parts[i].field_type;
+		def->parts[i].field_no = scenario->parts[i].field_no;
+		def->parts[i].is_nullable = false;
+		def->parts[i].collation = NULL;
+	}
+	key_def_set_compare_func(def);
+}
+
+// Tuples and their keys generated for a scenario.
+class CBenchData
+{
+public:
+	CBenchData(const BenchScenario *scenario, KeyDef *def, uint64_t seed)
+		: m_rng(seed)
+	{
+		assert(scenario->field_count <= TEST_FIELD_COUNT_IN_TUPLE);
+		m_format = tuple_format_new(&def, 1);
+		Generate(scenario, def);
+	}
+
+	~CBenchData()
+	{
+		tuple_format_delete(m_format);
+	}
+
+	CBenchData(const CBenchData&) = delete;
+	CBenchData& operator=(const CBenchData&) = delete;
+
+	size_t Count() const
+	{
+		return m_tuples.size();
+	}
+
+	// Tuples in generated order.
+	Tuple **Tuples()
+	{
+		return m_tuples.data();
+	}
+
+	// keys[i] is the key of Tuples()[i].
+	const char **Keys()
+	{
+		return m_keys.data();
+	}
+
+	// Uniformly distributed random number below n.
+	size_t Random(size_t n)
+	{
+		return m_rng() % n;
+	}
+
+private:
+	std::mt19937_64 m_rng;
+	TupleFormat *m_format;
+	CTupleArena m_arena;
+	std::vector<Tuple *> m_tuples;
+	std::vector<char> m_keyData;
+	std::vector<const char *> m_keys;
+
+	void GenerateField(TupleBuilder *builder, KeyDef::field_type_t type,
+			   uint32_t len)
+	{
+		char string[MAX_TEST_TUPLE_DATA_SIZE];
+		assert(len < sizeof(string) - 5);
+		switch (type) {
+			case KeyDef::UINT:
+				builder->add(m_rng() >> 32);
+				break;
+			case KeyDef::STRING:
+				for (uint32_t k = 0; k < len; k++)
+					string[k] = 'a' + m_rng() % 26;
+				builder->add(string, len);
+				break;
+			case KeyDef::INTEGER:
+				builder->add_int((int64_t)(m_rng() >> 33) -
+						 ((int64_t)1 << 30));
+				break;
+			case KeyDef::DOUBLE:
+				builder->add_double(((int64_t)(m_rng() >> 40) -
+						     ((int64_t)1 << 23)) / 1000.0);
+				break;
+			case KeyDef::NUMBER:
+				if (m_rng() % 2)
+					builder->add_int((int64_t)(m_rng() % 2000000) -
+							 1000000);
+				else
+					builder->add_double(((int64_t)(m_rng() %
+						4000000) - 2000000) / 2.0);
+				break;
+			case KeyDef::BOOLEAN:
+				builder->add_bool(m_rng() % 2);
+				break;
+			default:
+				assert(type == KeyDef::BINARY);
+				for (uint32_t k = 0; k < len; k++)
+					string[k] = (char)m_rng();
+				builder->add_bin(string, len);
+		}
+	}
+
+	void Generate(const BenchScenario *scenario, KeyDef *def)
+	{
+		size_t count = scenario->tuple_count;
+		size_t dup_count = count * scenario->dup_percent / 100;
+		size_t distinct = dup_count < count ? count - dup_count : 1;
+		TupleBuilder builder;
+		m_tuples.reserve(count);
+		for (size_t i = 0; i < distinct; i++) {
+			builder.reset(m_format);
+			for (size_t j = 0; j < scenario->field_count; j++) {
+				KeyDef::field_type_t type = KeyDef::UINT;
+				for (size_t k = 0; k < scenario->part_count; k++)
+					if (scenario->parts[k].field_no == j)
+						type = scenario->parts[k].field_type;
+				GenerateField(&builder, type, scenario->string_len);
+			}
+			builder.finish();
+			// Fields of the scenario must fit into the tuple.
+			if (builder.is_overflow)
+				abort();
+			m_tuples.push_back(tuple_new(&m_arena, &builder.tuple));
+		}
+		// Duplicates are copies, they are not shared with originals.
+		for (size_t i = distinct; i < count; i++)
+			m_tuples.push_back(tuple_new(&m_arena,
+						     m_tuples[Random(distinct)]));
+
+		if (scenario->sorted_percent == 0) {
+			std::shuffle(m_tuples.begin(), m_tuples.end(), m_rng);
+		} else {
+			tuple_sort(def, m_tuples.data(), count);
+			size_t swaps = count * (100 - scenario->sorted_percent) /
+				       100 / 2;
+			for (size_t i = 0; i < swaps; i++)
+				std::swap(m_tuples[Random(count)],
+					  m_tuples[Random(count)]);
+		}
+
+		std::vector<size_t> offsets(count);
+		char key[MAX_TEST_TUPLE_DATA_SIZE + 5];
+		for (size_t i = 0; i < count; i++) {
+			char *end = key;
+			tuple_extract_key(def, m_tuples[i], end);
+			offsets[i] = m_keyData.size();
+			m_keyData.insert(m_keyData.end(), key, end);
+		}
+		m_keys.resize(count);
+		for (size_t i = 0; i < count; i++)
+			m_keys[i] = m_keyData.data() + offsets[i];
+	}
+};
+
+/**
+ * Measure comparisons of the scenario tuples by the key def: all pairs,
+ * random pairs (pairs of tuple numbers) and sort. Names of ops get
+ * the suffix.
+ */
+inline void
+bench_scenario_compare(CBenchRunner *runner, const BenchScenario *scenario,
+		       CBenchData *data, const std::vector<uint32_t> &pairs,
+		       KeyDef *d, const char *suffix)
+{
+	size_t count = data->Count();
+	Tuple **tuples = data->Tuples();
+	const char *name = scenario->name;
+
+	if ((scenario->access & BENCH_ALL_PAIRS) != 0) {
+		size_t n = std::min(count, BENCH_ALL_PAIRS_MAX);
+		std::string op = std::string("all_pairs") + suffix;
+		runner->Run(name, op.c_str(), (uint64_t)n * n, [=]() {
+			uint64_t r = 0;
+			for (size_t i = 0; i < n; i++)
+				for (size_t j = 0; j < n; j++)
+					r += d->tuple_compare_f(d, tuples[i],
+								tuples[j]);
+			return r;
+		});
+	}
+
+	if ((scenario->access & BENCH_RANDOM_PAIRS) != 0) {
+		const uint32_t *p = pairs.data();
+		std::string op = std::string("random_pairs") + suffix;
+		runner->Run(name, op.c_str(), BENCH_LOOKUP_COUNT, [=]() {
+			uint64_t r = 0;
+			for (size_t i = 0; i < BENCH_LOOKUP_COUNT; i++)
+				r += d->tuple_compare_f(d, tuples[p[2 * i]],
+							tuples[p[2 * i + 1]]);
+			return r;
+		});
+	}
+
+	if ((scenario->access & BENCH_SORT) != 0) {
+		std::vector<Tuple *> arr(count);
+		Tuple **a = arr.data();
+		std::string op = std::string("sort") + suffix;
+		runner->Run(name, op.c_str(), count, [=]() {
+			std::copy(tuples, tuples + count, a);
+		}, [=]() {
+			tuple_sort(d, a, count);
+			return (uint64_t)(uintptr_t)a[count / 2];
+		});
+		for (size_t i = 1; i < count; i++)
+			if (d->tuple_compare_f(d, arr[i - 1], arr[i]) > 0)
+				abort();
+	}
+}
+
+/**
+ * Select tuples whose first part is a uint below 1/8 of the uint32 range
+ * or a string starting with 'a': row by row, and by a column that is
+ * decoded once (column_decode) and then selected from (column_select).
+ */
+inline void
+bench_scenario_column(CBenchRunner *runner, const BenchScenario *scenario,
+		      CBenchData *data)
+{
+	size_t count = data->Count();
+	Tuple **tuples = data->Tuples();
+	const char *name = scenario->name;
+	size_t field_no = scenario->parts[0].field_no;
+	const uint64_t max = UINT32_MAX / 8;
+	std::vector<uint32_t> selection(count);
+	uint32_t *sel = selection.data();
+
+	if (scenario->parts[0].field_type == KeyDef::UINT) {
+		size_t expected = 0;
+		for (size_t i = 0; i < count; i++) {
+			const char *field = tuples[i]->get_field(field_no);
+			expected += mp_decode_uint(field) <= max;
+		}
+		std::vector<uint64_t> column(count);
+		uint64_t *values = column.data();
+		runner->Run(name, "row_filter", count, [=]() {
+			size_t found = 0;
+			for (size_t i = 0; i < count; i++) {
+				const char *field = tuples[i]->get_field(field_no);
+				found += mp_decode_uint(field) <= max;
+			}
+			if (found != expected)
+				abort();
+			return (uint64_t)found;
+		});
+		runner->Run(name, "column_decode", count, [=]() {
+			tuple_column_uint(tuples, count, field_no, values);
+			return values[count / 2];
+		});
+		// The column is decoded once for many predicates.
+		tuple_column_uint(tuples, count, field_no, values);
+		runner->Run(name, "column_select", count, [=]() {
+			size_t found = column_select_uint_range(values, count, 0,
+								max, sel);
+			if (found != expected)
+				abort();
+			return (uint64_t)found;
+		});
+	} else {
+		assert(scenario->parts[0].field_type == KeyDef::STRING);
+		size_t expected = 0;
+		for (size_t i = 0; i < count; i++) {
+			const char *field = tuples[i]->get_field(field_no);
+			uint32_t len;
+			const char *string = mp_decode_string(field, len);
+			expected += len > 0 && string[0] == 'a';
+		}
+		std::vector<ColumnString> column(count);
+		ColumnString *strings = column.data();
+		runner->Run(name, "row_filter", count, [=]() {
+			size_t found = 0;
+			for (size_t i = 0; i < count; i++) {
+				const char *field = tuples[i]->get_field(field_no);
+				uint32_t len;
+				const char *string = mp_decode_string(field, len);
+				found += len > 0 && string[0] == 'a';
+			}
+			if (found != expected)
+				abort();
+			return (uint64_t)found;
+		});
+		runner->Run(name, "column_decode", count, [=]() {
+			tuple_column_string(tuples, count, field_no, strings);
+			return (uint64_t)strings[count / 2].len;
+		});
+		tuple_column_string(tuples, count, field_no, strings);
+		runner->Run(name, "column_select", count, [=]() {
+			size_t found = column_select_string_prefix(strings, count,
+								   "a", 1, sel);
+			if (found != expected)
+				abort();
+			return (uint64_t)found;
+		});
+	}
+}
+
+/**
+ * Look up keys of random tuples in a concurrent tree of the sorted
+ * tuples without equal keys by threads of a pool (see BENCH_CONCURRENT).
+ * The tree has its own copies of tuples, so the writer can replace them
+ * and the tree can free them.
+ */
+inline void
+bench_scenario_concurrent(CBenchRunner *runner, const BenchScenario *scenario,
+			  CBenchData *data, Tuple **sorted, KeyDef *d)
+{
+	size_t count = data->Count();
+	const char *name = scenario->name;
+	std::vector<Tuple *> unique;
+	for (size_t i = 0; i < count; i++)
+		if (unique.empty() ||
+		    d->tuple_compare_f(d, unique.back(), sorted[i]) != 0)
+			unique.push_back(sorted[i]);
+	size_t unique_count = unique.size();
+	CTupleArena arena;
+	std::vector<Tuple *> copies(unique_count);
+	for (size_t i = 0; i < unique_count; i++)
+		copies[i] = tuple_new(&arena, unique[i]);
+	CTupleTreeConcurrent<> tree(d, &arena);
+	tree.Build(copies.data(), unique_count);
+	std::vector<const char *> keys(BENCH_LOOKUP_COUNT);
+	for (size_t i = 0; i < keys.size(); i++)
+		keys[i] = data->Keys()[data->Random(count)];
+
+	CTupleTreeConcurrent<> *t = &tree;
+	CTupleArena *a = &arena;
+	Tuple **u = unique.data();
+	const char **k = keys.data();
+	for (size_t threads = 1; threads <= BENCH_CONCURRENT_MAX_THREADS;
+	     threads *= 2) {
+		for (int is_writer = 0; is_writer < 2; is_writer++) {
+			CThreadPool pool(threads + is_writer);
+			CThreadPool *p = &pool;
+			std::string op = std::string("concurrent_find_") +
+					 (is_writer ? "writer_" : "") +
+					 std::to_string(threads) + "t";
+			uint64_t ops = threads * BENCH_CONCURRENT_LOOKUPS;
+			runner->Run(name, op.c_str(), ops, [=]() {
+				std::atomic<size_t> found(0);
+				std::atomic<size_t> done(0);
+				if (is_writer) {
+					p->Submit([&]() {
+						size_t j = 0;
+						while (done.load() < threads) {
+							j = (j + 7919) % unique_count;
+							if (!t->Replace(tuple_new(a, u[j])))
+								abort();
+						}
+					});
+				}
+				for (size_t i = 0; i < threads; i++) {
+					p->Submit([&, i]() {
+						CEpochReader reader(t->Epoch());
+						size_t local = 0;
+						size_t begin = i * BENCH_CONCURRENT_LOOKUPS;
+						for (size_t n = 0;
+						     n < BENCH_CONCURRENT_LOOKUPS; n++) {
+							CEpochGuard guard(&reader);
+							const char *key = k[(begin + n) %
+									    BENCH_LOOKUP_COUNT];
+							local += t->Find(key) != NULL;
+						}
+						found += local;
+						done++;
+					});
+				}
+				p->Wait();
+				if (found.load() != ops)
+					abort();
+				return (uint64_t)found.load();
+			});
+		}
+	}
+}
+
+// Generate data of the scenario and measure its access patterns.
+inline void
+bench_scenario_run(CBenchRunner *runner, const BenchScenario *scenario,
+		   uint64_t seed)
+{
+	// Unused parts are zeroed too.
+	KeyDef def = KeyDef();
+	bench_scenario_key_def(scenario, &def);
+	KeyDef *d = &def;
+	CBenchData data(scenario, d, seed);
+	size_t count = data.Count();
+	Tuple **tuples = data.Tuples();
+	const char *name = scenario->name;
+
+	std::vector<uint32_t> pairs;
+	if ((scenario->access & BENCH_RANDOM_PAIRS) != 0) {
+		pairs.resize(2 * BENCH_LOOKUP_COUNT);
+		for (size_t i = 0; i < pairs.size(); i++)
+			pairs[i] = data.Random(count);
+	}
+	bench_scenario_compare(runner, scenario, &data, pairs, d, "");
+	if ((scenario->access & BENCH_BRANCHLESS) != 0) {
+		KeyDef branchless = def;
+		branchless.use_branchless = true;
+		key_def_set_compare_func(&branchless);
+		bench_scenario_compare(runner, scenario, &data, pairs,
+				       &branchless, "_branchless");
+	}
+
+	if ((scenario->access & BENCH_COLUMN) != 0)
+		bench_scenario_column(runner, scenario, &data);
+
+	std::vector<Tuple *> sorted(tuples, tuples + count);
+	tuple_sort(d, sorted.data(), count);
+
+	if ((scenario->access & BENCH_BINARY_SEARCH) != 0) {
+		std::vector<const char *> keys(BENCH_LOOKUP_COUNT);
+		for (size_t i = 0; i < keys.size(); i++)
+			keys[i] = data.Keys()[data.Random(count)];
+		Tuple **begin = sorted.data();
+		Tuple **end = begin + count;
+		const char **k = keys.data();
+		runner->Run(name, "binary_search", BENCH_LOOKUP_COUNT, [=]() {
+			uint64_t found = 0;
+			for (size_t i = 0; i < BENCH_LOOKUP_COUNT; i++) {
+				Tuple **pos = std::lower_bound(begin, end, k[i],
+					[d](Tuple *tuple, const char *key) {
+					return tuple_compare_with_key(d, tuple,
+								      key) < 0;
+				});
+				found += pos != end;
+			}
+			if (found != BENCH_LOOKUP_COUNT)
+				abort();
+			return found;
+		});
+	}
+
+	if ((scenario->access & BENCH_CONCURRENT) != 0)
+		bench_scenario_concurrent(runner, scenario, &data, sorted.data(),
+					  d);
+
+	if ((scenario->access & BENCH_MERGE) != 0) {
+		// Every way takes every BENCH_MERGE_WAYS-th sorted tuple.
+		std::vector<std::vector<Tuple *> > ways(BENCH_MERGE_WAYS);
+		for (size_t i = 0; i < count; i++)
+			ways[i % BENCH_MERGE_WAYS].push_back(sorted[i]);
+		std::vector<TupleMergeSource> sources(BENCH_MERGE_WAYS);
+		for (size_t i = 0; i < BENCH_MERGE_WAYS; i++)
+			sources[i] = tuple_merge_source_array(ways[i].data(),
+							      ways[i].size());
+		const TupleMergeSource *s = sources.data();
+		runner->Run(name, "merge", count, [=]() {
+			CTupleMerge merge(d, s, BENCH_MERGE_WAYS);
+			uint64_t r = 0;
+			for (Tuple *t = merge.Next(); t != NULL; t = merge.Next())
+				r += (uintptr_t)t;
+			return r;
+		});
+	}
+}
@@ -0,0 +1,271 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <ByteSwap.h>
+#include <MemCompare.h>
+
+/**
+ * Collation defines the order of strings other than byte by byte.
+ * Every collation can compare strings in place and can make a sort key
+ * of a string: a binary string such that comparison of sort keys with
+ * mem_compare gives the same result as comparison of strings.
+ * Simple collations (binary, ASCII case insensitive) are fast enough to
+ * compare strings in place. Full collations (like ICU ones) are too
+ * slow for that, so their sort keys are calculated once per tuple and
+ * then compared many times: the prefix of sort key is the tuple hint
+ * (see tuple_hint) and the whole sort key is a part of normalized key
+ * (see NormalizedKey.h), that is used by tuple_sort.
+ * An ICU collation is plugged in the same way, with ucol_strcoll and
+ * ucol_getSortKey as compare and sort_key.
+ */
+struct Collation {
+	// Compare two strings in place.
+	typedef int (*compare_t)(const char *string1, uint32_t len1,
+				 const char *string2, uint32_t len2);
+	/**
+	 * Write up to size bytes of sort key of the string to out.
+	 * Return the size of whole sort key, that is not greater than
+	 * sort_key_ratio * len. out may be NULL if size is zero.
+	 */
+	typedef size_t (*sort_key_t)(const char *string, uint32_t len,
+				     char *out, size_t size);
+
+	const char *name;
+	compare_t compare;
+	sort_key_t sort_key;
+	// Maximal size of sort key per byte of string.
+	uint32_t sort_key_ratio;
+};
+
+enum collation_id_t {
+	// Byte by byte, the same as no collation.
+	COLLATION_BINARY,
+	// Case insensitive for ASCII letters, other bytes as is.
+	COLLATION_ASCII_CI,
+	// Case insensitive for UTF-8 letters of common alphabets.
+	COLLATION_UNICODE_CI,
+	COLLATION_COUNT,
+};
+
+inline int
+collation_binary_compare(const char *string1, uint32_t len1,
+			 const char *string2, uint32_t len2)
+{
+	return mem_compare(string1, len1, string2, len2);
+}
+
+inline size_t
+collation_binary_sort_key(const char *string, uint32_t len, char *out,
+			  size_t size)
+{
+	size_t count = len < size ? len : size;
+	if (count != 0)
+		memcpy(out, string, count);
+	return len;
+}
+
+inline uint8_t
+ascii_fold(uint8_t c)
+{
+	return (uint8_t)(c - 'A') < 26 ? c + ('a' - 'A') : c;
+}
+
+/**
+ * Fold ASCII letters of 8 bytes at once: a byte is upper case letter if
+ * its high bit is zero and its low 7 bits are in ['A', 'Z'], that is
+ * checked by two additions that carry to the high bit of every byte.
+ */
+inline uint64_t
+ascii_fold_word(uint64_t word)
+{
+	const uint64_t ones = 0x0101010101010101ull;
+	const uint64_t high_bits = 0x8080808080808080ull;
+	uint64_t low = word & ~high_bits;
+	uint64_t ge_a = low + (0x80 - 'A') * ones;
+	uint64_t gt_z = low + (0x7f - 'Z') * ones;
+	uint64_t is_upper = (ge_a ^ gt_z) & ~word & high_bits;
+	return word | (is_upper >> 2);
+}
+
+// Compare 8 bytes at once while folded words are equal.
+inline int
+collation_ascii_ci_compare(const char *string1, uint32_t len1,
+			   const char *string2, uint32_t len2)
+{
+	uint32_t min_len = len1 < len2 ? len1 : len2;
+	uint32_t i = 0;
+	for (; i + sizeof(uint64_t) <= min_len; i += sizeof(uint64_t)) {
+		uint64_t word1, word2;
+		memcpy(&word1, string1 + i, sizeof(word1));
+		memcpy(&word2, string2 + i, sizeof(word2));
+		if (word1 == word2)
+			continue;
+		word1 = ascii_fold_word(word1);
+		word2 = ascii_fold_word(word2);
+		if (word1 != word2) {
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ != __ORDER_BIG_ENDIAN__
+			word1 = bswap(word1);
+			word2 = bswap(word2);
+#endif
+			return word1 < word2 ? -1 : 1;
+		}
+	}
+	for (; i < min_len; i++) {
+		uint8_t c1 = ascii_fold(string1[i]);
+		uint8_t c2 = ascii_fold(string2[i]);
+		if (c1 != c2)
+			return c1 < c2 ? -1 : 1;
+	}
+	return len1 < len2 ? -1 : len1 > len2;
+}
+
+inline size_t
+collation_ascii_ci_sort_key(const char *string, uint32_t len, char *out,
+			    size_t size)
+{
+	size_t count = len < size ? len : size;
+	for (size_t i = 0; i < count; i++)
+		out[i] = ascii_fold(string[i]);
+	return len;
+}
+
+/**
+ * Decode UTF-8 code point and move the pointer to the next one.
+ * A byte that doesn't start valid sequence is decoded as itself
+ * plus UTF8_INVALID_BASE, so invalid strings are still ordered.
+ */
+const uint32_t UTF8_INVALID_BASE = 0x1fff00;
+
+inline uint32_t
+utf8_decode(const char *&p, const char *end)
+{
+	uint8_t c = *p++;
+	if (c < 0x80)
+		return c;
+	uint32_t count;
+	uint32_t code;
+	if (c >= 0xc2 && c <= 0xdf) {
+		count = 1;
+		code = c & 0x1f;
+	} else if (c >= 0xe0 && c <= 0xef) {
+		count = 2;
+		code = c & 0x0f;
+	} else if (c >= 0xf0 && c <= 0xf4) {
+		count = 3;
+		code = c & 0x07;
+	} else {
+		return UTF8_INVALID_BASE + c;
+	}
+	if ((size_t)(end - p) < count)
+		return UTF8_INVALID_BASE + c;
+	for (uint32_t i = 0; i < count; i++) {
+		uint8_t next = p[i];
+		if ((next & 0xc0) != 0x80)
+			return UTF8_INVALID_BASE + c;
+		code = (code << 6) | (next & 0x3f);
+	}
+	p += count;
+	return code;
+}
+
+/**
+ * Simple case folding of Latin (with Latin-1 and Latin Extended-A),
+ * Greek and Cyrillic letters: upper case letters are mapped to lower case.
+ */
+inline uint32_t
+unicode_fold(uint32_t code)
+{
+	if (code < 0x80)
+		return ascii_fold(code);
+	if (code >= 0xc0 && code <= 0xde && code != 0xd7)
+		return code + 0x20;
+	if (code >= 0x100 && code <= 0x17f) {
+		if (code == 0x178)
+			return 0xff;
+		// Pairs of upper (first) and lower case letters.
+		bool odd_upper = (code >= 0x139 && code <= 0x148) ||
+				 (code >= 0x179 && code <= 0x17e);
+		if (code == 0x130 || code == 0x138 || code == 0x149 ||
+		    code == 0x17f)
+			return code;
+		if (odd_upper)
+			return (code & 1) != 0 ? code + 1 : code;
+		return code | 1;
+	}
+	if (code >= 0x391 && code <= 0x3a9 && code != 0x3a2)
+		return code + 0x20;
+	if (code >= 0x410 && code <= 0x42f)
+		return code + 0x20;
+	if (code >= 0x400 && code <= 0x40f)
+		return code + 0x50;
+	return code;
+}
+
+inline int
+collation_unicode_ci_compare(const char *string1, uint32_t len1,
+			     const char *string2, uint32_t len2)
+{
+	const char *end1 = string1 + len1;
+	const char *end2 = string2 + len2;
+	while (string1 < end1 && string2 < end2) {
+		// Common prefix of ASCII is compared without folding.
+		if (*string1 == *string2 && (uint8_t)*string1 < 0x80) {
+			string1++;
+			string2++;
+			continue;
+		}
+		uint32_t code1 = unicode_fold(utf8_decode(string1, end1));
+		uint32_t code2 = unicode_fold(utf8_decode(string2, end2));
+		if (code1 != code2)
+			return code1 < code2 ? -1 : 1;
+	}
+	return (int)(string1 < end1) - (int)(string2 < end2);
+}
+
+/**
+ * Sort key of unicode_ci is a sequence of folded code points, every code
+ * point takes 3 bytes of 7 bits, big-endian, with high bit set.
+ * Thus the sort key doesn't contain zero bytes.
+ */
+const uint32_t UNICODE_CI_SORT_KEY_RATIO = 3;
+
+inline size_t
+collation_unicode_ci_sort_key(const char *string, uint32_t len, char *out,
+			      size_t size)
+{
+	const char *end = string + len;
+	size_t out_size = 0;
+	while (string < end) {
+		uint32_t code = unicode_fold(utf8_decode(string, end));
+		uint8_t bytes[UNICODE_CI_SORT_KEY_RATIO];
+		bytes[0] = 0x80 | (code >> 14);
+		bytes[1] = 0x80 | ((code >> 7) & 0x7f);
+		bytes[2] = 0x80 | (code & 0x7f);
+		for (uint32_t i = 0; i < UNICODE_CI_SORT_KEY_RATIO; i++) {
+			if (out_size < size)
+				out[out_size] = bytes[i];
+			out_size++;
+		}
+	}
+	return out_size;
+}
+
+// Get built-in collation.
+inline const Collation *
+collation_by_id(collation_id_t id)
+{
+	static const Collation collations[COLLATION_COUNT] = {
+		{"binary", collation_binary_compare,
+		 collation_binary_sort_key, 1},
+		{"ascii_ci", collation_ascii_ci_compare,
+		 collation_ascii_ci_sort_key, 1},
+		{"unicode_ci", collation_unicode_ci_compare,
+		 collation_unicode_ci_sort_key, UNICODE_CI_SORT_KEY_RATIO},
+	};
+	assert(id < COLLATION_COUNT);
+	return &collations[id];
+}
@@ -0,0 +1,255 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+/**
+ * Epoch-based reclamation of memory of structures that are read without
+ * locks, see CTupleTreeConcurrent.
+ * A writer unlinks an object from the structure and retires it instead
+ * of freeing: the object is stamped with the global epoch and is freed
+ * only when every reader that could have seen it has left its read
+ * section. A reader enters a read section by copying the global epoch
+ * to its own slot and leaves it by clearing the slot. Reclaim advances
+ * the global epoch and frees objects retired before the earliest epoch
+ * of readers in read sections.
+ * Readers write only their slots, every slot takes its own cache line,
+ * and read the global epoch, that writers change once per reclaim
+ * batch. So readers don't write shared cache lines.
+ * Writers are serialized by the owner of the structure: Retire,
+ * Reclaim and Drain are not thread-safe.
+ */
+
+const size_t EPOCH_MAX_READERS = 256;
+// Retired objects are reclaimed when there are as many of them.
+const size_t EPOCH_RECLAIM_BATCH = 1024;
+const size_t EPOCH_CACHE_LINE = 64;
+
+class CEpoch
+{
+public:
+	// Free the retired object, ctx is given to Retire.
+	typedef void (*reclaim_f)(void *ctx, void *ptr);
+
+	CEpoch()
+		: m_epoch(1), m_slotCount(0), m_reclaimAt(EPOCH_RECLAIM_BATCH)
+	{
+		// Slots are allocated apart and aligned by hand, so they take
+		// their cache lines wherever the owner is: new does not align
+		// to more than alignof(std::max_align_t) before C++17.
+		m_memory = malloc(EPOCH_MAX_READERS * sizeof(Slot) +
+				  EPOCH_CACHE_LINE - 1);
+		if (m_memory == NULL)
+			throw std::bad_alloc();
+		uintptr_t slots = ((uintptr_t)m_memory + EPOCH_CACHE_LINE - 1) &
+				  ~(uintptr_t)(EPOCH_CACHE_LINE - 1);
+		m_slots = (Slot *)slots;
+		for (size_t i = 0; i < EPOCH_MAX_READERS; i++) {
+			new (&m_slots[i]) Slot();
+			m_slots[i].epoch.store(0, std::memory_order_relaxed);
+			m_slots[i].is_used.store(false,
+						 std::memory_order_relaxed);
+		}
+	}
+
+	~CEpoch()
+	{
+		Drain();
+		free(m_memory);
+	}
+
+	CEpoch(const CEpoch&) = delete;
+	CEpoch& operator=(const CEpoch&) = delete;
+
+	/**
+	 * Take a free reader slot, see CEpochReader. Abort if all
+	 * EPOCH_MAX_READERS slots are taken.
+	 */
+	size_t AcquireReader()
+	{
+		for (size_t i = 0; i < EPOCH_MAX_READERS; i++) {
+			Slot *slot = &m_slots[i];
+			bool is_used = false;
+			if (slot->is_used.load(std::memory_order_relaxed) ||
+			    !slot->is_used.compare_exchange_strong(is_used, true))
+				continue;
+			size_t count = m_slotCount.load();
+			while (count <= i &&
+			       !m_slotCount.compare_exchange_weak(count, i + 1))
+				;
+			return i;
+		}
+		abort();
+	}
+
+	void ReleaseReader(size_t reader)
+	{
+		assert(m_slots[reader].epoch.load(std::memory_order_relaxed) == 0);
+		m_slots[reader].is_used.store(false, std::memory_order_release);
+	}
+
+	// Enter the read section of the reader.
+	void Enter(size_t reader)
+	{
+		Slot *slot = &m_slots[reader];
+		assert(slot->epoch.load(std::memory_order_relaxed) == 0);
+		slot->epoch.store(m_epoch.load(std::memory_order_acquire),
+				  std::memory_order_relaxed);
+		// Pairs with the fence of Reclaim: either the reclaim sees
+		// the slot, or the reader sees all objects unlinked before.
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+	}
+
+	void Exit(size_t reader)
+	{
+		m_slots[reader].epoch.store(0, std::memory_order_release);
+	}
+
+	/**
+	 * Free the object by reclaim when no reader can see it. The object
+	 * must be unlinked from the structure already.
+	 */
+	void Retire(void *ptr, reclaim_f reclaim, void *ctx)
+	{
+		RetiredObject retired = {m_epoch.load(std::memory_order_relaxed),
+					 ptr, reclaim, ctx};
+		m_retired.push_back(retired);
+		if (m_retired.size() >= m_reclaimAt)
+			Reclaim();
+	}
+
+	// Free the retired objects that no reader can see, return their number.
+	size_t Reclaim()
+	{
+		uint64_t min = m_epoch.fetch_add(1) + 1;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		size_t slot_count = m_slotCount.load();
+		for (size_t i = 0; i < slot_count; i++) {
+			uint64_t epoch =
+				m_slots[i].epoch.load(std::memory_order_acquire);
+			if (epoch != 0 && epoch < min)
+				min = epoch;
+		}
+		size_t kept = 0;
+		for (size_t i = 0; i < m_retired.size(); i++) {
+			const RetiredObject &retired = m_retired[i];
+			if (retired.epoch < min)
+				retired.reclaim(retired.ctx, retired.ptr);
+			else
+				m_retired[kept++] = retired;
+		}
+		size_t freed = m_retired.size() - kept;
+		m_retired.resize(kept);
+		// Objects of the last epoch are usually held by active readers,
+		// they are freed by the next reclaim.
+		m_reclaimAt = kept + EPOCH_RECLAIM_BATCH;
+		return freed;
+	}
+
+	// Free all the retired objects, there must be no readers in sections.
+	void Drain()
+	{
+		for (size_t i = 0; i < EPOCH_MAX_READERS; i++)
+			assert(m_slots[i].epoch.load() == 0);
+		for (size_t i = 0; i < m_retired.size(); i++)
+			m_retired[i].reclaim(m_retired[i].ctx, m_retired[i].ptr);
+		m_retired.clear();
+		m_reclaimAt = EPOCH_RECLAIM_BATCH;
+	}
+
+	// Number of retired objects that are not freed yet.
+	size_t Retired() const
+	{
+		return m_retired.size();
+	}
+
+private:
+	// Reader slot, takes a whole cache line.
+	struct alignas(EPOCH_CACHE_LINE) Slot {
+		// Epoch of the read section, 0 out of section.
+		std::atomic<uint64_t> epoch;
+		std::atomic<bool> is_used;
+		char padding[EPOCH_CACHE_LINE - sizeof(std::atomic<uint64_t>) -
+			     sizeof(std::atomic<bool>)];
+	};
+	static_assert(sizeof(Slot) == EPOCH_CACHE_LINE,
+		      "reader slot must take one cache line");
+	static_assert(alignof(Slot) == EPOCH_CACHE_LINE,
+		      "reader slot must be aligned to a cache line");
+
+	struct RetiredObject {
+		uint64_t epoch;
+		void *ptr;
+		reclaim_f reclaim;
+		void *ctx;
+	};
+
+	std::atomic<uint64_t> m_epoch;
+	// Slots above are never taken.
+	std::atomic<size_t> m_slotCount;
+	// EPOCH_MAX_READERS slots aligned in m_memory.
+	Slot *m_slots;
+	// Keeps the fields that writers change off the line of the above.
+	char m_padding[EPOCH_CACHE_LINE];
+	std::vector<RetiredObject> m_retired;
+	size_t m_reclaimAt;
+	void *m_memory;
+};
+
+// Reader slot of a thread, taken for the lifetime of the object.
+class CEpochReader
+{
+public:
+	explicit CEpochReader(CEpoch *epoch)
+		: m_epoch(epoch), m_reader(epoch->AcquireReader())
+	{
+	}
+
+	~CEpochReader()
+	{
+		m_epoch->ReleaseReader(m_reader);
+	}
+
+	CEpochReader(const CEpochReader&) = delete;
+	CEpochReader& operator=(const CEpochReader&) = delete;
+
+	void Enter()
+	{
+		m_epoch->Enter(m_reader);
+	}
+
+	void Exit()
+	{
+		m_epoch->Exit(m_reader);
+	}
+
+private:
+	CEpoch *m_epoch;
+	size_t m_reader;
+};
+
+// Read section for the lifetime of the object.
+class CEpochGuard
+{
+public:
+	explicit CEpochGuard(CEpochReader *reader) : m_reader(reader)
+	{
+		reader->Enter();
+	}
+
+	~CEpochGuard()
+	{
+		m_reader->Exit();
+	}
+
+	CEpochGuard(const CEpochGuard&) = delete;
+	CEpochGuard& operator=(const CEpochGuard&) = delete;
+
+private:
+	CEpochReader *m_reader;
+};
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
+
+/**
+ * Fast 64-bit hash of the wyhash family: data is read by 8 bytes (or
+ * less for short data), and every 16 bytes are mixed by one 64x64->128 bit
+ * multiplication, folded by xor of the halves of the product.
+ * The hash is used by in-memory indexes only, so it's not stable across
+ * platforms or versions.
+ */
+
+const uint64_t HASH_P0 = 0xa0761d6478bd642full;
+const uint64_t HASH_P1 = 0xe7037ed1a0b428dbull;
+const uint64_t HASH_P2 = 0x8ebc6af09c88c6e3ull;
+const uint64_t HASH_P3 = 0x589965cc75374cc3ull;
+
+// Multiply to 128 bits and xor the halves.
+inline uint64_t
+hash_mum(uint64_t a, uint64_t b)
+{
+#if defined(__SIZEOF_INT128__)
+	__extension__ typedef unsigned __int128 uint128_t;
+	uint128_t r = (uint128_t)a * b;
+	return (uint64_t)r ^ (uint64_t)(r >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+	uint64_t hi;
+	uint64_t lo = _umul128(a, b, &hi);
+	return lo ^ hi;
+#else
+	uint64_t a_lo = (uint32_t)a, a_hi = a >> 32;
+	uint64_t b_lo = (uint32_t)b, b_hi = b >> 32;
+	uint64_t lo_lo = a_lo * b_lo, hi_lo = a_hi * b_lo;
+	uint64_t lo_hi = a_lo * b_hi, hi_hi = a_hi * b_hi;
+	uint64_t cross = (lo_lo >> 32) + (uint32_t)hi_lo + lo_hi;
+	uint64_t hi = hi_hi + (hi_lo >> 32) + (cross >> 32);
+	uint64_t lo = (cross << 32) | (uint32_t)lo_lo;
+	return lo ^ hi;
+#endif
+}
+
+inline uint64_t
+hash_read64(const char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+inline uint64_t
+hash_read32(const char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+// Hash bytes, seed is a hash of preceding data or any number.
+inline uint64_t
+hash_bytes(const char *data, size_t len, uint64_t seed)
+{
+	seed ^= HASH_P0;
+	uint64_t a, b;
+	if (len <= 16) {
+		if (len >= 4) {
+			// Two overlapped pairs of 4 bytes cover 4..16 bytes.
+			size_t shift = (len >> 3) << 2;
+			a = (hash_read32(data) << 32) | hash_read32(data + shift);
+			b = (hash_read32(data + len - 4) << 32) |
+			    hash_read32(data + len - 4 - shift);
+		} else if (len > 0) {
+			a = ((uint64_t)(uint8_t)data[0] << 16) |
+			    ((uint64_t)(uint8_t)data[len >> 1] << 8) |
+			    (uint8_t)data[len - 1];
+			b = 0;
+		} else {
+			a = b = 0;
+		}
+	} else {
+		size_t left = len;
+		for (; left > 16; left -= 16, data += 16)
+			seed = hash_mum(hash_read64(data) ^ HASH_P1,
+					hash_read64(data + 8) ^ seed);
+		// The last 16 bytes, maybe overlapped with the previous ones.
+		a = hash_read64(data + left - 16);
+		b = hash_read64(data + left - 8);
+	}
+	return hash_mum(HASH_P1 ^ len, hash_mum(a ^ HASH_P1, b ^ seed));
+}
+
+// Hash 64-bit value, seed is a hash of preceding data or any number.
+inline uint64_t
+hash_uint(uint64_t value, uint64_t seed)
+{
+	return hash_mum(value ^ HASH_P1, seed ^ HASH_P2);
+}
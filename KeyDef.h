@@ -0,0 +1,707 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <Collation.h>
+#include <Hash.h>
+#include <MsgPack.h>
+#include <MsgPackCheck.h>
+#include <Tuple.h>
+
+const size_t MAX_NUM_FIELDS_IN_KEY = 16;
+
+// Compiled comparison of key def parts, see TupleCompare.h.
+struct TupleCompareProgram;
+
+/**
+ * KeyDef is a definition of how tuples are compared. Generally any order
+ * of tuple fields may be chosen and then tuples are compared lexicographically
+ * field by field, with the chosen field order. Of course any subset of tuple
+ * fields may be chosen either.
+ * For example we may create a key def: compare fields number 3; than (if 3rds
+ * are equal) compare fields number 0; that's all.
+ * Different key defs thus must define different order for the same group of
+ * tuples. That allows, for example, to construct several indexes for faster
+ * tuple search by different tuple fields.
+ */
+struct KeyDef {
+	enum field_type_t {
+		UINT,
+		STRING,
+		// Negative or positive integer, int64_t or uint64_t.
+		INTEGER,
+		// Float or double.
+		DOUBLE,
+		// Any of uint, int, float or double, compared exactly.
+		NUMBER,
+		BOOLEAN,
+		// Binary string, compared lexicographically.
+		BINARY,
+		UNDEFINED,
+	};
+	struct KeyPart {
+		field_type_t field_type;
+		size_t field_no;
+		// The field may be nil, that is less than any value.
+		bool is_nullable;
+		// Collation of string part, NULL for byte by byte order.
+		const Collation *collation;
+	};
+
+	/**
+	 * Parts describe how tuples are compared.
+	 * Each part stores field_no, that field type, nullability
+	 * and collation.
+	 */
+	size_t part_count;
+	KeyPart parts[MAX_NUM_FIELDS_IN_KEY];
+
+	/**
+	 * Compare tuple hints (see tuple_hint) before comparing parts.
+	 * The hints must be set to tuples before comparison.
+	 */
+	bool use_hint;
+
+	/**
+	 * Compare all parts and combine their results without branches,
+	 * see compare_result_select, instead of returning at the first
+	 * unequal part. That is faster when the deciding part is hard to
+	 * predict, e.g. many keys share prefixes, and slower when the first
+	 * part almost always decides. Applied by key_def_set_compare_func
+	 * to tuple comparators.
+	 */
+	bool use_branchless;
+
+	typedef int (*tuple_compare_t)(KeyDef *def, Tuple *tuple1, Tuple *tuple2);
+	/**
+	 * Comparison function. Can be default_tuple_compare that works
+	 * with any key def, or a function specialized for given parts,
+	 * see key_def_set_compare_func.
+	 */
+	tuple_compare_t tuple_compare_f;
+
+	/**
+	 * Key is a msgpack array of part values, in the order of parts.
+	 * It may be partial, i.e. contain only the first part_count parts.
+	 * The function receives the key without array header,
+	 * see tuple_compare_with_key.
+	 */
+	typedef int (*tuple_compare_with_key_t)(KeyDef *def, Tuple *tuple,
+						const char *key,
+						uint32_t part_count);
+	/**
+	 * Comparison function of tuple and key. Can be
+	 * default_tuple_compare_with_key or a specialized one.
+	 */
+	tuple_compare_with_key_t tuple_compare_with_key_f;
+
+	typedef uint64_t (*tuple_hash_t)(KeyDef *def, Tuple *tuple);
+	/**
+	 * Hash of the parts of the tuple, equal for all the tuples that
+	 * are equal by tuple_compare_f. Can be default_tuple_hash or
+	 * a function specialized for given parts, see key_def_set_hash_func.
+	 */
+	tuple_hash_t tuple_hash_f;
+
+	/**
+	 * Parts compiled by key_def_set_compiled, that are run by compiled
+	 * comparators. Programs are cached and shared by key defs with
+	 * equal parts and format, they are never freed.
+	 */
+	const TupleCompareProgram *compare_program;
+
+#ifdef TUPLE_COMPARE_PROFILE
+	/**
+	 * The chosen comparator, that is called by tuple_compare_profiled
+	 * set as tuple_compare_f, and the identifier of the key def in
+	 * profiles, see TupleCompareProfile.h.
+	 */
+	tuple_compare_t profiled_compare_f;
+	uint64_t profile_id;
+	bool profile_is_compiled;
+#endif
+};
+
+// Compare two msgpack fields of given type, move the pointers to the ends.
+inline int
+field_compare(KeyDef::field_type_t field_type, const char *&field1,
+	      const char *&field2)
+{
+	switch (field_type) {
+		case KeyDef::UINT:
+			return mp_compare_uint(field1, field2);
+		case KeyDef::STRING:
+			return mp_compare_string(field1, field2);
+		case KeyDef::INTEGER:
+			return mp_compare_integer(field1, field2);
+		case KeyDef::DOUBLE:
+			return mp_compare_double(field1, field2);
+		case KeyDef::NUMBER:
+			return mp_compare_number(field1, field2);
+		case KeyDef::BOOLEAN:
+			return mp_compare_bool(field1, field2);
+		default:
+			assert(field_type == KeyDef::BINARY);
+			return mp_compare_bin(field1, field2);
+	}
+}
+
+// Compare two strings by collation, move the pointers to the ends.
+inline int
+mp_compare_string_coll(const char *&field1, const char *&field2,
+		       const Collation *collation)
+{
+	uint32_t len1, len2;
+	const char *string1 = mp_decode_string(field1, len1);
+	const char *string2 = mp_decode_string(field2, len2);
+	return collation->compare(string1, len1, string2, len2);
+}
+
+/**
+ * Compare two msgpack fields of the part, move the pointers to the ends.
+ * Strings with collation are compared by the collation.
+ */
+inline int
+key_part_compare(const KeyDef::KeyPart *part, const char *&field1,
+		 const char *&field2)
+{
+	if (part->collation != NULL) {
+		assert(part->field_type == KeyDef::STRING);
+		return mp_compare_string_coll(field1, field2, part->collation);
+	}
+	return field_compare(part->field_type, field1, field2);
+}
+
+/**
+ * Compare fields of nullable part if any of them is nil, nil is less
+ * than any value. Return true and set result if the fields are compared.
+ * Pointers are moved to the ends only if both fields are nil.
+ */
+inline bool
+field_compare_nil(const char *&field1, const char *&field2, int &result)
+{
+	bool is_nil1 = mp_is_nil(field1);
+	bool is_nil2 = mp_is_nil(field2);
+	if (!is_nil1 && !is_nil2)
+		return false;
+	result = (int)is_nil2 - (int)is_nil1;
+	if (result == 0) {
+		mp_decode_nil(field1);
+		mp_decode_nil(field2);
+	}
+	return true;
+}
+
+/**
+ * Default comparison of anything that has get_field(field_no): Tuple
+ * or TupleView (see TupleView.h), in any combination.
+ */
+template <class TUPLE1, class TUPLE2>
+inline int
+tuple_compare_generic(KeyDef *def, TUPLE1 *tuple1, TUPLE2 *tuple2)
+{
+	assert(def->part_count > 0);
+
+	const char *part1;
+	const char *part2;
+
+	for (size_t i = 0; i < def->part_count; i++) {
+		KeyDef::KeyPart *part = &def->parts[i];
+
+		if (i == 0 ||
+		    def->parts[i].field_no != def->parts[i - 1].field_no + 1) {
+			/*
+			 * That's an important part. In real life the field
+			 * access by index is a bit more complicated and should
+			 * be avoided.
+			 * One the other hand decoding of a field puts the
+			 * pointer exactly to the next field. So if the fields
+			 * are sequential there's no need to reposition the
+			 * pointer.
+			 * The if condition above makes this optimization.
+			 */
+			part1 = tuple1->get_field(part->field_no);
+			part2 = tuple2->get_field(part->field_no);
+		}
+
+		int r;
+		if (part->is_nullable && field_compare_nil(part1, part2, r)) {
+			if (r != 0)
+				return r;
+			continue;
+		}
+		r = key_part_compare(part, part1, part2);
+		if (r != 0)
+			return r;
+		// If parts are equal - go to the next part.
+	}
+
+	// All parts are equal.
+	return 0;
+}
+
+inline int
+default_tuple_compare(KeyDef *def, Tuple *tuple1, Tuple *tuple2)
+{
+	return tuple_compare_generic(def, tuple1, tuple2);
+}
+
+inline int
+tuple_compare_by_first_uint(KeyDef *, Tuple *tuple1, Tuple *tuple2)
+{
+	const char *part1 = tuple1->data() + tuple1->first_field_offset;
+	const char *part2 = tuple2->data() + tuple2->first_field_offset;
+	return mp_compare_uint(part1, part2);
+}
+
+template <class TUPLE>
+inline int
+tuple_compare_with_key_generic(KeyDef *def, TUPLE *tuple, const char *key,
+			       uint32_t part_count)
+{
+	assert(part_count <= def->part_count);
+
+	const char *part1;
+	// Key parts are always sequential.
+	const char *part2 = key;
+
+	for (size_t i = 0; i < part_count; i++) {
+		KeyDef::KeyPart *part = &def->parts[i];
+
+		if (i == 0 ||
+		    def->parts[i].field_no != def->parts[i - 1].field_no + 1)
+			part1 = tuple->get_field(part->field_no);
+
+		int r;
+		if (part->is_nullable && field_compare_nil(part1, part2, r)) {
+			if (r != 0)
+				return r;
+			continue;
+		}
+		r = key_part_compare(part, part1, part2);
+		if (r != 0)
+			return r;
+	}
+
+	// All parts of the key are equal.
+	return 0;
+}
+
+inline int
+default_tuple_compare_with_key(KeyDef *def, Tuple *tuple, const char *key,
+			       uint32_t part_count)
+{
+	return tuple_compare_with_key_generic(def, tuple, key, part_count);
+}
+
+// Compare tuple with a key - msgpack array of part values.
+inline int
+tuple_compare_with_key(KeyDef *def, Tuple *tuple, const char *key)
+{
+	uint32_t part_count = mp_decode_array(key);
+	return def->tuple_compare_with_key_f(def, tuple, key, part_count);
+}
+
+/**
+ * Compare two keys - msgpack arrays of part values, that can be partial.
+ * Only the common prefix of parts is compared.
+ */
+inline int
+key_compare(KeyDef *def, const char *key1, const char *key2)
+{
+	uint32_t part_count1 = mp_decode_array(key1);
+	uint32_t part_count2 = mp_decode_array(key2);
+	uint32_t part_count = part_count1 < part_count2 ? part_count1
+							: part_count2;
+	assert(part_count <= def->part_count);
+	for (size_t i = 0; i < part_count; i++) {
+		KeyDef::KeyPart *part = &def->parts[i];
+		int r;
+		if (part->is_nullable && field_compare_nil(key1, key2, r)) {
+			if (r != 0)
+				return r;
+			continue;
+		}
+		r = key_part_compare(part, key1, key2);
+		if (r != 0)
+			return r;
+	}
+	return 0;
+}
+
+// Check whether the marker is of a value of the field type.
+inline bool
+field_type_marker(KeyDef::field_type_t field_type, uint8_t c)
+{
+	switch (field_type) {
+		case KeyDef::UINT:
+			return mp_uint_size[c] != MP_BAD_UINT_SIZE;
+		case KeyDef::STRING:
+			return (c >= 0xa0 && c <= 0xbf) || (c >= 0xd9 && c <= 0xdb);
+		case KeyDef::INTEGER:
+			return mp_uint_size[c] != MP_BAD_UINT_SIZE ||
+			       (c >= 0xd0 && c <= 0xd3) || c >= 0xe0;
+		case KeyDef::DOUBLE:
+			return mp_is_float_marker(c);
+		case KeyDef::NUMBER:
+			return field_type_marker(KeyDef::INTEGER, c) ||
+			       mp_is_float_marker(c);
+		case KeyDef::BOOLEAN:
+			return c == 0xc2 || c == 0xc3;
+		default:
+			assert(field_type == KeyDef::BINARY);
+			return c >= 0xc4 && c <= 0xc6;
+	}
+}
+
+/**
+ * Check the key (msgpack array of part values) from untrusted input,
+ * that ends not later than end, and move key pointer to its end.
+ * The key may be partial. Values must be of types of the parts, or nil
+ * for nullable parts. A checked key can be given to
+ * tuple_compare_with_key, key_compare and others.
+ */
+inline mp_check_t
+key_check(KeyDef *def, const char *&key, const char *end)
+{
+	const char *p = key;
+	uint32_t part_count;
+	mp_check_t r = mp_check_array(p, end, part_count);
+	if (r != MP_CHECK_OK)
+		return r;
+	if (part_count > def->part_count)
+		return MP_CHECK_BAD_VALUE;
+	for (uint32_t i = 0; i < part_count; i++) {
+		const KeyDef::KeyPart *part = &def->parts[i];
+		if (p == end)
+			return MP_CHECK_TRUNCATED;
+		uint8_t c = p[0];
+		bool is_nil = part->is_nullable && c == 0xc0;
+		if (!is_nil && !field_type_marker(part->field_type, c))
+			return MP_CHECK_BAD_MARKER;
+		r = mp_check_next(p, end);
+		if (r != MP_CHECK_OK)
+			return r;
+	}
+	key = p;
+	return MP_CHECK_OK;
+}
+
+/**
+ * Extract key (msgpack array of part values) from the tuple.
+ * Part values are copied as is, without reencoding.
+ * Move key pointer to the end of encoded key.
+ * Works for Tuple and TupleView.
+ */
+template <class TUPLE>
+inline void
+tuple_extract_key(KeyDef *def, TUPLE *tuple, char *&key)
+{
+	mp_encode_array(key, def->part_count);
+	for (size_t i = 0; i < def->part_count; i++) {
+		const char *begin = tuple->get_field(def->parts[i].field_no);
+		const char *end = begin;
+		mp_next(end);
+		memcpy(key, begin, end - begin);
+		key += end - begin;
+	}
+}
+
+// Hint of string or binary string, see field_hint.
+inline Tuple::hint_t
+string_hint(const char *string, uint32_t len)
+{
+	uint32_t hint_len = len < 7 ? len : 7;
+	Tuple::hint_t hint = 0;
+	for (uint32_t i = 0; i < hint_len; i++)
+		hint |= (Tuple::hint_t)(uint8_t)string[i] << (56 - 8 * i);
+	return hint | hint_len;
+}
+
+/**
+ * Bits of double that are ordered as unsigned integers in the same way
+ * as doubles are: the sign bit is flipped for positive values and all bits
+ * are flipped for negative ones. -0 is the same as 0 and NaN is 0.
+ */
+inline uint64_t
+double_hint(double num)
+{
+	if (num != num)
+		return 0;
+	if (num == 0)
+		num = 0;
+	uint64_t bits;
+	memcpy(&bits, &num, sizeof(bits));
+	const uint64_t sign = (uint64_t)1 << 63;
+	return (bits & sign) != 0 ? ~bits : bits | sign;
+}
+
+/**
+ * Comparison hint is an order preserving digest of the first part:
+ * if hint1 < hint2 then the first part of tuple1 is less than the first
+ * part of tuple2, so only equal hints require full comparison.
+ * Hints of different values may be equal, it only means that full
+ * comparison is needed.
+ * For uint and bool the hint is the value itself.
+ * For string and binary the hint is the first 7 bytes (padded with zeros)
+ * and the number of these bytes in the lowest byte. For string with
+ * collation it's the same for the sort key of the string.
+ * For integer the hint is the value shifted by 2^63, with big uints
+ * cut to 2^63 - 1.
+ * For double and number the hint is ordered bits of double (see
+ * double_hint), integers of number are rounded to double.
+ * Nil of nullable part has hint 0, that is not greater than any other.
+ */
+inline Tuple::hint_t
+field_hint(KeyDef::field_type_t field_type, const char *field)
+{
+	uint32_t len;
+	const char *string;
+	uint64_t value;
+	const uint64_t sign = (uint64_t)1 << 63;
+	switch (field_type) {
+		case KeyDef::UINT:
+			return mp_decode_uint(field);
+		case KeyDef::STRING:
+			string = mp_decode_string(field, len);
+			return string_hint(string, len);
+		case KeyDef::INTEGER:
+			if (mp_decode_integer(field, value))
+				return value ^ sign;
+			return value < sign ? value | sign : ~(uint64_t)0;
+		case KeyDef::DOUBLE:
+			return double_hint(mp_decode_double(field));
+		case KeyDef::NUMBER:
+			if (mp_is_float_marker(field[0]))
+				return double_hint(mp_decode_double(field));
+			if (mp_decode_integer(field, value))
+				return double_hint((double)(int64_t)value);
+			return double_hint((double)value);
+		case KeyDef::BOOLEAN:
+			return mp_decode_bool(field);
+		default:
+			assert(field_type == KeyDef::BINARY);
+			string = mp_decode_bin(field, len);
+			return string_hint(string, len);
+	}
+}
+
+// Calculate comparison hint of the field of the first key part.
+inline Tuple::hint_t
+key_part_hint(const KeyDef::KeyPart *part, const char *field)
+{
+	if (part->is_nullable && mp_is_nil(field))
+		return 0;
+	if (part->collation != NULL) {
+		uint32_t len;
+		const char *string = mp_decode_string(field, len);
+		char sort_key[7];
+		size_t size = part->collation->sort_key(string, len, sort_key,
+							sizeof(sort_key));
+		return string_hint(sort_key, size);
+	}
+	return field_hint(part->field_type, field);
+}
+
+// Calculate comparison hint of the tuple for the key def.
+inline Tuple::hint_t
+tuple_hint(KeyDef *def, Tuple *tuple)
+{
+	assert(def->part_count > 0);
+	KeyDef::KeyPart *part = &def->parts[0];
+	return key_part_hint(part, tuple->get_field(part->field_no));
+}
+
+/**
+ * Calculate comparison hint of the key (msgpack array of part values),
+ * that is compatible with tuple_hint. The key must have at least one part.
+ */
+inline Tuple::hint_t
+key_hint(KeyDef *def, const char *key)
+{
+	uint32_t part_count = mp_decode_array(key);
+	assert(part_count > 0);
+	(void)part_count;
+	return key_part_hint(&def->parts[0], key);
+}
+
+// Hash of integer, see mp_decode_integer about is_negative and value.
+inline uint64_t
+integer_hash(bool is_negative, uint64_t value, uint64_t seed)
+{
+	return hash_uint(value, is_negative ? seed ^ HASH_P3 : seed);
+}
+
+// Hash of double, -0 is the same as 0 and all NaNs are the same.
+inline uint64_t
+double_hash(double num, uint64_t seed)
+{
+	if (num != num)
+		return hash_uint(0, seed ^ HASH_P0);
+	if (num == 0)
+		num = 0;
+	uint64_t bits;
+	memcpy(&bits, &num, sizeof(bits));
+	return hash_uint(bits, seed);
+}
+
+/**
+ * Hash of number: double that is equal to an integer (see
+ * mp_compare_double_integer) has the hash of the integer.
+ */
+inline uint64_t
+number_double_hash(double num, uint64_t seed)
+{
+	const double two_pow_63 = 9223372036854775808.0;
+	const double two_pow_64 = 18446744073709551616.0;
+	if (num >= 0 && num < two_pow_64) {
+		uint64_t integer = (uint64_t)num;
+		if ((double)integer == num)
+			return integer_hash(false, integer, seed);
+	} else if (num < 0 && num >= -two_pow_63) {
+		int64_t integer = (int64_t)num;
+		if ((double)integer == num)
+			return integer_hash(true, (uint64_t)integer, seed);
+	}
+	return double_hash(num, seed);
+}
+
+/**
+ * Hash msgpack field of given type, move the pointer to the end.
+ * Fields that are equal by field_compare have equal hashes: uints are
+ * hashed by value whatever their encoded size, floats as doubles,
+ * and integral doubles of number as integers.
+ * The seed is the hash of the previous parts.
+ */
+inline uint64_t
+field_hash(KeyDef::field_type_t field_type, const char *&field, uint64_t seed)
+{
+	uint32_t len;
+	const char *string;
+	uint64_t value;
+	bool is_negative;
+	switch (field_type) {
+		case KeyDef::UINT:
+			return hash_uint(mp_decode_uint(field), seed);
+		case KeyDef::STRING:
+			string = mp_decode_string(field, len);
+			return hash_bytes(string, len, seed);
+		case KeyDef::INTEGER:
+			is_negative = mp_decode_integer(field, value);
+			return integer_hash(is_negative, value, seed);
+		case KeyDef::DOUBLE:
+			return double_hash(mp_decode_double(field), seed);
+		case KeyDef::NUMBER:
+			if (mp_is_float_marker(field[0]))
+				return number_double_hash(mp_decode_double(field),
+							  seed);
+			is_negative = mp_decode_integer(field, value);
+			return integer_hash(is_negative, value, seed);
+		case KeyDef::BOOLEAN:
+			return hash_uint(mp_decode_bool(field), seed);
+		default:
+			assert(field_type == KeyDef::BINARY);
+			string = mp_decode_bin(field, len);
+			return hash_bytes(string, len, seed);
+	}
+}
+
+/**
+ * Hash string by the whole sort key of the collation, so strings that
+ * are equal by the collation have equal hashes.
+ */
+inline uint64_t
+mp_hash_string_coll(const char *&field, const Collation *collation,
+		    uint64_t seed)
+{
+	uint32_t len;
+	const char *string = mp_decode_string(field, len);
+	char buf[256];
+	size_t size = collation->sort_key(string, len, buf, sizeof(buf));
+	if (size <= sizeof(buf))
+		return hash_bytes(buf, size, seed);
+	std::vector<char> sort_key(size);
+	collation->sort_key(string, len, sort_key.data(), size);
+	return hash_bytes(sort_key.data(), size, seed);
+}
+
+/**
+ * Hash msgpack field of the part, move the pointer to the end.
+ * Nil of nullable part has the same hash, different from any value.
+ */
+inline uint64_t
+key_part_hash(const KeyDef::KeyPart *part, const char *&field, uint64_t seed)
+{
+	if (part->is_nullable && mp_is_nil(field)) {
+		mp_decode_nil(field);
+		return hash_uint(0, seed ^ HASH_P2);
+	}
+	if (part->collation != NULL) {
+		assert(part->field_type == KeyDef::STRING);
+		return mp_hash_string_coll(field, part->collation, seed);
+	}
+	return field_hash(part->field_type, field, seed);
+}
+
+/**
+ * Default hash of anything that has get_field(field_no): Tuple
+ * or TupleView (see TupleView.h).
+ */
+template <class TUPLE>
+inline uint64_t
+tuple_hash_generic(KeyDef *def, TUPLE *tuple)
+{
+	uint64_t hash = 0;
+	const char *field;
+	for (size_t i = 0; i < def->part_count; i++) {
+		KeyDef::KeyPart *part = &def->parts[i];
+		if (i == 0 ||
+		    def->parts[i].field_no != def->parts[i - 1].field_no + 1)
+			field = tuple->get_field(part->field_no);
+		hash = key_part_hash(part, field, hash);
+	}
+	return hash;
+}
+
+inline uint64_t
+default_tuple_hash(KeyDef *def, Tuple *tuple)
+{
+	return tuple_hash_generic(def, tuple);
+}
+
+/**
+ * Hash of the key (msgpack array of part values), that is equal to
+ * hash of tuples that are equal to the key. The key must be full.
+ */
+inline uint64_t
+key_hash(KeyDef *def, const char *key)
+{
+	uint32_t part_count = mp_decode_array(key);
+	assert(part_count == def->part_count);
+	(void)part_count;
+	uint64_t hash = 0;
+	for (size_t i = 0; i < def->part_count; i++)
+		hash = key_part_hash(&def->parts[i], key, hash);
+	return hash;
+}
+
+/**
+ * Create tuple format with offsets for all the fields that are used
+ * by given key defs, for example by all indexes of a space.
+ */
+inline TupleFormat *
+tuple_format_new(KeyDef **defs, size_t count)
+{
+	size_t fields[MAX_TUPLE_FORMAT_FIELDS];
+	size_t field_count = 0;
+	for (size_t i = 0; i < count; i++) {
+		for (size_t j = 0; j < defs[i]->part_count; j++) {
+			assert(field_count < MAX_TUPLE_FORMAT_FIELDS);
+			fields[field_count++] = defs[i]->parts[j].field_no;
+		}
+	}
+	return tuple_format_register(fields, field_count);
+}
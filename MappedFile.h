@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstddef>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read only memory mapping of a whole file.
+class CMappedFile
+{
+public:
+	CMappedFile() : m_data(NULL), m_size(0)
+	{
+	}
+
+	~CMappedFile()
+	{
+		Close();
+	}
+
+	CMappedFile(const CMappedFile&) = delete;
+	CMappedFile& operator=(const CMappedFile&) = delete;
+
+	// Map the file. Return false if the file can't be mapped or is empty.
+	bool Open(const char *path)
+	{
+		Close();
+#ifdef _WIN32
+		HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ,
+					  NULL, OPEN_EXISTING,
+					  FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+		LARGE_INTEGER size;
+		HANDLE mapping = NULL;
+		if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+			mapping = CreateFileMappingA(file, NULL, PAGE_READONLY,
+						     0, 0, NULL);
+		CloseHandle(file);
+		if (mapping == NULL)
+			return false;
+		m_data = (const char *)MapViewOfFile(mapping, FILE_MAP_READ,
+						     0, 0, 0);
+		CloseHandle(mapping);
+		if (m_data == NULL)
+			return false;
+		m_size = size.QuadPart;
+#else
+		int fd = open(path, O_RDONLY);
+		if (fd < 0)
+			return false;
+		struct stat st;
+		void *data = MAP_FAILED;
+		if (fstat(fd, &st) == 0 && st.st_size > 0)
+			data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+				    fd, 0);
+		close(fd);
+		if (data == MAP_FAILED)
+			return false;
+		m_data = (const char *)data;
+		m_size = st.st_size;
+#endif
+		return true;
+	}
+
+	void Close()
+	{
+		if (m_data == NULL)
+			return;
+#ifdef _WIN32
+		UnmapViewOfFile(m_data);
+#else
+		munmap((void *)m_data, m_size);
+#endif
+		m_data = NULL;
+		m_size = 0;
+	}
+
+	const char *Data() const
+	{
+		return m_data;
+	}
+
+	size_t Size() const
+	{
+		return m_size;
+	}
+
+private:
+	const char *m_data;
+	size_t m_size;
+};
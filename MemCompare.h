@@ -0,0 +1,223 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <ByteSwap.h>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define MEM_COMPARE_X86 1
+#include <immintrin.h>
+#ifdef _WIN32
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define MEM_COMPARE_NEON 1
+#include <arm_neon.h>
+#endif
+
+#ifdef _WIN32
+#define MEM_COMPARE_AVX2_TARGET
+#else
+#define MEM_COMPARE_AVX2_TARGET __attribute__((target("avx2")))
+#endif
+
+/**
+ * Search of the first mismatching byte of two buffers.
+ * There are several kernels: scalar one that compares 8 bytes at once,
+ * and SIMD ones that compare 16 (SSE2, NEON) or 32 (AVX2) bytes at once.
+ * The best kernel is chosen in runtime by CPU features.
+ * Every kernel returns the index of the first mismatching byte,
+ * or len if the buffers are equal.
+ */
+typedef size_t (*mem_mismatch_t)(const char *data1, const char *data2,
+				 size_t len);
+
+// Buffers shorter than that are always compared by scalar kernel.
+const size_t MEM_MISMATCH_SIMD_MIN_LEN = 16;
+
+// Number of trailing zero bits, the value must not be zero.
+inline uint32_t
+count_trailing_zeros(uint64_t value)
+{
+#ifdef _WIN32
+	unsigned long res;
+	_BitScanForward64(&res, value);
+	return res;
+#else
+	return __builtin_ctzll(value);
+#endif
+}
+
+inline size_t
+mem_mismatch_scalar(const char *data1, const char *data2, size_t len)
+{
+	size_t i = 0;
+	for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+		uint64_t word1, word2;
+		memcpy(&word1, data1 + i, sizeof(word1));
+		memcpy(&word2, data2 + i, sizeof(word2));
+		uint64_t diff = word1 ^ word2;
+		if (diff != 0) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+			diff = bswap(diff);
+#endif
+			return i + count_trailing_zeros(diff) / 8;
+		}
+	}
+	for (; i < len; i++)
+		if (data1[i] != data2[i])
+			return i;
+	return len;
+}
+
+#ifdef MEM_COMPARE_X86
+inline uint32_t
+mem_mismatch_sse2_chunk(const char *data1, const char *data2)
+{
+	__m128i v1 = _mm_loadu_si128((const __m128i *)data1);
+	__m128i v2 = _mm_loadu_si128((const __m128i *)data2);
+	return ~_mm_movemask_epi8(_mm_cmpeq_epi8(v1, v2)) & 0xffff;
+}
+
+inline size_t
+mem_mismatch_sse2(const char *data1, const char *data2, size_t len)
+{
+	if (len < 16)
+		return mem_mismatch_scalar(data1, data2, len);
+	size_t i = 0;
+	uint32_t mask;
+	for (; i + 16 <= len; i += 16) {
+		mask = mem_mismatch_sse2_chunk(data1 + i, data2 + i);
+		if (mask != 0)
+			return i + count_trailing_zeros(mask);
+	}
+	if (i == len)
+		return len;
+	// The last chunk overlaps the previous one that is equal.
+	i = len - 16;
+	mask = mem_mismatch_sse2_chunk(data1 + i, data2 + i);
+	return mask != 0 ? i + count_trailing_zeros(mask) : len;
+}
+
+MEM_COMPARE_AVX2_TARGET inline uint32_t
+mem_mismatch_avx2_chunk(const char *data1, const char *data2)
+{
+	__m256i v1 = _mm256_loadu_si256((const __m256i *)data1);
+	__m256i v2 = _mm256_loadu_si256((const __m256i *)data2);
+	return ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(v1, v2));
+}
+
+MEM_COMPARE_AVX2_TARGET inline size_t
+mem_mismatch_avx2(const char *data1, const char *data2, size_t len)
+{
+	if (len < 32)
+		return mem_mismatch_sse2(data1, data2, len);
+	size_t i = 0;
+	uint32_t mask;
+	for (; i + 32 <= len; i += 32) {
+		mask = mem_mismatch_avx2_chunk(data1 + i, data2 + i);
+		if (mask != 0)
+			return i + count_trailing_zeros(mask);
+	}
+	if (i == len)
+		return len;
+	// The last chunk overlaps the previous one that is equal.
+	i = len - 32;
+	mask = mem_mismatch_avx2_chunk(data1 + i, data2 + i);
+	return mask != 0 ? i + count_trailing_zeros(mask) : len;
+}
+
+// Check that CPU and OS support AVX2.
+inline bool
+cpu_has_avx2()
+{
+#ifdef _WIN32
+	int info[4];
+	__cpuid(info, 1);
+	// OSXSAVE and AVX.
+	if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0)
+		return false;
+	// YMM state is enabled by OS.
+	if ((_xgetbv(0) & 6) != 6)
+		return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif // MEM_COMPARE_X86
+
+#ifdef MEM_COMPARE_NEON
+// Mismatch mask of 16 bytes, 4 bits per byte.
+inline uint64_t
+mem_mismatch_neon_chunk(const char *data1, const char *data2)
+{
+	uint8x16_t v1 = vld1q_u8((const uint8_t *)data1);
+	uint8x16_t v2 = vld1q_u8((const uint8_t *)data2);
+	uint8x16_t eq = vceqq_u8(v1, v2);
+	uint8x8_t res = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+	return ~vget_lane_u64(vreinterpret_u64_u8(res), 0);
+}
+
+inline size_t
+mem_mismatch_neon(const char *data1, const char *data2, size_t len)
+{
+	if (len < 16)
+		return mem_mismatch_scalar(data1, data2, len);
+	size_t i = 0;
+	uint64_t mask;
+	for (; i + 16 <= len; i += 16) {
+		mask = mem_mismatch_neon_chunk(data1 + i, data2 + i);
+		if (mask != 0)
+			return i + count_trailing_zeros(mask) / 4;
+	}
+	if (i == len)
+		return len;
+	// The last chunk overlaps the previous one that is equal.
+	i = len - 16;
+	mask = mem_mismatch_neon_chunk(data1 + i, data2 + i);
+	return mask != 0 ? i + count_trailing_zeros(mask) / 4 : len;
+}
+#endif // MEM_COMPARE_NEON
+
+// Choose the best kernel for current CPU.
+inline mem_mismatch_t
+mem_mismatch_select()
+{
+#if defined(MEM_COMPARE_X86)
+	if (cpu_has_avx2())
+		return mem_mismatch_avx2;
+	return mem_mismatch_sse2;
+#elif defined(MEM_COMPARE_NEON)
+	return mem_mismatch_neon;
+#else
+	return mem_mismatch_scalar;
+#endif
+}
+
+// Index of the first mismatching byte, or len if there's no mismatch.
+inline size_t
+mem_mismatch(const char *data1, const char *data2, size_t len)
+{
+	if (len < MEM_MISMATCH_SIMD_MIN_LEN)
+		return mem_mismatch_scalar(data1, data2, len);
+	static const mem_mismatch_t kernel = mem_mismatch_select();
+	return kernel(data1, data2, len);
+}
+
+/**
+ * Lexicographical comparison of two byte strings, bytes are unsigned.
+ * Return negative, zero or positive value, as memcmp does.
+ */
+inline int
+mem_compare(const char *data1, size_t len1, const char *data2, size_t len2)
+{
+	size_t min_len = len1 < len2 ? len1 : len2;
+	size_t i = mem_mismatch(data1, data2, min_len);
+	if (i < min_len)
+		return (int)(uint8_t)data1[i] - (int)(uint8_t)data2[i];
+	return len1 < len2 ? -1 : len1 > len2;
+}
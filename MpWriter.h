@@ -0,0 +1,248 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include <MsgPack.h>
+#include <Tuple.h>
+
+/**
+ * Msgpack encoder that checks the room for every value, unlike
+ * mp_encode_* functions that write to a raw pointer.
+ * The writer either owns its memory and grows it as needed, or writes
+ * to a fixed buffer given by the caller, e.g. a chunk of an arena. If
+ * a value does not fit into the fixed buffer the writer is overflowed:
+ * the value and all the next ones are not written, so the caller checks
+ * IsOverflow once at the end instead of after every value.
+ * Add* methods check the room for each value. A run of values can be
+ * written without checks after one Begin that reserves room for all of
+ * them (e.g. by MP_MAX_SIZEOF_NUM per number): mp_encode_* are used on
+ * the returned pointer and End sets the end of written data.
+ */
+class CMpWriter
+{
+public:
+	// Writer to own memory of initial capacity, that grows as needed.
+	explicit CMpWriter(size_t capacity = 0)
+		: m_buffer(NULL), m_pos(NULL), m_end(NULL), m_isOwner(true),
+		  m_isOverflow(false)
+	{
+#ifndef NDEBUG
+		m_reserved = NULL;
+#endif
+		if (capacity > 0)
+			Grow(capacity);
+	}
+
+	// Writer to the fixed buffer of size bytes.
+	CMpWriter(char *buffer, size_t size)
+		: m_buffer(buffer), m_pos(buffer), m_end(buffer + size),
+		  m_isOwner(false), m_isOverflow(false)
+	{
+#ifndef NDEBUG
+		m_reserved = NULL;
+#endif
+	}
+
+	~CMpWriter()
+	{
+		if (m_isOwner)
+			free(m_buffer);
+	}
+
+	CMpWriter(const CMpWriter&) = delete;
+	CMpWriter& operator=(const CMpWriter&) = delete;
+
+	const char *Data() const
+	{
+		return m_buffer;
+	}
+
+	// Size of written data.
+	size_t Size() const
+	{
+		return m_pos - m_buffer;
+	}
+
+	size_t Capacity() const
+	{
+		return m_end - m_buffer;
+	}
+
+	// A value did not fit into the fixed buffer, see the class comment.
+	bool IsOverflow() const
+	{
+		return m_isOverflow;
+	}
+
+	// Forget written data and overflow, the memory is kept.
+	void Clear()
+	{
+		m_pos = m_buffer;
+		m_isOverflow = false;
+	}
+
+	/**
+	 * Make room for size more bytes. Return false if the writer is
+	 * overflowed.
+	 */
+	bool Reserve(size_t size)
+	{
+		if ((size_t)(m_end - m_pos) >= size && !m_isOverflow)
+			return true;
+		return Grow(size);
+	}
+
+	/**
+	 * Reserve size bytes and return the pointer to write them without
+	 * checks, NULL if the writer is overflowed. Writing is finished by
+	 * End with the end of written data.
+	 */
+	char *Begin(size_t size)
+	{
+		if (!Reserve(size))
+			return NULL;
+#ifndef NDEBUG
+		m_reserved = m_pos + size;
+#endif
+		return m_pos;
+	}
+
+	void End(char *end)
+	{
+		assert(end >= m_pos && end <= m_reserved);
+		m_pos = end;
+	}
+
+	void AddUint(uint64_t value)
+	{
+		if (Reserve(mp_sizeof_uint(value)))
+			mp_encode_uint(m_pos, value);
+	}
+
+	void AddInt(int64_t value)
+	{
+		if (Reserve(mp_sizeof_int(value)))
+			mp_encode_int(m_pos, value);
+	}
+
+	void AddDouble(double value)
+	{
+		if (Reserve(MP_SIZEOF_DOUBLE))
+			mp_encode_double(m_pos, value);
+	}
+
+	void AddString(const char *string, uint32_t len)
+	{
+		if (Reserve(mp_sizeof_string(len)))
+			mp_encode_string(m_pos, string, len);
+	}
+
+	void AddBin(const char *bin, uint32_t len)
+	{
+		if (Reserve(mp_sizeof_bin(len)))
+			mp_encode_bin(m_pos, bin, len);
+	}
+
+	void AddNil()
+	{
+		if (Reserve(MP_SIZEOF_NIL))
+			mp_encode_nil(m_pos);
+	}
+
+	void AddBool(bool value)
+	{
+		if (Reserve(MP_SIZEOF_BOOL))
+			mp_encode_bool(m_pos, value);
+	}
+
+	// Array header, size values must follow.
+	void AddArray(uint32_t size)
+	{
+		if (Reserve(mp_sizeof_array(size)))
+			mp_encode_array(m_pos, size);
+	}
+
+	// Copy encoded msgpack value.
+	void AddEncoded(const char *value)
+	{
+		const char *end = value;
+		mp_next(end);
+		AddRaw(value, end - value);
+	}
+
+	// Copy encoded msgpack data of size bytes as is.
+	void AddRaw(const char *data, size_t size)
+	{
+		if (Reserve(size)) {
+			memcpy(m_pos, data, size);
+			m_pos += size;
+		}
+	}
+
+	/**
+	 * Encode tuples as msgpack arrays of their fields. The room for all
+	 * of them is reserved at once.
+	 */
+	void AddTuples(const Tuple *const *tuples, size_t count)
+	{
+		size_t size = 0;
+		for (size_t i = 0; i < count; i++) {
+			const Tuple *tuple = tuples[i];
+			size += mp_sizeof_array(tuple->field_count) +
+				tuple->data_used - tuple->first_field_offset;
+		}
+		char *p = Begin(size);
+		if (p == NULL)
+			return;
+		for (size_t i = 0; i < count; i++) {
+			const Tuple *tuple = tuples[i];
+			const char *fields = tuple->data() + tuple->first_field_offset;
+			size_t fields_size = tuple->data_used -
+					     tuple->first_field_offset;
+			mp_encode_array(p, tuple->field_count);
+			memcpy(p, fields, fields_size);
+			p += fields_size;
+		}
+		End(p);
+	}
+
+private:
+	char *m_buffer;
+	char *m_pos;
+	char *m_end;
+	bool m_isOwner;
+	bool m_isOverflow;
+#ifndef NDEBUG
+	// End of the room returned by Begin.
+	char *m_reserved;
+#endif
+
+	// Slow path of Reserve.
+	bool Grow(size_t size)
+	{
+		if (m_isOverflow)
+			return false;
+		size_t used = m_pos - m_buffer;
+		if (!m_isOwner) {
+			if ((size_t)(m_end - m_pos) >= size)
+				return true;
+			m_isOverflow = true;
+			return false;
+		}
+		size_t capacity = Capacity() < 64 ? 64 : 2 * Capacity();
+		while (capacity - used < size)
+			capacity *= 2;
+		char *buffer = (char *)realloc(m_buffer, capacity);
+		if (buffer == NULL)
+			throw std::bad_alloc();
+		m_buffer = buffer;
+		m_pos = buffer + used;
+		m_end = buffer + capacity;
+		return true;
+	}
+};
@@ -1,9 +1,12 @@
 #pragma once
 
 #include <cassert>
+#include <cstddef>
+#include <cstdint>
 #include <cstring>
 
 #include <ByteSwap.h>
+#include <MemCompare.h>
 
 // Encode helper. Copy byte-swapped value to buffer. Advance buffer pointer to the end of value.
 template <class T>
@@ -47,6 +50,24 @@ mp_encode_uint(char *&data, uint64_t num)
 	}
 }
 
+// Size of uint encoded by mp_encode_uint.
+inline size_t
+mp_sizeof_uint(uint64_t num)
+{
+	if (num <= 0x7f)
+		return 1;
+	if (num <= UINT8_MAX)
+		return 2;
+	if (num <= UINT16_MAX)
+		return 3;
+	if (num <= UINT32_MAX)
+		return 5;
+	return 9;
+}
+
+// Maximal size of encoded uint, int or double.
+const size_t MP_MAX_SIZEOF_NUM = 9;
+
 // Decode uint from given data buffer. Move data pointer to the end of decoded data.
 inline uint64_t
 mp_decode_uint(const char *&data)
@@ -67,6 +88,134 @@ mp_decode_uint(const char *&data)
 	}
 }
 
+/**
+ * Number of bytes of uint value that follow the msgpack marker,
+ * 0 for positive fixint, MP_BAD_UINT_SIZE if the marker is not uint.
+ */
+const uint8_t MP_BAD_UINT_SIZE = 0xff;
+#define X MP_BAD_UINT_SIZE
+const uint8_t mp_uint_size[256] = {
+	/* 0x00 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	/* 0x10 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	/* 0x20 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	/* 0x30 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	/* 0x40 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	/* 0x50 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	/* 0x60 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	/* 0x70 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	/* 0x80 */ X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	/* 0x90 */ X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	/* 0xa0 */ X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	/* 0xb0 */ X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	/* 0xc0 */ X, X, X, X, X, X, X, X, X, X, X, X, 1, 2, 4, 8,
+	/* 0xd0 */ X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	/* 0xe0 */ X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	/* 0xf0 */ X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+};
+#undef X
+
+// Number of bytes that must be readable starting from uint
+// that is decoded by mp_decode_uint_fast.
+const size_t MP_DECODE_UINT_FAST_PADDING = 1 + sizeof(uint64_t);
+
+/**
+ * The same as mp_decode_uint, but without branches. The size of value
+ * is taken from mp_uint_size table, the value is read with one unaligned
+ * load of 8 bytes and shifted to drop the bytes that belong to the
+ * next values. Positive fixint is masked in from the marker itself.
+ * Note that MP_DECODE_UINT_FAST_PADDING bytes are always read.
+ */
+inline uint64_t
+mp_decode_uint_fast(const char *&data)
+{
+	uint8_t c = data[0];
+	uint32_t size = mp_uint_size[c];
+	assert(size != MP_BAD_UINT_SIZE);
+	uint64_t value;
+	memcpy(&value, data + 1, sizeof(value));
+	value = bswap(value);
+	// All ones if the value follows the marker, zero for fixint.
+	uint64_t mask = -(uint64_t)(size != 0);
+	uint32_t shift = (64 - 8 * size) & 63;
+	data += 1 + size;
+	return ((value >> shift) & mask) | (c & ~mask);
+}
+
+/**
+ * Compare two uints, decoding only if needed. Move data pointers to the
+ * ends of values.
+ * Values with the same marker are compared by payloads of the same size,
+ * and positive fixints are the markers themselves. Values with other
+ * different markers are decoded: in the shortest form, as mp_encode_uint
+ * does, the markers would settle the order, but tuples from the network
+ * or files (see TupleView and CTupleRun) may have wider encodings, e.g.
+ * 0xcd 0x00 0x05 for 5.
+ */
+inline int
+mp_compare_uint(const char *&data1, const char *&data2)
+{
+	uint8_t c1 = mp_read<uint8_t>(data1);
+	uint8_t c2 = mp_read<uint8_t>(data2);
+	assert(mp_uint_size[c1] != MP_BAD_UINT_SIZE);
+	assert(mp_uint_size[c2] != MP_BAD_UINT_SIZE);
+	if (c1 != c2) {
+		if (c1 <= 0x7f && c2 <= 0x7f)
+			return c1 < c2 ? -1 : 1;
+		data1--;
+		data2--;
+		uint64_t value1 = mp_decode_uint(data1);
+		uint64_t value2 = mp_decode_uint(data2);
+		return value1 < value2 ? -1 : value1 > value2;
+	}
+	uint64_t value1, value2;
+	switch (c1) {
+		case 0xcc:
+			value1 = mp_read<uint8_t>(data1);
+			value2 = mp_read<uint8_t>(data2);
+			break;
+		case 0xcd:
+			value1 = mp_read<uint16_t>(data1);
+			value2 = mp_read<uint16_t>(data2);
+			break;
+		case 0xce:
+			value1 = mp_read<uint32_t>(data1);
+			value2 = mp_read<uint32_t>(data2);
+			break;
+		case 0xcf:
+			value1 = mp_read<uint64_t>(data1);
+			value2 = mp_read<uint64_t>(data2);
+			break;
+		default:
+			// The same positive fixint.
+			return 0;
+	}
+	return value1 < value2 ? -1 : value1 > value2;
+}
+
+/**
+ * Combine comparison results: first if it is not zero, otherwise second.
+ * Without branches, as a mask of second, so both results are computed
+ * and a data-dependent branch on the first is never mispredicted.
+ */
+inline int
+compare_result_select(int first, int second)
+{
+	return first | (second & -(int)(first == 0));
+}
+
+/**
+ * The same as mp_compare_uint, but the result is computed from decoded
+ * values without branches. Only the decoding branches on markers, that
+ * are mostly the same in a column.
+ */
+inline int
+mp_compare_uint_branchless(const char *&data1, const char *&data2)
+{
+	uint64_t value1 = mp_decode_uint(data1);
+	uint64_t value2 = mp_decode_uint(data2);
+	return (int)(value1 > value2) - (int)(value1 < value2);
+}
+
 // Encode string into given data buffer. Move data pointer to the end of encoded data.
 inline void
 mp_encode_string(char *&data, const char *string, uint32_t len)
@@ -87,6 +236,19 @@ mp_encode_string(char *&data, const char *string, uint32_t len)
 	data += len;
 }
 
+// Size of string of given length encoded by mp_encode_string.
+inline size_t
+mp_sizeof_string(uint32_t len)
+{
+	if (len <= 31)
+		return 1 + len;
+	if (len <= UINT8_MAX)
+		return 2 + len;
+	if (len <= UINT16_MAX)
+		return 3 + len;
+	return 5 + len;
+}
+
 // Decode string from given data buffer. Move data pointer to the end of decoded data.
 inline const char *
 mp_decode_string(const char *&data, uint32_t& len)
@@ -110,3 +272,552 @@ mp_decode_string(const char *&data, uint32_t& len)
 	data += len;
 	return string;
 }
+
+// Compare two strings lexicographically. Move data pointers to the ends of values.
+inline int
+mp_compare_string(const char *&data1, const char *&data2)
+{
+	uint32_t len1, len2;
+	const char *string1 = mp_decode_string(data1, len1);
+	const char *string2 = mp_decode_string(data2, len2);
+	return mem_compare(string1, len1, string2, len2);
+}
+
+// Encode array header into given data buffer. Move data pointer to the end of encoded data.
+// The header must be followed by size encoded values.
+inline void
+mp_encode_array(char *&data, uint32_t size)
+{
+	if (size <= 15) {
+		mp_write<uint8_t>(data, 0x90 | size);
+	} else if (size <= UINT16_MAX) {
+		mp_write<uint8_t>(data, 0xdc);
+		mp_write<uint16_t>(data, size);
+	} else {
+		mp_write<uint8_t>(data, 0xdd);
+		mp_write<uint32_t>(data, size);
+	}
+}
+
+// Size of array header encoded by mp_encode_array.
+inline size_t
+mp_sizeof_array(uint32_t size)
+{
+	return size <= 15 ? 1 : size <= UINT16_MAX ? 3 : 5;
+}
+
+// Decode array header from given data buffer. Move data pointer to the first value in array.
+inline uint32_t
+mp_decode_array(const char *&data)
+{
+	uint8_t c = mp_read<uint8_t>(data);
+	switch (c) {
+		case 0xdc:
+			return mp_read<uint16_t>(data);
+		case 0xdd:
+			return mp_read<uint32_t>(data);
+		default:
+			assert(c >= 0x90 && c <= 0x9f);
+			return c & 0x0f;
+	}
+}
+
+// Encode nil into given data buffer. Move data pointer to the end of encoded data.
+inline void
+mp_encode_nil(char *&data)
+{
+	mp_write<uint8_t>(data, 0xc0);
+}
+
+// Size of encoded nil or bool.
+const size_t MP_SIZEOF_NIL = 1;
+const size_t MP_SIZEOF_BOOL = 1;
+
+// Decode nil from given data buffer. Move data pointer to the end of decoded data.
+inline void
+mp_decode_nil(const char *&data)
+{
+	uint8_t c = mp_read<uint8_t>(data);
+	assert(c == 0xc0);
+	(void)c;
+}
+
+// Check whether the value in given data buffer is nil.
+inline bool
+mp_is_nil(const char *data)
+{
+	return (uint8_t)data[0] == 0xc0;
+}
+
+// Encode bool into given data buffer. Move data pointer to the end of encoded data.
+inline void
+mp_encode_bool(char *&data, bool value)
+{
+	mp_write<uint8_t>(data, value ? 0xc3 : 0xc2);
+}
+
+// Decode bool from given data buffer. Move data pointer to the end of decoded data.
+inline bool
+mp_decode_bool(const char *&data)
+{
+	uint8_t c = mp_read<uint8_t>(data);
+	assert(c == 0xc2 || c == 0xc3);
+	return c == 0xc3;
+}
+
+// Compare two bools, false is less than true. Move data pointers to the ends of values.
+inline int
+mp_compare_bool(const char *&data1, const char *&data2)
+{
+	int value1 = mp_decode_bool(data1);
+	int value2 = mp_decode_bool(data2);
+	return value1 - value2;
+}
+
+/**
+ * Encode signed integer into given data buffer. Move data pointer to the end of encoded data.
+ * Non-negative values are encoded as uint, as msgpack requires.
+ */
+inline void
+mp_encode_int(char *&data, int64_t num)
+{
+	if (num >= 0) {
+		mp_encode_uint(data, num);
+	} else if (num >= -32) {
+		mp_write<uint8_t>(data, (uint8_t)num);
+	} else if (num >= INT8_MIN) {
+		mp_write<uint8_t>(data, 0xd0);
+		mp_write<uint8_t>(data, (uint8_t)num);
+	} else if (num >= INT16_MIN) {
+		mp_write<uint8_t>(data, 0xd1);
+		mp_write<uint16_t>(data, (uint16_t)num);
+	} else if (num >= INT32_MIN) {
+		mp_write<uint8_t>(data, 0xd2);
+		mp_write<uint32_t>(data, (uint32_t)num);
+	} else {
+		mp_write<uint8_t>(data, 0xd3);
+		mp_write<uint64_t>(data, (uint64_t)num);
+	}
+}
+
+// Size of signed integer encoded by mp_encode_int.
+inline size_t
+mp_sizeof_int(int64_t num)
+{
+	if (num >= 0)
+		return mp_sizeof_uint(num);
+	if (num >= -32)
+		return 1;
+	if (num >= INT8_MIN)
+		return 2;
+	if (num >= INT16_MIN)
+		return 3;
+	if (num >= INT32_MIN)
+		return 5;
+	return 9;
+}
+
+/**
+ * Decode integer (uint or negative int) from given data buffer. Move data
+ * pointer to the end of decoded data. Return true if the value is negative,
+ * then value is int64_t bits of it, otherwise value is the uint itself.
+ */
+inline bool
+mp_decode_integer(const char *&data, uint64_t &value)
+{
+	uint8_t c = data[0];
+	if (c <= 0x7f || (c >= 0xcc && c <= 0xcf)) {
+		value = mp_decode_uint(data);
+		return false;
+	}
+	data++;
+	switch (c) {
+		case 0xd0:
+			value = (int64_t)(int8_t)mp_read<uint8_t>(data);
+			break;
+		case 0xd1:
+			value = (int64_t)(int16_t)mp_read<uint16_t>(data);
+			break;
+		case 0xd2:
+			value = (int64_t)(int32_t)mp_read<uint32_t>(data);
+			break;
+		case 0xd3:
+			value = mp_read<uint64_t>(data);
+			break;
+		default:
+			assert(c >= 0xe0);
+			value = (int64_t)(int8_t)c;
+	}
+	/*
+	 * Non-negative values are always encoded as uint by mp_encode_int,
+	 * but other encoders may use int markers for them.
+	 */
+	return (int64_t)value < 0;
+}
+
+// Decode signed integer from given data buffer. Move data pointer to the end of decoded data.
+inline int64_t
+mp_decode_int(const char *&data)
+{
+	uint64_t value;
+	bool is_negative = mp_decode_integer(data, value);
+	assert(is_negative || value <= (uint64_t)INT64_MAX);
+	(void)is_negative;
+	return (int64_t)value;
+}
+
+// Compare two integers (uint or negative int). Move data pointers to the ends of values.
+inline int
+mp_compare_integer(const char *&data1, const char *&data2)
+{
+	uint64_t value1, value2;
+	bool is_negative1 = mp_decode_integer(data1, value1);
+	bool is_negative2 = mp_decode_integer(data2, value2);
+	if (is_negative1 != is_negative2)
+		return is_negative1 ? -1 : 1;
+	// Negative values are ordered as their int64_t bits are too.
+	return value1 < value2 ? -1 : value1 > value2;
+}
+
+// The same as mp_compare_integer, with results combined without branches.
+inline int
+mp_compare_integer_branchless(const char *&data1, const char *&data2)
+{
+	uint64_t value1, value2;
+	bool is_negative1 = mp_decode_integer(data1, value1);
+	bool is_negative2 = mp_decode_integer(data2, value2);
+	int sign = (int)is_negative2 - (int)is_negative1;
+	int r = (int)(value1 > value2) - (int)(value1 < value2);
+	return compare_result_select(sign, r);
+}
+
+// Encode float into given data buffer. Move data pointer to the end of encoded data.
+inline void
+mp_encode_float(char *&data, float num)
+{
+	uint32_t bits;
+	memcpy(&bits, &num, sizeof(bits));
+	mp_write<uint8_t>(data, 0xca);
+	mp_write<uint32_t>(data, bits);
+}
+
+// Encode double into given data buffer. Move data pointer to the end of encoded data.
+inline void
+mp_encode_double(char *&data, double num)
+{
+	uint64_t bits;
+	memcpy(&bits, &num, sizeof(bits));
+	mp_write<uint8_t>(data, 0xcb);
+	mp_write<uint64_t>(data, bits);
+}
+
+// Size of double encoded by mp_encode_double.
+const size_t MP_SIZEOF_DOUBLE = 9;
+
+// Check whether the marker is of float or double.
+inline bool
+mp_is_float_marker(uint8_t c)
+{
+	return c == 0xca || c == 0xcb;
+}
+
+// Decode float or double from given data buffer. Move data pointer to the end of decoded data.
+inline double
+mp_decode_double(const char *&data)
+{
+	uint8_t c = mp_read<uint8_t>(data);
+	if (c == 0xca) {
+		uint32_t bits = mp_read<uint32_t>(data);
+		float num;
+		memcpy(&num, &bits, sizeof(num));
+		return num;
+	}
+	assert(c == 0xcb);
+	uint64_t bits = mp_read<uint64_t>(data);
+	double num;
+	memcpy(&num, &bits, sizeof(num));
+	return num;
+}
+
+// Compare two doubles. NaN is less than any other number and equal to NaN.
+inline int
+mp_compare_double_value(double value1, double value2)
+{
+	if (value1 < value2)
+		return -1;
+	if (value1 > value2)
+		return 1;
+	if (value1 == value2)
+		return 0;
+	bool is_nan1 = value1 != value1;
+	bool is_nan2 = value2 != value2;
+	return (int)is_nan2 - (int)is_nan1;
+}
+
+// Compare two floats or doubles. Move data pointers to the ends of values.
+inline int
+mp_compare_double(const char *&data1, const char *&data2)
+{
+	double value1 = mp_decode_double(data1);
+	double value2 = mp_decode_double(data2);
+	return mp_compare_double_value(value1, value2);
+}
+
+/**
+ * The same as mp_compare_double, without branches: NaNs are equal to
+ * each other and are less than other values.
+ */
+inline int
+mp_compare_double_branchless(const char *&data1, const char *&data2)
+{
+	double value1 = mp_decode_double(data1);
+	double value2 = mp_decode_double(data2);
+	int nan = (int)(value2 != value2) - (int)(value1 != value1);
+	int r = (int)(value1 > value2) - (int)(value1 < value2);
+	return compare_result_select(nan, r);
+}
+
+/**
+ * Compare double with integer exactly, see mp_decode_integer
+ * about is_negative and value. NaN is less than any integer.
+ * The integer part of double is compared first, in integers,
+ * and then the fractional part settles the order.
+ */
+inline int
+mp_compare_double_integer(double num, bool is_negative, uint64_t value)
+{
+	const double two_pow_63 = 9223372036854775808.0;
+	const double two_pow_64 = 18446744073709551616.0;
+	if (num != num)
+		return -1;
+	if (!is_negative) {
+		if (num < 0)
+			return -1;
+		if (num >= two_pow_64)
+			return 1;
+		// Truncated double is a double and is converted back exactly.
+		uint64_t integer = (uint64_t)num;
+		if (integer != value)
+			return integer < value ? -1 : 1;
+		return num > (double)integer;
+	}
+	if (num >= 0)
+		return 1;
+	if (num < -two_pow_63)
+		return -1;
+	int64_t integer = (int64_t)num;
+	if (integer != (int64_t)value)
+		return integer < (int64_t)value ? -1 : 1;
+	return num < (double)integer ? -1 : 0;
+}
+
+/**
+ * Compare two numbers: uints, negative ints, floats or doubles, in any
+ * combination. Integers are compared with doubles exactly, without
+ * conversion of integer to double. Move data pointers to the ends of values.
+ */
+inline int
+mp_compare_number(const char *&data1, const char *&data2)
+{
+	bool is_float1 = mp_is_float_marker(data1[0]);
+	bool is_float2 = mp_is_float_marker(data2[0]);
+	if (!is_float1 && !is_float2)
+		return mp_compare_integer(data1, data2);
+	if (is_float1 && is_float2)
+		return mp_compare_double(data1, data2);
+	uint64_t value;
+	if (is_float1) {
+		double num = mp_decode_double(data1);
+		bool is_negative = mp_decode_integer(data2, value);
+		return mp_compare_double_integer(num, is_negative, value);
+	}
+	bool is_negative = mp_decode_integer(data1, value);
+	double num = mp_decode_double(data2);
+	return -mp_compare_double_integer(num, is_negative, value);
+}
+
+// Encode binary string into given data buffer. Move data pointer to the end of encoded data.
+inline void
+mp_encode_bin(char *&data, const char *bin, uint32_t len)
+{
+	if (len <= UINT8_MAX) {
+		mp_write<uint8_t>(data, 0xc4);
+		mp_write<uint8_t>(data, len);
+	} else if (len <= UINT16_MAX) {
+		mp_write<uint8_t>(data, 0xc5);
+		mp_write<uint16_t>(data, len);
+	} else {
+		mp_write<uint8_t>(data, 0xc6);
+		mp_write<uint32_t>(data, len);
+	}
+	memcpy(data, bin, len);
+	data += len;
+}
+
+// Size of binary string of given length encoded by mp_encode_bin.
+inline size_t
+mp_sizeof_bin(uint32_t len)
+{
+	return len <= UINT8_MAX ? 2 + len : len <= UINT16_MAX ? 3 + len : 5 + len;
+}
+
+// Decode binary string from given data buffer. Move data pointer to the end of decoded data.
+inline const char *
+mp_decode_bin(const char *&data, uint32_t &len)
+{
+	uint8_t c = mp_read<uint8_t>(data);
+	switch (c) {
+		case 0xc4:
+			len = mp_read<uint8_t>(data);
+			break;
+		case 0xc5:
+			len = mp_read<uint16_t>(data);
+			break;
+		default:
+			assert(c == 0xc6);
+			len = mp_read<uint32_t>(data);
+	}
+	const char *bin = data;
+	data += len;
+	return bin;
+}
+
+// Compare two binary strings lexicographically. Move data pointers to the ends of values.
+inline int
+mp_compare_bin(const char *&data1, const char *&data2)
+{
+	uint32_t len1, len2;
+	const char *bin1 = mp_decode_bin(data1, len1);
+	const char *bin2 = mp_decode_bin(data2, len2);
+	return mem_compare(bin1, len1, bin2, len2);
+}
+
+/**
+ * Size of msgpack value by its marker, for skipping values without decoding.
+ * A positive number is the whole size of value along with the marker:
+ * fixints, ints and uints of any width, fixstr, nil, bool, float, double.
+ * A negative number is minus the width of length that follows the marker,
+ * the length of data follows then: str8/16/32 and bin8/16/32.
+ * MP_BAD_NEXT_SIZE if the marker is not supported.
+ */
+const int8_t MP_BAD_NEXT_SIZE = 0;
+#define X MP_BAD_NEXT_SIZE
+const int8_t mp_next_size[256] = {
+	/* 0x00 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	/* 0x10 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	/* 0x20 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	/* 0x30 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	/* 0x40 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	/* 0x50 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	/* 0x60 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	/* 0x70 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	/* 0x80 */ X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	/* 0x90 */ X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	/* 0xa0 */ 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
+	/* 0xb0 */ 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32,
+	/* 0xc0 */ 1, X, 1, 1, -1, -2, -4, X, X, X, 5, 9, 2, 3, 5, 9,
+	/* 0xd0 */ 2, 3, 5, 9, X, X, X, X, X, -1, -2, -4, X, X, X, X,
+	/* 0xe0 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	/* 0xf0 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+};
+#undef X
+
+// Skip value with length that follows the marker, see mp_next_size.
+// Strings and binary strings have the same layout.
+inline void
+mp_next_slow(const char *&data, int8_t size)
+{
+	data++;
+	uint32_t len;
+	switch (size) {
+		case -1:
+			len = mp_read<uint8_t>(data);
+			break;
+		case -2:
+			len = mp_read<uint16_t>(data);
+			break;
+		default:
+			assert(size == -4);
+			len = mp_read<uint32_t>(data);
+	}
+	data += len;
+}
+
+// Skip one value in given data buffer. Move data pointer to the next value.
+inline void
+mp_next(const char *&data)
+{
+	int8_t size = mp_next_size[(uint8_t)data[0]];
+	assert(size != MP_BAD_NEXT_SIZE);
+	if (size > 0)
+		data += size;
+	else
+		mp_next_slow(data, size);
+}
+
+// Number of bytes that are checked at once by mp_fixint_run.
+const size_t MP_FIXINT_RUN_SIZE = 16;
+
+/**
+ * Number of positive fixints (bytes with zero high bit) in a row at data,
+ * up to MP_FIXINT_RUN_SIZE. MP_FIXINT_RUN_SIZE bytes are always read.
+ */
+inline uint32_t
+mp_fixint_run(const char *data)
+{
+#ifdef MEM_COMPARE_X86
+	__m128i v = _mm_loadu_si128((const __m128i *)data);
+	uint32_t mask = _mm_movemask_epi8(v) | 0x10000;
+	return count_trailing_zeros(mask);
+#else
+	const uint64_t high_bits = 0x8080808080808080ull;
+	uint64_t word1, word2;
+	memcpy(&word1, data, sizeof(word1));
+	memcpy(&word2, data + sizeof(word1), sizeof(word2));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	word1 = bswap(word1);
+	word2 = bswap(word2);
+#endif
+	if ((word1 & high_bits) != 0)
+		return count_trailing_zeros(word1 & high_bits) / 8;
+	if ((word2 & high_bits) != 0)
+		return 8 + count_trailing_zeros(word2 & high_bits) / 8;
+	return 16;
+#endif
+}
+
+/**
+ * Skip n values in a row. Move data pointer to the value after them.
+ * Runs of positive fixints (small uints) are skipped by whole SIMD
+ * words if there are at least four fixints in a row, other values are
+ * skipped by mp_next. The words are read only
+ * when at least MP_FIXINT_RUN_SIZE values are left, so they never
+ * go beyond the skipped values, every value taking at least one byte.
+ */
+inline void
+mp_skip_n(const char *&data, size_t n)
+{
+	const char *p = data;
+	while (n >= MP_FIXINT_RUN_SIZE) {
+		// Short runs are not worth the check of the whole word,
+		// and on mixed values the branch is rarely taken.
+		uint32_t head;
+		memcpy(&head, p, sizeof(head));
+		if ((head & 0x80808080) != 0) {
+			mp_next(p);
+			n--;
+			continue;
+		}
+		uint32_t run = mp_fixint_run(p);
+		p += run;
+		n -= run;
+		if (run < MP_FIXINT_RUN_SIZE) {
+			// The value after the run is not a fixint.
+			mp_next(p);
+			n--;
+		}
+	}
+	for (; n > 0; n--)
+		mp_next(p);
+	data = p;
+}
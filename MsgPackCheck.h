@@ -0,0 +1,166 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+#include <MsgPack.h>
+
+/**
+ * Decoding of msgpack from untrusted input, that may be truncated or
+ * have wrong markers. The decoders of MsgPack.h only assert the markers
+ * and read as much as the values say.
+ * Functions below take the end of data and return an error code instead
+ * of asserting. On success the data pointer is moved as by the trusted
+ * decoders, which do the decoding after one bounds check per value, so
+ * the success path costs a table lookup and a compare or two.
+ * Input can be checked in one pass by mp_check (any values) or
+ * key_check (a key of a key def, see KeyDef.h), and then decoded by the
+ * trusted decoders, e.g. compared by the comparators.
+ */
+
+enum mp_check_t {
+	MP_CHECK_OK = 0,
+	// The value goes beyond the end of data.
+	MP_CHECK_TRUNCATED,
+	// The marker is not of the expected type or is not supported.
+	MP_CHECK_BAD_MARKER,
+	// The marker is right, but the value is not accepted.
+	MP_CHECK_BAD_VALUE,
+};
+
+// Read the length of size bytes that follows the marker at data.
+inline uint32_t
+mp_check_read_len(const char *data, uint32_t size)
+{
+	data++;
+	switch (size) {
+		case 1:
+			return mp_read<uint8_t>(data);
+		case 2:
+			return mp_read<uint16_t>(data);
+		default:
+			assert(size == 4);
+			return mp_read<uint32_t>(data);
+	}
+}
+
+// Decode uint, see mp_decode_uint.
+inline mp_check_t
+mp_check_uint(const char *&data, const char *end, uint64_t &value)
+{
+	if (data == end)
+		return MP_CHECK_TRUNCATED;
+	uint32_t size = mp_uint_size[(uint8_t)data[0]];
+	if (size == MP_BAD_UINT_SIZE)
+		return MP_CHECK_BAD_MARKER;
+	if ((size_t)(end - data) <= size)
+		return MP_CHECK_TRUNCATED;
+	value = mp_decode_uint(data);
+	return MP_CHECK_OK;
+}
+
+// Decode string, see mp_decode_string.
+inline mp_check_t
+mp_check_string(const char *&data, const char *end, const char *&string,
+		uint32_t &len)
+{
+	if (data == end)
+		return MP_CHECK_TRUNCATED;
+	uint8_t c = data[0];
+	size_t size;
+	if (c >= 0xa0 && c <= 0xbf) {
+		size = 1 + (c & 0x1f);
+	} else if (c >= 0xd9 && c <= 0xdb) {
+		uint32_t len_size = 1 << (c - 0xd9);
+		if ((size_t)(end - data) <= len_size)
+			return MP_CHECK_TRUNCATED;
+		size = 1 + len_size + (size_t)mp_check_read_len(data, len_size);
+	} else {
+		return MP_CHECK_BAD_MARKER;
+	}
+	if ((size_t)(end - data) < size)
+		return MP_CHECK_TRUNCATED;
+	string = mp_decode_string(data, len);
+	return MP_CHECK_OK;
+}
+
+// Decode array header, see mp_decode_array. The values are not checked.
+inline mp_check_t
+mp_check_array(const char *&data, const char *end, uint32_t &size)
+{
+	if (data == end)
+		return MP_CHECK_TRUNCATED;
+	uint8_t c = data[0];
+	size_t header_size = c == 0xdc ? 3 : c == 0xdd ? 5 : 1;
+	if (header_size == 1 && (c < 0x90 || c > 0x9f))
+		return MP_CHECK_BAD_MARKER;
+	if ((size_t)(end - data) < header_size)
+		return MP_CHECK_TRUNCATED;
+	size = mp_decode_array(data);
+	return MP_CHECK_OK;
+}
+
+/**
+ * Skip one value that is not an array, see mp_next. Markers of values
+ * that mp_next does not support are bad.
+ */
+inline mp_check_t
+mp_check_next(const char *&data, const char *end)
+{
+	if (data == end)
+		return MP_CHECK_TRUNCATED;
+	int8_t size = mp_next_size[(uint8_t)data[0]];
+	if (size == MP_BAD_NEXT_SIZE)
+		return MP_CHECK_BAD_MARKER;
+	size_t left = end - data;
+	if (size > 0) {
+		if (left < (size_t)size)
+			return MP_CHECK_TRUNCATED;
+		data += size;
+		return MP_CHECK_OK;
+	}
+	uint32_t len_size = -size;
+	if (left <= len_size)
+		return MP_CHECK_TRUNCATED;
+	size_t len = mp_check_read_len(data, len_size);
+	if (left - 1 - len_size < len)
+		return MP_CHECK_TRUNCATED;
+	data += 1 + len_size + len;
+	return MP_CHECK_OK;
+}
+
+/**
+ * Check one value with nested arrays in one pass and move data pointer
+ * to its end. After that the value can be decoded by trusted decoders
+ * that don't care about types (e.g. mp_next for values that are not
+ * arrays), others need a check of types, see key_check.
+ */
+inline mp_check_t
+mp_check(const char *&data, const char *end)
+{
+	const char *p = data;
+	// Values to check, nested arrays add their values.
+	uint64_t left = 1;
+	for (; left > 0; left--) {
+		if (p == end)
+			return MP_CHECK_TRUNCATED;
+		uint8_t c = p[0];
+		if ((c >= 0x90 && c <= 0x9f) || c == 0xdc || c == 0xdd) {
+			uint32_t size;
+			mp_check_t r = mp_check_array(p, end, size);
+			if (r != MP_CHECK_OK)
+				return r;
+			// Every value takes at least a byte.
+			if (size > (size_t)(end - p))
+				return MP_CHECK_TRUNCATED;
+			left += size;
+			continue;
+		}
+		mp_check_t r = mp_check_next(p, end);
+		if (r != MP_CHECK_OK)
+			return r;
+	}
+	data = p;
+	return MP_CHECK_OK;
+}
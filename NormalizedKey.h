@@ -0,0 +1,231 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <Collation.h>
+#include <KeyDef.h>
+#include <MemCompare.h>
+#include <MsgPack.h>
+#include <Tuple.h>
+
+/**
+ * Normalized key is a binary string made of tuple key parts, such that
+ * comparison of normalized keys with memcmp gives the same result as
+ * comparison of tuples by key def.
+ * Uint is stored as 8 bytes big-endian.
+ * String is stored byte by byte with zero byte escaped as 0x00 0xff,
+ * and terminated by 0x00 0x00. Thus a string is never a prefix of other
+ * string encoding, and the shorter of strings with common prefix is less.
+ * String with collation is stored as its sort key, in the same way.
+ * Binary string is stored in the same way as string.
+ * Integer is stored as 0x00 for negative and 0x01 for non-negative value,
+ * and then 8 bytes big-endian of the value (int64_t bits for negative).
+ * Double is stored as 8 bytes big-endian of double_hint.
+ * Number is stored as 8 bytes of double_hint of the number rounded to
+ * double, and then 2 bytes of difference between the number and that
+ * double (always zero for doubles), biased by 0x8000.
+ * Bool is stored as one byte.
+ * Value of nullable part is stored after 0x01, nil is stored as 0x00.
+ * The key is extracted once and then can be compared many times
+ * (for example during sort) without decoding msgpack.
+ */
+
+// Size of normalized part of fixed size type, see KeyDef::field_type_t.
+inline size_t
+normalized_part_size(KeyDef::field_type_t field_type)
+{
+	switch (field_type) {
+		case KeyDef::UINT:
+		case KeyDef::DOUBLE:
+			return sizeof(uint64_t);
+		case KeyDef::INTEGER:
+			return 1 + sizeof(uint64_t);
+		case KeyDef::NUMBER:
+			return sizeof(uint64_t) + sizeof(uint16_t);
+		default:
+			assert(field_type == KeyDef::BOOLEAN);
+			return 1;
+	}
+}
+
+// Upper bound of normalized key size of the tuple; strings are not scanned.
+inline size_t
+key_def_normalized_size_max(KeyDef *def, Tuple *tuple)
+{
+	size_t size = 0;
+	const char *field;
+	for (size_t i = 0; i < def->part_count; i++) {
+		KeyDef::KeyPart *part = &def->parts[i];
+		if (i == 0 ||
+		    def->parts[i].field_no != def->parts[i - 1].field_no + 1)
+			field = tuple->get_field(part->field_no);
+		if (part->is_nullable) {
+			size++;
+			if (mp_is_nil(field)) {
+				mp_decode_nil(field);
+				continue;
+			}
+		}
+		uint32_t len;
+		switch (part->field_type) {
+			case KeyDef::STRING:
+				mp_decode_string(field, len);
+				if (part->collation != NULL)
+					size += 2 * (size_t)len *
+						part->collation->sort_key_ratio;
+				else
+					size += 2 * (size_t)len;
+				size += 2;
+				break;
+			case KeyDef::BINARY:
+				mp_decode_bin(field, len);
+				size += 2 * (size_t)len + 2;
+				break;
+			default:
+				mp_next(field);
+				size += normalized_part_size(part->field_type);
+		}
+	}
+	return size;
+}
+
+// Write string with escaped zeros and terminator, see normalized key.
+inline void
+normalized_write_string(char *&p, const char *string, uint32_t len)
+{
+	const char *end = string + len;
+	while (string < end) {
+		const char *zero = (const char *)memchr(string, 0, end - string);
+		size_t run = (zero == NULL ? end : zero) - string;
+		memcpy(p, string, run);
+		p += run;
+		string += run;
+		if (zero != NULL) {
+			mp_write<uint8_t>(p, 0x00);
+			mp_write<uint8_t>(p, 0xff);
+			string++;
+		}
+	}
+	mp_write<uint8_t>(p, 0x00);
+	mp_write<uint8_t>(p, 0x00);
+}
+
+// Write sort key of string by collation, see normalized key.
+inline void
+normalized_write_sort_key(char *&p, const Collation *collation,
+			  const char *string, uint32_t len)
+{
+	char buf[256];
+	size_t size = collation->sort_key(string, len, buf, sizeof(buf));
+	if (size <= sizeof(buf)) {
+		normalized_write_string(p, buf, size);
+		return;
+	}
+	std::vector<char> sort_key(size);
+	collation->sort_key(string, len, sort_key.data(), size);
+	normalized_write_string(p, sort_key.data(), size);
+}
+
+/**
+ * Write number, see normalized key. Numbers that are rounded to the same
+ * double are big integers, so the double is integer too and the difference
+ * is exact; it's less than half of ulp of 2^64, that fits 2 bytes.
+ */
+inline void
+normalized_write_number(char *&p, const char *&field)
+{
+	if (mp_is_float_marker(field[0])) {
+		mp_write<uint64_t>(p, double_hint(mp_decode_double(field)));
+		mp_write<uint16_t>(p, 0x8000);
+		return;
+	}
+	const double two_pow_64 = 18446744073709551616.0;
+	uint64_t value;
+	bool is_negative = mp_decode_integer(field, value);
+	double num = is_negative ? (double)(int64_t)value : (double)value;
+	// The difference is calculated modulo 2^64, it's small anyway.
+	uint64_t rounded;
+	if (is_negative)
+		rounded = (uint64_t)(int64_t)num;
+	else
+		rounded = num < two_pow_64 ? (uint64_t)num : 0;
+	int64_t diff = (int64_t)(value - rounded);
+	assert(diff >= -0x8000 && diff < 0x8000);
+	mp_write<uint64_t>(p, double_hint(num));
+	mp_write<uint16_t>(p, (uint16_t)(diff + 0x8000));
+}
+
+/**
+ * Write normalized key of the tuple to out. There must be at least
+ * key_def_normalized_size_max bytes. Return the size of the key.
+ */
+inline size_t
+key_def_extract_normalized(KeyDef *def, Tuple *tuple, char *out)
+{
+	char *p = out;
+	const char *field;
+	for (size_t i = 0; i < def->part_count; i++) {
+		KeyDef::KeyPart *part = &def->parts[i];
+		if (i == 0 ||
+		    def->parts[i].field_no != def->parts[i - 1].field_no + 1)
+			field = tuple->get_field(part->field_no);
+		if (part->is_nullable) {
+			if (mp_is_nil(field)) {
+				mp_decode_nil(field);
+				mp_write<uint8_t>(p, 0x00);
+				continue;
+			}
+			mp_write<uint8_t>(p, 0x01);
+		}
+		uint32_t len;
+		const char *string;
+		uint64_t value;
+		switch (part->field_type) {
+			case KeyDef::UINT:
+				mp_write<uint64_t>(p, mp_decode_uint(field));
+				break;
+			case KeyDef::STRING:
+				string = mp_decode_string(field, len);
+				if (part->collation != NULL)
+					normalized_write_sort_key(p,
+						part->collation, string, len);
+				else
+					normalized_write_string(p, string, len);
+				break;
+			case KeyDef::INTEGER:
+				if (mp_decode_integer(field, value))
+					mp_write<uint8_t>(p, 0x00);
+				else
+					mp_write<uint8_t>(p, 0x01);
+				mp_write<uint64_t>(p, value);
+				break;
+			case KeyDef::DOUBLE:
+				mp_write<uint64_t>(p,
+					double_hint(mp_decode_double(field)));
+				break;
+			case KeyDef::NUMBER:
+				normalized_write_number(p, field);
+				break;
+			case KeyDef::BOOLEAN:
+				mp_write<uint8_t>(p, mp_decode_bool(field));
+				break;
+			default:
+				assert(part->field_type == KeyDef::BINARY);
+				string = mp_decode_bin(field, len);
+				normalized_write_string(p, string, len);
+		}
+	}
+	return p - out;
+}
+
+// Compare normalized keys.
+inline int
+normalized_key_compare(const char *key1, size_t size1,
+		       const char *key2, size_t size2)
+{
+	return mem_compare(key1, size1, key2, size2);
+}
@@ -0,0 +1,230 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <string>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define PERF_HAVE_RDTSC 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PERF_HAVE_RDTSC 1
+#endif
+
+/**
+ * Hardware performance counters of the current thread: cycles,
+ * instructions, branch misses, L1D and LLC read misses. They tell why
+ * a benchmark became faster or slower, not only that it did.
+ * Counters are read by perf_event_open on Linux, as one group so that
+ * they are counted over the same time, in user space only (that is
+ * allowed with perf_event_paranoid up to 2). If hardware events are not
+ * available (other OS, VM without PMU, no permission) cycles are taken
+ * from rdtsc, that counts reference cycles at a constant rate, and other
+ * counters are unavailable.
+ * Counting is off unless CPerfCounters::Enable is called, then Start and
+ * Stop cost a read syscall each; disabled counters cost nothing.
+ * Benchmark output names rdtsc cycles "tsc" in text, but CSV and JSON
+ * keep them in the cycles column.
+ */
+
+enum perf_counter_t {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_BRANCH_MISSES,
+	PERF_L1D_MISSES,
+	PERF_LLC_MISSES,
+	PERF_COUNTER_COUNT,
+};
+
+const char *const perf_counter_names[PERF_COUNTER_COUNT] = {
+	"cycles", "instructions", "branch_misses", "l1d_misses", "llc_misses",
+};
+
+class CPerfCounters
+{
+public:
+	CPerfCounters() : m_enabled(IsEnabled()), m_groupFd(-1),
+			  m_groupSize(0), m_rdtsc(false)
+	{
+		for (size_t i = 0; i < PERF_COUNTER_COUNT; i++) {
+			m_slot[i] = -1;
+			m_start[i] = 0;
+			m_accum[i] = 0;
+		}
+		if (!m_enabled)
+			return;
+		Open();
+#ifdef PERF_HAVE_RDTSC
+		if (m_slot[PERF_CYCLES] < 0)
+			m_rdtsc = true;
+#endif
+	}
+
+	~CPerfCounters()
+	{
+#ifdef __linux__
+		for (size_t i = 0; i < m_groupSize; i++)
+			close(m_fds[i]);
+#endif
+	}
+
+	CPerfCounters(const CPerfCounters&) = delete;
+	CPerfCounters& operator=(const CPerfCounters&) = delete;
+
+	// Enable counting in counters that are created after the call.
+	static void Enable(bool enable = true)
+	{
+		EnabledFlag() = enable;
+	}
+
+	static bool IsEnabled()
+	{
+		return EnabledFlag();
+	}
+
+	void Start()
+	{
+		if (m_enabled)
+			Read(m_start);
+	}
+
+	void Stop()
+	{
+		if (!m_enabled)
+			return;
+		uint64_t values[PERF_COUNTER_COUNT];
+		Read(values);
+		for (size_t i = 0; i < PERF_COUNTER_COUNT; i++)
+			m_accum[i] += values[i] - m_start[i];
+	}
+
+	bool Available(perf_counter_t counter) const
+	{
+		return m_slot[counter] >= 0 ||
+		       (counter == PERF_CYCLES && m_rdtsc);
+	}
+
+	// Whether cycles are reference cycles of rdtsc.
+	bool IsRdtsc() const
+	{
+		return m_rdtsc;
+	}
+
+	// Sum of the counter over all Start..Stop intervals.
+	uint64_t Value(perf_counter_t counter) const
+	{
+		return m_accum[counter];
+	}
+
+	/**
+	 * Available counters per operation, for example
+	 * " [cycles/op 12.1, instructions/op 30.4, ...]".
+	 * Empty if counting is disabled.
+	 */
+	std::string PerOp(unsigned long long ops) const
+	{
+		if (!m_enabled || ops == 0)
+			return std::string();
+		std::ostringstream out;
+		const char *sep = " [";
+		for (size_t i = 0; i < PERF_COUNTER_COUNT; i++) {
+			perf_counter_t counter = (perf_counter_t)i;
+			if (!Available(counter))
+				continue;
+			const char *name = counter == PERF_CYCLES && m_rdtsc ?
+					   "tsc" : perf_counter_names[i];
+			out << sep << name << "/op " << (double)m_accum[i] / ops;
+			sep = ", ";
+		}
+		if (sep[0] == ',')
+			out << "]";
+		return out.str();
+	}
+
+private:
+	bool m_enabled;
+	int m_groupFd;
+	// Open file descriptors of the group, in the order of values.
+	int m_fds[PERF_COUNTER_COUNT];
+	size_t m_groupSize;
+	// Position of the counter in the group, -1 if it's not opened.
+	int m_slot[PERF_COUNTER_COUNT];
+	bool m_rdtsc;
+	uint64_t m_start[PERF_COUNTER_COUNT];
+	uint64_t m_accum[PERF_COUNTER_COUNT];
+
+	static bool& EnabledFlag()
+	{
+		static bool enabled = false;
+		return enabled;
+	}
+
+	void Open()
+	{
+#ifdef __linux__
+		const uint64_t cache_read_miss =
+			(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+			(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		const uint32_t types[PERF_COUNTER_COUNT] = {
+			PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+			PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+			PERF_TYPE_HW_CACHE,
+		};
+		const uint64_t configs[PERF_COUNTER_COUNT] = {
+			PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+			PERF_COUNT_HW_BRANCH_MISSES,
+			PERF_COUNT_HW_CACHE_L1D | cache_read_miss,
+			PERF_COUNT_HW_CACHE_LL | cache_read_miss,
+		};
+		for (size_t i = 0; i < PERF_COUNTER_COUNT; i++) {
+			struct perf_event_attr attr;
+			memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = types[i];
+			attr.config = configs[i];
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			attr.read_format = PERF_FORMAT_GROUP;
+			int fd = syscall(__NR_perf_event_open, &attr, 0, -1,
+					 m_groupFd, 0);
+			if (fd < 0)
+				continue;
+			if (m_groupFd < 0)
+				m_groupFd = fd;
+			m_slot[i] = m_groupSize;
+			m_fds[m_groupSize++] = fd;
+		}
+#endif
+	}
+
+	void Read(uint64_t *values)
+	{
+		for (size_t i = 0; i < PERF_COUNTER_COUNT; i++)
+			values[i] = 0;
+#ifdef __linux__
+		if (m_groupFd >= 0) {
+			// The number of values and the values.
+			uint64_t group[1 + PERF_COUNTER_COUNT];
+			ssize_t size = (1 + m_groupSize) * sizeof(uint64_t);
+			if (read(m_groupFd, group, size) == size) {
+				for (size_t i = 0; i < PERF_COUNTER_COUNT; i++)
+					if (m_slot[i] >= 0)
+						values[i] = group[1 + m_slot[i]];
+			}
+		}
+#endif
+#ifdef PERF_HAVE_RDTSC
+		if (m_rdtsc)
+			values[PERF_CYCLES] = __rdtsc();
+#endif
+	}
+};
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of threads that execute submitted tasks.
+class CThreadPool
+{
+public:
+	typedef std::function<void()> task_t;
+
+	// Zero thread count means the number of hardware threads.
+	explicit CThreadPool(size_t threadCount = 0) : m_pending(0), m_stop(false)
+	{
+		if (threadCount == 0)
+			threadCount = HardwareThreads();
+		for (size_t i = 0; i < threadCount; i++)
+			m_threads.emplace_back(&CThreadPool::Run, this);
+	}
+
+	~CThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_taskCond.notify_all();
+		for (size_t i = 0; i < m_threads.size(); i++)
+			m_threads[i].join();
+	}
+
+	CThreadPool(const CThreadPool&) = delete;
+	CThreadPool& operator=(const CThreadPool&) = delete;
+
+	size_t Size() const
+	{
+		return m_threads.size();
+	}
+
+	void Submit(task_t task)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_tasks.push_back(std::move(task));
+			m_pending++;
+		}
+		m_taskCond.notify_one();
+	}
+
+	// Wait for all submitted tasks to complete.
+	void Wait()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_doneCond.wait(lock, [this] { return m_pending == 0; });
+	}
+
+	static size_t HardwareThreads()
+	{
+		size_t count = std::thread::hardware_concurrency();
+		return count != 0 ? count : 1;
+	}
+
+private:
+	std::vector<std::thread> m_threads;
+	std::deque<task_t> m_tasks;
+	std::mutex m_mutex;
+	std::condition_variable m_taskCond;
+	std::condition_variable m_doneCond;
+	size_t m_pending;
+	bool m_stop;
+
+	void Run()
+	{
+		for (;;) {
+			task_t task;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_taskCond.wait(lock, [this] {
+					return m_stop || !m_tasks.empty();
+				});
+				if (m_tasks.empty())
+					return;
+				task = std::move(m_tasks.front());
+				m_tasks.pop_front();
+			}
+			task();
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_pending--;
+			}
+			m_doneCond.notify_all();
+		}
+	}
+};
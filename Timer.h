@@ -1,7 +1,14 @@
 #pragma once
 
 #include <chrono>
+#include <string>
 
+#include <PerfCounters.h>
+
+/**
+ * Wall time of Start..Stop intervals. If CPerfCounters are enabled
+ * the timer also counts hardware events of the intervals, see Counters.
+ */
 class CTimer
 {
 public:
@@ -14,6 +21,7 @@ public:
 	void Start()
 	{
 		m_started = true;
+		m_counters.Start();
 		m_startTime = std::chrono::high_resolution_clock::now();
 	}
 
@@ -21,6 +29,7 @@ public:
 	{
 		m_started = false;
 		timeSpan_t timeSpan = now() - m_startTime;
+		m_counters.Stop();
 		m_accum += timeSpan.count();
 	}
 
@@ -39,12 +48,24 @@ public:
 		return r / Elapsed() * 1e-6;
 	}
 
+	// Hardware counters per request, empty if counters are disabled.
+	std::string Counters(unsigned long long r) const
+	{
+		return m_counters.PerOp(r);
+	}
+
+	const CPerfCounters& PerfCounters() const
+	{
+		return m_counters;
+	}
+
 private:
 	bool m_started;
 	double m_accum;
 	typedef std::chrono::time_point<std::chrono::high_resolution_clock> timePoint_t;
 	typedef std::chrono::duration<double> timeSpan_t;
 	timePoint_t m_startTime;
+	CPerfCounters m_counters;
 
 	static timePoint_t now()
 	{
@@ -0,0 +1,352 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <MsgPack.h>
+#include <TupleFormat.h>
+
+const size_t TEST_FIELD_COUNT_IN_TUPLE = 16;
+// Maximal size of tuple data, limits only tuples that are built in TupleBuilder.
+const size_t MAX_TEST_TUPLE_DATA_SIZE = 16 * TEST_FIELD_COUNT_IN_TUPLE;
+
+/**
+ * A tuple is a data structure that consist of variable number of values
+ * with variable type. Those values are usually called 'fields'.
+ * In order to provide type variability all the values are serialized
+ * into char buffer one value after other. For serialization the msgpack
+ * format is chosen (https://msgpack.org/).
+ * This causes some read performance problems: since every field has a variable
+ * size it is not possible to jump directly to nth field. If it is critical to
+ * has a high performance access to some field a tuple stores additional
+ * offsets for it - position in buffer where the serialized value is located.
+ * Generally this requires common (for many tuples) tuple format that declares
+ * which field has offset and where in tuple it is store. Since those offsets
+ * can be of variable size they are also stored in the same buffer as fields.
+
+ * Here is schematic layout of tuple in memory:
+ * (fldX - serialized field X; offX - offset of field X.)
+
+ * [ static part - struct members ][     dynamic part - char buffer (data)     ]
+ * [...........][off0][...........][off1][off2]..[fld0][ fld1 ][fld3]...]
+ *                                 <----off0---->
+ *                                 <-------off1------->
+ *                                 <-----------off2----------->
+ *
+ * The dynamic part immediately follows the struct and has exactly the size
+ * of offsets and fields (data_used), so a tuple takes only as much memory
+ * as needed. Tuples are built in TupleBuilder, that has a buffer of maximal
+ * size after the struct, and then are copied to exactly sized memory
+ * (see tuple_new in TupleArena.h).
+ *
+ * Which fields have offsets is declared by the tuple format (see TupleFormat.h),
+ * the tuple refers to it by format_id. Other fields are found by decoding
+ * from the nearest previous field with offset.
+ * For test purposes the tuple can store only scalar values.
+ */
+struct Tuple {
+	/*
+	 * The members below (except data_used) a made specially for this test,
+	 * in order to make dynamic modification of tuple.
+	 * Actual tuple is built once and immutable later.
+	 */
+	// Current number of fields.
+	uint32_t field_count;
+	// Current used number of bytes in data, i.e. the size of data.
+	uint32_t data_used;
+	// Id of tuple format, see tuple_format_by_id.
+	uint16_t format_id;
+
+	// Offset of the first field,
+	// i.e. the first field starts in data[first_field_offset].
+	// Note that we use shorter type for this offset to safe some space.
+	uint16_t first_field_offset;
+	// Type of field offset starting from field two.
+	// Offsets are stored with the width of 1, 2 or 4 bytes, the least
+	// width that fits the tuple data size is chosen for each tuple.
+	typedef uint32_t offset_t;
+	// Log2 of width of offsets: 0, 1 or 2 for uint8_t, uint16_t or uint32_t.
+	uint16_t offset_width_log : 2;
+	// In real life there are several useful fields.
+	uint16_t some_useful_data : 14;
+	// Type of comparison hint.
+	typedef uint64_t hint_t;
+	// Comparison hint, see tuple_hint. Is set only for key def with
+	// use_hint option and is valid only for that key def.
+	hint_t hint;
+
+	// Data buffer for both field offsets and msgpack data.
+	// The buffer follows the struct in memory.
+	char *data()
+	{
+		return (char *)(this + 1);
+	}
+
+	const char *data() const
+	{
+		return (const char *)(this + 1);
+	}
+
+	// Size of the tuple along with data.
+	size_t size() const
+	{
+		return sizeof(Tuple) + data_used;
+	}
+
+	// Get offset from slot (see TupleFormat), OFFSET_T must be of offset width.
+	template <class OFFSET_T>
+	offset_t get_offset(size_t slot) const
+	{
+		assert(slot > 0);
+		assert(sizeof(OFFSET_T) == (size_t)1 << offset_width_log);
+		return ((const OFFSET_T *)data())[slot - 1];
+	}
+
+	// Get field i, OFFSET_T must be of offset width.
+	template <class OFFSET_T>
+	const char *get_field(size_t i)
+	{
+		if (i == 0)
+			return data() + first_field_offset;
+		return get_field<OFFSET_T>(tuple_format_by_id(format_id), i);
+	}
+
+	/**
+	 * Get field i by the format of the tuple, that is looked up once
+	 * for many fields. OFFSET_T must be of offset width.
+	 */
+	template <class OFFSET_T>
+	const char *get_field(const TupleFormat *format, size_t i)
+	{
+		assert(format == tuple_format_by_id(format_id));
+		if (i == 0)
+			return data() + first_field_offset;
+		int32_t slot = format->get_slot(i);
+		if (slot > 0)
+			return data() + get_offset<OFFSET_T>(slot);
+		size_t nearest = format->get_nearest_field(i);
+		const char *field = data() + (nearest == 0 ? first_field_offset :
+			get_offset<OFFSET_T>(format->get_slot(nearest)));
+		// Skip fields without offsets after the nearest field with offset.
+		assert(i < field_count);
+		mp_skip_n(field, i - nearest);
+		return field;
+	}
+
+	// Get offset from slot (see TupleFormat).
+	offset_t get_offset(size_t slot) const
+	{
+		switch (offset_width_log) {
+			case 0:
+				return get_offset<uint8_t>(slot);
+			case 1:
+				return get_offset<uint16_t>(slot);
+			default:
+				return get_offset<uint32_t>(slot);
+		}
+	}
+
+	// Get field i.
+	const char *get_field(size_t i)
+	{
+		switch (offset_width_log) {
+			case 0:
+				return get_field<uint8_t>(i);
+			case 1:
+				return get_field<uint16_t>(i);
+			default:
+				return get_field<uint32_t>(i);
+		}
+	}
+};
+
+/**
+ * Tuple with data buffer of maximal size, in order to build a tuple.
+ * The built tuple is copied to exactly sized memory, see tuple_new.
+ * If a field does not fit into the buffer the builder is overflowed, as
+ * CMpWriter (see MpWriter.h): the field and all the next ones are not
+ * added, so is_overflow is checked once after finish.
+ * Not needed in real life.
+ */
+struct TupleBuilder {
+	Tuple tuple;
+	char data[MAX_TEST_TUPLE_DATA_SIZE];
+
+	/**
+	 * Several methods for tuple modification.
+	 */
+	// Clean up the tuple. Offsets are 4 bytes wide until finish.
+	void reset(const TupleFormat *a_format)
+	{
+		format = a_format;
+		tuple.field_count = 0;
+		tuple.format_id = format->id;
+		tuple.offset_width_log = 2;
+		// Slot 0 is stored in first_field_offset member,
+		// other slots are stored at the beginning of data buffer.
+		tuple.data_used = format->slot_count * sizeof(uint32_t);
+		is_overflow = tuple.data_used > MAX_TEST_TUPLE_DATA_SIZE;
+	}
+
+	// Add integer value to the end of tuple, save offset if necessary.
+	void add(uint64_t value)
+	{
+		char *p = next(mp_sizeof_uint(value));
+		if (p == NULL)
+			return;
+		mp_encode_uint(p, value);
+		added(p);
+	}
+
+	// Add string value to the end of tuple, save offset if necessary.
+	void add(const char *string, uint32_t len)
+	{
+		char *p = next(mp_sizeof_string(len));
+		if (p == NULL)
+			return;
+		mp_encode_string(p, string, len);
+		added(p);
+	}
+
+	// Add nil to the end of tuple, save offset if necessary.
+	void add_nil()
+	{
+		char *p = next(MP_SIZEOF_NIL);
+		if (p == NULL)
+			return;
+		mp_encode_nil(p);
+		added(p);
+	}
+
+	// Add bool value to the end of tuple, save offset if necessary.
+	void add_bool(bool value)
+	{
+		char *p = next(MP_SIZEOF_BOOL);
+		if (p == NULL)
+			return;
+		mp_encode_bool(p, value);
+		added(p);
+	}
+
+	// Add signed integer value to the end of tuple, save offset if necessary.
+	void add_int(int64_t value)
+	{
+		char *p = next(mp_sizeof_int(value));
+		if (p == NULL)
+			return;
+		mp_encode_int(p, value);
+		added(p);
+	}
+
+	// Add double value to the end of tuple, save offset if necessary.
+	void add_double(double value)
+	{
+		char *p = next(MP_SIZEOF_DOUBLE);
+		if (p == NULL)
+			return;
+		mp_encode_double(p, value);
+		added(p);
+	}
+
+	// Add binary string to the end of tuple, save offset if necessary.
+	void add_bin(const char *bin, uint32_t len)
+	{
+		char *p = next(mp_sizeof_bin(len));
+		if (p == NULL)
+			return;
+		mp_encode_bin(p, bin, len);
+		added(p);
+	}
+
+	// Copy encoded msgpack value to the end of tuple, save offset if necessary.
+	void add_encoded(const char *field)
+	{
+		const char *end = field;
+		mp_next(end);
+		char *p = next(end - field);
+		if (p == NULL)
+			return;
+		memcpy(p, field, end - field);
+		added(p + (end - field));
+	}
+
+	/**
+	 * Choose the least offset width that fits the tuple and move
+	 * the fields to the end of narrowed offsets.
+	 * The tuple must have all the fields of its format. An overflowed
+	 * tuple is not finished and must not be used.
+	 */
+	void finish()
+	{
+		if (is_overflow)
+			return;
+		assert(tuple.offset_width_log == 2);
+		assert(tuple.field_count >= format->field_count);
+		size_t offset_count = format->slot_count;
+		size_t fields_begin = offset_count * sizeof(uint32_t);
+		size_t fields_size = tuple.data_used - fields_begin;
+		uint32_t width_log = 0;
+		for (; width_log < 2; width_log++) {
+			size_t size = (offset_count << width_log) + fields_size;
+			if (size <= (size_t)1 << (8 << width_log))
+				break;
+		}
+		if (width_log == 2)
+			return;
+		size_t new_begin = offset_count << width_log;
+		size_t shift = fields_begin - new_begin;
+		uint32_t offsets[MAX_TUPLE_FORMAT_FIELDS];
+		for (size_t i = 0; i < offset_count; i++)
+			offsets[i] = ((uint32_t *)data)[i] - shift;
+		memmove(data + new_begin, data + fields_begin, fields_size);
+		for (size_t i = 0; i < offset_count; i++) {
+			if (width_log == 0)
+				((uint8_t *)data)[i] = offsets[i];
+			else
+				((uint16_t *)data)[i] = offsets[i];
+		}
+		if (tuple.field_count > 0)
+			tuple.first_field_offset -= shift;
+		tuple.data_used -= shift;
+		tuple.offset_width_log = width_log;
+	}
+
+	// Format of the tuple being built. Not a part of the tuple.
+	const TupleFormat *format;
+	// A field did not fit into data, see the struct comment.
+	bool is_overflow;
+
+private:
+	/**
+	 * Place of the next field of size bytes, NULL if it does not fit
+	 * into data and the builder is overflowed.
+	 */
+	char *next(size_t size)
+	{
+		if (is_overflow ||
+		    size > MAX_TEST_TUPLE_DATA_SIZE - tuple.data_used) {
+			is_overflow = true;
+			return NULL;
+		}
+		return data + tuple.data_used;
+	}
+
+	// Save offset of just added field that ends at p.
+	void added(char *p)
+	{
+		int32_t slot = format->get_slot(tuple.field_count);
+		if (slot == 0) {
+			tuple.first_field_offset = tuple.data_used;
+		} else if (slot > 0) {
+			uint32_t *offsets = (uint32_t *)data;
+			offsets[slot - 1] = tuple.data_used;
+		}
+		tuple.data_used = p - data;
+		tuple.field_count++;
+	}
+};
+
+static_assert(offsetof(TupleBuilder, data) == sizeof(Tuple),
+	      "Builder data must be the data of tuple");
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+
+#include <Tuple.h>
+
+/**
+ * Arena allocator with size classes.
+ * Small objects are cut from big slabs one after another, freed objects
+ * are put to the free list of their size class and are reused for
+ * objects of the same class. Size classes have granularity of ALIGN bytes,
+ * so objects take exactly their size rounded up to ALIGN.
+ * Objects bigger than MAX_SMALL_SIZE are allocated separately.
+ * All the objects can be freed at once by Reset, for example at the
+ * end of a transaction or when temporary results are not needed anymore.
+ */
+class CTupleArena
+{
+public:
+	static const size_t ALIGN = 8;
+	static const size_t SLAB_SIZE = 64 * 1024;
+	static const size_t MAX_SMALL_SIZE = 1024;
+
+	CTupleArena() : m_slab(NULL), m_slabUsed(SLAB_SIZE), m_large(NULL),
+			  m_used(0)
+	{
+		memset(m_free, 0, sizeof(m_free));
+	}
+
+	~CTupleArena()
+	{
+		Reset();
+	}
+
+	CTupleArena(const CTupleArena&) = delete;
+	CTupleArena& operator=(const CTupleArena&) = delete;
+
+	void *Alloc(size_t size)
+	{
+		assert(size > 0);
+		if (size > MAX_SMALL_SIZE)
+			return AllocLarge(size);
+		size_t cls = SizeClass(size);
+		m_used += ClassSize(cls);
+		if (m_free[cls] != NULL) {
+			FreeItem *item = m_free[cls];
+			m_free[cls] = item->next;
+			return item;
+		}
+		if (m_slabUsed + ClassSize(cls) > SLAB_SIZE) {
+			m_slab = (char *)malloc(SLAB_SIZE);
+			if (m_slab == NULL)
+				throw std::bad_alloc();
+			m_slabs.push_back(m_slab);
+			m_slabUsed = 0;
+		}
+		void *ptr = m_slab + m_slabUsed;
+		m_slabUsed += ClassSize(cls);
+		return ptr;
+	}
+
+	// Free the object, size must be the same as in Alloc.
+	void Free(void *ptr, size_t size)
+	{
+		if (size > MAX_SMALL_SIZE) {
+			FreeLarge(ptr, size);
+			return;
+		}
+		size_t cls = SizeClass(size);
+		m_used -= ClassSize(cls);
+		FreeItem *item = (FreeItem *)ptr;
+		item->next = m_free[cls];
+		m_free[cls] = item;
+	}
+
+	// Free all the objects at once.
+	void Reset()
+	{
+		for (size_t i = 0; i < m_slabs.size(); i++)
+			free(m_slabs[i]);
+		m_slabs.clear();
+		m_slab = NULL;
+		m_slabUsed = SLAB_SIZE;
+		memset(m_free, 0, sizeof(m_free));
+		while (m_large != NULL) {
+			LargeHeader *next = m_large->next;
+			free(m_large);
+			m_large = next;
+		}
+		m_used = 0;
+	}
+
+	// Total size of allocated objects, with rounding to size classes.
+	size_t Used() const
+	{
+		return m_used;
+	}
+
+private:
+	static const size_t CLASS_COUNT = MAX_SMALL_SIZE / ALIGN;
+
+	struct FreeItem {
+		FreeItem *next;
+	};
+	// Header of large object, all large objects are in a list.
+	struct LargeHeader {
+		LargeHeader *prev;
+		LargeHeader *next;
+	};
+
+	std::vector<char *> m_slabs;
+	char *m_slab;
+	size_t m_slabUsed;
+	FreeItem *m_free[CLASS_COUNT];
+	LargeHeader *m_large;
+	size_t m_used;
+
+	static size_t SizeClass(size_t size)
+	{
+		return (size + ALIGN - 1) / ALIGN - 1;
+	}
+
+	static size_t ClassSize(size_t cls)
+	{
+		return (cls + 1) * ALIGN;
+	}
+
+	void *AllocLarge(size_t size)
+	{
+		LargeHeader *header =
+			(LargeHeader *)malloc(sizeof(LargeHeader) + size);
+		if (header == NULL)
+			throw std::bad_alloc();
+		header->prev = NULL;
+		header->next = m_large;
+		if (m_large != NULL)
+			m_large->prev = header;
+		m_large = header;
+		m_used += size;
+		return header + 1;
+	}
+
+	void FreeLarge(void *ptr, size_t size)
+	{
+		LargeHeader *header = (LargeHeader *)ptr - 1;
+		if (header->prev != NULL)
+			header->prev->next = header->next;
+		else
+			m_large = header->next;
+		if (header->next != NULL)
+			header->next->prev = header->prev;
+		free(header);
+		m_used -= size;
+	}
+};
+
+// Copy built tuple (see TupleBuilder) to exactly sized memory of the arena.
+inline Tuple *
+tuple_new(CTupleArena *arena, const Tuple *src)
+{
+	Tuple *tuple = (Tuple *)arena->Alloc(src->size());
+	memcpy((void *)tuple, (const void *)src, src->size());
+	return tuple;
+}
+
+// Free the tuple allocated by tuple_new.
+inline void
+tuple_delete(CTupleArena *arena, Tuple *tuple)
+{
+	arena->Free(tuple, tuple->size());
+}
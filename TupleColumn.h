@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <MsgPack.h>
+#include <Tuple.h>
+#include <TupleCompareBatch.h>
+
+/**
+ * Columnar decoding: one field of many tuples is decoded in one pass
+ * into a contiguous array - uints into uint64_t values, strings into
+ * (data, length) pairs - that is then scanned without msgpack decoding,
+ * for example to filter tuples by a predicate.
+ * Tuples are prefetched TUPLE_COLUMN_PREFETCH tuples ahead, so their
+ * cache misses overlap when tuples are scattered over memory.
+ * Values are decoded by the usual decoders: in a column the markers are
+ * mostly the same and their branches are predicted well.
+ * Selections of uints are built without branches on the predicate, so
+ * their speed does not depend on selectivity.
+ */
+
+// Distance of tuple prefetch, in tuples.
+const size_t TUPLE_COLUMN_PREFETCH = 8;
+
+// String value of a column, points into tuple data.
+struct ColumnString {
+	const char *data;
+	uint32_t len;
+};
+
+// Decode uint field field_no of count tuples into values.
+inline void
+tuple_column_uint(Tuple **tuples, size_t count, size_t field_no,
+		  uint64_t *values)
+{
+	for (size_t i = 0; i < count; i++) {
+		if (i + TUPLE_COLUMN_PREFETCH < count)
+			TUPLE_PREFETCH(tuples[i + TUPLE_COLUMN_PREFETCH]);
+		const char *field = tuples[i]->get_field(field_no);
+		values[i] = mp_decode_uint(field);
+	}
+}
+
+// Decode string field field_no of count tuples into strings.
+inline void
+tuple_column_string(Tuple **tuples, size_t count, size_t field_no,
+		    ColumnString *strings)
+{
+	for (size_t i = 0; i < count; i++) {
+		if (i + TUPLE_COLUMN_PREFETCH < count)
+			TUPLE_PREFETCH(tuples[i + TUPLE_COLUMN_PREFETCH]);
+		const char *field = tuples[i]->get_field(field_no);
+		strings[i].data = mp_decode_string(field, strings[i].len);
+	}
+}
+
+/**
+ * Put numbers of values in [min, max] into selection in ascending order,
+ * return their number. selection must have room for count numbers.
+ */
+inline size_t
+column_select_uint_range(const uint64_t *values, size_t count, uint64_t min,
+			 uint64_t max, uint32_t *selection)
+{
+	assert(min <= max);
+	uint64_t range = max - min;
+	size_t selected = 0;
+	for (size_t i = 0; i < count; i++) {
+		selection[selected] = i;
+		// Values below min wrap around to big ones.
+		selected += values[i] - min <= range;
+	}
+	return selected;
+}
+
+// Number of values in [min, max].
+inline size_t
+column_count_uint_range(const uint64_t *values, size_t count, uint64_t min,
+			uint64_t max)
+{
+	assert(min <= max);
+	uint64_t range = max - min;
+	size_t selected = 0;
+	for (size_t i = 0; i < count; i++)
+		selected += values[i] - min <= range;
+	return selected;
+}
+
+/**
+ * Put numbers of strings that start with the prefix into selection in
+ * ascending order, return their number.
+ */
+inline size_t
+column_select_string_prefix(const ColumnString *strings, size_t count,
+			    const char *prefix, uint32_t prefix_len,
+			    uint32_t *selection)
+{
+	size_t selected = 0;
+	for (size_t i = 0; i < count; i++) {
+		const ColumnString *string = &strings[i];
+		selection[selected] = i;
+		selected += string->len >= prefix_len &&
+			    memcmp(string->data, prefix, prefix_len) == 0;
+	}
+	return selected;
+}
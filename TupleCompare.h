@@ -0,0 +1,1003 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <Collation.h>
+#include <Hash.h>
+#include <KeyDef.h>
+#include <MsgPack.h>
+#include <Tuple.h>
+#include <TupleCompareProfile.h>
+
+/**
+ * Specialized tuple comparators.
+ * default_tuple_compare interprets key def parts in runtime: it checks the
+ * type of every part and whether the part field immediately follows
+ * the field of the previous part. Here the same comparison is generated
+ * in compile time for given list of part types and sequential flag,
+ * so all the checks are resolved by the compiler.
+ * Only field numbers are taken from key def in runtime.
+ * Comparators of tuple with key are generated in the same way.
+ */
+
+// Maximal number of parts that have specialized comparators.
+const size_t MAX_SPECIALIZED_PART_COUNT = 3;
+
+// Compare two msgpack fields of given type, move the pointers to the ends.
+template <KeyDef::field_type_t TYPE>
+struct FieldCompare;
+
+template <>
+struct FieldCompare<KeyDef::UINT> {
+	static int compare(const char *&part1, const char *&part2)
+	{
+		return mp_compare_uint(part1, part2);
+	}
+};
+
+template <>
+struct FieldCompare<KeyDef::STRING> {
+	static int compare(const char *&part1, const char *&part2)
+	{
+		return mp_compare_string(part1, part2);
+	}
+};
+
+template <>
+struct FieldCompare<KeyDef::INTEGER> {
+	static int compare(const char *&part1, const char *&part2)
+	{
+		return mp_compare_integer(part1, part2);
+	}
+};
+
+template <>
+struct FieldCompare<KeyDef::DOUBLE> {
+	static int compare(const char *&part1, const char *&part2)
+	{
+		return mp_compare_double(part1, part2);
+	}
+};
+
+template <>
+struct FieldCompare<KeyDef::NUMBER> {
+	static int compare(const char *&part1, const char *&part2)
+	{
+		return mp_compare_number(part1, part2);
+	}
+};
+
+template <>
+struct FieldCompare<KeyDef::BOOLEAN> {
+	static int compare(const char *&part1, const char *&part2)
+	{
+		return mp_compare_bool(part1, part2);
+	}
+};
+
+template <>
+struct FieldCompare<KeyDef::BINARY> {
+	static int compare(const char *&part1, const char *&part2)
+	{
+		return mp_compare_bin(part1, part2);
+	}
+};
+
+/**
+ * FieldCompare with the result computed without branches, for types
+ * that have such comparators. Others are compared by FieldCompare.
+ */
+template <KeyDef::field_type_t TYPE>
+struct FieldCompareBranchless : FieldCompare<TYPE> {
+};
+
+template <>
+struct FieldCompareBranchless<KeyDef::UINT> {
+	static int compare(const char *&part1, const char *&part2)
+	{
+		return mp_compare_uint_branchless(part1, part2);
+	}
+};
+
+template <>
+struct FieldCompareBranchless<KeyDef::INTEGER> {
+	static int compare(const char *&part1, const char *&part2)
+	{
+		return mp_compare_integer_branchless(part1, part2);
+	}
+};
+
+template <>
+struct FieldCompareBranchless<KeyDef::DOUBLE> {
+	static int compare(const char *&part1, const char *&part2)
+	{
+		return mp_compare_double_branchless(part1, part2);
+	}
+};
+
+/**
+ * Compare parts starting from part number PART_NO, TYPES are the types of
+ * the rest of parts. If IS_SEQUENTIAL is set that all the parts are stored
+ * in sequential fields and only the field of the first part is looked up,
+ * the rest are reached by decoding the previous ones.
+ * OFFSET1 and OFFSET2 are types of field offsets of the tuples.
+ */
+template <bool IS_SEQUENTIAL, size_t PART_NO, class OFFSET1, class OFFSET2,
+	  KeyDef::field_type_t... TYPES>
+struct TupleCompareParts;
+
+template <bool IS_SEQUENTIAL, size_t PART_NO, class OFFSET1, class OFFSET2>
+struct TupleCompareParts<IS_SEQUENTIAL, PART_NO, OFFSET1, OFFSET2> {
+	static int compare(KeyDef *, Tuple *, Tuple *,
+			   const char *&, const char *&)
+	{
+		// All parts are equal.
+		return 0;
+	}
+};
+
+template <bool IS_SEQUENTIAL, size_t PART_NO, class OFFSET1, class OFFSET2,
+	  KeyDef::field_type_t TYPE, KeyDef::field_type_t... TYPES>
+struct TupleCompareParts<IS_SEQUENTIAL, PART_NO, OFFSET1, OFFSET2,
+			 TYPE, TYPES...> {
+	static int compare(KeyDef *def, Tuple *tuple1, Tuple *tuple2,
+			   const char *&part1, const char *&part2)
+	{
+		if (!IS_SEQUENTIAL || PART_NO == 0) {
+			size_t field_no = def->parts[PART_NO].field_no;
+			part1 = tuple1->get_field<OFFSET1>(field_no);
+			part2 = tuple2->get_field<OFFSET2>(field_no);
+		}
+		int r = FieldCompare<TYPE>::compare(part1, part2);
+		if (r != 0)
+			return r;
+		typedef TupleCompareParts<IS_SEQUENTIAL, PART_NO + 1,
+					  OFFSET1, OFFSET2, TYPES...> next_t;
+		return next_t::compare(def, tuple1, tuple2, part1, part2);
+	}
+};
+
+/**
+ * The same as TupleCompareParts, but all parts are compared and their
+ * results are combined by compare_result_select, without a branch on
+ * every part result.
+ */
+template <bool IS_SEQUENTIAL, size_t PART_NO, class OFFSET1, class OFFSET2,
+	  KeyDef::field_type_t... TYPES>
+struct TupleCompareBranchlessParts;
+
+template <bool IS_SEQUENTIAL, size_t PART_NO, class OFFSET1, class OFFSET2>
+struct TupleCompareBranchlessParts<IS_SEQUENTIAL, PART_NO, OFFSET1, OFFSET2> {
+	static int compare(KeyDef *, Tuple *, Tuple *,
+			   const char *&, const char *&)
+	{
+		return 0;
+	}
+};
+
+template <bool IS_SEQUENTIAL, size_t PART_NO, class OFFSET1, class OFFSET2,
+	  KeyDef::field_type_t TYPE, KeyDef::field_type_t... TYPES>
+struct TupleCompareBranchlessParts<IS_SEQUENTIAL, PART_NO, OFFSET1, OFFSET2,
+				   TYPE, TYPES...> {
+	static int compare(KeyDef *def, Tuple *tuple1, Tuple *tuple2,
+			   const char *&part1, const char *&part2)
+	{
+		if (!IS_SEQUENTIAL || PART_NO == 0) {
+			size_t field_no = def->parts[PART_NO].field_no;
+			part1 = tuple1->get_field<OFFSET1>(field_no);
+			part2 = tuple2->get_field<OFFSET2>(field_no);
+		}
+		int r = FieldCompareBranchless<TYPE>::compare(part1, part2);
+		typedef TupleCompareBranchlessParts<IS_SEQUENTIAL, PART_NO + 1,
+						    OFFSET1, OFFSET2,
+						    TYPES...> next_t;
+		int next = next_t::compare(def, tuple1, tuple2, part1, part2);
+		return compare_result_select(r, next);
+	}
+};
+
+// Comparator of tuples by key def with given part types.
+template <bool IS_SEQUENTIAL, KeyDef::field_type_t... TYPES>
+struct TupleCompare {
+	template <class OFFSET1, class OFFSET2>
+	static int compare_offsets(KeyDef *def, Tuple *tuple1, Tuple *tuple2)
+	{
+		const char *part1;
+		const char *part2;
+		typedef TupleCompareParts<IS_SEQUENTIAL, 0, OFFSET1, OFFSET2,
+					  TYPES...> parts_t;
+		return parts_t::compare(def, tuple1, tuple2, part1, part2);
+	}
+
+	template <class OFFSET1>
+	static int compare_offset1(KeyDef *def, Tuple *tuple1, Tuple *tuple2)
+	{
+		switch (tuple2->offset_width_log) {
+			case 0:
+				return compare_offsets<OFFSET1, uint8_t>(def, tuple1,
+									 tuple2);
+			case 1:
+				return compare_offsets<OFFSET1, uint16_t>(def, tuple1,
+									  tuple2);
+			default:
+				return compare_offsets<OFFSET1, uint32_t>(def, tuple1,
+									  tuple2);
+		}
+	}
+
+	// Offsets of tuples are read with the types of their widths.
+	static int compare(KeyDef *def, Tuple *tuple1, Tuple *tuple2)
+	{
+		assert(def->part_count == sizeof...(TYPES));
+		switch (tuple1->offset_width_log) {
+			case 0:
+				return compare_offset1<uint8_t>(def, tuple1, tuple2);
+			case 1:
+				return compare_offset1<uint16_t>(def, tuple1, tuple2);
+			default:
+				return compare_offset1<uint32_t>(def, tuple1, tuple2);
+		}
+	}
+};
+
+// Comparator of tuples by key def with given part types, see use_branchless.
+template <bool IS_SEQUENTIAL, KeyDef::field_type_t... TYPES>
+struct TupleCompareBranchless {
+	template <class OFFSET1, class OFFSET2>
+	static int compare_offsets(KeyDef *def, Tuple *tuple1, Tuple *tuple2)
+	{
+		const char *part1;
+		const char *part2;
+		typedef TupleCompareBranchlessParts<IS_SEQUENTIAL, 0, OFFSET1,
+						    OFFSET2, TYPES...> parts_t;
+		return parts_t::compare(def, tuple1, tuple2, part1, part2);
+	}
+
+	template <class OFFSET1>
+	static int compare_offset1(KeyDef *def, Tuple *tuple1, Tuple *tuple2)
+	{
+		switch (tuple2->offset_width_log) {
+			case 0:
+				return compare_offsets<OFFSET1, uint8_t>(def, tuple1,
+									 tuple2);
+			case 1:
+				return compare_offsets<OFFSET1, uint16_t>(def, tuple1,
+									  tuple2);
+			default:
+				return compare_offsets<OFFSET1, uint32_t>(def, tuple1,
+									  tuple2);
+		}
+	}
+
+	static int compare(KeyDef *def, Tuple *tuple1, Tuple *tuple2)
+	{
+		assert(def->part_count == sizeof...(TYPES));
+		switch (tuple1->offset_width_log) {
+			case 0:
+				return compare_offset1<uint8_t>(def, tuple1, tuple2);
+			case 1:
+				return compare_offset1<uint16_t>(def, tuple1, tuple2);
+			default:
+				return compare_offset1<uint32_t>(def, tuple1, tuple2);
+		}
+	}
+};
+
+/**
+ * Compare tuple parts starting from part number PART_NO with key parts.
+ * The key may be partial, so the compare stops after part_count parts.
+ * Key parts are always sequential, IS_SEQUENTIAL is about tuple fields.
+ * OFFSET_T is the type of field offsets of the tuple.
+ */
+template <bool IS_SEQUENTIAL, size_t PART_NO, class OFFSET_T,
+	  KeyDef::field_type_t... TYPES>
+struct TupleCompareWithKeyParts;
+
+template <bool IS_SEQUENTIAL, size_t PART_NO, class OFFSET_T>
+struct TupleCompareWithKeyParts<IS_SEQUENTIAL, PART_NO, OFFSET_T> {
+	static int compare(KeyDef *, Tuple *, uint32_t,
+			   const char *&, const char *&)
+	{
+		// All parts of the key are equal.
+		return 0;
+	}
+};
+
+template <bool IS_SEQUENTIAL, size_t PART_NO, class OFFSET_T,
+	  KeyDef::field_type_t TYPE, KeyDef::field_type_t... TYPES>
+struct TupleCompareWithKeyParts<IS_SEQUENTIAL, PART_NO, OFFSET_T,
+				TYPE, TYPES...> {
+	static int compare(KeyDef *def, Tuple *tuple, uint32_t part_count,
+			   const char *&part, const char *&key)
+	{
+		if (PART_NO == part_count)
+			return 0;
+		if (!IS_SEQUENTIAL || PART_NO == 0) {
+			size_t field_no = def->parts[PART_NO].field_no;
+			part = tuple->get_field<OFFSET_T>(field_no);
+		}
+		int r = FieldCompare<TYPE>::compare(part, key);
+		if (r != 0)
+			return r;
+		typedef TupleCompareWithKeyParts<IS_SEQUENTIAL, PART_NO + 1,
+						 OFFSET_T, TYPES...> next_t;
+		return next_t::compare(def, tuple, part_count, part, key);
+	}
+};
+
+// Comparator of tuple and key by key def with given part types.
+template <bool IS_SEQUENTIAL, KeyDef::field_type_t... TYPES>
+struct TupleCompareWithKey {
+	template <class OFFSET_T>
+	static int compare_offsets(KeyDef *def, Tuple *tuple, const char *key,
+				   uint32_t part_count)
+	{
+		const char *part;
+		typedef TupleCompareWithKeyParts<IS_SEQUENTIAL, 0, OFFSET_T,
+						 TYPES...> parts_t;
+		return parts_t::compare(def, tuple, part_count, part, key);
+	}
+
+	// Offsets of the tuple are read with the type of its width.
+	static int compare(KeyDef *def, Tuple *tuple, const char *key,
+			   uint32_t part_count)
+	{
+		assert(def->part_count == sizeof...(TYPES));
+		assert(part_count <= def->part_count);
+		switch (tuple->offset_width_log) {
+			case 0:
+				return compare_offsets<uint8_t>(def, tuple, key,
+								 part_count);
+			case 1:
+				return compare_offsets<uint16_t>(def, tuple, key,
+								  part_count);
+			default:
+				return compare_offsets<uint32_t>(def, tuple, key,
+								  part_count);
+		}
+	}
+};
+
+/**
+ * Comparator that compares tuple hints first and calls COMPARE only
+ * if they are equal.
+ */
+template <KeyDef::tuple_compare_t COMPARE>
+inline int
+tuple_compare_hinted(KeyDef *def, Tuple *tuple1, Tuple *tuple2)
+{
+	if (tuple1->hint != tuple2->hint)
+		return tuple1->hint < tuple2->hint ? -1 : 1;
+	return COMPARE(def, tuple1, tuple2);
+}
+
+// Set tuple comparator to key def, with hints if necessary.
+template <KeyDef::tuple_compare_t COMPARE>
+inline void
+key_def_set_tuple_compare(KeyDef *def)
+{
+	if (def->use_hint)
+		def->tuple_compare_f = tuple_compare_hinted<COMPARE>;
+	else
+		def->tuple_compare_f = COMPARE;
+}
+
+// Set comparators specialized for given part types to key def.
+template <bool IS_SEQUENTIAL, KeyDef::field_type_t... TYPES>
+inline void
+key_def_set_specialized(KeyDef *def)
+{
+	if (def->use_branchless)
+		key_def_set_tuple_compare<TupleCompareBranchless<IS_SEQUENTIAL,
+							  TYPES...>::compare>(def);
+	else
+		key_def_set_tuple_compare<TupleCompare<IS_SEQUENTIAL, TYPES...>
+					  ::compare>(def);
+	def->tuple_compare_with_key_f =
+		TupleCompareWithKey<IS_SEQUENTIAL, TYPES...>::compare;
+}
+
+template <size_t PARTS_LEFT, bool IS_SEQUENTIAL, KeyDef::field_type_t... TYPES>
+struct TupleCompareSelector;
+
+// Cost of a part in TupleCompareSelector if its type is not uint or string.
+const size_t EXTENDED_TYPE_PART_COST = 2;
+
+/**
+ * Continue TupleCompareSelector after a part of type other than uint or
+ * string, that takes EXTENDED_TYPE_PART_COST of PARTS_LEFT. Thus key defs
+ * with such types are specialized only up to two parts, and only one of
+ * them may be of such type. That keeps the number of generated comparators
+ * (and compile time) moderate.
+ */
+template <bool HAS_ROOM, size_t PARTS_LEFT, bool IS_SEQUENTIAL,
+	  KeyDef::field_type_t... TYPES>
+struct TupleCompareSelectorExtended {
+	static bool select(KeyDef *def, size_t part_no)
+	{
+		typedef TupleCompareSelector<PARTS_LEFT - EXTENDED_TYPE_PART_COST,
+					     IS_SEQUENTIAL, TYPES...> selector_t;
+		return selector_t::select(def, part_no);
+	}
+};
+
+template <size_t PARTS_LEFT, bool IS_SEQUENTIAL, KeyDef::field_type_t... TYPES>
+struct TupleCompareSelectorExtended<false, PARTS_LEFT, IS_SEQUENTIAL,
+				    TYPES...> {
+	static bool select(KeyDef *, size_t)
+	{
+		return false;
+	}
+};
+
+// TupleCompareSelectorExtended that checks whether the part fits.
+template <size_t PARTS_LEFT, bool IS_SEQUENTIAL, KeyDef::field_type_t... TYPES>
+struct TupleCompareSelectorNext
+	: TupleCompareSelectorExtended<PARTS_LEFT >= EXTENDED_TYPE_PART_COST,
+				       PARTS_LEFT, IS_SEQUENTIAL, TYPES...> {
+};
+
+/**
+ * Find specialized comparators for key def parts and set them to key def.
+ * Part types are collected one by one (starting from part_no) into TYPES,
+ * PARTS_LEFT is the number of parts that can be added to TYPES yet.
+ * Return false if there are no suitable comparators, in particular
+ * nullable parts and parts with collation are compared only by default
+ * comparators.
+ */
+template <size_t PARTS_LEFT, bool IS_SEQUENTIAL, KeyDef::field_type_t... TYPES>
+struct TupleCompareSelector {
+	static bool select(KeyDef *def, size_t part_no)
+	{
+		if (part_no == def->part_count) {
+			key_def_set_specialized<IS_SEQUENTIAL, TYPES...>(def);
+			return true;
+		}
+		if (def->parts[part_no].is_nullable ||
+		    def->parts[part_no].collation != NULL)
+			return false;
+		switch (def->parts[part_no].field_type) {
+			case KeyDef::UINT:
+				return TupleCompareSelector<PARTS_LEFT - 1,
+					IS_SEQUENTIAL, TYPES..., KeyDef::UINT>
+					::select(def, part_no + 1);
+			case KeyDef::STRING:
+				return TupleCompareSelector<PARTS_LEFT - 1,
+					IS_SEQUENTIAL, TYPES..., KeyDef::STRING>
+					::select(def, part_no + 1);
+			case KeyDef::INTEGER:
+				return TupleCompareSelectorNext<PARTS_LEFT,
+					IS_SEQUENTIAL, TYPES..., KeyDef::INTEGER>
+					::select(def, part_no + 1);
+			case KeyDef::DOUBLE:
+				return TupleCompareSelectorNext<PARTS_LEFT,
+					IS_SEQUENTIAL, TYPES..., KeyDef::DOUBLE>
+					::select(def, part_no + 1);
+			case KeyDef::NUMBER:
+				return TupleCompareSelectorNext<PARTS_LEFT,
+					IS_SEQUENTIAL, TYPES..., KeyDef::NUMBER>
+					::select(def, part_no + 1);
+			case KeyDef::BOOLEAN:
+				return TupleCompareSelectorNext<PARTS_LEFT,
+					IS_SEQUENTIAL, TYPES..., KeyDef::BOOLEAN>
+					::select(def, part_no + 1);
+			case KeyDef::BINARY:
+				return TupleCompareSelectorNext<PARTS_LEFT,
+					IS_SEQUENTIAL, TYPES..., KeyDef::BINARY>
+					::select(def, part_no + 1);
+			default:
+				return false;
+		}
+	}
+};
+
+template <bool IS_SEQUENTIAL, KeyDef::field_type_t... TYPES>
+struct TupleCompareSelector<0, IS_SEQUENTIAL, TYPES...> {
+	static bool select(KeyDef *def, size_t part_no)
+	{
+		if (part_no != def->part_count)
+			return false;
+		key_def_set_specialized<IS_SEQUENTIAL, TYPES...>(def);
+		return true;
+	}
+};
+
+// Check whether all parts of the key def are stored in sequential fields.
+inline bool
+key_def_is_sequential(const KeyDef *def)
+{
+	for (size_t i = 1; i < def->part_count; i++)
+		if (def->parts[i].field_no != def->parts[i - 1].field_no + 1)
+			return false;
+	return true;
+}
+
+/**
+ * Comparators compiled in runtime, for key defs that have no specialized
+ * comparators: more than MAX_SPECIALIZED_PART_COUNT parts, other type
+ * combinations, nullable parts or collations.
+ * Parts are compiled once into a program - a straight-line list of steps.
+ * A step compares a run of parts in sequential fields that have the same
+ * type, nullability and collation, by a comparator specialized for them,
+ * so e.g. four uint parts of fields 3-6 are one step with one indirect
+ * call. How the first field of a step is found is resolved by compile
+ * too: the first field of tuple is at first_field_offset, a field that
+ * follows the previous step is where the step stopped, and only other
+ * fields are found by offset slots. Slots are resolved for the format
+ * the program is compiled for, formats of other tuples are looked up
+ * once per comparison. Offsets are read with the types of tuple offset
+ * widths, that are chosen once per comparison as in TupleCompare.
+ * Programs are cached by their steps, key defs with equal parts and
+ * format share a program.
+ */
+
+typedef int (*compiled_part_compare_t)(const char *&field1,
+				       const char *&field2,
+				       const Collation *collation,
+				       uint32_t part_count);
+
+// Compiled comparator of one part.
+template <KeyDef::field_type_t TYPE, bool IS_NULLABLE, bool IS_BRANCHLESS>
+struct CompiledPartCompare {
+	static int compare_part(const char *&field1, const char *&field2,
+				const Collation *)
+	{
+		int r;
+		if (IS_NULLABLE && field_compare_nil(field1, field2, r)) {
+			// The next step may continue from the fields.
+			if (IS_BRANCHLESS && r != 0) {
+				mp_next(field1);
+				mp_next(field2);
+			}
+			return r;
+		}
+		if (IS_BRANCHLESS)
+			return FieldCompareBranchless<TYPE>::compare(field1,
+								     field2);
+		return FieldCompare<TYPE>::compare(field1, field2);
+	}
+};
+
+// Compiled comparator of string part with collation.
+template <bool IS_NULLABLE, bool IS_BRANCHLESS>
+struct CompiledPartCompareColl {
+	static int compare_part(const char *&field1, const char *&field2,
+				const Collation *collation)
+	{
+		int r;
+		if (IS_NULLABLE && field_compare_nil(field1, field2, r)) {
+			// The next step may continue from the fields.
+			if (IS_BRANCHLESS && r != 0) {
+				mp_next(field1);
+				mp_next(field2);
+			}
+			return r;
+		}
+		return mp_compare_string_coll(field1, field2, collation);
+	}
+};
+
+/**
+ * Compiled comparator of a step: part_count parts in sequential fields,
+ * that are compared by PART::compare_part.
+ */
+template <class PART, bool IS_BRANCHLESS>
+struct CompiledStepCompare {
+	static int compare(const char *&field1, const char *&field2,
+			   const Collation *collation, uint32_t part_count)
+	{
+		int result = 0;
+		for (uint32_t i = 0; i < part_count; i++) {
+			int r = PART::compare_part(field1, field2, collation);
+			if (IS_BRANCHLESS)
+				result = compare_result_select(result, r);
+			else if (r != 0)
+				return r;
+		}
+		return result;
+	}
+};
+
+template <bool IS_NULLABLE, bool IS_BRANCHLESS>
+inline compiled_part_compare_t
+compiled_part_compare_by_type(KeyDef::field_type_t field_type)
+{
+	switch (field_type) {
+		case KeyDef::UINT:
+			return CompiledStepCompare<CompiledPartCompare<KeyDef::UINT,
+				IS_NULLABLE, IS_BRANCHLESS>, IS_BRANCHLESS>::compare;
+		case KeyDef::STRING:
+			return CompiledStepCompare<CompiledPartCompare<KeyDef::STRING,
+				IS_NULLABLE, IS_BRANCHLESS>, IS_BRANCHLESS>::compare;
+		case KeyDef::INTEGER:
+			return CompiledStepCompare<CompiledPartCompare<KeyDef::INTEGER,
+				IS_NULLABLE, IS_BRANCHLESS>, IS_BRANCHLESS>::compare;
+		case KeyDef::DOUBLE:
+			return CompiledStepCompare<CompiledPartCompare<KeyDef::DOUBLE,
+				IS_NULLABLE, IS_BRANCHLESS>, IS_BRANCHLESS>::compare;
+		case KeyDef::NUMBER:
+			return CompiledStepCompare<CompiledPartCompare<KeyDef::NUMBER,
+				IS_NULLABLE, IS_BRANCHLESS>, IS_BRANCHLESS>::compare;
+		case KeyDef::BOOLEAN:
+			return CompiledStepCompare<CompiledPartCompare<KeyDef::BOOLEAN,
+				IS_NULLABLE, IS_BRANCHLESS>, IS_BRANCHLESS>::compare;
+		default:
+			assert(field_type == KeyDef::BINARY);
+			return CompiledStepCompare<CompiledPartCompare<KeyDef::BINARY,
+				IS_NULLABLE, IS_BRANCHLESS>, IS_BRANCHLESS>::compare;
+	}
+}
+
+// Compiled comparator of steps of the part, see KeyDef::use_branchless.
+inline compiled_part_compare_t
+compiled_part_compare(const KeyDef::KeyPart *part, bool is_branchless)
+{
+	KeyDef::field_type_t type = part->field_type;
+	if (part->collation != NULL) {
+		assert(type == KeyDef::STRING);
+		if (is_branchless)
+			return part->is_nullable ?
+			       CompiledStepCompare<CompiledPartCompareColl<true,
+					true>, true>::compare :
+			       CompiledStepCompare<CompiledPartCompareColl<false,
+					true>, true>::compare;
+		return part->is_nullable ?
+		       CompiledStepCompare<CompiledPartCompareColl<true, false>,
+					   false>::compare :
+		       CompiledStepCompare<CompiledPartCompareColl<false, false>,
+					   false>::compare;
+	}
+	if (part->is_nullable)
+		return is_branchless ?
+		       compiled_part_compare_by_type<true, true>(type) :
+		       compiled_part_compare_by_type<true, false>(type);
+	return is_branchless ? compiled_part_compare_by_type<false, true>(type) :
+	       compiled_part_compare_by_type<false, false>(type);
+}
+
+// How the first field of a step is found.
+enum compiled_field_t {
+	// The first field of tuple.
+	COMPILED_FIELD_FIRST,
+	// The field that follows the fields of the previous step.
+	COMPILED_FIELD_NEXT,
+	// By the offset slot, that is resolved by compile for tuples of
+	// the format of the program and is looked up for other tuples.
+	COMPILED_FIELD_SLOT,
+};
+
+struct TupleCompareProgram {
+	struct Step {
+		// Field of the first part of the step.
+		size_t field_no;
+		compiled_field_t field;
+		// Offset slot of COMPILED_FIELD_SLOT in the format of the
+		// program.
+		int32_t slot;
+		// Number of parts, that are in sequential fields.
+		uint32_t part_count;
+		compiled_part_compare_t compare;
+		const Collation *collation;
+	};
+	// Hash of the steps, to find programs in the cache.
+	uint64_t signature;
+	// Results of steps are combined by compare_result_select.
+	bool is_branchless;
+	// Some steps find fields by slots.
+	bool has_slots;
+	// Id of the format that slots are resolved for, -1 if none.
+	int32_t format_id;
+	// Number of parts of the key def.
+	size_t part_count;
+	size_t step_count;
+	Step steps[MAX_NUM_FIELDS_IN_KEY];
+};
+
+/**
+ * The format of the tuple to find fields by slots, NULL if the slots
+ * of the program are for the tuple.
+ */
+inline const TupleFormat *
+tuple_compare_program_format(const TupleCompareProgram *program,
+			     const Tuple *tuple)
+{
+	if (!program->has_slots || tuple->format_id == program->format_id)
+		return NULL;
+	return tuple_format_by_id(tuple->format_id);
+}
+
+/**
+ * The first field of the step, that is not COMPILED_FIELD_NEXT, format
+ * is given by tuple_compare_program_format.
+ */
+template <class OFFSET_T>
+inline const char *
+tuple_compare_program_field(const TupleCompareProgram::Step *step,
+			    Tuple *tuple, const TupleFormat *format)
+{
+	assert(step->field != COMPILED_FIELD_NEXT);
+	if (step->field == COMPILED_FIELD_FIRST)
+		return tuple->data() + tuple->first_field_offset;
+	if (format == NULL)
+		return tuple->data() + tuple->get_offset<OFFSET_T>(step->slot);
+	return tuple->get_field<OFFSET_T>(format, step->field_no);
+}
+
+/**
+ * Run the program on tuples, OFFSET1 and OFFSET2 are types of field
+ * offsets of the tuples. If IS_BRANCHLESS is set all steps are run and
+ * their results are combined, otherwise the first unequal part returns.
+ */
+template <bool IS_BRANCHLESS, class OFFSET1, class OFFSET2>
+inline int
+tuple_compare_program_run(const TupleCompareProgram *program, Tuple *tuple1,
+			  Tuple *tuple2)
+{
+	const TupleFormat *format1 = tuple_compare_program_format(program,
+								  tuple1);
+	const TupleFormat *format2 = tuple_compare_program_format(program,
+								  tuple2);
+	const char *part1 = NULL;
+	const char *part2 = NULL;
+	int result = 0;
+	const TupleCompareProgram::Step *step = program->steps;
+	const TupleCompareProgram::Step *end = step + program->step_count;
+	for (; step != end; step++) {
+		if (step->field != COMPILED_FIELD_NEXT) {
+			part1 = tuple_compare_program_field<OFFSET1>(step, tuple1,
+								     format1);
+			part2 = tuple_compare_program_field<OFFSET2>(step, tuple2,
+								     format2);
+		}
+		int r = step->compare(part1, part2, step->collation,
+				      step->part_count);
+		if (IS_BRANCHLESS)
+			result = compare_result_select(result, r);
+		else if (r != 0)
+			return r;
+	}
+	return result;
+}
+
+// Run the program on the tuple and the first part_count parts of the key.
+template <class OFFSET_T>
+inline int
+tuple_compare_with_key_program_run(const TupleCompareProgram *program,
+				   Tuple *tuple, const char *key,
+				   uint32_t part_count)
+{
+	const TupleFormat *format = tuple_compare_program_format(program,
+								 tuple);
+	const char *part = NULL;
+	const TupleCompareProgram::Step *step = program->steps;
+	for (; part_count > 0; step++) {
+		if (step->field != COMPILED_FIELD_NEXT)
+			part = tuple_compare_program_field<OFFSET_T>(step, tuple,
+								     format);
+		uint32_t count = step->part_count < part_count ?
+				 step->part_count : part_count;
+		int r = step->compare(part, key, step->collation, count);
+		if (r != 0)
+			return r;
+		part_count -= count;
+	}
+	// All parts of the key are equal.
+	return 0;
+}
+
+// Comparators that run the compiled program of key def.
+template <bool IS_BRANCHLESS>
+struct TupleCompareCompiled {
+	template <class OFFSET1>
+	static int compare_offset1(const TupleCompareProgram *program,
+				   Tuple *tuple1, Tuple *tuple2)
+	{
+		switch (tuple2->offset_width_log) {
+			case 0:
+				return tuple_compare_program_run<IS_BRANCHLESS,
+					OFFSET1, uint8_t>(program, tuple1, tuple2);
+			case 1:
+				return tuple_compare_program_run<IS_BRANCHLESS,
+					OFFSET1, uint16_t>(program, tuple1, tuple2);
+			default:
+				return tuple_compare_program_run<IS_BRANCHLESS,
+					OFFSET1, uint32_t>(program, tuple1, tuple2);
+		}
+	}
+
+	static int compare(KeyDef *def, Tuple *tuple1, Tuple *tuple2)
+	{
+		const TupleCompareProgram *program = def->compare_program;
+		assert(program->part_count == def->part_count);
+		switch (tuple1->offset_width_log) {
+			case 0:
+				return compare_offset1<uint8_t>(program, tuple1,
+								tuple2);
+			case 1:
+				return compare_offset1<uint16_t>(program, tuple1,
+								 tuple2);
+			default:
+				return compare_offset1<uint32_t>(program, tuple1,
+								 tuple2);
+		}
+	}
+
+	static int compare_with_key(KeyDef *def, Tuple *tuple, const char *key,
+				    uint32_t part_count)
+	{
+		const TupleCompareProgram *program = def->compare_program;
+		assert(part_count <= program->part_count);
+		switch (tuple->offset_width_log) {
+			case 0:
+				return tuple_compare_with_key_program_run<uint8_t>(
+					program, tuple, key, part_count);
+			case 1:
+				return tuple_compare_with_key_program_run<uint16_t>(
+					program, tuple, key, part_count);
+			default:
+				return tuple_compare_with_key_program_run<uint32_t>(
+					program, tuple, key, part_count);
+		}
+	}
+};
+
+// Compiled programs of all key defs.
+struct TupleCompareProgramCache {
+	std::mutex mutex;
+	std::vector<std::unique_ptr<TupleCompareProgram> > programs;
+};
+
+inline TupleCompareProgramCache&
+tuple_compare_program_cache()
+{
+	static TupleCompareProgramCache cache;
+	return cache;
+}
+
+inline bool
+tuple_compare_program_equal(const TupleCompareProgram *program1,
+			    const TupleCompareProgram *program2)
+{
+	if (program1->signature != program2->signature ||
+	    program1->is_branchless != program2->is_branchless ||
+	    program1->format_id != program2->format_id ||
+	    program1->part_count != program2->part_count ||
+	    program1->step_count != program2->step_count)
+		return false;
+	for (size_t i = 0; i < program1->step_count; i++) {
+		const TupleCompareProgram::Step *step1 = &program1->steps[i];
+		const TupleCompareProgram::Step *step2 = &program2->steps[i];
+		if (step1->field_no != step2->field_no ||
+		    step1->field != step2->field ||
+		    step1->slot != step2->slot ||
+		    step1->part_count != step2->part_count ||
+		    step1->compare != step2->compare ||
+		    step1->collation != step2->collation)
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Compile parts of the key def, with slots of the format if it's not
+ * NULL, or find the program of equal parts in the cache. Thread safe.
+ */
+inline const TupleCompareProgram *
+tuple_compare_program_compile(const KeyDef *def, const TupleFormat *format)
+{
+	assert(def->part_count > 0);
+	TupleCompareProgram program;
+	program.is_branchless = def->use_branchless;
+	program.has_slots = false;
+	program.format_id = format != NULL ? format->id : -1;
+	program.part_count = def->part_count;
+	program.step_count = 0;
+	for (size_t i = 0; i < def->part_count; i++) {
+		const KeyDef::KeyPart *part = &def->parts[i];
+		compiled_part_compare_t compare =
+			compiled_part_compare(part, def->use_branchless);
+		bool is_next = i != 0 &&
+			       part->field_no == def->parts[i - 1].field_no + 1;
+		TupleCompareProgram::Step *step =
+			&program.steps[program.step_count];
+		if (is_next && step[-1].compare == compare &&
+		    step[-1].collation == part->collation) {
+			// The part continues the run of the previous step.
+			step[-1].part_count++;
+			continue;
+		}
+		program.step_count++;
+		step->field_no = part->field_no;
+		if (part->field_no == 0)
+			step->field = COMPILED_FIELD_FIRST;
+		else if (is_next)
+			step->field = COMPILED_FIELD_NEXT;
+		else
+			step->field = COMPILED_FIELD_SLOT;
+		step->slot = TupleFormat::NO_SLOT;
+		step->part_count = 1;
+		step->compare = compare;
+		step->collation = part->collation;
+		if (step->field != COMPILED_FIELD_SLOT)
+			continue;
+		program.has_slots = true;
+		if (format != NULL)
+			step->slot = format->get_slot(part->field_no);
+		// Fields without offsets are found as in other formats.
+		if (step->slot == TupleFormat::NO_SLOT)
+			program.format_id = -1;
+	}
+	program.signature = hash_uint(program.format_id, 0);
+	for (size_t i = 0; i < program.step_count; i++) {
+		const TupleCompareProgram::Step *step = &program.steps[i];
+		program.signature = hash_uint(step->field_no, program.signature);
+		program.signature = hash_uint(step->slot, program.signature);
+		program.signature = hash_uint(step->part_count,
+					      program.signature);
+		program.signature = hash_uint((uintptr_t)step->compare,
+					      program.signature);
+		program.signature = hash_uint((uintptr_t)step->collation,
+					      program.signature);
+	}
+
+	TupleCompareProgramCache &cache = tuple_compare_program_cache();
+	std::lock_guard<std::mutex> lock(cache.mutex);
+	for (size_t i = 0; i < cache.programs.size(); i++)
+		if (tuple_compare_program_equal(cache.programs[i].get(),
+						&program))
+			return cache.programs[i].get();
+	cache.programs.emplace_back(new TupleCompareProgram(program));
+	return cache.programs.back().get();
+}
+
+/**
+ * Set compiled comparators to the key def, with hints if necessary.
+ * If the format is given, fields of its tuples are found by the slots
+ * resolved by compile. The format must not be deleted while the key
+ * def is used, tuples of a new format could get its id.
+ */
+inline void
+key_def_set_compiled(KeyDef *def, const TupleFormat *format = NULL)
+{
+	def->compare_program = tuple_compare_program_compile(def, format);
+	if (def->use_branchless)
+		key_def_set_tuple_compare<TupleCompareCompiled<true>::compare>(def);
+	else
+		key_def_set_tuple_compare<TupleCompareCompiled<false>::compare>(def);
+	def->tuple_compare_with_key_f =
+		TupleCompareCompiled<false>::compare_with_key;
+}
+
+/**
+ * Set the best comparison functions for the key def.
+ * Fall back to compiled ones if there are no specialized, that are
+ * compiled for tuples of the format if it's given, see
+ * key_def_set_compiled.
+ */
+inline void
+key_def_set_compare_func(KeyDef *def, const TupleFormat *format = NULL)
+{
+	assert(def->part_count > 0);
+	bool found = false;
+	if (def->part_count <= MAX_SPECIALIZED_PART_COUNT) {
+		const size_t max = MAX_SPECIALIZED_PART_COUNT;
+		if (key_def_is_sequential(def))
+			found = TupleCompareSelector<max, true>::select(def, 0);
+		else
+			found = TupleCompareSelector<max, false>::select(def, 0);
+	}
+	if (!found)
+		key_def_set_compiled(def, format);
+	if (def->part_count == 1 && def->parts[0].field_no == 0 &&
+	    def->parts[0].field_type == KeyDef::UINT &&
+	    !def->parts[0].is_nullable)
+		key_def_set_tuple_compare<tuple_compare_by_first_uint>(def);
+#ifdef TUPLE_COMPARE_PROFILE
+	key_def_set_compare_profiled(def, !found);
+#endif
+}
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+#include <KeyDef.h>
+#include <MemCompare.h>
+#include <MsgPack.h>
+#include <Tuple.h>
+
+#ifdef _WIN32
+#include <xmmintrin.h>
+#define TUPLE_PREFETCH(addr) _mm_prefetch((const char *)(addr), _MM_HINT_T0)
+#else
+#define TUPLE_PREFETCH(addr) __builtin_prefetch(addr)
+#endif
+
+/**
+ * Comparison of one tuple (pivot) with many others.
+ * The key parts of the pivot are decoded once, and then every other
+ * tuple is compared with decoded values in a loop, without calling
+ * tuple_compare_f for every pair.
+ */
+
+// Key parts of a tuple, decoded for repeated comparisons.
+struct DecodedKey {
+	struct Part {
+		// Value of uint part, or length of string part.
+		uint64_t value;
+		// Data of string part, or the field itself for other parts
+		// (see decoded_key_part_is_field).
+		const char *string;
+	};
+	Part parts[MAX_NUM_FIELDS_IN_KEY];
+};
+
+/**
+ * Only uint and string parts are decoded. The field of nullable part,
+ * string part with collation or part of other type is kept as is and
+ * compared by key_part_compare.
+ */
+inline bool
+decoded_key_part_is_field(const KeyDef::KeyPart *part)
+{
+	return part->is_nullable || part->collation != NULL ||
+	       (part->field_type != KeyDef::UINT &&
+		part->field_type != KeyDef::STRING);
+}
+
+// Decode key parts of the tuple.
+inline void
+tuple_decode_key(KeyDef *def, Tuple *tuple, DecodedKey *key)
+{
+	const char *field;
+	for (size_t i = 0; i < def->part_count; i++) {
+		KeyDef::KeyPart *part = &def->parts[i];
+		if (i == 0 ||
+		    def->parts[i].field_no != def->parts[i - 1].field_no + 1)
+			field = tuple->get_field(part->field_no);
+		if (decoded_key_part_is_field(part)) {
+			key->parts[i].string = field;
+			mp_next(field);
+		} else if (part->field_type == KeyDef::UINT) {
+			key->parts[i].value = mp_decode_uint(field);
+		} else {
+			uint32_t len;
+			key->parts[i].string = mp_decode_string(field, len);
+			key->parts[i].value = len;
+		}
+	}
+}
+
+// Compare decoded key with the tuple, as tuple_compare_f does.
+inline int
+decoded_key_compare(KeyDef *def, const DecodedKey *key, Tuple *tuple)
+{
+	const char *field;
+	for (size_t i = 0; i < def->part_count; i++) {
+		KeyDef::KeyPart *part = &def->parts[i];
+		if (i == 0 ||
+		    def->parts[i].field_no != def->parts[i - 1].field_no + 1)
+			field = tuple->get_field(part->field_no);
+		const DecodedKey::Part *value = &key->parts[i];
+		if (decoded_key_part_is_field(part)) {
+			const char *field1 = value->string;
+			int r;
+			if (part->is_nullable &&
+			    field_compare_nil(field1, field, r)) {
+				if (r != 0)
+					return r;
+				continue;
+			}
+			r = key_part_compare(part, field1, field);
+			if (r != 0)
+				return r;
+		} else if (part->field_type == KeyDef::UINT) {
+			uint64_t value2 = mp_decode_uint(field);
+			if (value->value != value2)
+				return value->value < value2 ? -1 : 1;
+		} else {
+			uint32_t len2;
+			const char *string2 = mp_decode_string(field, len2);
+			int r = mem_compare(value->string, value->value,
+					    string2, len2);
+			if (r != 0)
+				return r;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Compare pivot with n other tuples, results[i] is the result of
+ * comparison of pivot and others[i] (the same as tuple_compare_f).
+ */
+inline void
+tuple_compare_batch(KeyDef *def, Tuple *pivot, Tuple **others, size_t n,
+		    int *results)
+{
+	assert(def->part_count > 0);
+	DecodedKey key;
+	tuple_decode_key(def, pivot, &key);
+	for (size_t i = 0; i < n; i++)
+		results[i] = decoded_key_compare(def, &key, others[i]);
+}
+
+// Distance (in tuples) of prefetch in tuple_compare_batch_prefetch.
+const size_t TUPLE_COMPARE_BATCH_PREFETCH = 8;
+
+// Prefetch the header and beginning of tuple data.
+inline void
+tuple_prefetch(Tuple *tuple)
+{
+	TUPLE_PREFETCH(tuple);
+	TUPLE_PREFETCH((const char *)tuple + 64);
+}
+
+/**
+ * The same as tuple_compare_batch, but tuples are prefetched ahead,
+ * so cache misses on tuple data of scattered tuples are overlapped
+ * with comparisons.
+ */
+inline void
+tuple_compare_batch_prefetch(KeyDef *def, Tuple *pivot, Tuple **others,
+			     size_t n, int *results)
+{
+	assert(def->part_count > 0);
+	DecodedKey key;
+	tuple_decode_key(def, pivot, &key);
+	const size_t distance = TUPLE_COMPARE_BATCH_PREFETCH;
+	size_t prefetched = n < distance ? n : distance;
+	for (size_t i = 0; i < prefetched; i++)
+		tuple_prefetch(others[i]);
+	for (size_t i = 0; i < n; i++) {
+		if (i + distance < n)
+			tuple_prefetch(others[i + distance]);
+		results[i] = decoded_key_compare(def, &key, others[i]);
+	}
+}
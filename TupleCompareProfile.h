@@ -0,0 +1,394 @@
+#pragma once
+
+#ifdef TUPLE_COMPARE_PROFILE
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+#include <Hash.h>
+#include <KeyDef.h>
+#include <PerfCounters.h>
+#include <Tuple.h>
+
+/**
+ * Sampled profiling of comparators, compiled in only with
+ * TUPLE_COMPARE_PROFILE (cmake -DTUPLE_COMPARE_PROFILE=ON).
+ * key_def_set_compare_func then sets tuple_compare_profiled as
+ * tuple_compare_f of key defs, and the chosen comparator is called
+ * from it. For every key def it counts comparisons, and every
+ * TUPLE_COMPARE_PROFILE_PERIOD-th comparison of a thread is sampled:
+ * its time is measured by rdtsc and the part that decides the result is
+ * found (or the hint, or that tuples are equal). That tells which key
+ * defs are hot, whether they use the default comparator, and where
+ * hints or specialized comparators would pay off.
+ * Counters are thread-local: only the owner thread writes them, so there
+ * is no contention, and they are read by tuple_compare_profile_snapshot
+ * from any thread. Counters of finished threads are kept.
+ * Key defs are identified by address and configuration (parts,
+ * use_hint and use_branchless), see key_def_profile_id.
+ */
+
+// Every TUPLE_COMPARE_PROFILE_PERIOD-th comparison of a thread is sampled.
+const uint64_t TUPLE_COMPARE_PROFILE_PERIOD = 1024;
+// Maximal number of key defs profiled by a thread, others are dropped.
+const size_t TUPLE_COMPARE_PROFILE_SLOTS = 64;
+
+// Profile of a key def, summed over threads.
+struct KeyDefProfile {
+	uint64_t id;
+	size_t part_count;
+	KeyDef::KeyPart parts[MAX_NUM_FIELDS_IN_KEY];
+	bool use_hint;
+	bool use_branchless;
+	// The comparator runs the compiled program of the key def, there
+	// are no specialized ones (see key_def_set_compiled).
+	bool is_compiled;
+	uint64_t compares;
+	uint64_t samples;
+	// Time of sampled comparisons, in rdtsc ticks or nanoseconds.
+	uint64_t sample_ticks;
+	// Sampled comparisons decided by hints.
+	uint64_t decided_by_hint;
+	// decided_by_part[i] - by part i, [part_count] - tuples are equal.
+	uint64_t decided_by_part[MAX_NUM_FIELDS_IN_KEY + 1];
+};
+
+// Identifier of key def address and configuration.
+inline uint64_t
+key_def_profile_id(const KeyDef *def)
+{
+	uint64_t hash = hash_uint((uintptr_t)def, def->use_hint);
+	hash = hash_uint(def->use_branchless, hash);
+	for (size_t i = 0; i < def->part_count; i++) {
+		const KeyDef::KeyPart *part = &def->parts[i];
+		hash = hash_uint(part->field_type, hash);
+		hash = hash_uint(part->field_no, hash);
+		hash = hash_uint(part->is_nullable, hash);
+		hash = hash_uint((uintptr_t)part->collation, hash);
+	}
+	// 0 marks a free slot.
+	return hash != 0 ? hash : 1;
+}
+
+inline uint64_t
+tuple_compare_profile_ticks()
+{
+#ifdef PERF_HAVE_RDTSC
+	return __rdtsc();
+#else
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// Counter that is written by one thread and read by any.
+struct ProfileCounter {
+	std::atomic<uint64_t> value;
+
+	void add(uint64_t n)
+	{
+		value.store(value.load(std::memory_order_relaxed) + n,
+			    std::memory_order_relaxed);
+	}
+
+	uint64_t get() const
+	{
+		return value.load(std::memory_order_relaxed);
+	}
+};
+
+class CTupleCompareProfileThread;
+
+// All the threads that profile comparisons, and totals of finished ones.
+struct TupleCompareProfileRegistry {
+	std::mutex mutex;
+	std::vector<CTupleCompareProfileThread *> threads;
+	std::vector<KeyDefProfile> finished;
+	uint64_t dropped;
+};
+
+inline TupleCompareProfileRegistry&
+tuple_compare_profile_registry()
+{
+	static TupleCompareProfileRegistry registry;
+	return registry;
+}
+
+// Add profile to the ones with the same id in profiles.
+inline void
+key_def_profile_merge(std::vector<KeyDefProfile> &profiles,
+		      const KeyDefProfile &profile)
+{
+	for (size_t i = 0; i < profiles.size(); i++) {
+		KeyDefProfile &p = profiles[i];
+		if (p.id != profile.id)
+			continue;
+		p.compares += profile.compares;
+		p.samples += profile.samples;
+		p.sample_ticks += profile.sample_ticks;
+		p.decided_by_hint += profile.decided_by_hint;
+		for (size_t j = 0; j <= MAX_NUM_FIELDS_IN_KEY; j++)
+			p.decided_by_part[j] += profile.decided_by_part[j];
+		return;
+	}
+	profiles.push_back(profile);
+}
+
+// Profile counters of one thread.
+class CTupleCompareProfileThread
+{
+public:
+	CTupleCompareProfileThread() : m_countdown(TUPLE_COMPARE_PROFILE_PERIOD)
+	{
+		for (size_t i = 0; i < TUPLE_COMPARE_PROFILE_SLOTS; i++)
+			m_slots[i].id.store(0, std::memory_order_relaxed);
+		m_dropped.value.store(0, std::memory_order_relaxed);
+		TupleCompareProfileRegistry &registry =
+			tuple_compare_profile_registry();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		registry.threads.push_back(this);
+	}
+
+	~CTupleCompareProfileThread()
+	{
+		TupleCompareProfileRegistry &registry =
+			tuple_compare_profile_registry();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		Collect(registry.finished, registry.dropped);
+		std::vector<CTupleCompareProfileThread *> &threads =
+			registry.threads;
+		threads.erase(std::find(threads.begin(), threads.end(), this));
+	}
+
+	CTupleCompareProfileThread(const CTupleCompareProfileThread&) = delete;
+	CTupleCompareProfileThread&
+	operator=(const CTupleCompareProfileThread&) = delete;
+
+	int Compare(KeyDef *def, Tuple *tuple1, Tuple *tuple2)
+	{
+		Slot *slot = Find(def);
+		if (slot == NULL) {
+			m_dropped.add(1);
+			return def->profiled_compare_f(def, tuple1, tuple2);
+		}
+		slot->compares.add(1);
+		if (--m_countdown != 0)
+			return def->profiled_compare_f(def, tuple1, tuple2);
+		m_countdown = TUPLE_COMPARE_PROFILE_PERIOD;
+		uint64_t start = tuple_compare_profile_ticks();
+		int r = def->profiled_compare_f(def, tuple1, tuple2);
+		slot->sample_ticks.add(tuple_compare_profile_ticks() - start);
+		slot->samples.add(1);
+		if (def->use_hint && tuple1->hint != tuple2->hint)
+			slot->decided_by_hint.add(1);
+		else
+			slot->decided_by_part[DecidingPart(def, tuple1,
+							   tuple2)].add(1);
+		return r;
+	}
+
+	// Add profiles of the thread to profiles. Called under registry mutex.
+	void Collect(std::vector<KeyDefProfile> &profiles, uint64_t &dropped)
+	{
+		for (size_t i = 0; i < TUPLE_COMPARE_PROFILE_SLOTS; i++) {
+			Slot *slot = &m_slots[i];
+			KeyDefProfile profile;
+			profile.id = slot->id.load(std::memory_order_acquire);
+			if (profile.id == 0)
+				continue;
+			profile.part_count = slot->part_count;
+			for (size_t j = 0; j < slot->part_count; j++)
+				profile.parts[j] = slot->parts[j];
+			profile.use_hint = slot->use_hint;
+			profile.use_branchless = slot->use_branchless;
+			profile.is_compiled = slot->is_compiled;
+			profile.compares = slot->compares.get();
+			profile.samples = slot->samples.get();
+			profile.sample_ticks = slot->sample_ticks.get();
+			profile.decided_by_hint = slot->decided_by_hint.get();
+			for (size_t j = 0; j <= MAX_NUM_FIELDS_IN_KEY; j++)
+				profile.decided_by_part[j] =
+					slot->decided_by_part[j].get();
+			key_def_profile_merge(profiles, profile);
+		}
+		dropped += m_dropped.get();
+	}
+
+private:
+	struct Slot {
+		// 0 if the slot is free, set last when the slot is taken.
+		std::atomic<uint64_t> id;
+		size_t part_count;
+		KeyDef::KeyPart parts[MAX_NUM_FIELDS_IN_KEY];
+		bool use_hint;
+		bool use_branchless;
+		bool is_compiled;
+		ProfileCounter compares;
+		ProfileCounter samples;
+		ProfileCounter sample_ticks;
+		ProfileCounter decided_by_hint;
+		ProfileCounter decided_by_part[MAX_NUM_FIELDS_IN_KEY + 1];
+	};
+
+	Slot m_slots[TUPLE_COMPARE_PROFILE_SLOTS];
+	uint64_t m_countdown;
+	ProfileCounter m_dropped;
+
+	// Find or take the slot of the key def, NULL if there are no free.
+	Slot *Find(KeyDef *def)
+	{
+		uint64_t id = def->profile_id;
+		size_t mask = TUPLE_COMPARE_PROFILE_SLOTS - 1;
+		for (size_t i = 0; i < TUPLE_COMPARE_PROFILE_SLOTS; i++) {
+			Slot *slot = &m_slots[(id + i) & mask];
+			uint64_t slot_id = slot->id.load(std::memory_order_relaxed);
+			if (slot_id == id)
+				return slot;
+			if (slot_id == 0)
+				return Take(slot, def);
+		}
+		return NULL;
+	}
+
+	Slot *Take(Slot *slot, KeyDef *def)
+	{
+		slot->part_count = def->part_count;
+		for (size_t i = 0; i < def->part_count; i++)
+			slot->parts[i] = def->parts[i];
+		slot->use_hint = def->use_hint;
+		slot->use_branchless = def->use_branchless;
+		slot->is_compiled = def->profile_is_compiled;
+		slot->compares.value.store(0, std::memory_order_relaxed);
+		slot->samples.value.store(0, std::memory_order_relaxed);
+		slot->sample_ticks.value.store(0, std::memory_order_relaxed);
+		slot->decided_by_hint.value.store(0, std::memory_order_relaxed);
+		for (size_t i = 0; i <= MAX_NUM_FIELDS_IN_KEY; i++)
+			slot->decided_by_part[i].value.store(
+				0, std::memory_order_relaxed);
+		slot->id.store(def->profile_id, std::memory_order_release);
+		return slot;
+	}
+
+	// Number of the first unequal part, part_count if tuples are equal.
+	static size_t DecidingPart(KeyDef *def, Tuple *tuple1, Tuple *tuple2)
+	{
+		const char *part1;
+		const char *part2;
+		for (size_t i = 0; i < def->part_count; i++) {
+			KeyDef::KeyPart *part = &def->parts[i];
+			if (i == 0 ||
+			    def->parts[i].field_no != def->parts[i - 1].field_no + 1) {
+				part1 = tuple1->get_field(part->field_no);
+				part2 = tuple2->get_field(part->field_no);
+			}
+			int r;
+			if (part->is_nullable &&
+			    field_compare_nil(part1, part2, r)) {
+				if (r != 0)
+					return i;
+				continue;
+			}
+			if (key_part_compare(part, part1, part2) != 0)
+				return i;
+		}
+		return def->part_count;
+	}
+};
+
+inline CTupleCompareProfileThread *
+tuple_compare_profile_thread()
+{
+	static thread_local CTupleCompareProfileThread thread;
+	return &thread;
+}
+
+// Comparator that profiles profiled_compare_f of the key def.
+inline int
+tuple_compare_profiled(KeyDef *def, Tuple *tuple1, Tuple *tuple2)
+{
+	return tuple_compare_profile_thread()->Compare(def, tuple1, tuple2);
+}
+
+/**
+ * Profile the comparator that is set to the key def: called by
+ * key_def_set_compare_func after the comparator is chosen.
+ */
+inline void
+key_def_set_compare_profiled(KeyDef *def, bool is_compiled)
+{
+	def->profiled_compare_f = def->tuple_compare_f;
+	def->profile_is_compiled = is_compiled;
+	def->profile_id = key_def_profile_id(def);
+	def->tuple_compare_f = tuple_compare_profiled;
+}
+
+/**
+ * Profiles of all key defs summed over all threads. dropped is set to
+ * the number of comparisons that were not profiled because threads had
+ * no free slots.
+ */
+inline std::vector<KeyDefProfile>
+tuple_compare_profile_snapshot(uint64_t *dropped = NULL)
+{
+	TupleCompareProfileRegistry &registry = tuple_compare_profile_registry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	std::vector<KeyDefProfile> profiles = registry.finished;
+	uint64_t total_dropped = registry.dropped;
+	for (size_t i = 0; i < registry.threads.size(); i++)
+		registry.threads[i]->Collect(profiles, total_dropped);
+	if (dropped != NULL)
+		*dropped = total_dropped;
+	return profiles;
+}
+
+// Print profiles of all key defs, one key def per line.
+inline void
+tuple_compare_profile_print(std::ostream &out)
+{
+	static const char *const type_names[] = {
+		"uint", "string", "integer", "double", "number", "boolean",
+		"binary", "undefined",
+	};
+	uint64_t dropped;
+	std::vector<KeyDefProfile> profiles =
+		tuple_compare_profile_snapshot(&dropped);
+	for (size_t i = 0; i < profiles.size(); i++) {
+		const KeyDefProfile &p = profiles[i];
+		out << "profile";
+		for (size_t j = 0; j < p.part_count; j++)
+			out << (j == 0 ? " " : ",")
+			    << type_names[p.parts[j].field_type] << "@"
+			    << p.parts[j].field_no
+			    << (p.parts[j].is_nullable ? "?" : "")
+			    << (p.parts[j].collation != NULL ? "+coll" : "");
+		out << (p.use_hint ? " hinted" : "")
+		    << (p.use_branchless ? " branchless" : "")
+		    << (p.is_compiled ? " compiled" : " specialized")
+		    << " compares " << p.compares << " samples " << p.samples;
+		if (p.samples == 0) {
+			out << std::endl;
+			continue;
+		}
+		out << " ticks/compare " << (double)p.sample_ticks / p.samples
+		    << " decided by";
+		if (p.use_hint)
+			out << " hint " << 100.0 * p.decided_by_hint / p.samples
+			    << "%";
+		for (size_t j = 0; j < p.part_count; j++)
+			out << " part" << j << " "
+			    << 100.0 * p.decided_by_part[j] / p.samples << "%";
+		out << " equal "
+		    << 100.0 * p.decided_by_part[p.part_count] / p.samples
+		    << "%" << std::endl;
+	}
+	if (dropped != 0)
+		out << "profile dropped compares " << dropped << std::endl;
+}
+
+#endif // TUPLE_COMPARE_PROFILE
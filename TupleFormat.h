@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Tuple format is common for many tuples and declares which fields
+ * have offsets stored in tuple and where (in which slot) they are stored.
+ * Only fields that are used by keys need offsets, so usually the format
+ * is built from all key defs of a space, see tuple_format_new in KeyDef.h.
+ * The first field is always found by first_field_offset of tuple (slot 0),
+ * other slots start from 1 and are stored in tuple data, see Tuple.
+ * A field without offset is found by skipping fields (see mp_skip_n)
+ * starting from the nearest previous field that has an offset.
+ * Tuple refers to its format by id, see tuple_format_by_id.
+ */
+
+// Maximal number of fields that can have offsets.
+const size_t MAX_TUPLE_FORMAT_FIELDS = 256;
+// Maximal number of registered formats.
+const size_t MAX_TUPLE_FORMATS = 1024;
+
+struct TupleFormat {
+	// Slot of a field that has no offset.
+	static const int32_t NO_SLOT = -1;
+
+	// Id of the format, see tuple_format_by_id.
+	uint16_t id;
+	// Number of fields that are described by the format,
+	// fields with greater numbers have no offsets.
+	uint32_t field_count;
+	// Number of offsets stored in tuple data (slot 0 is not counted).
+	uint32_t slot_count;
+	// Offset slot of every field or NO_SLOT.
+	int32_t offset_slot[MAX_TUPLE_FORMAT_FIELDS];
+	// The nearest field, not greater than the given one, that has an offset.
+	uint32_t nearest_field[MAX_TUPLE_FORMAT_FIELDS];
+
+	// Offset slot of the field or NO_SLOT.
+	int32_t get_slot(size_t field_no) const
+	{
+		if (field_no >= field_count)
+			return NO_SLOT;
+		return offset_slot[field_no];
+	}
+
+	// The nearest field, not greater than field_no, that has an offset.
+	size_t get_nearest_field(size_t field_no) const
+	{
+		if (field_no >= field_count)
+			return nearest_field[field_count - 1];
+		return nearest_field[field_no];
+	}
+};
+
+// Registry of formats, indexed by format id.
+inline TupleFormat **
+tuple_formats()
+{
+	static TupleFormat *formats[MAX_TUPLE_FORMATS];
+	return formats;
+}
+
+inline const TupleFormat *
+tuple_format_by_id(uint16_t id)
+{
+	assert(id < MAX_TUPLE_FORMATS && tuple_formats()[id] != NULL);
+	return tuple_formats()[id];
+}
+
+/**
+ * Create and register a format, with offsets for given fields.
+ * Return NULL if there's no room in registry.
+ */
+inline TupleFormat *
+tuple_format_register(const size_t *fields, size_t count)
+{
+	TupleFormat **formats = tuple_formats();
+	size_t id = 0;
+	while (id < MAX_TUPLE_FORMATS && formats[id] != NULL)
+		id++;
+	if (id == MAX_TUPLE_FORMATS)
+		return NULL;
+
+	TupleFormat *format = new TupleFormat;
+	format->id = id;
+	// The first field is always there.
+	format->field_count = 1;
+	for (size_t i = 0; i < MAX_TUPLE_FORMAT_FIELDS; i++)
+		format->offset_slot[i] = TupleFormat::NO_SLOT;
+	format->offset_slot[0] = 0;
+	for (size_t i = 0; i < count; i++) {
+		assert(fields[i] < MAX_TUPLE_FORMAT_FIELDS);
+		if (fields[i] >= format->field_count)
+			format->field_count = fields[i] + 1;
+		format->offset_slot[fields[i]] = 0;
+	}
+	// Slots are given in order of fields.
+	format->slot_count = 0;
+	for (size_t i = 1; i < format->field_count; i++)
+		if (format->offset_slot[i] == 0)
+			format->offset_slot[i] = ++format->slot_count;
+	for (size_t i = 0; i < format->field_count; i++) {
+		bool has_offset = format->offset_slot[i] != TupleFormat::NO_SLOT;
+		format->nearest_field[i] =
+			has_offset ? i : format->nearest_field[i - 1];
+	}
+	formats[id] = format;
+	return format;
+}
+
+// Unregister and delete the format. There must be no tuples of it, and
+// no key defs compiled for it (see key_def_set_compiled).
+inline void
+tuple_format_delete(TupleFormat *format)
+{
+	assert(tuple_formats()[format->id] == format);
+	tuple_formats()[format->id] = NULL;
+	delete format;
+}
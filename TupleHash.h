@@ -0,0 +1,141 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+#include <KeyDef.h>
+#include <MsgPack.h>
+#include <Tuple.h>
+#include <TupleCompare.h>
+
+/**
+ * Specialized tuple hash functions, generated in the same way as
+ * specialized comparators (see TupleCompare.h): part types, sequential
+ * flag and width of field offsets are resolved in compile time.
+ * They give exactly the same hashes as default_tuple_hash.
+ * Only uint and string parts are specialized, that are the most common
+ * in hash indexes; key defs with other parts use default_tuple_hash.
+ */
+
+/**
+ * Hash parts starting from part number PART_NO, TYPES are the types of
+ * the rest of parts, see TupleCompareParts about IS_SEQUENTIAL.
+ * OFFSET_T is the type of field offsets of the tuple.
+ */
+template <bool IS_SEQUENTIAL, size_t PART_NO, class OFFSET_T,
+	  KeyDef::field_type_t... TYPES>
+struct TupleHashParts;
+
+template <bool IS_SEQUENTIAL, size_t PART_NO, class OFFSET_T>
+struct TupleHashParts<IS_SEQUENTIAL, PART_NO, OFFSET_T> {
+	static uint64_t hash(KeyDef *, Tuple *, const char *&, uint64_t seed)
+	{
+		return seed;
+	}
+};
+
+template <bool IS_SEQUENTIAL, size_t PART_NO, class OFFSET_T,
+	  KeyDef::field_type_t TYPE, KeyDef::field_type_t... TYPES>
+struct TupleHashParts<IS_SEQUENTIAL, PART_NO, OFFSET_T, TYPE, TYPES...> {
+	static uint64_t hash(KeyDef *def, Tuple *tuple, const char *&field,
+			     uint64_t seed)
+	{
+		if (!IS_SEQUENTIAL || PART_NO == 0) {
+			size_t field_no = def->parts[PART_NO].field_no;
+			field = tuple->get_field<OFFSET_T>(field_no);
+		}
+		// The switch of field_hash is resolved by the compiler.
+		seed = field_hash(TYPE, field, seed);
+		typedef TupleHashParts<IS_SEQUENTIAL, PART_NO + 1, OFFSET_T,
+				       TYPES...> next_t;
+		return next_t::hash(def, tuple, field, seed);
+	}
+};
+
+// Hash function of tuples by key def with given part types.
+template <bool IS_SEQUENTIAL, KeyDef::field_type_t... TYPES>
+struct TupleHash {
+	template <class OFFSET_T>
+	static uint64_t hash_offsets(KeyDef *def, Tuple *tuple)
+	{
+		const char *field;
+		typedef TupleHashParts<IS_SEQUENTIAL, 0, OFFSET_T,
+				       TYPES...> parts_t;
+		return parts_t::hash(def, tuple, field, 0);
+	}
+
+	static uint64_t hash(KeyDef *def, Tuple *tuple)
+	{
+		assert(def->part_count == sizeof...(TYPES));
+		switch (tuple->offset_width_log) {
+			case 0:
+				return hash_offsets<uint8_t>(def, tuple);
+			case 1:
+				return hash_offsets<uint16_t>(def, tuple);
+			default:
+				return hash_offsets<uint32_t>(def, tuple);
+		}
+	}
+};
+
+/**
+ * Find specialized hash function for key def parts and set it to key def,
+ * like TupleCompareSelector. Return false if there is no one.
+ */
+template <size_t PARTS_LEFT, bool IS_SEQUENTIAL, KeyDef::field_type_t... TYPES>
+struct TupleHashSelector {
+	static bool select(KeyDef *def, size_t part_no)
+	{
+		if (part_no == def->part_count) {
+			def->tuple_hash_f = TupleHash<IS_SEQUENTIAL, TYPES...>::hash;
+			return true;
+		}
+		if (def->parts[part_no].is_nullable ||
+		    def->parts[part_no].collation != NULL)
+			return false;
+		switch (def->parts[part_no].field_type) {
+			case KeyDef::UINT:
+				return TupleHashSelector<PARTS_LEFT - 1,
+					IS_SEQUENTIAL, TYPES..., KeyDef::UINT>
+					::select(def, part_no + 1);
+			case KeyDef::STRING:
+				return TupleHashSelector<PARTS_LEFT - 1,
+					IS_SEQUENTIAL, TYPES..., KeyDef::STRING>
+					::select(def, part_no + 1);
+			default:
+				return false;
+		}
+	}
+};
+
+template <bool IS_SEQUENTIAL, KeyDef::field_type_t... TYPES>
+struct TupleHashSelector<0, IS_SEQUENTIAL, TYPES...> {
+	static bool select(KeyDef *def, size_t part_no)
+	{
+		if (part_no != def->part_count)
+			return false;
+		def->tuple_hash_f = TupleHash<IS_SEQUENTIAL, TYPES...>::hash;
+		return true;
+	}
+};
+
+/**
+ * Set the best hash function for the key def.
+ * Fall back to default_tuple_hash if there is no specialized one.
+ */
+inline void
+key_def_set_hash_func(KeyDef *def)
+{
+	assert(def->part_count > 0);
+	bool found = false;
+	if (def->part_count <= MAX_SPECIALIZED_PART_COUNT) {
+		const size_t max = MAX_SPECIALIZED_PART_COUNT;
+		if (key_def_is_sequential(def))
+			found = TupleHashSelector<max, true>::select(def, 0);
+		else
+			found = TupleHashSelector<max, false>::select(def, 0);
+	}
+	if (!found)
+		def->tuple_hash_f = default_tuple_hash;
+}
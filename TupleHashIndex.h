@@ -0,0 +1,185 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <KeyDef.h>
+#include <Tuple.h>
+
+/**
+ * Hash index of tuples by a key def, with unique keys.
+ * Open addressing with linear probing: every slot is a tuple pointer with
+ * the hash of the tuple (see tuple_hash_f), so probes compare hashes
+ * and tuples are compared only if the whole 64-bit hashes are equal.
+ * The capacity is a power of two and is doubled when the load factor
+ * exceeds TUPLE_HASH_MAX_LOAD. Deletion shifts the following entries
+ * back instead of leaving tombstones, so probe sequences stay short.
+ */
+
+const size_t TUPLE_HASH_MIN_CAPACITY = 16;
+// Maximal load factor is TUPLE_HASH_MAX_LOAD / 4.
+const size_t TUPLE_HASH_MAX_LOAD = 3;
+
+class CTupleHashIndex
+{
+public:
+	struct Entry {
+		uint64_t hash;
+		// NULL in empty slot.
+		Tuple *tuple;
+	};
+
+	/**
+	 * tuple_hash_f, tuple_compare_f and tuple_compare_with_key_f of
+	 * the key def must be set.
+	 */
+	explicit CTupleHashIndex(KeyDef *def)
+		: m_def(def), m_size(0)
+	{
+		Clear();
+	}
+
+	CTupleHashIndex(const CTupleHashIndex&) = delete;
+	CTupleHashIndex& operator=(const CTupleHashIndex&) = delete;
+
+	// Remove all the tuples.
+	void Clear()
+	{
+		std::vector<Entry> entries(TUPLE_HASH_MIN_CAPACITY);
+		m_entries.swap(entries);
+		m_mask = TUPLE_HASH_MIN_CAPACITY - 1;
+		m_size = 0;
+	}
+
+	size_t Size() const
+	{
+		return m_size;
+	}
+
+	size_t Capacity() const
+	{
+		return m_entries.size();
+	}
+
+	// Reserve capacity for count tuples without resizes.
+	void Reserve(size_t count)
+	{
+		size_t capacity = m_entries.size();
+		while (count * 4 > capacity * TUPLE_HASH_MAX_LOAD)
+			capacity *= 2;
+		if (capacity != m_entries.size())
+			Resize(capacity);
+	}
+
+	/**
+	 * Insert the tuple. If there's a tuple with equal key, it's
+	 * replaced and returned, otherwise NULL is returned.
+	 */
+	Tuple *Replace(Tuple *tuple)
+	{
+		uint64_t hash = m_def->tuple_hash_f(m_def, tuple);
+		size_t i = hash & m_mask;
+		for (; m_entries[i].tuple != NULL; i = (i + 1) & m_mask) {
+			Entry *entry = &m_entries[i];
+			if (entry->hash == hash &&
+			    m_def->tuple_compare_f(m_def, entry->tuple,
+						   tuple) == 0) {
+				Tuple *old = entry->tuple;
+				entry->tuple = tuple;
+				return old;
+			}
+		}
+		m_entries[i].hash = hash;
+		m_entries[i].tuple = tuple;
+		if (++m_size * 4 > m_entries.size() * TUPLE_HASH_MAX_LOAD)
+			Resize(m_entries.size() * 2);
+		return NULL;
+	}
+
+	/**
+	 * Find the tuple by full key - msgpack array of all part values.
+	 * Return NULL if there's no one.
+	 */
+	Tuple *Find(const char *key) const
+	{
+		size_t i = Lookup(key);
+		return m_entries[i].tuple;
+	}
+
+	/**
+	 * Delete the tuple by full key. Return the deleted tuple or NULL
+	 * if there's no one.
+	 */
+	Tuple *Delete(const char *key)
+	{
+		size_t i = Lookup(key);
+		Tuple *old = m_entries[i].tuple;
+		if (old == NULL)
+			return NULL;
+		/*
+		 * Shift back the following entries of the cluster that
+		 * can't be found if the slot becomes empty: those whose
+		 * home slot is not in the cyclic range (i, j].
+		 */
+		for (size_t j = (i + 1) & m_mask; m_entries[j].tuple != NULL;
+		     j = (j + 1) & m_mask) {
+			size_t home = m_entries[j].hash & m_mask;
+			if (((j - home) & m_mask) >= ((j - i) & m_mask)) {
+				m_entries[i] = m_entries[j];
+				i = j;
+			}
+		}
+		m_entries[i].tuple = NULL;
+		m_size--;
+		return old;
+	}
+
+	// All the slots, empty ones have NULL tuple.
+	const Entry *Entries() const
+	{
+		return m_entries.data();
+	}
+
+private:
+	KeyDef *m_def;
+	std::vector<Entry> m_entries;
+	size_t m_mask;
+	size_t m_size;
+
+	// Slot of the tuple equal to the key, or the empty slot.
+	size_t Lookup(const char *key) const
+	{
+		uint64_t hash = key_hash(m_def, key);
+		const char *parts = key;
+		uint32_t part_count = mp_decode_array(parts);
+		size_t i = hash & m_mask;
+		for (; m_entries[i].tuple != NULL; i = (i + 1) & m_mask) {
+			const Entry *entry = &m_entries[i];
+			if (entry->hash == hash &&
+			    m_def->tuple_compare_with_key_f(m_def, entry->tuple,
+							    parts,
+							    part_count) == 0)
+				break;
+		}
+		return i;
+	}
+
+	void Resize(size_t capacity)
+	{
+		std::vector<Entry> entries(capacity);
+		size_t mask = capacity - 1;
+		for (size_t i = 0; i < m_entries.size(); i++) {
+			const Entry &entry = m_entries[i];
+			if (entry.tuple == NULL)
+				continue;
+			size_t j = entry.hash & mask;
+			while (entries[j].tuple != NULL)
+				j = (j + 1) & mask;
+			entries[j] = entry;
+		}
+		m_entries.swap(entries);
+		m_mask = mask;
+	}
+};
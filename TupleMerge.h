@@ -0,0 +1,215 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <KeyDef.h>
+#include <Tuple.h>
+#include <TupleRun.h>
+
+/**
+ * K-way merge of sorted tuple sources with a loser tree (tournament tree).
+ * Leaves of the tree are sources, every inner node keeps the source that
+ * lost the match in the node, and the winner of the whole tree is the
+ * least tuple. When the winner is taken, its source is advanced and only
+ * the matches on the path from its leaf to the root are replayed, so it
+ * takes exactly log2(k) comparisons per tuple, unlike a binary heap that
+ * takes up to 2 * log2(k).
+ * The current hint of every source is cached in the tree, so most matches
+ * are decided without touching tuples, that are scattered in memory.
+ * The hint is the tuple hint (see tuple_hint) if the key def uses hints,
+ * or the normalized key prefix if all sources are runs with prefixes.
+ */
+
+// Sorted source of tuples: in-memory array or memory mapped run.
+struct TupleMergeSource {
+	// Tuples of array source, NULL for run source.
+	Tuple **tuples;
+	// Run of run source, NULL for array source.
+	const CTupleRun *run;
+	size_t count;
+
+	Tuple *get(size_t i) const
+	{
+		return tuples != NULL ? tuples[i] : run->Get(i);
+	}
+};
+
+inline TupleMergeSource
+tuple_merge_source_array(Tuple **tuples, size_t count)
+{
+	TupleMergeSource source;
+	source.tuples = tuples;
+	source.run = NULL;
+	source.count = count;
+	return source;
+}
+
+inline TupleMergeSource
+tuple_merge_source_run(const CTupleRun *run)
+{
+	TupleMergeSource source;
+	source.tuples = NULL;
+	source.run = run;
+	source.count = run->Count();
+	return source;
+}
+
+class CTupleMerge
+{
+public:
+	/**
+	 * Merge the sources, they must be sorted by the key def.
+	 * tuple_compare_f of the key def must be set.
+	 */
+	CTupleMerge(KeyDef *def, const TupleMergeSource *sources, size_t count)
+		: m_def(def), m_compare(def->tuple_compare_f),
+		  m_sources(sources, sources + count), m_hintKind(NO_HINT)
+	{
+		if (def->use_hint)
+			m_hintKind = TUPLE_HINT;
+		bool all_prefixed = count != 0;
+		for (size_t i = 0; i < count; i++)
+			all_prefixed = all_prefixed && sources[i].run != NULL &&
+				       sources[i].run->PrefixSize() != 0;
+		if (all_prefixed)
+			m_hintKind = PREFIX_HINT;
+
+		m_leafCount = 1;
+		while (m_leafCount < count)
+			m_leafCount *= 2;
+		m_leaves.resize(m_leafCount);
+		for (size_t i = 0; i < m_leafCount; i++) {
+			m_leaves[i].pos = 0;
+			if (i < count)
+				Load(i);
+			else
+				m_leaves[i].tuple = NULL;
+		}
+		// Play the initial tournament bottom up: winners[n] is the
+		// winner of node n, the loser stays in the node.
+		m_tree.resize(m_leafCount);
+		std::vector<size_t> winners(2 * m_leafCount);
+		for (size_t i = 0; i < m_leafCount; i++)
+			winners[m_leafCount + i] = i;
+		for (size_t n = m_leafCount - 1; n >= 1; n--) {
+			size_t a = winners[2 * n];
+			size_t b = winners[2 * n + 1];
+			bool a_wins = Wins(a, b);
+			winners[n] = a_wins ? a : b;
+			m_tree[n] = a_wins ? b : a;
+		}
+		m_tree[0] = m_leafCount > 1 ? winners[1] : 0;
+	}
+
+	CTupleMerge(const CTupleMerge&) = delete;
+	CTupleMerge& operator=(const CTupleMerge&) = delete;
+
+	// The least tuple of all sources, NULL if all of them are over.
+	Tuple *Top() const
+	{
+		return m_leaves[m_tree[0]].tuple;
+	}
+
+	// Source of the top tuple and the position of it in the source.
+	size_t TopSource() const
+	{
+		return m_tree[0];
+	}
+
+	size_t TopPos() const
+	{
+		return m_leaves[m_tree[0]].pos;
+	}
+
+	// Take the top tuple and find the next one.
+	void Pop()
+	{
+		size_t winner = m_tree[0];
+		assert(m_leaves[winner].tuple != NULL);
+		m_leaves[winner].pos++;
+		Load(winner);
+		for (size_t n = (m_leafCount + winner) / 2; n >= 1; n /= 2) {
+			if (Wins(m_tree[n], winner)) {
+				size_t loser = winner;
+				winner = m_tree[n];
+				m_tree[n] = loser;
+			}
+		}
+		m_tree[0] = winner;
+	}
+
+	// Take the top tuple and return it, NULL if all sources are over.
+	Tuple *Next()
+	{
+		Tuple *tuple = Top();
+		if (tuple != NULL)
+			Pop();
+		return tuple;
+	}
+
+private:
+	enum hint_kind_t {
+		NO_HINT,
+		TUPLE_HINT,
+		PREFIX_HINT,
+	};
+
+	struct Leaf {
+		// Current tuple of the source, NULL if the source is over.
+		Tuple *tuple;
+		Tuple::hint_t hint;
+		size_t pos;
+	};
+
+	KeyDef *m_def;
+	KeyDef::tuple_compare_t m_compare;
+	std::vector<TupleMergeSource> m_sources;
+	hint_kind_t m_hintKind;
+	size_t m_leafCount;
+	std::vector<Leaf> m_leaves;
+	// m_tree[0] is the winner, other nodes keep losers of their matches.
+	std::vector<size_t> m_tree;
+
+	// Load the current tuple of the source to its leaf.
+	void Load(size_t i)
+	{
+		Leaf *leaf = &m_leaves[i];
+		const TupleMergeSource *source = &m_sources[i];
+		if (leaf->pos == source->count) {
+			leaf->tuple = NULL;
+			return;
+		}
+		leaf->tuple = source->get(leaf->pos);
+		if (m_hintKind == TUPLE_HINT) {
+			leaf->hint = leaf->tuple->hint;
+		} else if (m_hintKind == PREFIX_HINT) {
+			// The first bytes of normalized key, big-endian.
+			const CTupleRun *run = source->run;
+			const char *prefix = run->Prefix(leaf->pos);
+			size_t size = run->PrefixSize() < sizeof(Tuple::hint_t) ?
+				      run->PrefixSize() : sizeof(Tuple::hint_t);
+			leaf->hint = 0;
+			for (size_t k = 0; k < size; k++)
+				leaf->hint |= (Tuple::hint_t)(uint8_t)prefix[k]
+					      << (56 - 8 * k);
+		}
+	}
+
+	// Whether source a goes before source b. Ties are given to the source
+	// with the least number, that makes the merge stable.
+	bool Wins(size_t a, size_t b) const
+	{
+		const Leaf *leaf_a = &m_leaves[a];
+		const Leaf *leaf_b = &m_leaves[b];
+		if (leaf_a->tuple == NULL || leaf_b->tuple == NULL)
+			return leaf_b->tuple == NULL &&
+			       (leaf_a->tuple != NULL || a < b);
+		if (m_hintKind != NO_HINT && leaf_a->hint != leaf_b->hint)
+			return leaf_a->hint < leaf_b->hint;
+		int r = m_compare(m_def, leaf_a->tuple, leaf_b->tuple);
+		return r < 0 || (r == 0 && a < b);
+	}
+};
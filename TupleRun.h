@@ -0,0 +1,439 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <KeyDef.h>
+#include <MappedFile.h>
+#include <MsgPackCheck.h>
+#include <NormalizedKey.h>
+#include <Tuple.h>
+#include <TupleFormat.h>
+
+/**
+ * Run is a file of tuples sorted by a key def, for example a piece of
+ * external sort (see TupleSortExternal.h) or an index snapshot.
+ * The file is read through memory mapping (see CTupleRun), and tuples are
+ * stored with their Tuple layout, so mapped tuples are compared directly
+ * by key def comparators, without deserialization.
+ * Here is the layout of file, every section is aligned to 8 bytes:
+ *
+ * [header][tuples][tuple offsets][prefixes][block index][block keys]
+ *
+ * Tuples follow the header one after another, each padded to 8 bytes.
+ * Tuple offsets are uint64_t offsets of tuples in the file.
+ * Prefixes are optional: the first prefix_size bytes of normalized key of
+ * every tuple (see NormalizedKey.h), padded with zeros. If prefixes of
+ * two tuples differ they give the order of tuples, otherwise the tuples
+ * must be compared.
+ * Tuples are grouped in blocks of about TUPLE_RUN_BLOCK_SIZE bytes; the
+ * block index is sparse, it has the number of the first tuple of block and
+ * its key (see tuple_extract_key), so a key is looked up in the compact
+ * index first and then only in tuples of one block.
+ * Tuples refer to their format by id (see tuple_format_by_id), so a run
+ * is read by the process that has the same formats as the writer.
+ * A mapped run is checked on open: sections, tuples and block keys must
+ * be within the file, fields of tuples are trusted.
+ */
+
+const uint32_t TUPLE_RUN_MAGIC = 0x4e555254;
+const uint32_t TUPLE_RUN_VERSION = 1;
+// Approximate size of tuples of one block of block index.
+const size_t TUPLE_RUN_BLOCK_SIZE = 4096;
+// Alignment of tuples and sections of the file.
+const size_t TUPLE_RUN_ALIGN = 8;
+
+struct TupleRunHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t tuple_count;
+	uint64_t block_count;
+	// Offsets of sections in the file.
+	uint64_t offsets_offset;
+	uint64_t prefixes_offset;
+	uint64_t blocks_offset;
+	// Size of normalized key prefix of every tuple, zero if there are none.
+	uint32_t prefix_size;
+	// Format of all tuples of the run.
+	uint16_t format_id;
+	uint16_t reserved;
+};
+
+struct TupleRunBlock {
+	// Number of the first tuple of the block.
+	uint64_t first_tuple;
+	// Offset of the key of the first tuple in the file.
+	uint64_t key_offset;
+};
+
+static_assert(sizeof(TupleRunHeader) % TUPLE_RUN_ALIGN == 0,
+	      "Tuples must be aligned after the header");
+
+/**
+ * Writer of a run. Tuples must be added in order of the key def.
+ * Tuple offsets, prefixes and block index are kept in memory until
+ * Finish, that writes them after the tuples.
+ */
+class CTupleRunWriter
+{
+public:
+	// Write prefixes of prefixSize bytes if it's not zero.
+	CTupleRunWriter(KeyDef *def, size_t prefixSize = 0)
+		: m_def(def), m_prefixSize(prefixSize), m_file(NULL),
+		  m_failed(false), m_offset(0), m_blockEnd(0)
+	{
+	}
+
+	~CTupleRunWriter()
+	{
+		if (m_file != NULL)
+			fclose(m_file);
+	}
+
+	CTupleRunWriter(const CTupleRunWriter&) = delete;
+	CTupleRunWriter& operator=(const CTupleRunWriter&) = delete;
+
+	// Create the file, return false on error.
+	bool Open(const char *path)
+	{
+		assert(m_file == NULL);
+		m_file = fopen(path, "wb");
+		if (m_file == NULL)
+			return false;
+		m_failed = false;
+		m_offset = 0;
+		m_blockEnd = 0;
+		m_offsets.clear();
+		m_prefixes.clear();
+		m_blocks.clear();
+		m_keys.clear();
+		memset(&m_header, 0, sizeof(m_header));
+		// The header is rewritten in Finish.
+		Write(&m_header, sizeof(m_header));
+		return !m_failed;
+	}
+
+	/**
+	 * Append the tuple. The prefix of the tuple is given if it's known
+	 * (for example copied from other run), otherwise it's calculated.
+	 */
+	void Add(Tuple *tuple, const char *prefix = NULL)
+	{
+		if (m_offsets.empty())
+			m_header.format_id = tuple->format_id;
+		assert(tuple->format_id == m_header.format_id);
+		if (m_offset >= m_blockEnd) {
+			TupleRunBlock block;
+			block.first_tuple = m_offsets.size();
+			block.key_offset = m_keys.size();
+			m_blocks.push_back(block);
+			size_t key_size = m_keys.size();
+			m_keys.resize(key_size + tuple->data_used + 5);
+			char *key = m_keys.data() + key_size;
+			tuple_extract_key(m_def, tuple, key);
+			m_keys.resize(key - m_keys.data());
+			m_blockEnd = m_offset + TUPLE_RUN_BLOCK_SIZE;
+		}
+		if (m_prefixSize != 0)
+			AddPrefix(tuple, prefix);
+		m_offsets.push_back(m_offset);
+		Write(tuple, tuple->size());
+		Pad();
+	}
+
+	// Write the sections and the header and close the file.
+	bool Finish()
+	{
+		assert(m_file != NULL);
+		m_header.magic = TUPLE_RUN_MAGIC;
+		m_header.version = TUPLE_RUN_VERSION;
+		m_header.tuple_count = m_offsets.size();
+		m_header.block_count = m_blocks.size();
+		m_header.prefix_size = m_prefixSize;
+		m_header.offsets_offset = m_offset;
+		Write(m_offsets.data(), m_offsets.size() * sizeof(uint64_t));
+		m_header.prefixes_offset = m_offset;
+		Write(m_prefixes.data(), m_prefixes.size());
+		Pad();
+		m_header.blocks_offset = m_offset;
+		uint64_t keys_offset =
+			m_offset + m_blocks.size() * sizeof(TupleRunBlock);
+		for (size_t i = 0; i < m_blocks.size(); i++)
+			m_blocks[i].key_offset += keys_offset;
+		Write(m_blocks.data(), m_blocks.size() * sizeof(TupleRunBlock));
+		Write(m_keys.data(), m_keys.size());
+		if (fseek(m_file, 0, SEEK_SET) != 0)
+			m_failed = true;
+		Write(&m_header, sizeof(m_header));
+		if (fclose(m_file) != 0)
+			m_failed = true;
+		m_file = NULL;
+		return !m_failed;
+	}
+
+	// Number of added tuples.
+	size_t Count() const
+	{
+		return m_offsets.size();
+	}
+
+private:
+	KeyDef *m_def;
+	size_t m_prefixSize;
+	FILE *m_file;
+	bool m_failed;
+	TupleRunHeader m_header;
+	// Current size of the file.
+	uint64_t m_offset;
+	// Offset from which the next block starts.
+	uint64_t m_blockEnd;
+	std::vector<uint64_t> m_offsets;
+	std::vector<char> m_prefixes;
+	std::vector<TupleRunBlock> m_blocks;
+	// Keys of the first tuples of blocks, block key_offset is in it
+	// until Finish.
+	std::vector<char> m_keys;
+	// Buffer for normalized key.
+	std::vector<char> m_normalized;
+
+	void Write(const void *data, size_t size)
+	{
+		if (size != 0 && fwrite(data, 1, size, m_file) != size)
+			m_failed = true;
+		m_offset += size;
+	}
+
+	void Pad()
+	{
+		static const char zeros[TUPLE_RUN_ALIGN] = {0};
+		size_t tail = m_offset % TUPLE_RUN_ALIGN;
+		if (tail != 0)
+			Write(zeros, TUPLE_RUN_ALIGN - tail);
+	}
+
+	void AddPrefix(Tuple *tuple, const char *prefix)
+	{
+		size_t prefix_offset = m_prefixes.size();
+		m_prefixes.resize(prefix_offset + m_prefixSize);
+		char *out = m_prefixes.data() + prefix_offset;
+		if (prefix != NULL) {
+			memcpy(out, prefix, m_prefixSize);
+			return;
+		}
+		m_normalized.resize(key_def_normalized_size_max(m_def, tuple));
+		size_t size = key_def_extract_normalized(m_def, tuple,
+							 m_normalized.data());
+		if (size > m_prefixSize)
+			size = m_prefixSize;
+		memcpy(out, m_normalized.data(), size);
+		memset(out + size, 0, m_prefixSize - size);
+	}
+};
+
+/**
+ * Memory mapped run. Tuples are in mapped read only pages and must not
+ * be modified, they are valid until the run is closed.
+ */
+class CTupleRun
+{
+public:
+	CTupleRun() : m_header(NULL), m_offsets(NULL), m_blocks(NULL)
+	{
+	}
+
+	CTupleRun(const CTupleRun&) = delete;
+	CTupleRun& operator=(const CTupleRun&) = delete;
+
+	/**
+	 * Map the run file. Return false if the file can't be mapped,
+	 * is not a run, its tuple format is not registered, or tuples or
+	 * block keys are not within their sections.
+	 */
+	bool Open(const char *path)
+	{
+		Close();
+		if (!m_file.Open(path))
+			return false;
+		const char *data = m_file.Data();
+		size_t size = m_file.Size();
+		const TupleRunHeader *header = (const TupleRunHeader *)data;
+		if (size < sizeof(*header) ||
+		    header->magic != TUPLE_RUN_MAGIC ||
+		    header->version != TUPLE_RUN_VERSION ||
+		    header->offsets_offset < sizeof(*header) ||
+		    header->offsets_offset % TUPLE_RUN_ALIGN != 0 ||
+		    header->blocks_offset % TUPLE_RUN_ALIGN != 0 ||
+		    !SectionFits(header->offsets_offset,
+				 header->tuple_count, sizeof(uint64_t)) ||
+		    !SectionFits(header->prefixes_offset,
+				 header->tuple_count, header->prefix_size) ||
+		    !SectionFits(header->blocks_offset,
+				 header->block_count, sizeof(TupleRunBlock)) ||
+		    (header->tuple_count == 0) != (header->block_count == 0) ||
+		    (header->tuple_count != 0 &&
+		     (header->format_id >= MAX_TUPLE_FORMATS ||
+		      tuple_formats()[header->format_id] == NULL))) {
+			m_file.Close();
+			return false;
+		}
+		m_header = header;
+		m_offsets = (const uint64_t *)(data + header->offsets_offset);
+		m_blocks = (const TupleRunBlock *)(data + header->blocks_offset);
+		if (!TuplesFit() || !BlocksFit()) {
+			Close();
+			return false;
+		}
+		return true;
+	}
+
+	void Close()
+	{
+		m_file.Close();
+		m_header = NULL;
+		m_offsets = NULL;
+		m_blocks = NULL;
+	}
+
+	size_t Count() const
+	{
+		return m_header->tuple_count;
+	}
+
+	Tuple *Get(size_t i) const
+	{
+		assert(i < Count());
+		return (Tuple *)(m_file.Data() + m_offsets[i]);
+	}
+
+	// Size of normalized key prefix of tuples, zero if there are none.
+	size_t PrefixSize() const
+	{
+		return m_header->prefix_size;
+	}
+
+	const char *Prefix(size_t i) const
+	{
+		assert(i < Count() && PrefixSize() != 0);
+		return m_file.Data() + m_header->prefixes_offset +
+		       i * m_header->prefix_size;
+	}
+
+	/**
+	 * Number of the first tuple that is not less than the key (msgpack
+	 * array of part values, maybe partial), or Count() if there's none.
+	 * The run must be sorted by def.
+	 */
+	size_t LowerBound(KeyDef *def, const char *key) const
+	{
+		// The first block with the first key not less than the key.
+		size_t begin = 0;
+		size_t end = m_header->block_count;
+		while (begin < end) {
+			size_t mid = begin + (end - begin) / 2;
+			const char *block_key =
+				m_file.Data() + m_blocks[mid].key_offset;
+			if (key_compare(def, block_key, key) < 0)
+				begin = mid + 1;
+			else
+				end = mid;
+		}
+		// The tuple is after the first tuple of previous block
+		// and not after the first tuple of the found block.
+		if (begin == 0)
+			return 0;
+		size_t low = m_blocks[begin - 1].first_tuple + 1;
+		size_t high = begin < m_header->block_count ?
+			      m_blocks[begin].first_tuple : Count();
+		while (low < high) {
+			size_t mid = low + (high - low) / 2;
+			if (tuple_compare_with_key(def, Get(mid), key) < 0)
+				low = mid + 1;
+			else
+				high = mid;
+		}
+		return low;
+	}
+
+private:
+	CMappedFile m_file;
+	const TupleRunHeader *m_header;
+	const uint64_t *m_offsets;
+	const TupleRunBlock *m_blocks;
+
+	bool SectionFits(uint64_t offset, uint64_t count, uint64_t size) const
+	{
+		uint64_t file_size = m_file.Size();
+		return offset <= file_size &&
+		       (size == 0 || count <= (file_size - offset) / size);
+	}
+
+	/**
+	 * Every tuple is aligned within the tuples section, that is between
+	 * the header and tuple offsets, is of the format of the run and
+	 * has its offsets and the first field within its data.
+	 */
+	bool TuplesFit() const
+	{
+		const uint64_t begin = sizeof(TupleRunHeader);
+		const uint64_t end = m_header->offsets_offset;
+		const TupleFormat *format = NULL;
+		if (m_header->tuple_count != 0)
+			format = tuple_format_by_id(m_header->format_id);
+		for (size_t i = 0; i < m_header->tuple_count; i++) {
+			uint64_t offset = m_offsets[i];
+			if (offset < begin || offset % TUPLE_RUN_ALIGN != 0 ||
+			    offset > end || end - offset < sizeof(Tuple))
+				return false;
+			const Tuple *tuple = Get(i);
+			if (tuple->data_used > end - offset - sizeof(Tuple) ||
+			    tuple->format_id != m_header->format_id ||
+			    tuple->offset_width_log > 2)
+				return false;
+			uint64_t slots_size =
+				(uint64_t)format->slot_count <<
+				tuple->offset_width_log;
+			if (slots_size > tuple->first_field_offset ||
+			    tuple->first_field_offset > tuple->data_used)
+				return false;
+			for (size_t slot = 1; slot <= format->slot_count; slot++)
+				if (tuple->get_offset(slot) > tuple->data_used)
+					return false;
+		}
+		return true;
+	}
+
+	/**
+	 * Blocks start from the first tuple in order of tuples, and their
+	 * keys are msgpack arrays in the keys section after the blocks.
+	 */
+	bool BlocksFit() const
+	{
+		const char *data = m_file.Data();
+		const char *end = data + m_file.Size();
+		const uint64_t begin = m_header->blocks_offset +
+			m_header->block_count * sizeof(TupleRunBlock);
+		for (size_t i = 0; i < m_header->block_count; i++) {
+			const TupleRunBlock *block = &m_blocks[i];
+			if (block->first_tuple >= m_header->tuple_count ||
+			    (i == 0 && block->first_tuple != 0) ||
+			    (i != 0 &&
+			     block->first_tuple <= m_blocks[i - 1].first_tuple))
+				return false;
+			if (block->key_offset < begin ||
+			    block->key_offset >= m_file.Size())
+				return false;
+			const char *key = data + block->key_offset;
+			const char *parts = key;
+			uint32_t part_count;
+			if (mp_check_array(parts, end, part_count) !=
+			    MP_CHECK_OK ||
+			    mp_check(key, end) != MP_CHECK_OK)
+				return false;
+		}
+		return true;
+	}
+};
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <KeyDef.h>
+#include <MemCompare.h>
+#include <MsgPack.h>
+#include <NormalizedKey.h>
+#include <Tuple.h>
+
+/**
+ * Sort of tuples by key def. The algorithm is chosen by key def:
+ * - LSD radix sort by the value itself for a single not nullable uint part;
+ * - MSD radix sort by normalized keys (see NormalizedKey.h) otherwise;
+ * - comparison sort with tuple_compare_f of key def for small arrays.
+ */
+
+// Below this number of tuples comparison sort is used.
+const size_t TUPLE_SORT_RADIX_MIN = 256;
+// Buckets smaller than that are sorted by comparison in MSD radix sort.
+const size_t TUPLE_SORT_MSD_BUCKET_MIN = 32;
+
+// Sort with tuple_compare_f of key def.
+inline void
+tuple_sort_compare(KeyDef *def, Tuple **arr, size_t n)
+{
+	KeyDef::tuple_compare_t compare = def->tuple_compare_f;
+	std::sort(arr, arr + n, [def, compare](Tuple *a, Tuple *b) {
+		return compare(def, a, b) < 0;
+	});
+}
+
+struct TupleSortUintEntry {
+	uint64_t key;
+	Tuple *tuple;
+};
+
+// LSD radix sort by the only uint part, byte by byte.
+inline void
+tuple_sort_lsd_uint(KeyDef *def, Tuple **arr, size_t n)
+{
+	assert(def->part_count == 1 &&
+	       def->parts[0].field_type == KeyDef::UINT &&
+	       !def->parts[0].is_nullable);
+	std::vector<TupleSortUintEntry> entries(n);
+	std::vector<TupleSortUintEntry> tmp(n);
+	// Histograms of all the bytes are calculated in one pass.
+	size_t count[sizeof(uint64_t)][256] = {};
+	size_t field_no = def->parts[0].field_no;
+	for (size_t i = 0; i < n; i++) {
+		const char *field = arr[i]->get_field(field_no);
+		uint64_t key = mp_decode_uint(field);
+		entries[i].key = key;
+		entries[i].tuple = arr[i];
+		for (size_t b = 0; b < sizeof(uint64_t); b++)
+			count[b][(key >> (8 * b)) & 0xff]++;
+	}
+
+	TupleSortUintEntry *src = entries.data();
+	TupleSortUintEntry *dst = tmp.data();
+	for (size_t b = 0; b < sizeof(uint64_t); b++) {
+		size_t shift = 8 * b;
+		// Skip the pass if all the keys have the same byte.
+		if (count[b][(src[0].key >> shift) & 0xff] == n)
+			continue;
+		size_t pos[256];
+		size_t sum = 0;
+		for (size_t d = 0; d < 256; d++) {
+			pos[d] = sum;
+			sum += count[b][d];
+		}
+		for (size_t i = 0; i < n; i++)
+			dst[pos[(src[i].key >> shift) & 0xff]++] = src[i];
+		std::swap(src, dst);
+	}
+	for (size_t i = 0; i < n; i++)
+		arr[i] = src[i].tuple;
+}
+
+struct TupleSortKeyEntry {
+	const char *key;
+	size_t size;
+	Tuple *tuple;
+};
+
+// Bucket of the entry in MSD radix sort: 0 if the key is over.
+inline size_t
+tuple_sort_msd_bucket(const TupleSortKeyEntry &entry, size_t depth)
+{
+	return depth < entry.size ? (uint8_t)entry.key[depth] + 1 : 0;
+}
+
+// MSD radix sort of entries with equal first depth bytes of keys.
+inline void
+tuple_sort_msd(TupleSortKeyEntry *entries, TupleSortKeyEntry *tmp, size_t n,
+	       size_t depth)
+{
+	if (n < TUPLE_SORT_MSD_BUCKET_MIN) {
+		std::sort(entries, entries + n,
+			  [depth](const TupleSortKeyEntry &a,
+				  const TupleSortKeyEntry &b) {
+			return mem_compare(a.key + depth, a.size - depth,
+					   b.key + depth, b.size - depth) < 0;
+		});
+		return;
+	}
+	size_t count[257] = {};
+	for (size_t i = 0; i < n; i++)
+		count[tuple_sort_msd_bucket(entries[i], depth)]++;
+
+	size_t bucket = tuple_sort_msd_bucket(entries[0], depth);
+	if (count[bucket] == n) {
+		// Common byte, or all the keys are over and equal.
+		if (bucket != 0)
+			tuple_sort_msd(entries, tmp, n, depth + 1);
+		return;
+	}
+
+	size_t pos[257];
+	size_t sum = 0;
+	for (size_t d = 0; d < 257; d++) {
+		pos[d] = sum;
+		sum += count[d];
+	}
+	for (size_t i = 0; i < n; i++)
+		tmp[pos[tuple_sort_msd_bucket(entries[i], depth)]++] =
+			entries[i];
+	std::copy(tmp, tmp + n, entries);
+
+	// Bucket 0 contains equal keys that are over.
+	size_t start = count[0];
+	for (size_t d = 1; d < 257; d++) {
+		if (count[d] > 1)
+			tuple_sort_msd(entries + start, tmp + start, count[d],
+				       depth + 1);
+		start += count[d];
+	}
+}
+
+// MSD radix sort by normalized keys.
+inline void
+tuple_sort_msd_normalized(KeyDef *def, Tuple **arr, size_t n)
+{
+	size_t data_size = 0;
+	for (size_t i = 0; i < n; i++)
+		data_size += key_def_normalized_size_max(def, arr[i]);
+	std::vector<char> data(data_size);
+	std::vector<TupleSortKeyEntry> entries(n);
+	std::vector<TupleSortKeyEntry> tmp(n);
+	char *p = data.data();
+	for (size_t i = 0; i < n; i++) {
+		entries[i].key = p;
+		entries[i].size = key_def_extract_normalized(def, arr[i], p);
+		entries[i].tuple = arr[i];
+		p += entries[i].size;
+	}
+	tuple_sort_msd(entries.data(), tmp.data(), n, 0);
+	for (size_t i = 0; i < n; i++)
+		arr[i] = entries[i].tuple;
+}
+
+/**
+ * Sort tuples in ascending order by key def.
+ * tuple_compare_f of the key def must be set.
+ * The sort is not stable.
+ */
+inline void
+tuple_sort(KeyDef *def, Tuple **arr, size_t n)
+{
+	assert(def->part_count > 0);
+	if (n < TUPLE_SORT_RADIX_MIN)
+		tuple_sort_compare(def, arr, n);
+	else if (def->part_count == 1 &&
+		 def->parts[0].field_type == KeyDef::UINT &&
+		 !def->parts[0].is_nullable)
+		tuple_sort_lsd_uint(def, arr, n);
+	else
+		tuple_sort_msd_normalized(def, arr, n);
+}
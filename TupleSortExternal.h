@@ -0,0 +1,162 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <KeyDef.h>
+#include <Tuple.h>
+#include <TupleArena.h>
+#include <TupleMerge.h>
+#include <TupleRun.h>
+#include <TupleSort.h>
+
+/**
+ * External sort of tuples that don't fit in memory.
+ * Added tuples are copied to memory until the memory limit is reached,
+ * then they are sorted by tuple_sort and written to a temporary run
+ * (see TupleRun.h). Finally all the runs are mapped and merged into the
+ * output run with a loser tree (see CTupleMerge), comparing normalized
+ * key prefixes first if the runs have them and then tuples with
+ * tuple_compare_f of the key def.
+ */
+
+/**
+ * Merge sorted runs into out.
+ * tuple_compare_f of the key def must be set.
+ */
+inline void
+tuple_runs_merge(KeyDef *def, CTupleRun **runs, size_t count,
+		 CTupleRunWriter *out)
+{
+	std::vector<TupleMergeSource> sources(count);
+	for (size_t i = 0; i < count; i++)
+		sources[i] = tuple_merge_source_run(runs[i]);
+	size_t prefix_size = count != 0 ? runs[0]->PrefixSize() : 0;
+	CTupleMerge merge(def, sources.data(), count);
+	for (Tuple *tuple = merge.Top(); tuple != NULL; tuple = merge.Top()) {
+		const char *prefix = NULL;
+		if (prefix_size != 0)
+			prefix = runs[merge.TopSource()]->Prefix(merge.TopPos());
+		out->Add(tuple, prefix);
+		merge.Pop();
+	}
+}
+
+class CTupleSortExternal
+{
+public:
+	/**
+	 * Temporary runs are named tmpPrefix.N. Tuples are kept in
+	 * memory up to memoryLimit bytes. Runs have normalized key
+	 * prefixes of prefixSize bytes if it's not zero.
+	 * tuple_compare_f of the key def must be set.
+	 */
+	CTupleSortExternal(KeyDef *def, const char *tmpPrefix,
+			   size_t memoryLimit, size_t prefixSize = 0)
+		: m_def(def), m_tmpPrefix(tmpPrefix),
+		  m_memoryLimit(memoryLimit), m_prefixSize(prefixSize),
+		  m_failed(false)
+	{
+	}
+
+	~CTupleSortExternal()
+	{
+		RemoveRuns();
+	}
+
+	CTupleSortExternal(const CTupleSortExternal&) = delete;
+	CTupleSortExternal& operator=(const CTupleSortExternal&) = delete;
+
+	// Add a copy of the tuple. Return false if a run can't be written.
+	bool Add(const Tuple *tuple)
+	{
+		if (m_failed)
+			return false;
+		if (!m_tuples.empty() &&
+		    m_arena.Used() + tuple->size() > m_memoryLimit)
+			FlushRun();
+		m_tuples.push_back(tuple_new(&m_arena, tuple));
+		return !m_failed;
+	}
+
+	// Write all the tuples sorted to the run at path.
+	bool Finish(const char *path)
+	{
+		if (m_failed)
+			return false;
+		if (m_runPaths.empty()) {
+			// Everything fits in memory.
+			m_failed = !WriteRun(path);
+			return !m_failed;
+		}
+		FlushRun();
+		if (m_failed)
+			return false;
+
+		std::vector<CTupleRun> runs(m_runPaths.size());
+		std::vector<CTupleRun *> run_ptrs(m_runPaths.size());
+		for (size_t i = 0; i < m_runPaths.size(); i++) {
+			if (!runs[i].Open(m_runPaths[i].c_str()))
+				return false;
+			run_ptrs[i] = &runs[i];
+		}
+		CTupleRunWriter out(m_def, m_prefixSize);
+		if (!out.Open(path))
+			return false;
+		tuple_runs_merge(m_def, run_ptrs.data(), run_ptrs.size(), &out);
+		m_failed = !out.Finish();
+		runs.clear();
+		RemoveRuns();
+		return !m_failed;
+	}
+
+	// Number of temporary runs written so far.
+	size_t RunCount() const
+	{
+		return m_runPaths.size();
+	}
+
+private:
+	KeyDef *m_def;
+	std::string m_tmpPrefix;
+	size_t m_memoryLimit;
+	size_t m_prefixSize;
+	bool m_failed;
+	CTupleArena m_arena;
+	std::vector<Tuple *> m_tuples;
+	std::vector<std::string> m_runPaths;
+
+	// Sort tuples in memory, write them to path and free them.
+	bool WriteRun(const char *path)
+	{
+		tuple_sort(m_def, m_tuples.data(), m_tuples.size());
+		CTupleRunWriter writer(m_def, m_prefixSize);
+		bool ok = writer.Open(path);
+		if (ok) {
+			for (size_t i = 0; i < m_tuples.size(); i++)
+				writer.Add(m_tuples[i]);
+			ok = writer.Finish();
+		}
+		m_tuples.clear();
+		m_arena.Reset();
+		return ok;
+	}
+
+	void FlushRun()
+	{
+		std::string path = m_tmpPrefix + "." +
+				   std::to_string(m_runPaths.size());
+		m_runPaths.push_back(path);
+		if (!WriteRun(path.c_str()))
+			m_failed = true;
+	}
+
+	void RemoveRuns()
+	{
+		for (size_t i = 0; i < m_runPaths.size(); i++)
+			remove(m_runPaths[i].c_str());
+		m_runPaths.clear();
+	}
+};
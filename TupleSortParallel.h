@@ -0,0 +1,92 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <vector>
+
+#include <KeyDef.h>
+#include <ThreadPool.h>
+#include <Tuple.h>
+#include <TupleSort.h>
+
+/**
+ * Parallel sort of tuples by key def.
+ * The array is split into one chunk per pool thread, the chunks are
+ * sorted by tuple_sort in parallel, and then sorted chunks are merged
+ * pairwise with tuple_compare_f of the key def: every merge round
+ * halves the number of chunks, and merges of one round are parallel too.
+ */
+
+// Below this number of tuples per thread the sort is not parallel.
+const size_t TUPLE_SORT_PARALLEL_MIN = 4096;
+
+// Merge two adjacent sorted ranges [begin, mid) and [mid, end) to out.
+inline void
+tuple_merge(KeyDef *def, Tuple **begin, Tuple **mid, Tuple **end,
+	    Tuple **out)
+{
+	KeyDef::tuple_compare_t compare = def->tuple_compare_f;
+	std::merge(begin, mid, mid, end, out, [def, compare](Tuple *a, Tuple *b) {
+		return compare(def, a, b) < 0;
+	});
+}
+
+/**
+ * Sort tuples in ascending order by key def with threads of the pool.
+ * tuple_compare_f of the key def must be set.
+ */
+inline void
+tuple_sort_parallel(KeyDef *def, Tuple **arr, size_t n, CThreadPool *pool)
+{
+	size_t chunk_count = pool->Size();
+	if (chunk_count > n / TUPLE_SORT_PARALLEL_MIN)
+		chunk_count = n / TUPLE_SORT_PARALLEL_MIN;
+	if (chunk_count <= 1) {
+		tuple_sort(def, arr, n);
+		return;
+	}
+
+	// Chunk i is [bounds[i], bounds[i + 1]).
+	std::vector<size_t> bounds(chunk_count + 1);
+	for (size_t i = 0; i <= chunk_count; i++)
+		bounds[i] = n * i / chunk_count;
+	for (size_t i = 0; i < chunk_count; i++) {
+		Tuple **begin = arr + bounds[i];
+		size_t size = bounds[i + 1] - bounds[i];
+		pool->Submit([def, begin, size] {
+			tuple_sort(def, begin, size);
+		});
+	}
+	pool->Wait();
+
+	std::vector<Tuple *> tmp(n);
+	Tuple **src = arr;
+	Tuple **dst = tmp.data();
+	while (bounds.size() > 2) {
+		std::vector<size_t> next_bounds;
+		size_t i = 0;
+		for (; i + 2 < bounds.size(); i += 2) {
+			Tuple **begin = src + bounds[i];
+			Tuple **mid = src + bounds[i + 1];
+			Tuple **end = src + bounds[i + 2];
+			Tuple **out = dst + bounds[i];
+			pool->Submit([def, begin, mid, end, out] {
+				tuple_merge(def, begin, mid, end, out);
+			});
+			next_bounds.push_back(bounds[i]);
+		}
+		if (i + 1 < bounds.size()) {
+			// Odd chunk without a pair.
+			std::copy(src + bounds[i], src + bounds[i + 1],
+				  dst + bounds[i]);
+			next_bounds.push_back(bounds[i]);
+		}
+		next_bounds.push_back(n);
+		pool->Wait();
+		bounds.swap(next_bounds);
+		std::swap(src, dst);
+	}
+	if (src != arr)
+		std::copy(src, src + n, arr);
+}
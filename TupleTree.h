@@ -0,0 +1,251 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+
+#include <KeyDef.h>
+#include <Tuple.h>
+#include <TupleTreeBase.h>
+
+/**
+ * B+tree index of tuples ordered by a key def, with unique keys, see
+ * CTupleTreeBase for nodes and entries. Leaves are linked in a list for
+ * range scans.
+ */
+template <size_t NODE_SIZE = TUPLE_TREE_NODE_SIZE>
+class CTupleTree : public CTupleTreeBase<NODE_SIZE, true>
+{
+	typedef CTupleTreeBase<NODE_SIZE, true> Base;
+	typedef typename Base::Node Node;
+	typedef typename Base::Leaf Leaf;
+	typedef typename Base::Inner Inner;
+	typedef typename Base::KeySearch KeySearch;
+	typedef typename Base::TupleSearch TupleSearch;
+	typedef typename Base::Path Path;
+	using Base::LEAF_CAPACITY;
+	using Base::m_def;
+	using Base::m_size;
+	using Base::m_depth;
+	using Base::FreeNode;
+	using Base::FreeChunks;
+	using Base::NewLeaf;
+	using Base::MakeKeySearch;
+	using Base::BuildNodes;
+	using Base::Search;
+	using Base::Descend;
+	using Base::InsertEntry;
+	using Base::SplitLeaf;
+	using Base::FixSeparator;
+	using Base::RemoveLeaf;
+	using Base::InsertChild;
+
+public:
+	typedef typename Base::Entry Entry;
+
+	// Position in the leaf list, the end if leaf is NULL.
+	struct Iterator {
+		Leaf *leaf;
+		size_t pos;
+
+		bool is_end() const
+		{
+			return leaf == NULL;
+		}
+
+		Tuple *get() const
+		{
+			assert(!is_end());
+			return leaf->entries[pos].tuple;
+		}
+
+		void next()
+		{
+			assert(!is_end());
+			if (++pos == leaf->count) {
+				leaf = leaf->next;
+				pos = 0;
+			}
+		}
+	};
+
+	/**
+	 * tuple_compare_f and tuple_compare_with_key_f of the key def
+	 * must be set.
+	 */
+	explicit CTupleTree(KeyDef *def)
+		: Base(def), m_root(NULL), m_first(NULL)
+	{
+		Clear();
+	}
+
+	CTupleTree(const CTupleTree&) = delete;
+	CTupleTree& operator=(const CTupleTree&) = delete;
+
+	// Remove all the tuples.
+	void Clear()
+	{
+		FreeChunks();
+		m_root = m_first = NewLeaf();
+		m_size = 0;
+		m_depth = 0;
+	}
+
+	/**
+	 * Build the tree from tuples sorted by the key def without equal
+	 * keys. Leaves and inner nodes are filled up.
+	 */
+	void Build(Tuple **tuples, size_t count)
+	{
+		Clear();
+		if (count == 0)
+			return;
+		m_root = BuildNodes(tuples, count, m_first);
+		m_size = count;
+	}
+
+	/**
+	 * Insert the tuple. If there's a tuple with equal key, it's
+	 * replaced and returned, otherwise NULL is returned.
+	 */
+	Tuple *Replace(Tuple *tuple)
+	{
+		TupleSearch search = {m_def, tuple_hint(m_def, tuple), tuple};
+		Path path;
+		Leaf *leaf = Descend(m_root, search, true, &path);
+		size_t pos = Search(leaf->entries, leaf->count, search, false);
+		Entry entry = {search.hint, tuple};
+		if (pos < leaf->count && search(leaf->entries[pos]) == 0) {
+			Tuple *old = leaf->entries[pos].tuple;
+			leaf->entries[pos] = entry;
+			if (pos == 0)
+				FixSeparator(&path, path.depth, old, entry);
+			return old;
+		}
+		m_size++;
+		if (leaf->count < LEAF_CAPACITY) {
+			InsertEntry(leaf->entries, leaf->count, pos, entry);
+			leaf->count++;
+			return NULL;
+		}
+		Leaf *right = SplitLeaf(leaf, pos, entry);
+		right->next = leaf->next;
+		if (right->next != NULL)
+			right->next->prev = right;
+		right->prev = leaf;
+		leaf->next = right;
+		InsertChild(&path, right->entries[0], right, m_root);
+		return NULL;
+	}
+
+	/**
+	 * Delete the tuple with the full key (msgpack array of part values),
+	 * return it or NULL if there's none.
+	 */
+	Tuple *Delete(const char *key)
+	{
+		KeySearch search = MakeKeySearch(key);
+		assert(search.part_count == m_def->part_count);
+		Path path;
+		Leaf *leaf = Descend(m_root, search, true, &path);
+		size_t pos = Search(leaf->entries, leaf->count, search, false);
+		if (pos == leaf->count || search(leaf->entries[pos]) != 0)
+			return NULL;
+		Tuple *old = leaf->entries[pos].tuple;
+		std::copy(leaf->entries + pos + 1, leaf->entries + leaf->count,
+			  leaf->entries + pos);
+		leaf->count--;
+		m_size--;
+		if (leaf->count != 0) {
+			if (pos == 0)
+				FixSeparator(&path, path.depth, old,
+					     leaf->entries[0]);
+			return old;
+		}
+		if (path.depth == 0)
+			return old;
+		// Remove the empty leaf and inner nodes that become empty.
+		if (leaf->prev != NULL)
+			leaf->prev->next = leaf->next;
+		else
+			m_first = leaf->next;
+		if (leaf->next != NULL)
+			leaf->next->prev = leaf->prev;
+		FreeNode(leaf);
+		if (!RemoveLeaf(&path, old)) {
+			m_root = m_first = NewLeaf();
+			m_depth = 0;
+			return old;
+		}
+		// The root with one child is not needed.
+		while (!m_root->is_leaf && m_root->count == 0) {
+			Node *child = static_cast<Inner *>(m_root)->children[0];
+			FreeNode(m_root);
+			m_root = child;
+			m_depth--;
+		}
+		return old;
+	}
+
+	/**
+	 * Find the tuple by the full key (msgpack array of part values),
+	 * return NULL if there's none.
+	 */
+	Tuple *Find(const char *key) const
+	{
+		KeySearch search = MakeKeySearch(key);
+		assert(search.part_count == m_def->part_count);
+		Leaf *leaf = Descend(m_root, search, true, NULL);
+		size_t pos = Search(leaf->entries, leaf->count, search, false);
+		if (pos == leaf->count || search(leaf->entries[pos]) != 0)
+			return NULL;
+		return leaf->entries[pos].tuple;
+	}
+
+	Iterator Begin() const
+	{
+		return Normalize(m_first, 0);
+	}
+
+	// The first tuple not less than the key, that may be partial.
+	Iterator LowerBound(const char *key) const
+	{
+		return Bound(key, false);
+	}
+
+	// The first tuple greater than the key, that may be partial.
+	Iterator UpperBound(const char *key) const
+	{
+		return Bound(key, true);
+	}
+
+private:
+	Node *m_root;
+	Leaf *m_first;
+
+	static Iterator Normalize(Leaf *leaf, size_t pos)
+	{
+		Iterator it;
+		if (pos == leaf->count) {
+			leaf = leaf->next;
+			pos = 0;
+		}
+		it.leaf = leaf;
+		it.pos = pos;
+		return it;
+	}
+
+	Iterator Bound(const char *key, bool upper) const
+	{
+		const char *parts = key;
+		if (mp_decode_array(parts) == 0) {
+			// Empty key is equal to any tuple.
+			Iterator end = {NULL, 0};
+			return upper ? end : Begin();
+		}
+		KeySearch search = MakeKeySearch(key);
+		Leaf *leaf = Descend(m_root, search, upper, NULL);
+		size_t pos = Search(leaf->entries, leaf->count, search, upper);
+		return Normalize(leaf, pos);
+	}
+};
@@ -0,0 +1,514 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+#include <KeyDef.h>
+#include <Tuple.h>
+
+/**
+ * Nodes and algorithms of B+trees of tuples with unique keys, that are
+ * shared by CTupleTree and CTupleTreeConcurrent.
+ * Every entry of a node is a tuple pointer with the hint of the tuple
+ * (see tuple_hint), that is stored inline, so most of comparisons in node
+ * search are decided by hints without touching tuples; tuples are
+ * compared by tuple_compare_f or tuple_compare_with_key_f only if hints
+ * are equal. Hints are calculated by the tree, use_hint of the key
+ * def is not needed.
+ * Tuples are stored in leaves, that are linked in a list if IS_LINKED
+ * is set. Inner nodes store separators: separator i is the least entry
+ * of child i + 1, so a separator always points to a tuple that is in
+ * the tree.
+ * Nodes are NODE_SIZE bytes aligned to cache line: a few cache lines are
+ * good for lookups in memory, a page is good for scans and a big tree.
+ * Nodes are not merged on delete, only empty nodes are removed.
+ */
+
+const size_t TUPLE_TREE_NODE_SIZE = 512;
+const size_t TUPLE_TREE_CACHE_LINE = 64;
+// Nodes are allocated by chunks of this size.
+const size_t TUPLE_TREE_CHUNK_SIZE = 64 * 1024;
+const size_t TUPLE_TREE_MAX_DEPTH = 32;
+
+struct TupleTreeEntry {
+	Tuple::hint_t hint;
+	Tuple *tuple;
+};
+
+struct TupleTreeNode {
+	// Number of entries of leaf or separators of inner node.
+	uint32_t count;
+	bool is_leaf;
+};
+
+template <size_t NODE_SIZE, bool IS_LINKED>
+struct TupleTreeLeaf;
+
+// Leaf that is linked in the list of leaves for range scans.
+template <size_t NODE_SIZE>
+struct TupleTreeLeaf<NODE_SIZE, true> : TupleTreeNode {
+	static const size_t CAPACITY =
+		(NODE_SIZE - sizeof(TupleTreeNode) - 2 * sizeof(void *)) /
+		sizeof(TupleTreeEntry);
+
+	TupleTreeLeaf *prev;
+	TupleTreeLeaf *next;
+	TupleTreeEntry entries[CAPACITY];
+
+	void clear_links()
+	{
+		prev = NULL;
+		next = NULL;
+	}
+
+	// Link the new leaf after this one, that is the last in the list.
+	void link_next(TupleTreeLeaf *leaf)
+	{
+		next = leaf;
+		leaf->prev = this;
+	}
+};
+
+template <size_t NODE_SIZE>
+struct TupleTreeLeaf<NODE_SIZE, false> : TupleTreeNode {
+	static const size_t CAPACITY =
+		(NODE_SIZE - sizeof(TupleTreeNode)) / sizeof(TupleTreeEntry);
+
+	TupleTreeEntry entries[CAPACITY];
+
+	void clear_links()
+	{
+	}
+
+	void link_next(TupleTreeLeaf *)
+	{
+	}
+};
+
+template <size_t NODE_SIZE>
+struct TupleTreeInner : TupleTreeNode {
+	static const size_t CAPACITY =
+		(NODE_SIZE - sizeof(TupleTreeNode) - sizeof(TupleTreeNode *)) /
+		(sizeof(TupleTreeEntry) + sizeof(TupleTreeNode *));
+
+	TupleTreeEntry keys[CAPACITY];
+	TupleTreeNode *children[CAPACITY + 1];
+};
+
+template <size_t NODE_SIZE, bool IS_LINKED>
+class CTupleTreeBase
+{
+public:
+	typedef TupleTreeEntry Entry;
+
+	static const size_t LEAF_CAPACITY =
+		TupleTreeLeaf<NODE_SIZE, IS_LINKED>::CAPACITY;
+	static const size_t INNER_CAPACITY = TupleTreeInner<NODE_SIZE>::CAPACITY;
+
+	// Number of tuples.
+	size_t Size() const
+	{
+		return m_size;
+	}
+
+	// Number of inner levels above leaves.
+	size_t Depth() const
+	{
+		return m_depth;
+	}
+
+protected:
+	typedef TupleTreeNode Node;
+	typedef TupleTreeLeaf<NODE_SIZE, IS_LINKED> Leaf;
+	typedef TupleTreeInner<NODE_SIZE> Inner;
+
+	static_assert(NODE_SIZE % TUPLE_TREE_CACHE_LINE == 0,
+		      "Node must take whole cache lines");
+	static_assert(NODE_SIZE <= TUPLE_TREE_CHUNK_SIZE,
+		      "Node must fit in a chunk");
+	static_assert(LEAF_CAPACITY >= 4 && INNER_CAPACITY >= 4,
+		      "Node is too small");
+	static_assert(sizeof(Leaf) <= NODE_SIZE && sizeof(Inner) <= NODE_SIZE,
+		      "Node must fit in NODE_SIZE");
+
+	// Comparison of an entry with a key, see Search.
+	struct KeySearch {
+		KeyDef *def;
+		Tuple::hint_t hint;
+		const char *key;
+		uint32_t part_count;
+
+		int operator()(const Entry &entry) const
+		{
+			if (entry.hint != hint)
+				return entry.hint < hint ? -1 : 1;
+			return def->tuple_compare_with_key_f(def, entry.tuple,
+							     key, part_count);
+		}
+	};
+
+	// Comparison of an entry with a tuple, see Search.
+	struct TupleSearch {
+		KeyDef *def;
+		Tuple::hint_t hint;
+		Tuple *tuple;
+
+		int operator()(const Entry &entry) const
+		{
+			if (entry.hint != hint)
+				return entry.hint < hint ? -1 : 1;
+			return def->tuple_compare_f(def, entry.tuple, tuple);
+		}
+	};
+
+	// Path from the root to a leaf: inner nodes and child positions.
+	struct Path {
+		Inner *nodes[TUPLE_TREE_MAX_DEPTH];
+		size_t pos[TUPLE_TREE_MAX_DEPTH];
+		size_t depth;
+	};
+
+	static const size_t CHUNK_NODES = TUPLE_TREE_CHUNK_SIZE / NODE_SIZE;
+
+	KeyDef *m_def;
+	size_t m_size;
+	size_t m_depth;
+	// Free list of nodes, linked through the first bytes.
+	void *m_free;
+	char *m_chunk;
+	size_t m_chunkUsed;
+	std::vector<void *> m_chunks;
+
+	explicit CTupleTreeBase(KeyDef *def)
+		: m_def(def), m_size(0), m_depth(0), m_free(NULL),
+		  m_chunk(NULL), m_chunkUsed(CHUNK_NODES)
+	{
+	}
+
+	~CTupleTreeBase()
+	{
+		FreeChunks();
+	}
+
+	CTupleTreeBase(const CTupleTreeBase&) = delete;
+	CTupleTreeBase& operator=(const CTupleTreeBase&) = delete;
+
+	void *AllocNode()
+	{
+		if (m_free != NULL) {
+			void *node = m_free;
+			m_free = *(void **)node;
+			return node;
+		}
+		if (m_chunkUsed == CHUNK_NODES) {
+			void *mem = malloc(TUPLE_TREE_CHUNK_SIZE +
+					   TUPLE_TREE_CACHE_LINE);
+			if (mem == NULL)
+				throw std::bad_alloc();
+			m_chunks.push_back(mem);
+			uintptr_t addr = (uintptr_t)mem;
+			addr = (addr + TUPLE_TREE_CACHE_LINE - 1) &
+			       ~(uintptr_t)(TUPLE_TREE_CACHE_LINE - 1);
+			m_chunk = (char *)addr;
+			m_chunkUsed = 0;
+		}
+		return m_chunk + NODE_SIZE * m_chunkUsed++;
+	}
+
+	void FreeNode(Node *node)
+	{
+		*(void **)node = m_free;
+		m_free = node;
+	}
+
+	void FreeChunks()
+	{
+		for (size_t i = 0; i < m_chunks.size(); i++)
+			free(m_chunks[i]);
+		m_chunks.clear();
+		m_free = NULL;
+		m_chunkUsed = CHUNK_NODES;
+	}
+
+	Leaf *NewLeaf()
+	{
+		Leaf *leaf = static_cast<Leaf *>((Node *)AllocNode());
+		leaf->count = 0;
+		leaf->is_leaf = true;
+		leaf->clear_links();
+		return leaf;
+	}
+
+	Inner *NewInner()
+	{
+		Inner *inner = static_cast<Inner *>((Node *)AllocNode());
+		inner->count = 0;
+		inner->is_leaf = false;
+		return inner;
+	}
+
+	KeySearch MakeKeySearch(const char *key) const
+	{
+		KeySearch search;
+		search.def = m_def;
+		search.hint = key_hint(m_def, key);
+		search.part_count = mp_decode_array(key);
+		search.key = key;
+		return search;
+	}
+
+	/**
+	 * Build the nodes from tuples sorted by the key def without equal
+	 * keys, starting from the empty first leaf, and return the root.
+	 * Leaves and inner nodes are filled up, m_depth is set.
+	 */
+	Node *BuildNodes(Tuple **tuples, size_t count, Leaf *first)
+	{
+		assert(count > 0 && first->count == 0);
+		std::vector<Node *> nodes;
+		std::vector<Entry> mins;
+		Leaf *leaf = NULL;
+		for (size_t i = 0; i < count; i++) {
+			assert(i == 0 || m_def->tuple_compare_f(m_def,
+				tuples[i - 1], tuples[i]) < 0);
+			if (leaf == NULL || leaf->count == LEAF_CAPACITY) {
+				Leaf *next = leaf == NULL ? first : NewLeaf();
+				if (leaf != NULL)
+					leaf->link_next(next);
+				leaf = next;
+				nodes.push_back(leaf);
+			}
+			Entry *entry = &leaf->entries[leaf->count++];
+			entry->hint = tuple_hint(m_def, tuples[i]);
+			entry->tuple = tuples[i];
+			if (leaf->count == 1)
+				mins.push_back(*entry);
+		}
+		// Build inner levels until there's one node.
+		m_depth = 0;
+		while (nodes.size() > 1) {
+			std::vector<Node *> parents;
+			std::vector<Entry> parent_mins;
+			for (size_t i = 0; i < nodes.size(); i++) {
+				Inner *inner = parents.empty() ? NULL :
+					static_cast<Inner *>(parents.back());
+				if (inner == NULL || inner->count == INNER_CAPACITY) {
+					inner = NewInner();
+					inner->children[0] = nodes[i];
+					parents.push_back(inner);
+					parent_mins.push_back(mins[i]);
+					continue;
+				}
+				inner->keys[inner->count] = mins[i];
+				inner->children[++inner->count] = nodes[i];
+			}
+			nodes.swap(parents);
+			mins.swap(parent_mins);
+			m_depth++;
+		}
+		return nodes[0];
+	}
+
+	/**
+	 * Number of entries that are less than the searched one, or not
+	 * greater if upper is true, i.e. lower or upper bound.
+	 */
+	template <class SEARCH>
+	static size_t
+	Search(const Entry *entries, size_t count, const SEARCH &search,
+	       bool upper)
+	{
+		size_t begin = 0;
+		size_t end = count;
+		while (begin < end) {
+			size_t mid = begin + (end - begin) / 2;
+			int r = search(entries[mid]);
+			if (r < 0 || (upper && r == 0))
+				begin = mid + 1;
+			else
+				end = mid;
+		}
+		return begin;
+	}
+
+	/**
+	 * Find the leaf of lower or upper bound from the node, save the path
+	 * if needed.
+	 */
+	template <class SEARCH>
+	static Leaf *
+	Descend(Node *node, const SEARCH &search, bool upper, Path *path)
+	{
+		size_t depth = 0;
+		while (!node->is_leaf) {
+			Inner *inner = static_cast<Inner *>(node);
+			size_t child = Search(inner->keys, inner->count, search,
+					      upper);
+			if (path != NULL) {
+				path->nodes[depth] = inner;
+				path->pos[depth] = child;
+			}
+			depth++;
+			node = inner->children[child];
+		}
+		if (path != NULL)
+			path->depth = depth;
+		return static_cast<Leaf *>(node);
+	}
+
+	static void
+	InsertEntry(Entry *entries, size_t count, size_t pos, const Entry &entry)
+	{
+		std::copy_backward(entries + pos, entries + count,
+				   entries + count + 1);
+		entries[pos] = entry;
+	}
+
+	/**
+	 * Insert the entry at pos of the full leaf, that is split: the upper
+	 * half goes to the new right leaf, that is returned. Leaf links are
+	 * not changed.
+	 */
+	Leaf *SplitLeaf(Leaf *leaf, size_t pos, const Entry &entry)
+	{
+		assert(leaf->count == LEAF_CAPACITY);
+		Entry all[LEAF_CAPACITY + 1];
+		std::copy(leaf->entries, leaf->entries + pos, all);
+		all[pos] = entry;
+		std::copy(leaf->entries + pos, leaf->entries + LEAF_CAPACITY,
+			  all + pos + 1);
+		size_t left_count = (LEAF_CAPACITY + 1) / 2;
+		Leaf *right = NewLeaf();
+		std::copy(all, all + left_count, leaf->entries);
+		leaf->count = left_count;
+		std::copy(all + left_count, all + LEAF_CAPACITY + 1,
+			  right->entries);
+		right->count = LEAF_CAPACITY + 1 - left_count;
+		return right;
+	}
+
+	/**
+	 * The least entry of a subtree changed from old to entry: update
+	 * the separator that points to old, it's in the deepest node of
+	 * the path above the level, where the subtree is not the first child.
+	 */
+	static void
+	FixSeparator(Path *path, size_t level, Tuple *old, const Entry &entry)
+	{
+		while (level > 0) {
+			level--;
+			size_t child = path->pos[level];
+			if (child > 0) {
+				Entry *separator = &path->nodes[level]->keys[child - 1];
+				assert(separator->tuple == old);
+				(void)old;
+				*separator = entry;
+				return;
+			}
+		}
+	}
+
+	// Remove the separator and the child from the inner node.
+	static void RemoveChild(Inner *inner, size_t key_pos, size_t child_pos)
+	{
+		std::copy(inner->keys + key_pos + 1, inner->keys + inner->count,
+			  inner->keys + key_pos);
+		std::copy(inner->children + child_pos + 1,
+			  inner->children + inner->count + 1,
+			  inner->children + child_pos);
+		inner->count--;
+	}
+
+	/**
+	 * The leaf at the end of the path became empty by deletion of old and
+	 * is freed by the caller: remove it from the inner nodes of the path
+	 * and free the inner nodes that become empty. Return false if all
+	 * the inner nodes are freed, so the tree is empty and needs a new
+	 * root. The root may be left with one child.
+	 */
+	bool RemoveLeaf(Path *path, Tuple *old)
+	{
+		size_t level = path->depth;
+		while (level > 0) {
+			level--;
+			Inner *parent = path->nodes[level];
+			size_t child = path->pos[level];
+			if (child > 0) {
+				// The separator of the child is the deleted one.
+				RemoveChild(parent, child - 1, child);
+				return true;
+			}
+			if (parent->count > 0) {
+				FixSeparator(path, level, old, parent->keys[0]);
+				RemoveChild(parent, 0, 0);
+				return true;
+			}
+			FreeNode(parent);
+		}
+		return false;
+	}
+
+	/**
+	 * Insert the new right sibling of the node at the end of the path,
+	 * with its least entry as separator, splitting inner nodes up to
+	 * the root if they are full. The root is replaced if it is split.
+	 */
+	void InsertChild(Path *path, Entry separator, Node *right, Node *&root)
+	{
+		size_t level = path->depth;
+		while (level > 0) {
+			level--;
+			Inner *inner = path->nodes[level];
+			size_t pos = path->pos[level];
+			if (inner->count < INNER_CAPACITY) {
+				InsertEntry(inner->keys, inner->count, pos,
+					    separator);
+				std::copy_backward(inner->children + pos + 1,
+						   inner->children + inner->count + 1,
+						   inner->children + inner->count + 2);
+				inner->children[pos + 1] = right;
+				inner->count++;
+				return;
+			}
+			// Split the inner node, the middle separator goes up.
+			Entry keys[INNER_CAPACITY + 1];
+			Node *children[INNER_CAPACITY + 2];
+			std::copy(inner->keys, inner->keys + pos, keys);
+			keys[pos] = separator;
+			std::copy(inner->keys + pos, inner->keys + INNER_CAPACITY,
+				  keys + pos + 1);
+			std::copy(inner->children, inner->children + pos + 1,
+				  children);
+			children[pos + 1] = right;
+			std::copy(inner->children + pos + 1,
+				  inner->children + INNER_CAPACITY + 1,
+				  children + pos + 2);
+			size_t mid = (INNER_CAPACITY + 1) / 2;
+			Inner *new_inner = NewInner();
+			std::copy(keys, keys + mid, inner->keys);
+			std::copy(children, children + mid + 1, inner->children);
+			inner->count = mid;
+			std::copy(keys + mid + 1, keys + INNER_CAPACITY + 1,
+				  new_inner->keys);
+			std::copy(children + mid + 1, children + INNER_CAPACITY + 2,
+				  new_inner->children);
+			new_inner->count = INNER_CAPACITY - mid;
+			separator = keys[mid];
+			right = new_inner;
+		}
+		// The root is split.
+		Inner *new_root = NewInner();
+		new_root->keys[0] = separator;
+		new_root->children[0] = root;
+		new_root->children[1] = right;
+		new_root->count = 1;
+		root = new_root;
+		m_depth++;
+		assert(m_depth < TUPLE_TREE_MAX_DEPTH);
+	}
+};
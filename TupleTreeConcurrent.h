@@ -0,0 +1,309 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+
+#include <Epoch.h>
+#include <KeyDef.h>
+#include <Tuple.h>
+#include <TupleArena.h>
+#include <TupleTreeBase.h>
+
+/**
+ * B+tree index of tuples for many reader threads, with unique keys.
+ * Readers don't take locks and don't write shared memory: published
+ * nodes are never changed, a writer copies the path from the root to
+ * the leaf it changes, changes the copies as CTupleTree does and
+ * publishes the new root with one atomic store. A reader that loaded the
+ * old root sees the old tree until it leaves its read section.
+ * Replaced nodes and tuples are retired to the epoch of the tree (see
+ * CEpoch) and freed when no reader can see them: nodes to the free list
+ * of the tree, tuples to the arena they were allocated from by
+ * tuple_new, so the arena reuses their memory.
+ * Writes cost a copy of a node per level, so the tree is for indexes
+ * that are read much more often than written. Writers must be
+ * serialized by the caller, they also own the arena, and only they call
+ * Size and Depth.
+ * Nodes and their changes are shared with CTupleTree (see
+ * CTupleTreeBase), but leaves are not linked: a link from an unchanged
+ * leaf would point to an old copy of a sibling.
+ */
+template <size_t NODE_SIZE = TUPLE_TREE_NODE_SIZE>
+class CTupleTreeConcurrent : public CTupleTreeBase<NODE_SIZE, false>
+{
+	typedef CTupleTreeBase<NODE_SIZE, false> Base;
+	typedef typename Base::Node Node;
+	typedef typename Base::Leaf Leaf;
+	typedef typename Base::Inner Inner;
+	typedef typename Base::KeySearch KeySearch;
+	typedef typename Base::TupleSearch TupleSearch;
+	typedef typename Base::Path Path;
+	using Base::LEAF_CAPACITY;
+	using Base::m_def;
+	using Base::m_size;
+	using Base::m_depth;
+	using Base::FreeNode;
+	using Base::NewLeaf;
+	using Base::NewInner;
+	using Base::MakeKeySearch;
+	using Base::BuildNodes;
+	using Base::Search;
+	using Base::Descend;
+	using Base::InsertEntry;
+	using Base::SplitLeaf;
+	using Base::FixSeparator;
+	using Base::RemoveLeaf;
+	using Base::InsertChild;
+
+public:
+	typedef typename Base::Entry Entry;
+
+	/**
+	 * tuple_compare_f and tuple_compare_with_key_f of the key def
+	 * must be set. Replaced and deleted tuples are freed to the arena,
+	 * or not freed if it's NULL.
+	 */
+	CTupleTreeConcurrent(KeyDef *def, CTupleArena *arena)
+		: Base(def), m_arena(arena), m_oldCount(0)
+	{
+		m_writeRoot = NewLeaf();
+		m_root.store(m_writeRoot, std::memory_order_release);
+	}
+
+	// There must be no readers.
+	~CTupleTreeConcurrent()
+	{
+		m_epoch.Drain();
+	}
+
+	CTupleTreeConcurrent(const CTupleTreeConcurrent&) = delete;
+	CTupleTreeConcurrent& operator=(const CTupleTreeConcurrent&) = delete;
+
+	// Readers of the tree take reader slots of the epoch, see CEpochReader.
+	CEpoch *Epoch()
+	{
+		return &m_epoch;
+	}
+
+	/**
+	 * Build the empty tree from tuples sorted by the key def without
+	 * equal keys. Leaves and inner nodes are filled up.
+	 */
+	void Build(Tuple **tuples, size_t count)
+	{
+		assert(m_size == 0);
+		if (count == 0)
+			return;
+		Node *root = BuildNodes(tuples, count, NewLeaf());
+		m_old[m_oldCount++] = m_writeRoot;
+		m_writeRoot = root;
+		m_size = count;
+		Publish();
+	}
+
+	/**
+	 * Insert the tuple. If there's a tuple with equal key, it's
+	 * replaced and retired, and true is returned.
+	 */
+	bool Replace(Tuple *tuple)
+	{
+		TupleSearch search = {m_def, tuple_hint(m_def, tuple), tuple};
+		Path path;
+		Leaf *leaf = CopyPath(search, &path);
+		size_t pos = Search(leaf->entries, leaf->count, search, false);
+		Entry entry = {search.hint, tuple};
+		if (pos < leaf->count && search(leaf->entries[pos]) == 0) {
+			Tuple *old = leaf->entries[pos].tuple;
+			leaf->entries[pos] = entry;
+			if (pos == 0)
+				FixSeparator(&path, path.depth, old, entry);
+			Publish();
+			if (old != tuple)
+				RetireTuple(old);
+			return true;
+		}
+		m_size++;
+		if (leaf->count < LEAF_CAPACITY) {
+			InsertEntry(leaf->entries, leaf->count, pos, entry);
+			leaf->count++;
+			Publish();
+			return false;
+		}
+		Leaf *right = SplitLeaf(leaf, pos, entry);
+		InsertChild(&path, right->entries[0], right, m_writeRoot);
+		Publish();
+		return false;
+	}
+
+	/**
+	 * Delete the tuple with the full key (msgpack array of part values)
+	 * and retire it. Return false if there's none.
+	 */
+	bool Delete(const char *key)
+	{
+		KeySearch search = MakeKeySearch(key);
+		assert(search.part_count == m_def->part_count);
+		Leaf *found = Descend(m_writeRoot, search, true, NULL);
+		size_t pos = Search(found->entries, found->count, search, false);
+		if (pos == found->count || search(found->entries[pos]) != 0)
+			return false;
+		Path path;
+		Leaf *leaf = CopyPath(search, &path);
+		Tuple *old = leaf->entries[pos].tuple;
+		std::copy(leaf->entries + pos + 1, leaf->entries + leaf->count,
+			  leaf->entries + pos);
+		leaf->count--;
+		m_size--;
+		if (leaf->count != 0 || path.depth == 0) {
+			if (leaf->count != 0 && pos == 0)
+				FixSeparator(&path, path.depth, old,
+					     leaf->entries[0]);
+			Publish();
+			RetireTuple(old);
+			return true;
+		}
+		// Remove the empty leaf and inner nodes that become empty.
+		// They are copies that readers haven't seen.
+		FreeNode(leaf);
+		if (!RemoveLeaf(&path, old)) {
+			m_writeRoot = NewLeaf();
+			m_depth = 0;
+			Publish();
+			RetireTuple(old);
+			return true;
+		}
+		// The root with one child is not needed.
+		while (!m_writeRoot->is_leaf && m_writeRoot->count == 0) {
+			Node *child = static_cast<Inner *>(m_writeRoot)->children[0];
+			DropNode(&path, m_writeRoot);
+			m_writeRoot = child;
+			m_depth--;
+		}
+		Publish();
+		RetireTuple(old);
+		return true;
+	}
+
+	/**
+	 * Find the tuple by the full key (msgpack array of part values),
+	 * return NULL if there's none. Readers call it in a read section
+	 * of the epoch (see CEpochGuard), the tuple can be used until the
+	 * section ends.
+	 */
+	Tuple *Find(const char *key) const
+	{
+		KeySearch search = MakeKeySearch(key);
+		assert(search.part_count == m_def->part_count);
+		Node *root = m_root.load(std::memory_order_acquire);
+		const Leaf *leaf = Descend(root, search, true, NULL);
+		size_t pos = Search(leaf->entries, leaf->count, search, false);
+		if (pos == leaf->count || search(leaf->entries[pos]) != 0)
+			return NULL;
+		return leaf->entries[pos].tuple;
+	}
+
+private:
+	CTupleArena *m_arena;
+	// The root that readers see.
+	std::atomic<Node *> m_root;
+	// Members below are used only by writers.
+	// The root being changed, it's published by Publish.
+	Node *m_writeRoot;
+	// Nodes replaced by copies or removed, they are retired by Publish.
+	Node *m_old[2 * TUPLE_TREE_MAX_DEPTH + 1];
+	size_t m_oldCount;
+	CEpoch m_epoch;
+
+	static void ReclaimNode(void *ctx, void *ptr)
+	{
+		static_cast<CTupleTreeConcurrent *>(ctx)->FreeNode((Node *)ptr);
+	}
+
+	static void ReclaimTuple(void *ctx, void *ptr)
+	{
+		CTupleTreeConcurrent *tree = static_cast<CTupleTreeConcurrent *>(ctx);
+		tuple_delete(tree->m_arena, (Tuple *)ptr);
+	}
+
+	void RetireTuple(Tuple *tuple)
+	{
+		if (m_arena != NULL)
+			m_epoch.Retire(tuple, ReclaimTuple, this);
+	}
+
+	// Copy of the node that is not published yet.
+	Node *CopyNode(const Node *node)
+	{
+		if (node->is_leaf) {
+			const Leaf *leaf = static_cast<const Leaf *>(node);
+			Leaf *copy = NewLeaf();
+			copy->count = leaf->count;
+			std::copy(leaf->entries, leaf->entries + leaf->count,
+				  copy->entries);
+			return copy;
+		}
+		const Inner *inner = static_cast<const Inner *>(node);
+		Inner *copy = NewInner();
+		copy->count = inner->count;
+		std::copy(inner->keys, inner->keys + inner->count, copy->keys);
+		std::copy(inner->children, inner->children + inner->count + 1,
+			  copy->children);
+		return copy;
+	}
+
+	/**
+	 * Remove the node from the tree being changed: copies of the path
+	 * are freed at once, other nodes can be seen by readers.
+	 */
+	void DropNode(const Path *path, Node *node)
+	{
+		for (size_t i = 0; i < path->depth; i++) {
+			if (path->nodes[i] == node) {
+				FreeNode(node);
+				return;
+			}
+		}
+		m_old[m_oldCount++] = node;
+	}
+
+	/**
+	 * Find the leaf of upper bound and replace the nodes from the root
+	 * to the leaf with copies, that can be changed in place. The path
+	 * consists of the copies, return the copy of the leaf.
+	 */
+	template <class SEARCH>
+	Leaf *CopyPath(const SEARCH &search, Path *path)
+	{
+		assert(m_oldCount == 0);
+		Node *node = m_writeRoot;
+		Node *copy = CopyNode(node);
+		m_old[m_oldCount++] = node;
+		m_writeRoot = copy;
+		size_t depth = 0;
+		while (!copy->is_leaf) {
+			Inner *inner = static_cast<Inner *>(copy);
+			size_t child = Search(inner->keys, inner->count, search,
+					      true);
+			path->nodes[depth] = inner;
+			path->pos[depth] = child;
+			depth++;
+			node = inner->children[child];
+			copy = CopyNode(node);
+			m_old[m_oldCount++] = node;
+			inner->children[child] = copy;
+		}
+		path->depth = depth;
+		return static_cast<Leaf *>(copy);
+	}
+
+	// Make the changed tree visible to readers and retire old nodes.
+	void Publish()
+	{
+		m_root.store(m_writeRoot, std::memory_order_release);
+		for (size_t i = 0; i < m_oldCount; i++)
+			m_epoch.Retire(m_old[i], ReclaimNode, this);
+		m_oldCount = 0;
+	}
+};
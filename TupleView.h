@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+#include <KeyDef.h>
+#include <MsgPack.h>
+#include <Tuple.h>
+
+// Number of the first fields whose offsets are saved in TupleView.
+const size_t TUPLE_VIEW_OFFSET_COUNT = 32;
+
+/**
+ * Tuple view is a tuple that is not copied: it points to an external
+ * msgpack array, for example in network or WAL buffer, and the buffer
+ * must outlive the view.
+ * There's no tuple format for the view, so offsets of fields are
+ * calculated lazily: when a field is requested for the first time,
+ * fields are skipped up to it and offsets of all the skipped fields are
+ * saved, so the next requests of them (and of the previous fields) are
+ * resolved at once.
+ * Tuple views are compared with default comparators, see
+ * tuple_view_compare.
+ */
+struct TupleView {
+	// The first field of the msgpack array.
+	const char *fields;
+	// Number of fields in the array.
+	uint32_t field_count;
+	// Number of fields with saved offsets, at least 1.
+	uint32_t resolved_count;
+	// Offsets of fields from the first field.
+	uint32_t offsets[TUPLE_VIEW_OFFSET_COUNT];
+
+	// Point the view to the msgpack array.
+	void reset(const char *array)
+	{
+		field_count = mp_decode_array(array);
+		fields = array;
+		offsets[0] = 0;
+		resolved_count = 1;
+	}
+
+	// Get field i, resolving offsets of the previous fields if necessary.
+	const char *get_field(size_t i)
+	{
+		assert(i < field_count);
+		if (i < resolved_count)
+			return fields + offsets[i];
+		const char *field = fields + offsets[resolved_count - 1];
+		for (; resolved_count < TUPLE_VIEW_OFFSET_COUNT; resolved_count++) {
+			mp_next(field);
+			offsets[resolved_count] = field - fields;
+			if (resolved_count == i) {
+				resolved_count++;
+				return field;
+			}
+		}
+		// Fields after the last saved offset are skipped every time.
+		mp_skip_n(field, i - (resolved_count - 1));
+		return field;
+	}
+};
+
+// Compare tuple views by key def, as default_tuple_compare does.
+inline int
+tuple_view_compare(KeyDef *def, TupleView *view1, TupleView *view2)
+{
+	return tuple_compare_generic(def, view1, view2);
+}
+
+// Compare tuple view with tuple by key def.
+inline int
+tuple_view_compare_tuple(KeyDef *def, TupleView *view, Tuple *tuple)
+{
+	return tuple_compare_generic(def, view, tuple);
+}
+
+// Compare tuple view with a key - msgpack array of part values.
+inline int
+tuple_view_compare_with_key(KeyDef *def, TupleView *view, const char *key)
+{
+	uint32_t part_count = mp_decode_array(key);
+	return tuple_compare_with_key_generic(def, view, key, part_count);
+}
@@ -1,230 +1,653 @@
+#include <algorithm>
 #include <cassert>
 #include <cstddef>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <queue>
 #include <setjmp.h>
+#include <string>
+#include <vector>
 
-#include <MsgPack.h>
+#include <BenchRunner.h>
+#include <BenchScenario.h>
+#include <KeyDef.h>
+#include <MpWriter.h>
+#include <MsgPackCheck.h>
+#include <NormalizedKey.h>
 #include <Timer.h>
+#include <Tuple.h>
+#include <TupleArena.h>
+#include <TupleCompare.h>
+#include <TupleCompareBatch.h>
+#include <TupleCompareProfile.h>
+#include <TupleHash.h>
+#include <TupleHashIndex.h>
+#include <TupleMerge.h>
+#include <TupleRun.h>
+#include <TupleSort.h>
+#include <TupleSortExternal.h>
+#include <TupleSortParallel.h>
+#include <TupleTree.h>
+#include <TupleView.h>
 
-const size_t MAX_NUM_FIELDS_IN_KEY = 16;
-const size_t TEST_FIELD_COUNT_IN_TUPLE = 16;
-const size_t MAX_TEST_TUPLE_DATA_SIZE = 16 * TEST_FIELD_COUNT_IN_TUPLE;
+#ifdef _WIN32
+#define NOINLINE __declspec(noinline)
+#else
+#define NOINLINE __attribute__((noinline))
+#endif
+
+const size_t N = 5000;
+// Generated tuples are allocated in the arena.
+CTupleArena tuple_arena;
+Tuple *tuples[N];
+// Keys extracted from tuples, keys[i] is the key of tuples[i].
+char keys_data[N * MAX_TEST_TUPLE_DATA_SIZE];
+const char *keys[N];
+// Pointers to generated tuples in random order, and comparison results.
+Tuple *tuple_ptrs[N];
+int batch_results[N];
+// Tuples that are sorted in sort benchmarks.
+Tuple *sort_ptrs[N];
+// Normalized keys of tuples that are sorted in sort benchmarks.
+struct NormalizedEntry {
+	const char *key;
+	size_t size;
+	Tuple *tuple;
+};
+char normalized_data[N * (2 * MAX_TEST_TUPLE_DATA_SIZE + 2)];
+NormalizedEntry normalized[N];
+// Tuples encoded as msgpack arrays and tuple views over them.
+char view_data[N * (MAX_TEST_TUPLE_DATA_SIZE + 5)];
+const char *view_arrays[N];
+TupleView views[N];
+TupleView *view_ptrs[N];
+
+// Compares all pairs of generated tuples measuring consumed time.
+NOINLINE void bench_compare(KeyDef *def, const char *test_name,
+			    const char *compare_name)
+{
+	CTimer t;
+	t.Start();
+	int r = 0;
+	for (size_t i = 0; i < N; i++)
+		for (size_t j = 0; j < N; j++)
+			r += def->tuple_compare_f(def, tuples[i], tuples[j]);
+	t.Stop();
+	std::cout << test_name << " (" << compare_name << ") Mrps: "
+		  << t.Mrps(N * N) << t.Counters(N * N) << std::endl;
+}
+
+// Compares all generated tuples with all keys measuring consumed time.
+NOINLINE void bench_compare_with_key(KeyDef *def, const char *test_name,
+				     const char *compare_name)
+{
+	CTimer t;
+	t.Start();
+	int r = 0;
+	for (size_t i = 0; i < N; i++)
+		for (size_t j = 0; j < N; j++)
+			r += tuple_compare_with_key(def, tuples[i], keys[j]);
+	t.Stop();
+	std::cout << test_name << " with key (" << compare_name << ") Mrps: "
+		  << t.Mrps(N * N) << t.Counters(N * N) << std::endl;
+}
+
+// Compares every tuple with all shuffled tuples by one batch call.
+NOINLINE void bench_compare_batch(KeyDef *def, const char *test_name,
+				  bool prefetch)
+{
+	CTimer t;
+	t.Start();
+	int r = 0;
+	for (size_t i = 0; i < N; i++) {
+		if (prefetch)
+			tuple_compare_batch_prefetch(def, tuples[i], tuple_ptrs,
+						     N, batch_results);
+		else
+			tuple_compare_batch(def, tuples[i], tuple_ptrs, N,
+					    batch_results);
+		r += batch_results[i];
+	}
+	t.Stop();
+	std::cout << test_name << " (batch" << (prefetch ? ", prefetch" : "")
+		  << ") Mrps: " << t.Mrps(N * N)
+		  << t.Counters(N * N) << std::endl;
+}
+
+// Sorts shuffled tuples with default_tuple_compare and by normalized keys.
+NOINLINE void bench_sort(KeyDef *def, const char *test_name)
+{
+	const size_t R = 20;
+	CTimer t1;
+	for (size_t r = 0; r < R; r++) {
+		std::copy(tuple_ptrs, tuple_ptrs + N, sort_ptrs);
+		t1.Start();
+		std::sort(sort_ptrs, sort_ptrs + N, [def](Tuple *a, Tuple *b) {
+			return default_tuple_compare(def, a, b) < 0;
+		});
+		t1.Stop();
+	}
+	std::cout << test_name << " sort (default) Mrps: " << t1.Mrps(R * N)
+		  << t1.Counters(R * N)
+		  << std::endl;
+
+	// Key extraction is included in measured time.
+	CTimer t2;
+	for (size_t r = 0; r < R; r++) {
+		t2.Start();
+		char *p = normalized_data;
+		for (size_t i = 0; i < N; i++) {
+			normalized[i].key = p;
+			normalized[i].size =
+				key_def_extract_normalized(def, tuple_ptrs[i], p);
+			normalized[i].tuple = tuple_ptrs[i];
+			p += normalized[i].size;
+		}
+		std::sort(normalized, normalized + N,
+			  [](const NormalizedEntry &a, const NormalizedEntry &b) {
+			return normalized_key_compare(a.key, a.size,
+						      b.key, b.size) < 0;
+		});
+		t2.Stop();
+	}
+	std::cout << test_name << " sort (normalized) Mrps: " << t2.Mrps(R * N)
+		  << t2.Counters(R * N)
+		  << std::endl;
+
+	for (size_t i = 0; i < N; i++)
+		if (default_tuple_compare(def, sort_ptrs[i],
+					  normalized[i].tuple) != 0)
+			abort();
+
+	// Comparison sort with the specialized comparator.
+	key_def_set_compare_func(def);
+	CTimer t3;
+	for (size_t r = 0; r < R; r++) {
+		std::copy(tuple_ptrs, tuple_ptrs + N, sort_ptrs);
+		t3.Start();
+		tuple_sort_compare(def, sort_ptrs, N);
+		t3.Stop();
+	}
+	std::cout << test_name << " sort (specialized) Mrps: "
+		  << t3.Mrps(R * N) << t3.Counters(R * N) << std::endl;
+
+	// Radix sort, chosen by key def.
+	CTimer t4;
+	for (size_t r = 0; r < R; r++) {
+		std::copy(tuple_ptrs, tuple_ptrs + N, sort_ptrs);
+		t4.Start();
+		tuple_sort(def, sort_ptrs, N);
+		t4.Stop();
+	}
+	std::cout << test_name << " sort (tuple_sort) Mrps: "
+		  << t4.Mrps(R * N) << t4.Counters(R * N) << std::endl;
+
+	for (size_t i = 0; i < N; i++)
+		if (default_tuple_compare(def, sort_ptrs[i],
+					  normalized[i].tuple) != 0)
+			abort();
+}
+
+// Sorts a big array (the shuffled tuples repeated) with different
+// number of threads, from one up to the number of hardware threads.
+NOINLINE void bench_sort_parallel(KeyDef *def, const char *test_name)
+{
+	const size_t M = 100;
+	std::vector<Tuple *> orig(N * M);
+	for (size_t i = 0; i < N * M; i++)
+		orig[i] = tuple_ptrs[rand() % N];
+	std::vector<Tuple *> arr;
+
+	arr = orig;
+	def->tuple_compare_f = default_tuple_compare;
+	CTimer t;
+	t.Start();
+	tuple_sort_compare(def, arr.data(), arr.size());
+	t.Stop();
+	std::cout << test_name << " big sort (default) Mrps: "
+		  << t.Mrps(arr.size()) << t.Counters(arr.size()) << std::endl;
+
+	key_def_set_compare_func(def);
+	size_t max_threads = CThreadPool::HardwareThreads();
+	for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+		if (threads * 2 > max_threads)
+			threads = max_threads;
+		CThreadPool pool(threads);
+		arr = orig;
+		CTimer tp;
+		tp.Start();
+		tuple_sort_parallel(def, arr.data(), arr.size(), &pool);
+		tp.Stop();
+		std::cout << test_name << " big sort (" << threads
+			  << " threads) Mrps: " << tp.Mrps(arr.size())
+			  << tp.Counters(arr.size())
+			  << std::endl;
+		for (size_t i = 1; i < arr.size(); i++)
+			if (default_tuple_compare(def, arr[i - 1], arr[i]) > 0)
+				abort();
+	}
+}
 
 /**
- * A tuple is a data structure that consist of variable number of values
- * with variable type. Those values are usually called 'fields'.
- * In order to provide type variability all the values are serialized
- * into char buffer one value after other. For serialization the msgpack
- * format is chosen (https://msgpack.org/).
- * This causes some read performance problems: since every field has a variable
- * size it is not possible to jump directly to nth field. If it is critical to
- * has a high performance access to some field a tuple stores additional
- * offsets for it - position in buffer where the serialized value is located.
- * Generally this requires common (for many tuples) tuple format that declares
- * which field has offset and where in tuple it is store. Since those offsets
- * can be of variable size they are also stored in the same buffer as fields.
-
- * Here is schematic layout of tuple in memory:
- * (fldX - serialized field X; offX - offset of field X.)
-
- * [ static part - struct members ][     dynamic part - char buffer (data)     ]
- * [...........][off0][...........][off1][off2]..[fld0][ fld1 ][fld3]...       ]
- *                                 <----off0---->
- *                                 <-------off1------->
- *                                 <-----------off2----------->
- *
- * For test purposes the tuple below stores num_offsets offsets for the first
- * num_offsets fields. That make tuples not to need tuple format.
- * Also for the same reason it has limited size and can store only
- * unsigned integers and strings.
+ * Sorts a big array (the shuffled tuples repeated) with external sort,
+ * that keeps at most 1MB of tuples in memory, and looks up keys in the
+ * output run.
  */
-struct Tuple {
-	/*
-	 * The three members below a made specially for this test, in order to
-	 * make dynamic modification of tuple.
-	 * Actual tuple is built once and immutable later.
-	 */
-	// Current number of fields.
-	uint32_t field_count;
-	// Current used number of bytes in data.
-	uint32_t data_used;
-	// Maximal number of offsets in this tuple.
-	uint32_t num_offsets;
-
-	// Offset of the first field,
-	// i.e. the first field starts in data[first_field_offset].
-	// Note that we use shorter type for this offset to safe some space.
-	uint16_t first_field_offset;
-	// Type of field offset starting from field two.
-	typedef uint32_t offset_t;
-	// In real life there are several useful fields.
-	uint16_t some_useful_data;
-	// Data buffer for both field offsets and msgpack data.
-	char data[MAX_TEST_TUPLE_DATA_SIZE];
-
-	// Get dynamically allocated offset.
-	offset_t& get_offset(size_t i)
-	{
-		assert(i > 0);
-		return ((offset_t *)data)[i - 1];
-	}
-
-	// Get field with offset.
-	const char *get_field(size_t i)
-	{
-		if (i == 0)
-			return data + first_field_offset;
-		else
-			return data + get_offset(i);
-	}
-
-	/**
-	 * Several methods for tuple modification. Are not need in real life.
-	 */
-	// Clean up the tuple.
-	void reset(uint32_t a_num_offsets)
-	{
-		field_count = 0;
-		num_offsets = a_num_offsets;
-		assert(a_num_offsets > 0);
-		// We have to store a_num_offsets offsets.
-		// But the first offset is stored in first_field_offset member.
-		// We have to store one less in data buffer.
-		data_used = (a_num_offsets - 1) * sizeof(offset_t);
-	}
-
-	// Add integer value to the end of tuple, save offset if necessary.
-	void add(uint64_t value)
-	{
-		char *p = data + data_used;
-		mp_encode_uint(p, value);
+NOINLINE void bench_sort_external(KeyDef *def, const char *test_name)
+{
+	const size_t M = 20;
+	const size_t memory_limit = 1024 * 1024;
+	const size_t prefix_size = 8;
+	const char *path = "bench_sort_external.run";
+	key_def_set_compare_func(def);
+	CTimer t1;
+	t1.Start();
+	CTupleSortExternal sort(def, path, memory_limit, prefix_size);
+	for (size_t i = 0; i < N * M; i++)
+		if (!sort.Add(tuple_ptrs[rand() % N]))
+			abort();
+	size_t run_count = sort.RunCount();
+	if (!sort.Finish(path))
+		abort();
+	t1.Stop();
+	std::cout << test_name << " external sort (" << run_count
+		  << " runs) Mrps: " << t1.Mrps(N * M)
+		  << t1.Counters(N * M) << std::endl;
 
-		if (field_count == 0)
-			first_field_offset = data_used;
-		else if (field_count < num_offsets)
-			get_offset(field_count) = data_used;
-		data_used = p - data;
-		field_count++;
+	CTupleRun run;
+	if (!run.Open(path) || run.Count() != N * M)
+		abort();
+	for (size_t i = 1; i < run.Count(); i++)
+		if (default_tuple_compare(def, run.Get(i - 1), run.Get(i)) > 0)
+			abort();
+	CTimer t2;
+	t2.Start();
+	size_t found = 0;
+	for (size_t i = 0; i < N; i++) {
+		size_t pos = run.LowerBound(def, keys[i]);
+		found += pos < run.Count() &&
+			 tuple_compare_with_key(def, run.Get(pos), keys[i]) == 0;
 	}
+	t2.Stop();
+	std::cout << test_name << " run lookup Mrps: " << t2.Mrps(N)
+		  << t2.Counters(N)
+		  << std::endl;
+	if (found != N)
+		abort();
+	run.Close();
+	remove(path);
+}
 
-	// Add string value to the end of tuple, save offset if necessary.
-	void add(const char *string, uint32_t len)
-	{
-		char *p = data + data_used;
-		mp_encode_string(p, string, len);
+/**
+ * Merges k sorted arrays of random tuples with a binary heap that calls
+ * tuple_compare_f and with loser tree, without and with cached hints.
+ * Hints of tuples must be set.
+ */
+NOINLINE void bench_merge(KeyDef *def, const char *test_name)
+{
+	const size_t M = 20;
+	std::vector<Tuple *> arr(N * M);
+	std::vector<Tuple *> out(N * M);
+	for (size_t k = 2; k <= 1024; k *= 8) {
+		for (size_t i = 0; i < N * M; i++)
+			arr[i] = tuple_ptrs[rand() % N];
+		def->use_hint = false;
+		key_def_set_compare_func(def);
+		std::vector<TupleMergeSource> sources(k);
+		for (size_t i = 0; i < k; i++) {
+			size_t begin = N * M * i / k;
+			size_t end = N * M * (i + 1) / k;
+			tuple_sort(def, arr.data() + begin, end - begin);
+			sources[i] = tuple_merge_source_array(arr.data() + begin,
+							      end - begin);
+		}
 
-		if (field_count == 0)
-			first_field_offset = data_used;
-		else if (field_count < num_offsets)
-			get_offset(field_count) = data_used;
-		data_used = p - data;
-		field_count++;
+		struct HeapItem {
+			Tuple *tuple;
+			size_t source;
+			size_t pos;
+		};
+		KeyDef::tuple_compare_t compare = def->tuple_compare_f;
+		auto greater = [def, compare](const HeapItem &a,
+					      const HeapItem &b) {
+			return compare(def, a.tuple, b.tuple) > 0;
+		};
+		CTimer t1;
+		t1.Start();
+		std::priority_queue<HeapItem, std::vector<HeapItem>,
+				    decltype(greater)> heap(greater);
+		for (size_t i = 0; i < k; i++) {
+			HeapItem item = {sources[i].get(0), i, 0};
+			heap.push(item);
+		}
+		for (size_t i = 0; i < N * M; i++) {
+			HeapItem item = heap.top();
+			heap.pop();
+			out[i] = item.tuple;
+			if (++item.pos < sources[item.source].count) {
+				item.tuple = sources[item.source].get(item.pos);
+				heap.push(item);
+			}
+		}
+		t1.Stop();
+		std::cout << test_name << " merge " << k << " (heap) Mrps: "
+			  << t1.Mrps(N * M) << t1.Counters(N * M) << std::endl;
+
+		for (int hinted = 0; hinted < 2; hinted++) {
+			def->use_hint = hinted;
+			key_def_set_compare_func(def);
+			CTimer t2;
+			t2.Start();
+			CTupleMerge merge(def, sources.data(), k);
+			for (size_t i = 0; i < N * M; i++)
+				out[i] = merge.Next();
+			t2.Stop();
+			std::cout << test_name << " merge " << k << " (loser tree"
+				  << (hinted ? ", hinted" : "") << ") Mrps: "
+				  << t2.Mrps(N * M)
+				  << t2.Counters(N * M) << std::endl;
+			if (merge.Next() != NULL)
+				abort();
+			for (size_t i = 1; i < N * M; i++)
+				if (default_tuple_compare(def, out[i - 1],
+							  out[i]) > 0)
+					abort();
+		}
 	}
-};
+	def->use_hint = false;
+	key_def_set_compare_func(def);
+}
 
 /**
- * KeyDef is a definition of how tuples are compared. Generally any order
- * of tuple fields may be chosen and then tuples are compared lexicographically
- * field by field, with the chosen field order. Of course any subset of tuple
- * fields may be chosen either.
- * For example we may create a key def: compare fields number 3; than (if 3rds
- * are equal) compare fields number 0; that's all.
- * Different key defs thus must define different order for the same group of
- * tuples. That allows, for example, to construct several indexes for faster
- * tuple search by different tuple fields.
+ * Inserts generated tuples to B+tree with nodes of NODE_SIZE bytes,
+ * looks up all keys, scans the tree and builds it from sorted tuples.
  */
-struct KeyDef {
-	enum field_type_t {
-		UINT,
-		STRING,
-		UNDEFINED,
-	};
-	struct KeyPart {
-		field_type_t field_type;
-		size_t field_no;
-	};
+template <size_t NODE_SIZE>
+NOINLINE void bench_tree(KeyDef *def, const char *test_name)
+{
+	const size_t R = 20;
+	key_def_set_compare_func(def);
+	CTupleTree<NODE_SIZE> tree(def);
+	CTimer t1;
+	for (size_t r = 0; r < R; r++) {
+		tree.Clear();
+		t1.Start();
+		for (size_t i = 0; i < N; i++)
+			tree.Replace(tuple_ptrs[i]);
+		t1.Stop();
+	}
+	std::cout << test_name << " tree " << NODE_SIZE << " insert Mrps: "
+		  << t1.Mrps(R * N) << t1.Counters(R * N) << std::endl;
 
-	/**
-	 * Parts describe how tuples are compared.
-	 * Each part stores field_no and that field type.
-	 */
-	size_t part_count;
-	KeyPart parts[MAX_NUM_FIELDS_IN_KEY];
+	CTimer t2;
+	t2.Start();
+	size_t found = 0;
+	for (size_t r = 0; r < R; r++)
+		for (size_t i = 0; i < N; i++)
+			found += tree.Find(keys[i]) != NULL;
+	t2.Stop();
+	std::cout << test_name << " tree " << NODE_SIZE << " find Mrps: "
+		  << t2.Mrps(R * N) << t2.Counters(R * N) << std::endl;
+	if (found != R * N)
+		abort();
 
-	int (*tuple_compare_f)(KeyDef *def, Tuple *tuple1, Tuple *tuple2);
-};
+	CTimer t3;
+	t3.Start();
+	size_t scanned = 0;
+	for (size_t r = 0; r < R; r++)
+		for (auto it = tree.Begin(); !it.is_end(); it.next())
+			scanned += it.get() != NULL;
+	t3.Stop();
+	std::cout << test_name << " tree " << NODE_SIZE << " scan Mrps: "
+		  << t3.Mrps(scanned) << t3.Counters(scanned) << std::endl;
+
+	// Equal keys are skipped, the tree has unique keys.
+	std::copy(tuple_ptrs, tuple_ptrs + N, sort_ptrs);
+	tuple_sort(def, sort_ptrs, N);
+	size_t count = 0;
+	for (size_t i = 0; i < N; i++)
+		if (count == 0 || def->tuple_compare_f(def, sort_ptrs[count - 1],
+						       sort_ptrs[i]) != 0)
+			sort_ptrs[count++] = sort_ptrs[i];
+	CTimer t4;
+	t4.Start();
+	for (size_t r = 0; r < R; r++)
+		tree.Build(sort_ptrs, count);
+	t4.Stop();
+	std::cout << test_name << " tree " << NODE_SIZE << " build Mrps: "
+		  << t4.Mrps(R * count) << t4.Counters(R * count) << std::endl;
+	if (tree.Size() != count)
+		abort();
+}
 
-int default_tuple_compare(KeyDef *def, Tuple *tuple1, Tuple *tuple2)
+/**
+ * Hashes tuples with default and specialized hash functions, then inserts
+ * generated tuples to hash index, looks up all keys and deletes them.
+ */
+NOINLINE void bench_hash(KeyDef *def, const char *test_name)
 {
-	assert(def->part_count > 0);
+	const size_t R = 20;
+	key_def_set_compare_func(def);
+	uint64_t hashes[2] = {0, 0};
+	for (int specialized = 0; specialized < 2; specialized++) {
+		if (specialized)
+			key_def_set_hash_func(def);
+		else
+			def->tuple_hash_f = default_tuple_hash;
+		CTimer t;
+		t.Start();
+		for (size_t r = 0; r < R; r++)
+			for (size_t i = 0; i < N; i++)
+				hashes[specialized] +=
+					def->tuple_hash_f(def, tuple_ptrs[i]);
+		t.Stop();
+		std::cout << test_name << " hash "
+			  << (specialized ? "specialized" : "default")
+			  << " Mrps: " << t.Mrps(R * N)
+			  << t.Counters(R * N) << std::endl;
+	}
+	if (hashes[0] != hashes[1])
+		abort();
+	for (size_t i = 0; i < N; i++)
+		if (key_hash(def, keys[i]) != def->tuple_hash_f(def, tuples[i]))
+			abort();
 
-	const char *part1;
-	const char *part2;
+	CTupleHashIndex index(def);
+	CTimer t1;
+	for (size_t r = 0; r < R; r++) {
+		index.Clear();
+		t1.Start();
+		for (size_t i = 0; i < N; i++)
+			index.Replace(tuple_ptrs[i]);
+		t1.Stop();
+	}
+	std::cout << test_name << " hash index insert Mrps: "
+		  << t1.Mrps(R * N) << t1.Counters(R * N) << std::endl;
 
-	for (size_t i = 0; i < def->part_count; i++) {
-		KeyDef::KeyPart *part = &def->parts[i];
-
-		if (i == 0 ||
-		    def->parts[i].field_no != def->parts[i - 1].field_no + 1) {
-			/*
-			 * That's an important part. In real life the field
-			 * access by index is a bit more complicated and should
-			 * be avoided.
-			 * One the other hand decoding of a field puts the
-			 * pointer exactly to the next field. So if the fields
-			 * are sequential there's no need to reposition the
-			 * pointer.
-			 * The if condition above makes this optimization.
-			 */
-			part1 = tuple1->get_field(part->field_no);
-			part2 = tuple2->get_field(part->field_no);
+	CTimer t2;
+	t2.Start();
+	size_t found = 0;
+	for (size_t r = 0; r < R; r++)
+		for (size_t i = 0; i < N; i++)
+			found += index.Find(keys[i]) != NULL;
+	t2.Stop();
+	std::cout << test_name << " hash index find Mrps: "
+		  << t2.Mrps(R * N) << t2.Counters(R * N) << std::endl;
+	if (found != R * N)
+		abort();
+
+	size_t count = index.Size();
+	size_t deleted = 0;
+	CTimer t3;
+	t3.Start();
+	for (size_t i = 0; i < N; i++)
+		deleted += index.Delete(keys[i]) != NULL;
+	t3.Stop();
+	std::cout << test_name << " hash index delete Mrps: "
+		  << t3.Mrps(N) << t3.Counters(N) << std::endl;
+	if (deleted != count || index.Size() != 0)
+		abort();
+}
+
+// Looks up all keys by binary search in the sorted array of tuples.
+NOINLINE void bench_sorted_array_find(KeyDef *def, const char *test_name)
+{
+	const size_t R = 20;
+	key_def_set_compare_func(def);
+	std::copy(tuple_ptrs, tuple_ptrs + N, sort_ptrs);
+	tuple_sort(def, sort_ptrs, N);
+	CTimer t;
+	t.Start();
+	size_t found = 0;
+	for (size_t r = 0; r < R; r++) {
+		for (size_t i = 0; i < N; i++) {
+			const char *key = keys[i];
+			Tuple **pos = std::lower_bound(sort_ptrs, sort_ptrs + N, key,
+				[def](Tuple *tuple, const char *key) {
+				return tuple_compare_with_key(def, tuple, key) < 0;
+			});
+			found += pos != sort_ptrs + N;
 		}
+	}
+	t.Stop();
+	std::cout << test_name << " sorted array find Mrps: "
+		  << t.Mrps(R * N) << t.Counters(R * N) << std::endl;
+	if (found != R * N)
+		abort();
+}
 
-		if (def->parts[0].field_type == KeyDef::UINT) {
-			uint64_t value1 = mp_decode_uint(part1);
-			uint64_t value2 = mp_decode_uint(part2);
-			if (value1 < value2)
-				return -1;
-			else if (value1 > value2)
-				return 1;
-		} else {
-			uint32_t len1,len2;
-			const char *string1 = mp_decode_string(part1, len1);
-			const char *string2 = mp_decode_string(part2, len2);
-			uint32_t min_len = len1 < len2 ? len1 : len2;
-			int r = memcmp(string1, string2, min_len);
-			if (r != 0)
-				return r;
-			if (len1 < len2)
-				return -1;
-			else if (len1 > len2)
-				return 1;
+/**
+ * Sorts incoming tuples, that are msgpack arrays in a buffer (as in
+ * replication or recovery), by materializing them into tuples and
+ * by tuple views over the buffer.
+ */
+NOINLINE void bench_tuple_view(KeyDef *def, const char *test_name,
+			       const TupleFormat *format)
+{
+	char *p = view_data;
+	for (size_t i = 0; i < N; i++) {
+		Tuple *tuple = tuple_ptrs[i];
+		const char *fields = tuple->data() + tuple->first_field_offset;
+		size_t size = tuple->data() + tuple->data_used - fields;
+		view_arrays[i] = p;
+		mp_encode_array(p, tuple->field_count);
+		memcpy(p, fields, size);
+		p += size;
+	}
+
+	const size_t R = 20;
+	CTupleArena arena;
+	TupleBuilder builder;
+	CTimer t1;
+	for (size_t r = 0; r < R; r++) {
+		arena.Reset();
+		t1.Start();
+		for (size_t i = 0; i < N; i++) {
+			const char *field = view_arrays[i];
+			uint32_t field_count = mp_decode_array(field);
+			builder.reset(format);
+			for (uint32_t j = 0; j < field_count; j++) {
+				builder.add_encoded(field);
+				mp_next(field);
+			}
+			builder.finish();
+			sort_ptrs[i] = tuple_new(&arena, &builder.tuple);
 		}
-		// If parts are equal - go to the next part.
+		std::sort(sort_ptrs, sort_ptrs + N, [def](Tuple *a, Tuple *b) {
+			return default_tuple_compare(def, a, b) < 0;
+		});
+		t1.Stop();
 	}
+	std::cout << test_name << " incoming sort (materialized) Mrps: "
+		  << t1.Mrps(R * N) << t1.Counters(R * N) << std::endl;
 
-	// All parts are equal.
-	return 0;
+	CTimer t2;
+	for (size_t r = 0; r < R; r++) {
+		t2.Start();
+		for (size_t i = 0; i < N; i++) {
+			views[i].reset(view_arrays[i]);
+			view_ptrs[i] = &views[i];
+		}
+		std::sort(view_ptrs, view_ptrs + N,
+			  [def](TupleView *a, TupleView *b) {
+			return tuple_view_compare(def, a, b) < 0;
+		});
+		t2.Stop();
+	}
+	std::cout << test_name << " incoming sort (view) Mrps: "
+		  << t2.Mrps(R * N) << t2.Counters(R * N) << std::endl;
+
+	for (size_t i = 0; i < N; i++)
+		if (tuple_view_compare_tuple(def, view_ptrs[i], sort_ptrs[i]) != 0)
+			abort();
 }
 
-int tuple_compare_by_first_uint(KeyDef *, Tuple *tuple1, Tuple *tuple2)
+// Add random value of given type to the tuple.
+void generate_field(TupleBuilder *builder, KeyDef::field_type_t field_type)
 {
-	const char *part1 = tuple1->data + tuple1->first_field_offset;
-	const char *part2 = tuple2->data + tuple2->first_field_offset;
-	uint64_t value1 = mp_decode_uint(part1);
-	uint64_t value2 = mp_decode_uint(part2);
-	return value1 < value2 ? -1 : value1 > value2;
+	uint32_t len = 3 + rand() % 6;
+	char string[16];
+	switch (field_type) {
+		case KeyDef::UINT:
+			builder->add((uint64_t)rand());
+			break;
+		case KeyDef::STRING:
+			for (uint32_t k = 0; k < len; k++)
+				string[k] = 'a' + rand() % 20;
+			builder->add(string, len);
+			break;
+		case KeyDef::INTEGER:
+			builder->add_int((int64_t)rand() - RAND_MAX / 2);
+			break;
+		case KeyDef::DOUBLE:
+			builder->add_double((rand() - RAND_MAX / 2) / 1000.0);
+			break;
+		case KeyDef::NUMBER:
+			// Some of doubles are equal to integers.
+			if (rand() % 2)
+				builder->add_int(rand() % 2000 - 1000);
+			else
+				builder->add_double((rand() % 4000 - 2000) / 2.0);
+			break;
+		case KeyDef::BOOLEAN:
+			builder->add_bool(rand() % 2);
+			break;
+		default:
+			assert(field_type == KeyDef::BINARY);
+			for (uint32_t k = 0; k < len; k++)
+				string[k] = rand() % 4;
+			builder->add_bin(string, len);
+	}
 }
 
-#ifdef _WIN32
-#define NOINLINE __declspec(noinline)
-#else
-#define NOINLINE __attribute__((noinline))
-#endif
-
-const size_t N = 5000;
-Tuple tuples[N];
+/**
+ * Add random string of letters in random case to the tuple.
+ * Half of letters are Cyrillic (two bytes in UTF-8) for unicode_ci.
+ */
+void generate_collated_string(TupleBuilder *builder,
+			      const Collation *collation)
+{
+	bool is_unicode = collation == collation_by_id(COLLATION_UNICODE_CI);
+	uint32_t count = 3 + rand() % 6;
+	char string[32];
+	uint32_t len = 0;
+	for (uint32_t k = 0; k < count; k++) {
+		uint32_t letter = rand() % 20;
+		bool is_upper = rand() % 2;
+		if (is_unicode && rand() % 2) {
+			// U+0430 is Cyrillic small a, U+0410 is capital A.
+			uint32_t code = (is_upper ? 0x410 : 0x430) + letter;
+			string[len++] = 0xc0 | (code >> 6);
+			string[len++] = 0x80 | (code & 0x3f);
+		} else {
+			string[len++] = (is_upper ? 'A' : 'a') + letter;
+		}
+	}
+	builder->add(string, len);
+}
 
 // Benchmark for particular key def.
 // Generates N tuples and compares them measuring cosumed time.
@@ -232,76 +655,1336 @@ NOINLINE void bench_key_def(KeyDef *def, const char *test_name)
 {
 	// Generate tuples compatible with key def.
 	KeyDef::field_type_t field_type[TEST_FIELD_COUNT_IN_TUPLE];
-	for (size_t i = 0; i < TEST_FIELD_COUNT_IN_TUPLE; i++)
+	bool field_is_nullable[TEST_FIELD_COUNT_IN_TUPLE];
+	const Collation *field_collation[TEST_FIELD_COUNT_IN_TUPLE];
+	for (size_t i = 0; i < TEST_FIELD_COUNT_IN_TUPLE; i++) {
 		field_type[i] = KeyDef::UNDEFINED;
-	size_t max_field_no = 0;
+		field_is_nullable[i] = false;
+		field_collation[i] = NULL;
+	}
 	for (size_t i = 0; i < def->part_count; i++) {
 		size_t field_no = def->parts[i].field_no;
 		assert(field_no < TEST_FIELD_COUNT_IN_TUPLE);
 		assert(field_type[field_no] == KeyDef::UNDEFINED);
 		field_type[field_no] = def->parts[i].field_type;
 		assert(field_type[field_no] != KeyDef::UNDEFINED);
-		if (i == 0 || field_no > max_field_no)
-			max_field_no = field_no;
+		field_is_nullable[field_no] = def->parts[i].is_nullable;
+		field_collation[field_no] = def->parts[i].collation;
 	}
+	// Only the fields of the key def have offsets.
+	TupleFormat *format = tuple_format_new(&def, 1);
+	tuple_arena.Reset();
+	TupleBuilder builder;
 	for (size_t i = 0; i < N; i++) {
-		tuples[i].reset(max_field_no + 1);
+		builder.reset(format);
 		for (size_t j = 0; j < TEST_FIELD_COUNT_IN_TUPLE; j++) {
 			KeyDef::field_type_t generate_type = field_type[j];
 			if (generate_type == KeyDef::UNDEFINED) {
 				generate_type = rand() % 2 ? KeyDef::UINT
 							   : KeyDef::STRING;
 			}
-			if (generate_type == KeyDef::UINT) {
-				uint64_t value = rand();
-				tuples[i].add(value);
+			// Every tenth value of nullable field is nil.
+			if (field_is_nullable[j] && rand() % 10 == 0)
+				builder.add_nil();
+			else if (field_collation[j] != NULL)
+				generate_collated_string(&builder,
+							 field_collation[j]);
+			else
+				generate_field(&builder, generate_type);
+		}
+		builder.finish();
+		tuples[i] = tuple_new(&tuple_arena, &builder.tuple);
+	}
+	std::cout << test_name << " tuple size: "
+		  << (double)tuple_arena.Used() / N << " (fixed size was "
+		  << sizeof(TupleBuilder) << ")" << std::endl;
+
+	// Shuffle tuple pointers for batch comparison.
+	for (size_t i = 0; i < N; i++) {
+		size_t j = rand() % (i + 1);
+		tuple_ptrs[i] = tuple_ptrs[j];
+		tuple_ptrs[j] = tuples[i];
+	}
+
+	// Extract keys of generated tuples.
+	char *key = keys_data;
+	for (size_t i = 0; i < N; i++) {
+		keys[i] = key;
+		tuple_extract_key(def, tuples[i], key);
+	}
+
+	// The test itself, first with generic comparators, then with
+	// the ones that are specialized for the key def.
+	def->tuple_compare_f = default_tuple_compare;
+	def->tuple_compare_with_key_f = default_tuple_compare_with_key;
+	def->tuple_hash_f = default_tuple_hash;
+	bench_compare(def, test_name, "default");
+	bench_compare_with_key(def, test_name, "default");
+	key_def_set_compiled(def, format);
+	bench_compare(def, test_name, "compiled");
+	bench_compare_with_key(def, test_name, "compiled");
+	key_def_set_compare_func(def);
+	bench_compare(def, test_name, "specialized");
+	bench_compare_with_key(def, test_name, "specialized");
+	def->use_branchless = true;
+	key_def_set_compare_func(def);
+	bench_compare(def, test_name, "branchless");
+	def->use_branchless = false;
+	key_def_set_compare_func(def);
+	bench_compare_batch(def, test_name, false);
+	bench_compare_batch(def, test_name, true);
+	bench_sort(def, test_name);
+	bench_sort_parallel(def, test_name);
+	bench_sort_external(def, test_name);
+	bench_sorted_array_find(def, test_name);
+	bench_tree<256>(def, test_name);
+	bench_tree<TUPLE_TREE_NODE_SIZE>(def, test_name);
+	bench_tree<4096>(def, test_name);
+	bench_hash(def, test_name);
+	bench_tuple_view(def, test_name, format);
+
+	// And with hints that are calculated once for each tuple.
+	for (size_t i = 0; i < N; i++)
+		tuples[i]->hint = tuple_hint(def, tuples[i]);
+	def->use_hint = true;
+	key_def_set_compare_func(def);
+	bench_compare(def, test_name, "hinted");
+	def->use_hint = false;
+	bench_merge(def, test_name);
+
+	tuple_arena.Reset();
+	tuple_format_delete(format);
+}
+
+// Add one of few values of the type to the tuple, so values are often equal.
+void generate_few_values_field(TupleBuilder *builder,
+			       KeyDef::field_type_t field_type)
+{
+	char string[2] = {'a', 'a'};
+	switch (field_type) {
+		case KeyDef::UINT:
+			builder->add((uint64_t)(rand() % 4));
+			break;
+		case KeyDef::STRING:
+			string[1] += rand() % 4;
+			builder->add(string, 2);
+			break;
+		case KeyDef::INTEGER:
+			builder->add_int(rand() % 4 - 2);
+			break;
+		default:
+			assert(field_type == KeyDef::DOUBLE);
+			builder->add_double((rand() % 4) / 2.0);
+	}
+}
+
+/**
+ * Compares all pairs of tuples with few values of key fields, so later
+ * parts decide too, by default_tuple_compare and the compiled comparator.
+ * The runs alternate and the best run of each comparator is shown.
+ */
+NOINLINE void bench_compiled(KeyDef *def, const char *test_name)
+{
+	KeyDef::field_type_t field_type[TEST_FIELD_COUNT_IN_TUPLE];
+	bool field_is_nullable[TEST_FIELD_COUNT_IN_TUPLE];
+	for (size_t i = 0; i < TEST_FIELD_COUNT_IN_TUPLE; i++) {
+		field_type[i] = KeyDef::UNDEFINED;
+		field_is_nullable[i] = false;
+	}
+	for (size_t i = 0; i < def->part_count; i++) {
+		size_t field_no = def->parts[i].field_no;
+		assert(field_no < TEST_FIELD_COUNT_IN_TUPLE);
+		field_type[field_no] = def->parts[i].field_type;
+		field_is_nullable[field_no] = def->parts[i].is_nullable;
+	}
+	TupleFormat *format = tuple_format_new(&def, 1);
+	tuple_arena.Reset();
+	TupleBuilder builder;
+	for (size_t i = 0; i < N; i++) {
+		builder.reset(format);
+		for (size_t j = 0; j < TEST_FIELD_COUNT_IN_TUPLE; j++) {
+			if (field_type[j] == KeyDef::UNDEFINED)
+				generate_field(&builder, rand() % 2 ?
+					       KeyDef::UINT : KeyDef::STRING);
+			else if (field_is_nullable[j] && rand() % 10 == 0)
+				builder.add_nil();
+			else
+				generate_few_values_field(&builder,
+							  field_type[j]);
+		}
+		builder.finish();
+		tuples[i] = tuple_new(&tuple_arena, &builder.tuple);
+	}
+
+	const char *names[2] = {"default", "compiled"};
+	double best[2] = {0, 0};
+	for (size_t run = 0; run < 10; run++) {
+		size_t k = run % 2;
+		if (k == 0)
+			def->tuple_compare_f = default_tuple_compare;
+		else
+			key_def_set_compiled(def, format);
+		CTimer t;
+		t.Start();
+		int r = 0;
+		for (size_t i = 0; i < N; i++)
+			for (size_t j = 0; j < N; j++)
+				r += def->tuple_compare_f(def, tuples[i],
+							  tuples[j]);
+		t.Stop();
+		best[k] = std::max(best[k], t.Mrps(N * N));
+	}
+	for (size_t k = 0; k < 2; k++)
+		std::cout << test_name << " few values (" << names[k]
+			  << ") Mrps: " << best[k] << std::endl;
+	std::cout << test_name << " few values compiled speedup: "
+		  << best[1] / best[0] << std::endl;
+
+	key_def_set_compare_func(def);
+	tuple_arena.Reset();
+	tuple_format_delete(format);
+}
+
+// Add i-th of few values of the type to the tuple, nil if i is 0.
+void check_add_value(TupleBuilder *builder, KeyDef::field_type_t field_type,
+		     size_t i)
+{
+	static const char *const strings[] = {"abc", "ABC", "abd"};
+	static const uint64_t uints[] = {5, 7, 300};
+	if (i == 0)
+		builder->add_nil();
+	else if (field_type == KeyDef::STRING)
+		builder->add(strings[i - 1], 3);
+	else
+		builder->add(uints[i - 1]);
+}
+
+/**
+ * Check branchless comparators of the key def of two parts in fields 0
+ * and 1 against the usual ones on all pairs of tuples, with nils in
+ * nullable parts. Fields are decoded one after another, so a part that
+ * is decided by nil must skip its fields. Abort on mismatch.
+ */
+NOINLINE void check_branchless_key_def(KeyDef *def)
+{
+	const size_t VALUE_COUNT = 4;
+	assert(def->part_count == 2 && def->parts[0].field_no == 0 &&
+	       def->parts[1].field_no == 1);
+	TupleFormat *format = tuple_format_new(&def, 1);
+	CTupleArena arena;
+	Tuple *check_tuples[VALUE_COUNT * VALUE_COUNT];
+	size_t count = 0;
+	TupleBuilder builder;
+	for (size_t i = 0; i < VALUE_COUNT; i++) {
+		for (size_t j = 0; j < VALUE_COUNT; j++) {
+			if ((i == 0 && !def->parts[0].is_nullable) ||
+			    (j == 0 && !def->parts[1].is_nullable))
+				continue;
+			builder.reset(format);
+			check_add_value(&builder, def->parts[0].field_type, i);
+			check_add_value(&builder, def->parts[1].field_type, j);
+			builder.finish();
+			check_tuples[count++] = tuple_new(&arena, &builder.tuple);
+		}
+	}
+	int expected[VALUE_COUNT * VALUE_COUNT][VALUE_COUNT * VALUE_COUNT];
+	def->use_branchless = false;
+	key_def_set_compare_func(def);
+	for (size_t i = 0; i < count; i++)
+		for (size_t j = 0; j < count; j++)
+			expected[i][j] = def->tuple_compare_f(def, check_tuples[i],
+							      check_tuples[j]);
+	def->use_branchless = true;
+	key_def_set_compare_func(def);
+	for (size_t i = 0; i < count; i++) {
+		for (size_t j = 0; j < count; j++) {
+			int r = def->tuple_compare_f(def, check_tuples[i],
+						     check_tuples[j]);
+			if ((r > 0) - (r < 0) !=
+			    (expected[i][j] > 0) - (expected[i][j] < 0))
+				abort();
+		}
+	}
+	def->use_branchless = false;
+	key_def_set_compare_func(def);
+	tuple_format_delete(format);
+}
+
+// Branchless comparators of nullable parts followed by sequential parts.
+NOINLINE void check_branchless()
+{
+	KeyDef def = KeyDef();
+	def.part_count = 2;
+	def.parts[0].field_no = 0;
+	def.parts[0].field_type = KeyDef::STRING;
+	def.parts[0].is_nullable = true;
+	def.parts[0].collation = collation_by_id(COLLATION_ASCII_CI);
+	def.parts[1].field_no = 1;
+	def.parts[1].field_type = KeyDef::UINT;
+	check_branchless_key_def(&def);
+
+	def.parts[0].field_type = KeyDef::UINT;
+	def.parts[0].collation = NULL;
+	def.parts[1].field_type = KeyDef::STRING;
+	check_branchless_key_def(&def);
+}
+
+/**
+ * Compiled comparators of the key def, with and without branches and
+ * slots of the format of the key def, give the same results as the
+ * default ones, also for parts of keys. Half of tuples are of a format
+ * with other slots.
+ */
+NOINLINE void check_compiled_key_def(KeyDef *def)
+{
+	const size_t COUNT = 64;
+	TupleFormat *format = tuple_format_new(&def, 1);
+	KeyDef other = KeyDef();
+	other.part_count = 2;
+	other.parts[0].field_no = 1;
+	other.parts[1].field_no = 3;
+	KeyDef *defs[2] = {def, &other};
+	TupleFormat *other_format = tuple_format_new(defs, 2);
+	CTupleArena arena;
+	Tuple *check_tuples[COUNT];
+	char key_data[COUNT * MAX_TEST_TUPLE_DATA_SIZE];
+	const char *check_keys[COUNT];
+	char *key = key_data;
+	TupleBuilder builder;
+	for (size_t i = 0; i < COUNT; i++) {
+		builder.reset(i % 2 ? format : other_format);
+		for (size_t j = 0; j < TEST_FIELD_COUNT_IN_TUPLE; j++) {
+			const KeyDef::KeyPart *part = NULL;
+			for (size_t k = 0; k < def->part_count; k++)
+				if (def->parts[k].field_no == j)
+					part = &def->parts[k];
+			if (part == NULL)
+				generate_field(&builder, KeyDef::STRING);
+			else if (part->is_nullable && rand() % 4 == 0)
+				builder.add_nil();
+			else
+				generate_few_values_field(&builder,
+							  part->field_type);
+		}
+		builder.finish();
+		check_tuples[i] = tuple_new(&arena, &builder.tuple);
+		check_keys[i] = key;
+		tuple_extract_key(def, check_tuples[i], key);
+	}
+	for (int k = 0; k < 4; k++) {
+		def->use_branchless = k % 2;
+		key_def_set_compiled(def, k < 2 ? NULL : format);
+		for (size_t i = 0; i < COUNT; i++) {
+			for (size_t j = 0; j < COUNT; j++) {
+				int r = def->tuple_compare_f(def, check_tuples[i],
+							     check_tuples[j]);
+				int e = default_tuple_compare(def, check_tuples[i],
+							      check_tuples[j]);
+				if ((r > 0) - (r < 0) != (e > 0) - (e < 0))
+					abort();
+				for (uint32_t n = 0; n <= def->part_count; n++) {
+					const char *parts = check_keys[j];
+					mp_decode_array(parts);
+					r = def->tuple_compare_with_key_f(def,
+						check_tuples[i], parts, n);
+					e = default_tuple_compare_with_key(def,
+						check_tuples[i], parts, n);
+					if ((r > 0) - (r < 0) != (e > 0) - (e < 0))
+						abort();
+				}
+			}
+		}
+	}
+	def->use_branchless = false;
+	key_def_set_compare_func(def);
+	tuple_format_delete(other_format);
+	tuple_format_delete(format);
+}
+
+// Compiled programs with runs of parts and fields found by slots.
+NOINLINE void check_compiled()
+{
+	KeyDef def = KeyDef();
+	def.part_count = 4;
+	for (size_t i = 0; i < 4; i++) {
+		def.parts[i].field_no = 2 + i;
+		def.parts[i].field_type = KeyDef::UINT;
+	}
+	check_compiled_key_def(&def);
+
+	def.part_count = 6;
+	def.parts[0].field_no = 0;
+	def.parts[0].field_type = KeyDef::STRING;
+	def.parts[0].collation = collation_by_id(COLLATION_ASCII_CI);
+	def.parts[1].field_no = 1;
+	def.parts[1].field_type = KeyDef::STRING;
+	def.parts[1].collation = collation_by_id(COLLATION_ASCII_CI);
+	def.parts[1].is_nullable = true;
+	def.parts[2].field_no = 2;
+	def.parts[2].field_type = KeyDef::INTEGER;
+	def.parts[3].field_no = 6;
+	def.parts[3].field_type = KeyDef::UINT;
+	def.parts[3].is_nullable = true;
+	def.parts[4].field_no = 7;
+	def.parts[4].field_type = KeyDef::UINT;
+	def.parts[4].is_nullable = true;
+	def.parts[5].field_no = 4;
+	def.parts[5].field_type = KeyDef::DOUBLE;
+	check_compiled_key_def(&def);
+}
+
+/**
+ * Fields that don't fit into TupleBuilder overflow it and are not added,
+ * the memory after its data is not touched even without asserts.
+ */
+NOINLINE void check_tuple_builder_overflow()
+{
+	struct GuardedBuilder {
+		TupleBuilder builder;
+		char guard[64];
+	};
+	KeyDef def = KeyDef();
+	def.part_count = 1;
+	def.parts[0].field_no = 1;
+	def.parts[0].field_type = KeyDef::STRING;
+	KeyDef *defs[1] = {&def};
+	TupleFormat *format = tuple_format_new(defs, 1);
+	GuardedBuilder *guarded = new GuardedBuilder;
+	memset(guarded->guard, 0x5a, sizeof(guarded->guard));
+	TupleBuilder &builder = guarded->builder;
+	char string[MAX_TEST_TUPLE_DATA_SIZE];
+	memset(string, 'a', sizeof(string));
+
+	builder.reset(format);
+	builder.add((uint64_t)1);
+	builder.add(string, 100);
+	if (builder.is_overflow)
+		abort();
+	uint32_t data_used = builder.tuple.data_used;
+	builder.add(string, MAX_TEST_TUPLE_DATA_SIZE - 100);
+	if (!builder.is_overflow || builder.tuple.data_used != data_used ||
+	    builder.tuple.field_count != 2)
+		abort();
+	// The next fields are not added even if they fit.
+	builder.add((uint64_t)1);
+	builder.add_nil();
+	builder.add_double(1.0);
+	if (!builder.is_overflow || builder.tuple.field_count != 2)
+		abort();
+	builder.finish();
+	if (builder.format != format)
+		abort();
+	for (size_t i = 0; i < sizeof(guarded->guard); i++)
+		if (guarded->guard[i] != 0x5a)
+			abort();
+	// Reset clears overflow, the buffer is filled exactly.
+	builder.reset(format);
+	builder.add((uint64_t)1);
+	// The string is longer than 31 bytes and has str 8 header.
+	uint32_t len = MAX_TEST_TUPLE_DATA_SIZE - builder.tuple.data_used - 2;
+	builder.add(string, len);
+	if (builder.is_overflow ||
+	    builder.tuple.data_used != MAX_TEST_TUPLE_DATA_SIZE)
+		abort();
+	builder.add_nil();
+	if (!builder.is_overflow)
+		abort();
+	delete guarded;
+	tuple_format_delete(format);
+}
+
+// Write the file and return whether it's opened as a run.
+bool check_run_open(const std::vector<char> &file, const char *path)
+{
+	FILE *out = fopen(path, "wb");
+	if (out == NULL)
+		abort();
+	if (fwrite(file.data(), 1, file.size(), out) != file.size())
+		abort();
+	fclose(out);
+	CTupleRun run;
+	return run.Open(path);
+}
+
+// Runs with tuples or block keys out of their sections are not opened.
+NOINLINE void check_run_corrupted()
+{
+	const size_t COUNT = 1000;
+	const char *path = "check_run_corrupted.run";
+	KeyDef def = KeyDef();
+	def.part_count = 2;
+	def.parts[0].field_no = 1;
+	def.parts[0].field_type = KeyDef::UINT;
+	def.parts[1].field_no = 3;
+	def.parts[1].field_type = KeyDef::STRING;
+	key_def_set_compare_func(&def);
+	KeyDef *defs[1] = {&def};
+	TupleFormat *format = tuple_format_new(defs, 1);
+	CTupleArena arena;
+	TupleBuilder builder;
+	CTupleRunWriter writer(&def, 8);
+	if (!writer.Open(path))
+		abort();
+	for (size_t i = 0; i < COUNT; i++) {
+		builder.reset(format);
+		builder.add((uint64_t)i);
+		builder.add((uint64_t)i);
+		builder.add((uint64_t)i * 1000);
+		builder.add("key", 3);
+		builder.finish();
+		writer.Add(tuple_new(&arena, &builder.tuple));
+	}
+	if (!writer.Finish())
+		abort();
+
+	std::vector<char> file;
+	FILE *in = fopen(path, "rb");
+	if (in == NULL)
+		abort();
+	char buf[4096];
+	size_t size;
+	while ((size = fread(buf, 1, sizeof(buf), in)) != 0)
+		file.insert(file.end(), buf, buf + size);
+	fclose(in);
+	if (!check_run_open(file, path))
+		abort();
+	TupleRunHeader header;
+	memcpy(&header, file.data(), sizeof(header));
+	if (header.block_count < 2)
+		abort();
+	uint64_t *offsets = (uint64_t *)(file.data() + header.offsets_offset);
+	TupleRunBlock *blocks =
+		(TupleRunBlock *)(file.data() + header.blocks_offset);
+
+	std::vector<char> corrupted = file;
+	uint64_t *tuple_offset = (uint64_t *)(corrupted.data() +
+					      header.offsets_offset) + 10;
+	// Tuple offset in the tuple offsets section.
+	*tuple_offset = header.offsets_offset;
+	if (check_run_open(corrupted, path))
+		abort();
+	// Tuple offset that is not aligned.
+	*tuple_offset = offsets[10] + 1;
+	if (check_run_open(corrupted, path))
+		abort();
+	// Tuple offset of the header.
+	*tuple_offset = 0;
+	if (check_run_open(corrupted, path))
+		abort();
+	// The last tuple goes beyond the tuples section.
+	corrupted = file;
+	Tuple *last = (Tuple *)(corrupted.data() + offsets[COUNT - 1]);
+	last->data_used += TUPLE_RUN_ALIGN;
+	if (check_run_open(corrupted, path))
+		abort();
+	// Offset slot of a tuple is beyond its data.
+	corrupted = file;
+	Tuple *tuple = (Tuple *)(corrupted.data() + offsets[20]);
+	tuple->data()[0] = (char)0xff;
+	if (check_run_open(corrupted, path))
+		abort();
+	// Block key in the block index.
+	corrupted = file;
+	TupleRunBlock *block = (TupleRunBlock *)(corrupted.data() +
+						 header.blocks_offset) + 1;
+	block->key_offset = header.blocks_offset;
+	if (check_run_open(corrupted, path))
+		abort();
+	// Block key beyond the file.
+	block->key_offset = corrupted.size();
+	if (check_run_open(corrupted, path))
+		abort();
+	// Block key that is not an array, and that has a bad marker.
+	block->key_offset = blocks[1].key_offset;
+	corrupted[blocks[1].key_offset] = (char)0xa3;
+	if (check_run_open(corrupted, path))
+		abort();
+	corrupted[blocks[1].key_offset] = file[blocks[1].key_offset];
+	corrupted[blocks[1].key_offset + 1] = (char)0xc1;
+	if (check_run_open(corrupted, path))
+		abort();
+	// Blocks out of order of tuples.
+	corrupted = file;
+	block = (TupleRunBlock *)(corrupted.data() + header.blocks_offset) + 1;
+	block->first_tuple = 0;
+	if (check_run_open(corrupted, path))
+		abort();
+	// The last block key is truncated.
+	corrupted = file;
+	corrupted.resize(corrupted.size() - 1);
+	if (check_run_open(corrupted, path))
+		abort();
+
+	remove(path);
+	tuple_format_delete(format);
+}
+
+// Encode uint with given size of payload, 0 for positive fixint.
+void check_encode_uint(char *&data, uint64_t value, uint32_t size)
+{
+	switch (size) {
+		case 0:
+			mp_write<uint8_t>(data, value);
+			break;
+		case 1:
+			mp_write<uint8_t>(data, 0xcc);
+			mp_write<uint8_t>(data, value);
+			break;
+		case 2:
+			mp_write<uint8_t>(data, 0xcd);
+			mp_write<uint16_t>(data, value);
+			break;
+		case 4:
+			mp_write<uint8_t>(data, 0xce);
+			mp_write<uint32_t>(data, value);
+			break;
+		default:
+			assert(size == 8);
+			mp_write<uint8_t>(data, 0xcf);
+			mp_write<uint64_t>(data, value);
+	}
+}
+
+/**
+ * Check uint comparators on equal and adjacent values in all encodings
+ * that fit them, not only in the shortest ones. Abort on mismatch.
+ */
+NOINLINE void check_compare_uint()
+{
+	static const uint64_t values[] = {
+		0, 5, 6, 0x7f, 0x80, UINT8_MAX, UINT8_MAX + 1, UINT16_MAX,
+		UINT16_MAX + 1, UINT32_MAX, (uint64_t)UINT32_MAX + 1,
+	};
+	static const uint32_t sizes[] = {0, 1, 2, 4, 8};
+	const size_t value_count = sizeof(values) / sizeof(values[0]);
+	const size_t size_count = sizeof(sizes) / sizeof(sizes[0]);
+	char data[value_count * size_count][MP_MAX_SIZEOF_NUM];
+	uint64_t decoded[value_count * size_count];
+	size_t count = 0;
+	for (size_t i = 0; i < value_count; i++) {
+		for (size_t j = 0; j < size_count; j++) {
+			uint64_t max = sizes[j] == 0 ? 0x7f :
+				       sizes[j] == 8 ? UINT64_MAX :
+				       (1ull << (8 * sizes[j])) - 1;
+			if (values[i] > max)
+				continue;
+			char *p = data[count];
+			check_encode_uint(p, values[i], sizes[j]);
+			decoded[count++] = values[i];
+		}
+	}
+	for (size_t i = 0; i < count; i++) {
+		for (size_t j = 0; j < count; j++) {
+			int expected = decoded[i] < decoded[j] ? -1 :
+				       decoded[i] > decoded[j];
+			const char *p1 = data[i];
+			const char *p2 = data[j];
+			if (mp_compare_uint(p1, p2) != expected)
+				abort();
+			const char *end1 = data[i];
+			const char *end2 = data[j];
+			mp_next(end1);
+			mp_next(end2);
+			if (p1 != end1 || p2 != end2)
+				abort();
+			p1 = data[i];
+			p2 = data[j];
+			if (mp_compare_uint_branchless(p1, p2) != expected)
+				abort();
+		}
+	}
+}
+
+// Buffer with encoded uints for decode benchmarks.
+const size_t UINT_BENCH_COUNT = 1000000;
+char uint_bench_data[UINT_BENCH_COUNT * 9 + MP_DECODE_UINT_FAST_PADDING];
+
+// Compares mp_decode_uint and mp_decode_uint_fast on a mix of uint sizes.
+NOINLINE void bench_decode_uint()
+{
+	// About 40% fixint, 25% uint8, 15% uint16, 15% uint32, 5% uint64.
+	char *p = uint_bench_data;
+	for (size_t i = 0; i < UINT_BENCH_COUNT; i++) {
+		int kind = rand() % 20;
+		uint64_t value = rand();
+		if (kind < 8)
+			value %= 0x80;
+		else if (kind < 13)
+			value = 0x80 + value % 0x80;
+		else if (kind < 16)
+			value = 0x100 + value % 0xff00;
+		else if (kind < 19)
+			value = 0x10000 + value;
+		else
+			value = (value << 32) | 0x100000000ull;
+		mp_encode_uint(p, value);
+	}
+
+	const size_t R = 20;
+	uint64_t sum1 = 0, sum2 = 0;
+	CTimer t1;
+	t1.Start();
+	for (size_t r = 0; r < R; r++) {
+		const char *data = uint_bench_data;
+		for (size_t i = 0; i < UINT_BENCH_COUNT; i++)
+			sum1 += mp_decode_uint(data);
+	}
+	t1.Stop();
+	std::cout << "decode uint Mrps: " << t1.Mrps(R * UINT_BENCH_COUNT)
+		  << t1.Counters(R * UINT_BENCH_COUNT)
+		  << std::endl;
+
+	CTimer t2;
+	t2.Start();
+	for (size_t r = 0; r < R; r++) {
+		const char *data = uint_bench_data;
+		for (size_t i = 0; i < UINT_BENCH_COUNT; i++)
+			sum2 += mp_decode_uint_fast(data);
+	}
+	t2.Stop();
+	std::cout << "decode uint fast Mrps: " << t2.Mrps(R * UINT_BENCH_COUNT)
+		  << t2.Counters(R * UINT_BENCH_COUNT)
+		  << std::endl;
+	if (sum1 != sum2)
+		abort();
+}
+
+// Records of (uint, string, uint, double) for encode benchmarks.
+const size_t WRITER_BENCH_COUNT = 1000000;
+const uint32_t WRITER_BENCH_MAX_SIZE = 1 + 9 + 5 + 16 + 9 + 9;
+struct WriterBenchRecord {
+	uint64_t id;
+	char name[16];
+	uint32_t name_len;
+	uint64_t count;
+	double score;
+};
+char writer_bench_data[WRITER_BENCH_COUNT * WRITER_BENCH_MAX_SIZE];
+
+/**
+ * Compares encoding of records to a raw pointer by mp_encode_* with
+ * CMpWriter: checked values in growable memory, unchecked values with
+ * one reserve per record, checked values in a fixed buffer. Then
+ * compares encoding of tuples one by one with batched AddTuples, tuples
+ * of N first records are built with the format of def.
+ */
+NOINLINE void bench_mp_writer(KeyDef *def)
+{
+	std::vector<WriterBenchRecord> records(WRITER_BENCH_COUNT);
+	for (size_t i = 0; i < WRITER_BENCH_COUNT; i++) {
+		WriterBenchRecord &record = records[i];
+		record.id = i;
+		record.name_len = 8 + rand() % 9;
+		for (uint32_t k = 0; k < record.name_len; k++)
+			record.name[k] = 'a' + rand() % 20;
+		record.count = rand() % 2 ? rand() % 100 : rand();
+		record.score = rand() / 1000.0;
+	}
+
+	const size_t R = 10;
+	size_t size = 0;
+	CTimer t1;
+	for (size_t r = 0; r < R; r++) {
+		t1.Start();
+		char *p = writer_bench_data;
+		for (size_t i = 0; i < WRITER_BENCH_COUNT; i++) {
+			const WriterBenchRecord &record = records[i];
+			mp_encode_array(p, 4);
+			mp_encode_uint(p, record.id);
+			mp_encode_string(p, record.name, record.name_len);
+			mp_encode_uint(p, record.count);
+			mp_encode_double(p, record.score);
+		}
+		t1.Stop();
+		size = p - writer_bench_data;
+	}
+	std::cout << "encode raw Mrps: " << t1.Mrps(R * WRITER_BENCH_COUNT)
+		  << t1.Counters(R * WRITER_BENCH_COUNT) << std::endl;
+
+	CMpWriter writer;
+	CTimer t2;
+	for (size_t r = 0; r < R; r++) {
+		writer.Clear();
+		t2.Start();
+		for (size_t i = 0; i < WRITER_BENCH_COUNT; i++) {
+			const WriterBenchRecord &record = records[i];
+			writer.AddArray(4);
+			writer.AddUint(record.id);
+			writer.AddString(record.name, record.name_len);
+			writer.AddUint(record.count);
+			writer.AddDouble(record.score);
+		}
+		t2.Stop();
+	}
+	std::cout << "encode writer Mrps: " << t2.Mrps(R * WRITER_BENCH_COUNT)
+		  << t2.Counters(R * WRITER_BENCH_COUNT) << std::endl;
+	if (writer.Size() != size ||
+	    memcmp(writer.Data(), writer_bench_data, size) != 0)
+		abort();
+
+	CTimer t3;
+	for (size_t r = 0; r < R; r++) {
+		writer.Clear();
+		t3.Start();
+		for (size_t i = 0; i < WRITER_BENCH_COUNT; i++) {
+			const WriterBenchRecord &record = records[i];
+			char *p = writer.Begin(WRITER_BENCH_MAX_SIZE);
+			mp_encode_array(p, 4);
+			mp_encode_uint(p, record.id);
+			mp_encode_string(p, record.name, record.name_len);
+			mp_encode_uint(p, record.count);
+			mp_encode_double(p, record.score);
+			writer.End(p);
+		}
+		t3.Stop();
+	}
+	std::cout << "encode writer reserved Mrps: "
+		  << t3.Mrps(R * WRITER_BENCH_COUNT)
+		  << t3.Counters(R * WRITER_BENCH_COUNT) << std::endl;
+	if (writer.Size() != size ||
+	    memcmp(writer.Data(), writer_bench_data, size) != 0)
+		abort();
+
+	// Encode into the buffer of the raw encoding, that fits exactly.
+	std::vector<char> expected(writer_bench_data, writer_bench_data + size);
+	CTimer t4;
+	for (size_t r = 0; r < R; r++) {
+		CMpWriter fixed(writer_bench_data, size);
+		t4.Start();
+		for (size_t i = 0; i < WRITER_BENCH_COUNT; i++) {
+			const WriterBenchRecord &record = records[i];
+			fixed.AddArray(4);
+			fixed.AddUint(record.id);
+			fixed.AddString(record.name, record.name_len);
+			fixed.AddUint(record.count);
+			fixed.AddDouble(record.score);
+		}
+		t4.Stop();
+		if (fixed.IsOverflow() || fixed.Size() != size)
+			abort();
+		// One more value does not fit.
+		fixed.AddNil();
+		if (!fixed.IsOverflow() || fixed.Size() != size)
+			abort();
+	}
+	std::cout << "encode writer fixed Mrps: "
+		  << t4.Mrps(R * WRITER_BENCH_COUNT)
+		  << t4.Counters(R * WRITER_BENCH_COUNT) << std::endl;
+	if (memcmp(expected.data(), writer_bench_data, size) != 0)
+		abort();
+
+	TupleFormat *format = tuple_format_new(&def, 1);
+	tuple_arena.Reset();
+	TupleBuilder builder;
+	for (size_t i = 0; i < N; i++) {
+		const WriterBenchRecord &record = records[i];
+		builder.reset(format);
+		builder.add(record.id);
+		builder.add(record.name, record.name_len);
+		builder.add(record.count);
+		builder.add_double(record.score);
+		builder.finish();
+		tuples[i] = tuple_new(&tuple_arena, &builder.tuple);
+	}
+
+	const size_t TR = 200;
+	CTimer t5;
+	for (size_t r = 0; r < TR; r++) {
+		writer.Clear();
+		t5.Start();
+		for (size_t i = 0; i < N; i++) {
+			const Tuple *tuple = tuples[i];
+			writer.AddArray(tuple->field_count);
+			writer.AddRaw(tuple->data() + tuple->first_field_offset,
+				      tuple->data_used - tuple->first_field_offset);
+		}
+		t5.Stop();
+	}
+	std::cout << "encode tuples Mrps: " << t5.Mrps(TR * N)
+		  << t5.Counters(TR * N) << std::endl;
+	expected.assign(writer.Data(), writer.Data() + writer.Size());
+
+	CTimer t6;
+	for (size_t r = 0; r < TR; r++) {
+		writer.Clear();
+		t6.Start();
+		writer.AddTuples(tuples, N);
+		t6.Stop();
+	}
+	std::cout << "encode tuples batched Mrps: " << t6.Mrps(TR * N)
+		  << t6.Counters(TR * N) << std::endl;
+	if (writer.Size() != expected.size() ||
+	    memcmp(writer.Data(), expected.data(), expected.size()) != 0)
+		abort();
+
+	tuple_arena.Reset();
+	tuple_format_delete(format);
+}
+
+// Buffer with encoded strings for string compare benchmark.
+const size_t STRING_BENCH_COUNT = 2000;
+const uint32_t STRING_BENCH_MAX_LEN = 200;
+char string_bench_data[STRING_BENCH_COUNT * (STRING_BENCH_MAX_LEN + 5)];
+const char *string_bench[STRING_BENCH_COUNT];
+
+// String comparison with memcmp, as it was made before mem_compare.
+inline int
+mp_compare_string_memcmp(const char *&data1, const char *&data2)
+{
+	uint32_t len1, len2;
+	const char *string1 = mp_decode_string(data1, len1);
+	const char *string2 = mp_decode_string(data2, len2);
+	uint32_t min_len = len1 < len2 ? len1 : len2;
+	int r = memcmp(string1, string2, min_len);
+	if (r != 0)
+		return r;
+	return len1 < len2 ? -1 : len1 > len2;
+}
+
+// Compares long strings (like URLs) with long common prefixes.
+NOINLINE void bench_compare_string()
+{
+	const char prefix[] = "https://example.com/catalog/items/";
+	const uint32_t prefix_len = sizeof(prefix) - 1;
+	char *p = string_bench_data;
+	for (size_t i = 0; i < STRING_BENCH_COUNT; i++) {
+		uint32_t len = 32 + rand() % (STRING_BENCH_MAX_LEN - 32 + 1);
+		char string[STRING_BENCH_MAX_LEN];
+		memcpy(string, prefix, prefix_len);
+		// Long runs of the same letter make long common prefixes.
+		for (uint32_t k = prefix_len; k < len; k++)
+			string[k] = rand() % 16 == 0 ? 'a' + rand() % 2 : 'x';
+		string_bench[i] = p;
+		mp_encode_string(p, string, len);
+	}
+
+	int r1 = 0, r2 = 0;
+	CTimer t1;
+	t1.Start();
+	for (size_t i = 0; i < STRING_BENCH_COUNT; i++) {
+		for (size_t j = 0; j < STRING_BENCH_COUNT; j++) {
+			const char *data1 = string_bench[i];
+			const char *data2 = string_bench[j];
+			int r = mp_compare_string_memcmp(data1, data2);
+			r1 += (r > 0) - (r < 0);
+		}
+	}
+	t1.Stop();
+	std::cout << "compare long string (memcmp) Mrps: "
+		  << t1.Mrps(STRING_BENCH_COUNT * STRING_BENCH_COUNT)
+		  << t1.Counters(STRING_BENCH_COUNT * STRING_BENCH_COUNT)
+		  << std::endl;
+
+	CTimer t2;
+	t2.Start();
+	for (size_t i = 0; i < STRING_BENCH_COUNT; i++) {
+		for (size_t j = 0; j < STRING_BENCH_COUNT; j++) {
+			const char *data1 = string_bench[i];
+			const char *data2 = string_bench[j];
+			int r = mp_compare_string(data1, data2);
+			r2 += (r > 0) - (r < 0);
+		}
+	}
+	t2.Stop();
+	std::cout << "compare long string (mem_compare) Mrps: "
+		  << t2.Mrps(STRING_BENCH_COUNT * STRING_BENCH_COUNT)
+		  << t2.Counters(STRING_BENCH_COUNT * STRING_BENCH_COUNT)
+		  << std::endl;
+	if (r1 != r2)
+		abort();
+}
+
+// Wide tuples for skip benchmark: data of many fields without offsets.
+const size_t SKIP_BENCH_COUNT = 10000;
+const size_t SKIP_BENCH_FIELD_COUNT = 128;
+// The field that is looked up, as a late field of secondary index.
+const size_t SKIP_BENCH_FIELD_NO = 100;
+char skip_bench_data[SKIP_BENCH_COUNT * SKIP_BENCH_FIELD_COUNT * 10];
+const char *skip_bench[SKIP_BENCH_COUNT];
+
+// Skip a value by decoding it, as it was made before mp_next.
+inline void
+mp_next_decode(const char *&data)
+{
+	uint8_t c = data[0];
+	if ((c >= 0xa0 && c <= 0xbf) || (c >= 0xd9 && c <= 0xdb)) {
+		uint32_t len;
+		mp_decode_string(data, len);
+	} else {
+		mp_decode_uint(data);
+	}
+}
+
+// Compares ways to reach a late field: step by step decode, mp_next
+// and mp_skip_n. Percent of small uints (positive fixints) is given,
+// the rest are bigger uints and short strings.
+NOINLINE void bench_skip(const char *test_name, int fixint_percent)
+{
+	char *p = skip_bench_data;
+	for (size_t i = 0; i < SKIP_BENCH_COUNT; i++) {
+		skip_bench[i] = p;
+		for (size_t j = 0; j < SKIP_BENCH_FIELD_COUNT; j++) {
+			int kind = rand() % 100;
+			if (kind < fixint_percent) {
+				mp_encode_uint(p, rand() % 0x80);
+			} else if (kind % 2 == 0) {
+				mp_encode_uint(p, rand());
 			} else {
 				uint32_t len = 3 + rand() % 6;
 				char string[16];
 				for (uint32_t k = 0; k < len; k++)
 					string[k] = 'a' + rand() % 20;
-				tuples[i].add(string, len);
+				mp_encode_string(p, string, len);
 			}
 		}
 	}
 
-	// The test itself
+	const size_t R = 20;
+	const size_t count = R * SKIP_BENCH_COUNT;
+	size_t sum1 = 0, sum2 = 0, sum3 = 0;
+	CTimer t1;
+	t1.Start();
+	for (size_t r = 0; r < R; r++) {
+		for (size_t i = 0; i < SKIP_BENCH_COUNT; i++) {
+			const char *data = skip_bench[i];
+			for (size_t j = 0; j < SKIP_BENCH_FIELD_NO; j++)
+				mp_next_decode(data);
+			sum1 += data - skip_bench[i];
+		}
+	}
+	t1.Stop();
+	std::cout << test_name << " skip (decode) Mrps: " << t1.Mrps(count)
+		  << t1.Counters(count)
+		  << std::endl;
+
+	CTimer t2;
+	t2.Start();
+	for (size_t r = 0; r < R; r++) {
+		for (size_t i = 0; i < SKIP_BENCH_COUNT; i++) {
+			const char *data = skip_bench[i];
+			for (size_t j = 0; j < SKIP_BENCH_FIELD_NO; j++)
+				mp_next(data);
+			sum2 += data - skip_bench[i];
+		}
+	}
+	t2.Stop();
+	std::cout << test_name << " skip (mp_next) Mrps: " << t2.Mrps(count)
+		  << t2.Counters(count)
+		  << std::endl;
+
+	CTimer t3;
+	t3.Start();
+	for (size_t r = 0; r < R; r++) {
+		for (size_t i = 0; i < SKIP_BENCH_COUNT; i++) {
+			const char *data = skip_bench[i];
+			mp_skip_n(data, SKIP_BENCH_FIELD_NO);
+			sum3 += data - skip_bench[i];
+		}
+	}
+	t3.Stop();
+	std::cout << test_name << " skip (mp_skip_n) Mrps: " << t3.Mrps(count)
+		  << t3.Counters(count)
+		  << std::endl;
+	if (sum1 != sum2 || sum1 != sum3)
+		abort();
+}
+
+const size_t SETJMP_BENCH_COUNT = 1000000;
+
+// The loop is apart from the timer, so nothing else lives across setjmp.
+NOINLINE void setjmp_loop()
+{
+	jmp_buf env;
+	for (size_t i = 0; i < SETJMP_BENCH_COUNT; i++)
+		if (setjmp(env) != 0)
+			abort();
+}
+
+NOINLINE void bench_setjump()
+{
+	const size_t M = SETJMP_BENCH_COUNT;
 	CTimer t;
 	t.Start();
-	int r = 0;
-	for (size_t i = 0; i < N; i++)
-		for (size_t j = 0; j < N; j++)
-			r += def->tuple_compare_f(def, &tuples[i], &tuples[j]);
+	setjmp_loop();
 	t.Stop();
-	std::cout << test_name << " Mrps: " << t.Mrps(N * N) << std::endl;
+	std::cout << "setjmp Mrps: " << t.Mrps(M) << t.Counters(M) << std::endl;
 }
 
-NOINLINE void bench_setjump()
+// Keys of (uint, string, uint) from untrusted input for check benchmarks.
+const size_t CHECK_BENCH_COUNT = 1000000;
+const size_t CHECK_BENCH_MAX_SIZE = 1 + 9 + 2 + 16 + 9;
+char check_bench_data[CHECK_BENCH_COUNT * CHECK_BENCH_MAX_SIZE];
+
+// Decode the key without checks, add its values to sum.
+inline void
+check_bench_decode(const char *&data, uint64_t &sum)
+{
+	uint32_t size = mp_decode_array(data);
+	assert(size == 3);
+	(void)size;
+	sum += mp_decode_uint(data);
+	uint32_t len;
+	mp_decode_string(data, len);
+	sum += len;
+	sum += mp_decode_uint(data);
+}
+
+// Decode the key by bounded decoders, the errors are returned.
+inline mp_check_t
+check_bench_decode_bounded(const char *&data, const char *end, uint64_t &sum)
+{
+	const char *p = data;
+	uint32_t size;
+	mp_check_t r = mp_check_array(p, end, size);
+	if (r != MP_CHECK_OK)
+		return r;
+	if (size != 3)
+		return MP_CHECK_BAD_VALUE;
+	uint64_t value1;
+	r = mp_check_uint(p, end, value1);
+	if (r != MP_CHECK_OK)
+		return r;
+	const char *string;
+	uint32_t len;
+	r = mp_check_string(p, end, string, len);
+	if (r != MP_CHECK_OK)
+		return r;
+	uint64_t value2;
+	r = mp_check_uint(p, end, value2);
+	if (r != MP_CHECK_OK)
+		return r;
+	sum += value1 + len + value2;
+	data = p;
+	return MP_CHECK_OK;
+}
+
+// Check the key by key_check, then decode it without checks.
+inline mp_check_t
+check_bench_decode_validated(KeyDef *def, const char *&data, const char *end,
+			     uint64_t &sum)
+{
+	const char *key = data;
+	mp_check_t r = key_check(def, data, end);
+	if (r != MP_CHECK_OK)
+		return r;
+	const char *parts = key;
+	if (mp_decode_array(parts) != 3)
+		return MP_CHECK_BAD_VALUE;
+	check_bench_decode(key, sum);
+	return MP_CHECK_OK;
+}
+
+// Bounded decoders that jump to env on errors, as parsers with setjmp do.
+inline uint64_t
+jmp_decode_uint(const char *&data, const char *end, jmp_buf env)
+{
+	uint64_t value;
+	if (mp_check_uint(data, end, value) != MP_CHECK_OK)
+		longjmp(env, 1);
+	return value;
+}
+
+inline uint32_t
+jmp_decode_string_len(const char *&data, const char *end, jmp_buf env)
+{
+	const char *string;
+	uint32_t len;
+	if (mp_check_string(data, end, string, len) != MP_CHECK_OK)
+		longjmp(env, 1);
+	return len;
+}
+
+inline void
+jmp_decode_key(const char *&data, const char *end, uint64_t &sum,
+	       jmp_buf env)
+{
+	uint32_t size;
+	if (mp_check_array(data, end, size) != MP_CHECK_OK || size != 3)
+		longjmp(env, 1);
+	sum += jmp_decode_uint(data, end, env);
+	sum += jmp_decode_string_len(data, end, env);
+	sum += jmp_decode_uint(data, end, env);
+}
+
+// setjmp for every key, as for every request of a client.
+NOINLINE bool
+check_bench_decode_setjmp(const char *&data, const char *end, uint64_t &sum)
 {
 	jmp_buf env;
-	const size_t M = 1000000;
-	CTimer t;
-	t.Start();
-	for (size_t i = 0; i < M; i++)
-		if (setjmp(env) != 0)
+	if (setjmp(env) != 0)
+		return false;
+	jmp_decode_key(data, end, sum, env);
+	return true;
+}
+
+// Every truncated or broken key must be rejected by all the checks.
+NOINLINE void check_bench_errors(KeyDef *def)
+{
+	char key[CHECK_BENCH_MAX_SIZE];
+	char *end = key;
+	mp_encode_array(end, 3);
+	mp_encode_uint(end, 300);
+	mp_encode_string(end, "abcdefghij", 10);
+	mp_encode_uint(end, 5);
+	size_t size = end - key;
+	uint64_t sum = 0;
+	for (size_t len = 0; len <= size; len++) {
+		mp_check_t expected = len < size ? MP_CHECK_TRUNCATED :
+				      MP_CHECK_OK;
+		const char *p = key;
+		if (check_bench_decode_bounded(p, key + len, sum) != expected)
 			abort();
-	t.Stop();
-	std::cout << "setjmp Mrps: " << t.Mrps(M) << std::endl;
+		p = key;
+		if (check_bench_decode_validated(def, p, key + len, sum) !=
+		    expected)
+			abort();
+		p = key;
+		if (check_bench_decode_setjmp(p, key + len, sum) !=
+		    (expected == MP_CHECK_OK))
+			abort();
+		p = key;
+		if (mp_check(p, key + len) != expected)
+			abort();
+	}
+	// Not msgpack in the array header, string instead of uint, uint
+	// instead of string.
+	const size_t positions[] = {0, 1, 4};
+	const uint8_t markers[] = {0xc1, 0xa2, 0x05};
+	for (size_t i = 0; i < 3; i++) {
+		char broken[CHECK_BENCH_MAX_SIZE];
+		memcpy(broken, key, size);
+		broken[positions[i]] = markers[i];
+		const char *p = broken;
+		if (check_bench_decode_bounded(p, broken + size, sum) ==
+		    MP_CHECK_OK)
+			abort();
+		p = broken;
+		if (check_bench_decode_validated(def, p, broken + size, sum) ==
+		    MP_CHECK_OK)
+			abort();
+		p = broken;
+		if (check_bench_decode_setjmp(p, broken + size, sum))
+			abort();
+	}
+	// Uints not in the shortest form are accepted, see mp_compare_uint.
+	char *p = key;
+	mp_encode_array(p, 3);
+	check_encode_uint(p, 5, 2);
+	mp_encode_string(p, "abcdefghij", 10);
+	check_encode_uint(p, 5, 8);
+	const char *q = key;
+	if (key_check(def, q, p) != MP_CHECK_OK || q != p)
+		abort();
 }
 
-int main(int, const char**)
+/**
+ * Compares decoding of keys from untrusted input: without checks, by
+ * bounded decoders that return errors, by key_check and then without
+ * checks, and by bounded decoders that jump to setjmp of every key.
+ */
+NOINLINE void bench_check()
 {
+	KeyDef def = KeyDef();
+	def.part_count = 3;
+	def.parts[0].field_type = KeyDef::UINT;
+	def.parts[1].field_type = KeyDef::STRING;
+	def.parts[2].field_type = KeyDef::UINT;
+	for (size_t i = 0; i < def.part_count; i++)
+		def.parts[i].field_no = i;
+	check_bench_errors(&def);
+
+	char *p = check_bench_data;
+	for (size_t i = 0; i < CHECK_BENCH_COUNT; i++) {
+		char string[16];
+		uint32_t len = 8 + rand() % 9;
+		for (uint32_t k = 0; k < len; k++)
+			string[k] = 'a' + rand() % 20;
+		mp_encode_array(p, 3);
+		mp_encode_uint(p, rand() % 2 ? rand() % 100 : rand());
+		mp_encode_string(p, string, len);
+		mp_encode_uint(p, rand() % 1000);
+	}
+	const char *end = p;
+
+	const size_t R = 10;
+	const size_t M = R * CHECK_BENCH_COUNT;
+	uint64_t sums[4] = {0, 0, 0, 0};
+	CTimer t1;
+	t1.Start();
+	for (size_t r = 0; r < R; r++) {
+		const char *data = check_bench_data;
+		for (size_t i = 0; i < CHECK_BENCH_COUNT; i++)
+			check_bench_decode(data, sums[0]);
+	}
+	t1.Stop();
+	std::cout << "decode unchecked Mrps: " << t1.Mrps(M) << t1.Counters(M)
+		  << std::endl;
+
+	CTimer t2;
+	t2.Start();
+	for (size_t r = 0; r < R; r++) {
+		const char *data = check_bench_data;
+		for (size_t i = 0; i < CHECK_BENCH_COUNT; i++)
+			if (check_bench_decode_bounded(data, end, sums[1]) !=
+			    MP_CHECK_OK)
+				abort();
+	}
+	t2.Stop();
+	std::cout << "decode bounded Mrps: " << t2.Mrps(M) << t2.Counters(M)
+		  << std::endl;
+
+	CTimer t3;
+	t3.Start();
+	for (size_t r = 0; r < R; r++) {
+		const char *data = check_bench_data;
+		for (size_t i = 0; i < CHECK_BENCH_COUNT; i++)
+			if (check_bench_decode_validated(&def, data, end,
+							 sums[2]) !=
+			    MP_CHECK_OK)
+				abort();
+	}
+	t3.Stop();
+	std::cout << "decode validated Mrps: " << t3.Mrps(M) << t3.Counters(M)
+		  << std::endl;
+
+	CTimer t4;
+	t4.Start();
+	for (size_t r = 0; r < R; r++) {
+		const char *data = check_bench_data;
+		for (size_t i = 0; i < CHECK_BENCH_COUNT; i++)
+			if (!check_bench_decode_setjmp(data, end, sums[3]))
+				abort();
+	}
+	t4.Stop();
+	std::cout << "decode setjmp Mrps: " << t4.Mrps(M) << t4.Counters(M)
+		  << std::endl;
+	for (size_t i = 1; i < 4; i++)
+		if (sums[i] != sums[0])
+			abort();
+}
+
+// The benchmarks of every part of the library with fixed settings.
+NOINLINE void bench_legacy()
+{
+	check_branchless();
+	check_compiled();
+	check_compare_uint();
+	check_run_corrupted();
+	check_tuple_builder_overflow();
+
 	KeyDef def;
-	def.tuple_compare_f = default_tuple_compare;
-	// Uncomment the line below to improve benchmark result.
-	//def.tuple_compare_f = tuple_compare_by_first_uint;
+	def.use_hint = false;
+	def.use_branchless = false;
+	for (size_t i = 0; i < MAX_NUM_FIELDS_IN_KEY; i++) {
+		def.parts[i].is_nullable = false;
+		def.parts[i].collation = NULL;
+	}
 
 	def.part_count = 1;
 	def.parts[0].field_no = 0;
 	def.parts[0].field_type = KeyDef::UINT;
 	bench_key_def(&def, "uint first field");
 
-	def.tuple_compare_f = default_tuple_compare;
 	def.part_count = 2;
 	def.parts[0].field_no = 1;
 	def.parts[0].field_type = KeyDef::UINT;
@@ -309,7 +1992,6 @@ int main(int, const char**)
 	def.parts[1].field_type = KeyDef::UINT;
 	bench_key_def(&def, "uint sequential fields");
 
-	def.tuple_compare_f = default_tuple_compare;
 	def.part_count = 2;
 	def.parts[0].field_no = 2;
 	def.parts[0].field_type = KeyDef::STRING;
@@ -317,5 +1999,236 @@ int main(int, const char**)
 	def.parts[1].field_type = KeyDef::STRING;
 	bench_key_def(&def, "string non-sequential fields");
 
+	def.part_count = 3;
+	def.parts[0].field_no = 3;
+	def.parts[0].field_type = KeyDef::STRING;
+	def.parts[1].field_no = 4;
+	def.parts[1].field_type = KeyDef::UINT;
+	def.parts[2].field_no = 5;
+	def.parts[2].field_type = KeyDef::STRING;
+	bench_key_def(&def, "string, uint, string sequential fields");
+
+	def.part_count = 1;
+	def.parts[0].field_no = 1;
+	def.parts[0].field_type = KeyDef::INTEGER;
+	bench_key_def(&def, "integer field");
+
+	def.part_count = 1;
+	def.parts[0].field_no = 1;
+	def.parts[0].field_type = KeyDef::DOUBLE;
+	bench_key_def(&def, "double field");
+
+	def.part_count = 1;
+	def.parts[0].field_no = 1;
+	def.parts[0].field_type = KeyDef::NUMBER;
+	bench_key_def(&def, "number field");
+
+	def.part_count = 2;
+	def.parts[0].field_no = 1;
+	def.parts[0].field_type = KeyDef::BOOLEAN;
+	def.parts[1].field_no = 2;
+	def.parts[1].field_type = KeyDef::UINT;
+	bench_key_def(&def, "boolean, uint sequential fields");
+
+	def.part_count = 1;
+	def.parts[0].field_no = 2;
+	def.parts[0].field_type = KeyDef::BINARY;
+	bench_key_def(&def, "binary field");
+
+	def.part_count = 2;
+	def.parts[0].field_no = 1;
+	def.parts[0].field_type = KeyDef::UINT;
+	def.parts[0].is_nullable = true;
+	def.parts[1].field_no = 2;
+	def.parts[1].field_type = KeyDef::STRING;
+	bench_key_def(&def, "nullable uint, string sequential fields");
+	def.parts[0].is_nullable = false;
+
+	def.part_count = 1;
+	def.parts[0].field_no = 1;
+	def.parts[0].field_type = KeyDef::STRING;
+	def.parts[0].collation = collation_by_id(COLLATION_ASCII_CI);
+	bench_key_def(&def, "ascii_ci string field");
+	def.parts[0].collation = collation_by_id(COLLATION_UNICODE_CI);
+	bench_key_def(&def, "unicode_ci string field");
+	def.parts[0].collation = NULL;
+
+	bench_decode_uint();
+	bench_mp_writer(&def);
+
+	def.part_count = 4;
+	for (size_t i = 0; i < 4; i++) {
+		def.parts[i].field_no = 1 + i;
+		def.parts[i].field_type = KeyDef::UINT;
+	}
+	bench_compiled(&def, "4 uint sequential fields");
+
+	def.part_count = 3;
+	def.parts[0].field_no = 1;
+	def.parts[0].field_type = KeyDef::UINT;
+	def.parts[0].is_nullable = true;
+	def.parts[1].field_no = 2;
+	def.parts[1].field_type = KeyDef::STRING;
+	def.parts[2].field_no = 5;
+	def.parts[2].field_type = KeyDef::UINT;
+	bench_compiled(&def, "nullable uint, string, uint fields");
+	def.parts[0].is_nullable = false;
+
+	def.part_count = 6;
+	def.parts[0].field_no = 0;
+	def.parts[0].field_type = KeyDef::UINT;
+	def.parts[1].field_no = 1;
+	def.parts[1].field_type = KeyDef::STRING;
+	def.parts[2].field_no = 2;
+	def.parts[2].field_type = KeyDef::INTEGER;
+	def.parts[3].field_no = 3;
+	def.parts[3].field_type = KeyDef::UINT;
+	def.parts[4].field_no = 5;
+	def.parts[4].field_type = KeyDef::DOUBLE;
+	def.parts[5].field_no = 6;
+	def.parts[5].field_type = KeyDef::STRING;
+	bench_compiled(&def, "mixed 6 fields");
+
+	bench_compare_string();
+	bench_skip("mixed fields", 30);
+	bench_skip("small uint fields", 90);
 	bench_setjump();
-}
\ No newline at end of file
+	bench_check();
+}
+
+/**
+ * Scenarios of the benchmark suite: key parts, field count, string length,
+ * tuple count (the working set is ~40 bytes per tuple with pointers,
+ * 512 fit in L1, 32K in LLC), duplicates %, sorted %, access patterns.
+ */
+const BenchScenario bench_scenarios[] = {
+	{"uint-l1", 1, {{KeyDef::UINT, 0}}, 4, 0, 512, 0, 0, BENCH_ALL},
+	{"uint-llc", 1, {{KeyDef::UINT, 0}}, 4, 0, 32768, 0, 0,
+	 BENCH_ALL | BENCH_COLUMN | BENCH_CONCURRENT},
+	{"uint-dram", 1, {{KeyDef::UINT, 0}}, 4, 0, 1 << 20, 0, 0, BENCH_ALL | BENCH_COLUMN},
+	{"uint-dup90-llc", 1, {{KeyDef::UINT, 0}}, 4, 0, 32768, 90, 0,
+	 BENCH_ALL},
+	{"uint-sorted95-llc", 1, {{KeyDef::UINT, 0}}, 4, 0, 32768, 0, 95,
+	 BENCH_SORT},
+	{"uint-sorted-llc", 1, {{KeyDef::UINT, 0}}, 4, 0, 32768, 0, 100,
+	 BENCH_SORT},
+	{"string8-l1", 1, {{KeyDef::STRING, 1}}, 4, 8, 512, 0, 0, BENCH_ALL},
+	{"string8-dram", 1, {{KeyDef::STRING, 1}}, 4, 8, 1 << 20, 0, 0,
+	 BENCH_ALL | BENCH_COLUMN},
+	{"string32-llc", 1, {{KeyDef::STRING, 1}}, 4, 32, 32768, 0, 0,
+	 BENCH_ALL},
+	{"string16-dup50-llc", 1, {{KeyDef::STRING, 1}}, 4, 16, 32768, 50, 0,
+	 BENCH_ALL},
+	{"uint-string-uint-llc", 3,
+	 {{KeyDef::UINT, 0}, {KeyDef::STRING, 1}, {KeyDef::UINT, 2}}, 8, 16,
+	 32768, 0, 0, BENCH_ALL | BENCH_BRANCHLESS | BENCH_CONCURRENT},
+	{"uint-string-uint-dup90-llc", 3,
+	 {{KeyDef::UINT, 0}, {KeyDef::STRING, 1}, {KeyDef::UINT, 2}}, 8, 16,
+	 32768, 90, 0, BENCH_ALL | BENCH_BRANCHLESS},
+	{"bool-bool-uint-llc", 3,
+	 {{KeyDef::BOOLEAN, 0}, {KeyDef::BOOLEAN, 1}, {KeyDef::UINT, 2}}, 4, 0,
+	 32768, 0, 0, BENCH_ALL | BENCH_BRANCHLESS},
+	{"string-uint-nonseq-llc", 2,
+	 {{KeyDef::STRING, 5}, {KeyDef::UINT, 2}}, 8, 16, 32768, 0, 0,
+	 BENCH_ALL},
+	{"number-llc", 1, {{KeyDef::NUMBER, 1}}, 4, 0, 32768, 0, 0, BENCH_ALL},
+	{"mixed6-llc", 6,
+	 {{KeyDef::UINT, 0}, {KeyDef::STRING, 1}, {KeyDef::INTEGER, 2},
+	  {KeyDef::UINT, 3}, {KeyDef::DOUBLE, 5}, {KeyDef::STRING, 6}}, 8, 16,
+	 32768, 0, 0, BENCH_ALL | BENCH_BRANCHLESS},
+	{"mixed6-dup90-llc", 6,
+	 {{KeyDef::UINT, 0}, {KeyDef::STRING, 1}, {KeyDef::INTEGER, 2},
+	  {KeyDef::UINT, 3}, {KeyDef::DOUBLE, 5}, {KeyDef::STRING, 6}}, 8, 16,
+	 32768, 90, 0, BENCH_ALL | BENCH_BRANCHLESS},
+};
+const size_t bench_scenario_count =
+	sizeof(bench_scenarios) / sizeof(bench_scenarios[0]);
+
+void usage(const char *program)
+{
+	std::cerr << "Usage: " << program << " [options]\n"
+		"  --scenario PREFIX  run scenarios with names starting with "
+		"PREFIX,\n"
+		"                     may be repeated, all by default\n"
+		"  --format FORMAT    text (default), csv or json\n"
+		"  --repeat N         measured runs of every op, 11 by default\n"
+		"  --warmup N         warm-up runs of every op, 2 by default\n"
+		"  --seed N           seed of generated data, 1 by default\n"
+		"  --counters         show hardware counters per operation\n"
+		"  --list             list scenarios\n"
+		"  --legacy           run the fixed benchmarks of every part\n";
+}
+
+int main(int argc, const char **argv)
+{
+	std::vector<std::string> prefixes;
+	bench_format_t format = BENCH_FORMAT_TEXT;
+	size_t repeat = 11;
+	size_t warmup = 2;
+	uint64_t seed = 1;
+	bool legacy = false;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool has_value = i + 1 < argc;
+		if (arg == "--legacy") {
+			legacy = true;
+		} else if (arg == "--counters") {
+			CPerfCounters::Enable();
+		} else if (arg == "--list") {
+			for (size_t j = 0; j < bench_scenario_count; j++)
+				std::cout << bench_scenarios[j].name << std::endl;
+			return 0;
+		} else if (arg == "--scenario" && has_value) {
+			prefixes.push_back(argv[++i]);
+		} else if (arg == "--format" && has_value) {
+			std::string value = argv[++i];
+			if (value == "text") {
+				format = BENCH_FORMAT_TEXT;
+			} else if (value == "csv") {
+				format = BENCH_FORMAT_CSV;
+			} else if (value == "json") {
+				format = BENCH_FORMAT_JSON;
+			} else {
+				usage(argv[0]);
+				return 1;
+			}
+		} else if (arg == "--repeat" && has_value) {
+			repeat = strtoul(argv[++i], NULL, 10);
+		} else if (arg == "--warmup" && has_value) {
+			warmup = strtoul(argv[++i], NULL, 10);
+		} else if (arg == "--seed" && has_value) {
+			seed = strtoull(argv[++i], NULL, 10);
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (repeat == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (legacy) {
+		bench_legacy();
+#ifdef TUPLE_COMPARE_PROFILE
+		tuple_compare_profile_print(std::cerr);
+#endif
+		return 0;
+	}
+
+	CBenchRunner runner(std::cout, format, warmup, repeat);
+	runner.Header();
+	for (size_t i = 0; i < bench_scenario_count; i++) {
+		const BenchScenario *scenario = &bench_scenarios[i];
+		bool selected = prefixes.empty();
+		for (size_t j = 0; j < prefixes.size(); j++)
+			if (std::string(scenario->name).compare(0,
+				prefixes[j].size(), prefixes[j]) == 0)
+				selected = true;
+		if (selected)
+			bench_scenario_run(&runner, scenario, seed);
+	}
+#ifdef TUPLE_COMPARE_PROFILE
+	// Separately from results, that may be CSV or JSON.
+	tuple_compare_profile_print(std::cerr);
+#endif
+}